@@ -0,0 +1,675 @@
+/*
+ * Copyright (c) 2015 Mark Heily <mark@heily.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/queue.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "arena.h"
+#include "hash.h"
+#include "log.h"
+
+/* The number of times a reader will retry before giving up */
+#define ARENA_MAX_RETRIES 1000
+
+/* Space for values in a newly created arena */
+#define ARENA_INITIAL_DATA (1024 * 1024)
+
+/* Values are allocated in multiples of this */
+#define ARENA_ALIGN 64
+
+#define ARENA_INDEX_OFF	\
+	((sizeof(struct arena_header) + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1))
+#define ARENA_SLOTS_OFF	\
+	(ARENA_INDEX_OFF + ARENA_INDEX_SIZE * sizeof(uint32_t))
+#define ARENA_DATA_OFF	\
+	(ARENA_SLOTS_OFF + ARENA_SLOTS * sizeof(struct arena_slot))
+
+struct arena_mapping {
+	SLIST_ENTRY(arena_mapping) am_entry;
+	void	*am_base;
+	size_t	 am_size;
+};
+
+struct arena_s {
+	int	 a_fd;
+	char	*a_path;
+	bool	 a_writable;
+	char	*a_base;		/* The current mapping */
+	size_t	 a_mapsz;		/* The size of the current mapping */
+	pthread_mutex_t a_mtx;		/* Serializes remapping and allocation */
+
+	/* Readers may still be using these, so they are kept until close */
+	SLIST_HEAD(, arena_mapping) a_old_mappings;
+};
+
+static size_t page_round(size_t len)
+{
+	size_t pagesz = (size_t) sysconf(_SC_PAGESIZE);
+
+	return (len + pagesz - 1) & ~(pagesz - 1);
+}
+
+/*
+ * The mapping is replaced by a larger one when the file grows. The base
+ * is stored before the size, so a reader that sees the new size will also
+ * see the new base.
+ */
+static char *arena_base(arena_t a, size_t *size)
+{
+	*size = __atomic_load_n(&a->a_mapsz, __ATOMIC_ACQUIRE);
+	return __atomic_load_n(&a->a_base, __ATOMIC_RELAXED);
+}
+
+static struct arena_header *arena_header(arena_t a)
+{
+	return (struct arena_header *) __atomic_load_n(&a->a_base, __ATOMIC_RELAXED);
+}
+
+static uint32_t *arena_index(arena_t a)
+{
+	return (uint32_t *) (__atomic_load_n(&a->a_base, __ATOMIC_RELAXED)
+			+ ARENA_INDEX_OFF);
+}
+
+static struct arena_slot *arena_slot(arena_t a, int slot)
+{
+	return (struct arena_slot *) (__atomic_load_n(&a->a_base, __ATOMIC_RELAXED)
+			+ ARENA_SLOTS_OFF) + slot;
+}
+
+/* The caller must hold a_mtx, unless the arena is still being opened */
+static int arena_remap(arena_t a)
+{
+	struct arena_mapping *am;
+	struct stat sb;
+	void *p;
+
+	if (fstat(a->a_fd, &sb) < 0) {
+		log_errno("fstat(2) of %s", a->a_path);
+		return -1;
+	}
+	if ((size_t) sb.st_size < ARENA_DATA_OFF) {
+		log_warning("arena %s is invalid; too short", a->a_path);
+		return -1;
+	}
+	if ((size_t) sb.st_size <= a->a_mapsz)
+		return 0;
+	p = mmap(NULL, sb.st_size, PROT_READ | (a->a_writable ? PROT_WRITE : 0),
+			MAP_SHARED, a->a_fd, 0);
+	if (p == MAP_FAILED) {
+		log_errno("mmap(2) of %s", a->a_path);
+		return -1;
+	}
+	if (a->a_base) {
+		if ((am = malloc(sizeof(*am))) == NULL) {
+			log_errno("malloc(3)");
+			(void) munmap(p, sb.st_size);
+			return -1;
+		}
+		am->am_base = a->a_base;
+		am->am_size = a->a_mapsz;
+		SLIST_INSERT_HEAD(&a->a_old_mappings, am, am_entry);
+	}
+	__atomic_store_n(&a->a_base, p, __ATOMIC_RELAXED);
+	__atomic_store_n(&a->a_mapsz, sb.st_size, __ATOMIC_RELEASE);
+	return 0;
+}
+
+/* Make sure that the first <end> bytes of the file are mapped */
+static int arena_cover(arena_t a, uint64_t end)
+{
+	size_t size;
+	int rv = 0;
+
+	(void) arena_base(a, &size);
+	if (end <= size)
+		return 0;
+	pthread_mutex_lock(&a->a_mtx);
+	if (end > a->a_mapsz)
+		rv = arena_remap(a);
+	if (rv == 0 && end > a->a_mapsz)
+		rv = -1;
+	pthread_mutex_unlock(&a->a_mtx);
+	return rv;
+}
+
+/* Initialize a new, empty arena. The caller must hold the file lock. */
+static int arena_format(arena_t a)
+{
+	struct arena_header hdr;
+	size_t size = page_round(ARENA_DATA_OFF + ARENA_INITIAL_DATA);
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.ah_magic = ARENA_MAGIC;
+	hdr.ah_version = ARENA_VERSION;
+	hdr.ah_nslots = ARENA_SLOTS;
+	hdr.ah_size = size;
+	hdr.ah_data_used = ARENA_DATA_OFF;
+	if (ftruncate(a->a_fd, size) < 0) {
+		log_errno("ftruncate(2) of %s", a->a_path);
+		return -1;
+	}
+	if (pwrite(a->a_fd, &hdr, sizeof(hdr), 0) < (ssize_t) sizeof(hdr)) {
+		log_errno("pwrite(2) of %s", a->a_path);
+		return -1;
+	}
+	return 0;
+}
+
+arena_t arena_open(const char *path, bool writable)
+{
+	struct arena_header *hdr;
+	struct stat sb;
+	arena_t a;
+
+	a = calloc(1, sizeof(*a));
+	if (!a)
+		return NULL;
+	a->a_fd = -1;
+	a->a_writable = writable;
+	pthread_mutex_init(&a->a_mtx, NULL);
+	SLIST_INIT(&a->a_old_mappings);
+	if ((a->a_path = strdup(path)) == NULL)
+		goto err_out;
+
+	a->a_fd = open(path, writable ? O_CREAT | O_RDWR : O_RDONLY, 0644);
+	if (a->a_fd < 0) {
+		log_errno("open(2) of %s", path);
+		goto err_out;
+	}
+	if (writable) {
+		if (flock(a->a_fd, LOCK_EX) < 0) {
+			log_errno("flock(2) of %s", path);
+			goto err_out;
+		}
+		if (fstat(a->a_fd, &sb) < 0 ||
+				(sb.st_size == 0 && arena_format(a) < 0)) {
+			(void) flock(a->a_fd, LOCK_UN);
+			goto err_out;
+		}
+		(void) flock(a->a_fd, LOCK_UN);
+	}
+	if (arena_remap(a) < 0)
+		goto err_out;
+
+	hdr = arena_header(a);
+	if (hdr->ah_magic != ARENA_MAGIC || hdr->ah_version != ARENA_VERSION ||
+			hdr->ah_nslots != ARENA_SLOTS) {
+		log_error("arena %s is invalid; bad magic or version", path);
+		goto err_out;
+	}
+	return a;
+
+err_out:
+	arena_close(a);
+	return NULL;
+}
+
+void arena_close(arena_t a)
+{
+	struct arena_mapping *am;
+
+	if (!a)
+		return;
+	while ((am = SLIST_FIRST(&a->a_old_mappings)) != NULL) {
+		SLIST_REMOVE_HEAD(&a->a_old_mappings, am_entry);
+		(void) munmap(am->am_base, am->am_size);
+		free(am);
+	}
+	if (a->a_base)
+		(void) munmap(a->a_base, a->a_mapsz);
+	if (a->a_fd >= 0)
+		(void) close(a->a_fd);
+	(void) pthread_mutex_destroy(&a->a_mtx);
+	free(a->a_path);
+	free(a);
+}
+
+int arena_get_fd(arena_t a)
+{
+	return a->a_fd;
+}
+
+const char *arena_get_path(arena_t a)
+{
+	return a->a_path;
+}
+
+int arena_slot_lookup(arena_t a, const char *name)
+{
+	const uint32_t mask = ARENA_INDEX_SIZE - 1;
+	uint32_t *index = arena_index(a);
+	uint32_t h, i, v;
+
+	h = hash_string(name) & mask;
+	for (i = 0; i < ARENA_INDEX_SIZE; i++) {
+		v = __atomic_load_n(&index[h], __ATOMIC_ACQUIRE);
+		if (v == 0)
+			return -1;
+		if (v <= ARENA_SLOTS && strncmp(arena_slot(a, v - 1)->as_name,
+				name, ARENA_NAME_MAX) == 0)
+			return v - 1;
+		h = (h + 1) & mask;
+	}
+	return -1;
+}
+
+/* The caller must hold a_mtx and the file lock */
+static int arena_slot_insert(arena_t a, const char *name)
+{
+	const uint32_t mask = ARENA_INDEX_SIZE - 1;
+	struct arena_header *hdr = arena_header(a);
+	uint32_t *index = arena_index(a);
+	struct arena_slot *s;
+	uint32_t h, slot;
+
+	slot = hdr->ah_used;
+	if (slot >= ARENA_SLOTS) {
+		log_error("arena %s is full", a->a_path);
+		return -1;
+	}
+	s = arena_slot(a, slot);
+	memset(s, 0, sizeof(*s));
+	strncpy(s->as_name, name, ARENA_NAME_MAX - 1);
+
+	for (h = hash_string(name) & mask; index[h] != 0; h = (h + 1) & mask)
+		;
+	__atomic_store_n(&index[h], slot + 1, __ATOMIC_RELEASE);
+	__atomic_store_n(&hdr->ah_used, slot + 1, __ATOMIC_RELEASE);
+	return slot;
+}
+
+int arena_slot_alloc(arena_t a, const char *name)
+{
+	int slot;
+
+	if (strlen(name) >= ARENA_NAME_MAX) {
+		log_error("name is too long for an arena: %s", name);
+		return -1;
+	}
+	if ((slot = arena_slot_lookup(a, name)) >= 0)
+		return slot;
+	if (!a->a_writable) {
+		log_error("arena %s is read-only", a->a_path);
+		return -1;
+	}
+
+	pthread_mutex_lock(&a->a_mtx);
+	if (flock(a->a_fd, LOCK_EX) < 0) {
+		log_errno("flock(2) of %s", a->a_path);
+		pthread_mutex_unlock(&a->a_mtx);
+		return -1;
+	}
+	/* Another process may have created it while we waited for the lock */
+	if ((slot = arena_slot_lookup(a, name)) < 0)
+		slot = arena_slot_insert(a, name);
+	(void) flock(a->a_fd, LOCK_UN);
+	pthread_mutex_unlock(&a->a_mtx);
+	return slot;
+}
+
+int arena_slot_count(arena_t a)
+{
+	return __atomic_load_n(&arena_header(a)->ah_used, __ATOMIC_ACQUIRE);
+}
+
+int arena_slot_name(arena_t a, int slot, char *buf)
+{
+	if (slot < 0 || slot >= ARENA_SLOTS)
+		return -1;
+	memcpy(buf, arena_slot(a, slot)->as_name, ARENA_NAME_MAX);
+	buf[ARENA_NAME_MAX - 1] = '\0';
+	return 0;
+}
+
+/* Allocate <size> bytes of data, growing the file if needed */
+static int64_t arena_data_alloc(arena_t a, size_t size)
+{
+	struct arena_header *hdr;
+	uint64_t off, newsz;
+
+	pthread_mutex_lock(&a->a_mtx);
+	if (flock(a->a_fd, LOCK_EX) < 0) {
+		log_errno("flock(2) of %s", a->a_path);
+		pthread_mutex_unlock(&a->a_mtx);
+		return -1;
+	}
+	hdr = arena_header(a);
+	off = hdr->ah_data_used;
+	if (off + size > hdr->ah_size) {
+		newsz = hdr->ah_size * 2;
+		if (newsz < off + size)
+			newsz = page_round(off + size);
+		if (ftruncate(a->a_fd, newsz) < 0) {
+			log_errno("ftruncate(2) of %s", a->a_path);
+			goto err_out;
+		}
+		__atomic_store_n(&hdr->ah_size, newsz, __ATOMIC_RELEASE);
+	}
+	if (off + size > a->a_mapsz && arena_remap(a) < 0)
+		goto err_out;
+	hdr = arena_header(a);
+	hdr->ah_data_used = off + size;
+	(void) flock(a->a_fd, LOCK_UN);
+	pthread_mutex_unlock(&a->a_mtx);
+	return off;
+
+err_out:
+	(void) flock(a->a_fd, LOCK_UN);
+	pthread_mutex_unlock(&a->a_mtx);
+	return -1;
+}
+
+/*
+ * Get the data of a slot, which may have been moved past the end of the
+ * mapping through another handle to the arena
+ */
+static char *arena_data(arena_t a, struct arena_slot *s)
+{
+	size_t size;
+
+	if (arena_cover(a, s->as_off + s->as_capacity) < 0) {
+		log_warning("arena %s is invalid; the data is not mapped",
+				a->a_path);
+		return NULL;
+	}
+	return arena_base(a, &size) + s->as_off;
+}
+
+static int arena_store(arena_t a, int slot, const char *value, size_t len)
+{
+	struct arena_slot *s;
+	uint64_t capacity = 0;
+	int64_t off = -1;
+	uint32_t seq;
+	size_t size;
+	char *data;
+
+	if (!a->a_writable || slot < 0 || slot >= ARENA_SLOTS)
+		return -1;
+	s = arena_slot(a, slot);
+	if (len >= s->as_capacity) {
+		capacity = s->as_capacity * 2;
+		if (capacity < len + 1)
+			capacity = (len + ARENA_ALIGN) & ~(uint64_t) (ARENA_ALIGN - 1);
+		if ((off = arena_data_alloc(a, capacity)) < 0)
+			return -1;
+		s = arena_slot(a, slot);
+		data = arena_base(a, &size) + off;
+	} else if ((data = arena_data(a, s)) == NULL) {
+		return -1;
+	}
+
+	seq = s->as_seq & ~1u; /* Recover from an interrupted write */
+	__atomic_store_n(&s->as_seq, seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	if (off >= 0) {
+		__atomic_store_n(&s->as_off, off, __ATOMIC_RELAXED);
+		__atomic_store_n(&s->as_capacity, capacity, __ATOMIC_RELAXED);
+	}
+	memcpy(data, value, len);
+	data[len] = '\0';
+	__atomic_store_n(&s->as_len, len, __ATOMIC_RELAXED);
+	__atomic_store_n(&s->as_seq, seq + 2, __ATOMIC_RELEASE);
+	return 0;
+}
+
+int arena_clear(arena_t a, int slot)
+{
+	return arena_store(a, slot, "", 0);
+}
+
+int arena_reserve(arena_t a, int slot, size_t size)
+{
+	struct arena_slot *s;
+	uint64_t capacity;
+	char *data, *old;
+	size_t mapsz;
+	int64_t off;
+	uint32_t seq;
+	int rv;
+
+	if (!a->a_writable || slot < 0 || slot >= ARENA_SLOTS)
+		return -1;
+	s = arena_slot(a, slot);
+	if (size < s->as_capacity)
+		return 0;
+	if ((old = arena_data(a, s)) == NULL)
+		return -1;
+	capacity = (size + ARENA_ALIGN) & ~(uint64_t) (ARENA_ALIGN - 1);
+	if ((off = arena_data_alloc(a, capacity)) < 0)
+		return -1;
+	if ((rv = posix_fallocate(a->a_fd, off, capacity)) != 0) {
+		log_error("posix_fallocate(2) of %s: %s", a->a_path, strerror(rv));
+		return -1;
+	}
+
+	/* Move the current value into the new space */
+	s = arena_slot(a, slot);
+	data = arena_base(a, &mapsz) + off;
+	seq = s->as_seq & ~1u;
+	__atomic_store_n(&s->as_seq, seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	if (s->as_off == 0)
+		data[0] = '\0';
+	else
+		memcpy(data, old, s->as_len + 1);
+	__atomic_store_n(&s->as_off, off, __ATOMIC_RELAXED);
+	__atomic_store_n(&s->as_capacity, capacity, __ATOMIC_RELAXED);
+	__atomic_store_n(&s->as_seq, seq + 2, __ATOMIC_RELEASE);
+	return 0;
+}
+
+/* Add a slot to the change log */
+static void arena_log(arena_t a, int slot)
+{
+	struct arena_header *hdr = arena_header(a);
+	uint64_t pos;
+
+	pos = __atomic_fetch_add(&hdr->ah_log_head, 1, __ATOMIC_ACQ_REL);
+	__atomic_store_n(&hdr->ah_log[pos % ARENA_LOG_SIZE],
+			((uint64_t) (uint32_t) (pos + 1) << 32) | (uint32_t) slot,
+			__ATOMIC_RELEASE);
+}
+
+int arena_update(arena_t a, int slot, const char *value, size_t len)
+{
+	if (arena_store(a, slot, value, len) < 0)
+		return -1;
+	arena_log(a, slot);
+	return 0;
+}
+
+char *arena_value(arena_t a, int slot)
+{
+	if (!a->a_writable || slot < 0 || slot >= ARENA_SLOTS)
+		return NULL;
+	return arena_data(a, arena_slot(a, slot));
+}
+
+int arena_touch(arena_t a, int slot)
+{
+	struct arena_slot *s;
+	uint32_t seq;
+
+	if (!a->a_writable || slot < 0 || slot >= ARENA_SLOTS)
+		return -1;
+	s = arena_slot(a, slot);
+	seq = __atomic_load_n(&s->as_seq, __ATOMIC_RELAXED) & ~1u;
+	__atomic_store_n(&s->as_seq, seq + 2, __ATOMIC_RELEASE);
+	arena_log(a, slot);
+	return 0;
+}
+
+int arena_notify(arena_t a)
+{
+	uint32_t touch = 0;
+
+	/* Stores to the mapping do not generate kqueue/inotify events */
+	if (pwrite(a->a_fd, &touch, sizeof(touch),
+			offsetof(struct arena_header, ah_touch)) < (ssize_t) sizeof(touch)) {
+		log_errno("pwrite(2) of %s", a->a_path);
+		return -1;
+	}
+	return 0;
+}
+
+int arena_write(arena_t a, int slot, const char *value, size_t len)
+{
+	if (arena_update(a, slot, value, len) < 0)
+		return -1;
+	return arena_notify(a);
+}
+
+/*
+ * Wait for a stable sequence number, make sure the value is mapped, and
+ * return its length and offset.
+ */
+static ssize_t arena_begin_read(arena_t a, int slot, uint32_t *seq,
+		uint64_t *off)
+{
+	struct arena_slot *s;
+	uint64_t len, capacity;
+	int retries;
+
+	if (slot < 0 || slot >= ARENA_SLOTS)
+		return -1;
+	for (retries = 0; retries < ARENA_MAX_RETRIES; retries++) {
+		s = arena_slot(a, slot);
+		*seq = __atomic_load_n(&s->as_seq, __ATOMIC_ACQUIRE);
+		if (*seq & 1) {
+			(void) sched_yield();
+			continue;
+		}
+		*off = __atomic_load_n(&s->as_off, __ATOMIC_RELAXED);
+		capacity = __atomic_load_n(&s->as_capacity, __ATOMIC_RELAXED);
+		len = __atomic_load_n(&s->as_len, __ATOMIC_RELAXED);
+		if (capacity == 0) {
+			/* Nothing has been published yet */
+			*off = 0;
+			return 0;
+		}
+		if (*off < ARENA_DATA_OFF || len >= capacity ||
+				arena_cover(a, *off + capacity) < 0) {
+			if (arena_validate(a, slot, *seq)) {
+				log_warning("arena %s is invalid; bad slot %d",
+						a->a_path, slot);
+				return -1;
+			}
+			continue;
+		}
+		return len;
+	}
+	log_warning("gave up reading an arena slot that is constantly changing");
+	return -1;
+}
+
+ssize_t arena_read(arena_t a, int slot, char **buf, size_t *bufsz,
+		uint32_t *seq)
+{
+	uint64_t off;
+	ssize_t len;
+	size_t size;
+	int retries;
+
+	for (retries = 0; retries < ARENA_MAX_RETRIES; retries++) {
+		if ((len = arena_begin_read(a, slot, seq, &off)) < 0)
+			return -1;
+		if (*bufsz <= (size_t) len) {
+			char *newbuf = realloc(*buf, len + 1);
+			if (newbuf == NULL) {
+				log_errno("realloc(3)");
+				return -1;
+			}
+			*buf = newbuf;
+			*bufsz = len + 1;
+		}
+		if (len > 0)
+			memcpy(*buf, arena_base(a, &size) + off, len);
+		(*buf)[len] = '\0';
+		if (arena_validate(a, slot, *seq))
+			return len;
+	}
+	log_warning("gave up reading an arena slot that is constantly changing");
+	return -1;
+}
+
+ssize_t arena_peek(arena_t a, int slot, const char **value, uint32_t *seq)
+{
+	uint64_t off;
+	ssize_t len;
+	size_t size;
+
+	if ((len = arena_begin_read(a, slot, seq, &off)) < 0)
+		return -1;
+	*value = (off == 0) ? "" : arena_base(a, &size) + off;
+	return len;
+}
+
+int arena_validate(arena_t a, int slot, uint32_t seq)
+{
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	return __atomic_load_n(&arena_slot(a, slot)->as_seq, __ATOMIC_RELAXED)
+			== seq;
+}
+
+uint64_t arena_log_position(arena_t a)
+{
+	return __atomic_load_n(&arena_header(a)->ah_log_head, __ATOMIC_ACQUIRE);
+}
+
+ssize_t arena_changes(arena_t a, uint64_t *pos, uint32_t *slots, size_t max)
+{
+	struct arena_header *hdr = arena_header(a);
+	uint64_t head, entry;
+	size_t n = 0;
+
+	head = __atomic_load_n(&hdr->ah_log_head, __ATOMIC_ACQUIRE);
+	if (head - *pos > ARENA_LOG_SIZE) {
+		*pos = head;
+		return -1;
+	}
+	while (*pos < head && n < max) {
+		entry = __atomic_load_n(&hdr->ah_log[*pos % ARENA_LOG_SIZE],
+				__ATOMIC_ACQUIRE);
+		if ((entry >> 32) != (uint32_t) (*pos + 1)) {
+			/*
+			 * Either the entry was overwritten, or the publisher has not
+			 * filled it in yet and will send another notification when
+			 * it does.
+			 */
+			head = __atomic_load_n(&hdr->ah_log_head, __ATOMIC_ACQUIRE);
+			if (head - *pos > ARENA_LOG_SIZE) {
+				*pos = head;
+				return -1;
+			}
+			break;
+		}
+		slots[n++] = (uint32_t) entry;
+		(*pos)++;
+	}
+	return n;
+}
@@ -0,0 +1,146 @@
+/*
+ * Copyright (c) 2015 Mark Heily <mark@heily.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#ifndef ARENA_H_
+#define ARENA_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/*
+ * An arena is a single file that holds the state of every name in a
+ * namespace. It is laid out as:
+ *
+ *   struct arena_header   including a ring buffer of recently changed slots
+ *   uint32_t index[]      open-addressed hash of name to slot number + 1
+ *   struct arena_slot[]   one per name, each with its own seqlock
+ *   data                  the values, allocated by bumping ah_data_used
+ *
+ * The file only grows, so a reader can keep using an old mapping.
+ * Publishers allocate slots and data while holding an flock(2) on the
+ * file. Values that outgrow their space are moved, and the old space is
+ * not reused until the arena is recreated.
+ */
+
+#define ARENA_MAGIC		0x4e524141	/* "AARN" in little-endian */
+#define ARENA_VERSION		1
+#define ARENA_NAME_MAX		128		/* including the NUL */
+#define ARENA_SLOTS		65536
+#define ARENA_INDEX_SIZE	(2 * ARENA_SLOTS)
+#define ARENA_LOG_SIZE		8192
+#define ARENA_FILE		".arena"	/* Within each state directory */
+
+struct arena_header {
+	uint32_t ah_magic;
+	uint32_t ah_version;
+	uint32_t ah_nslots;	/* The size of the slot table */
+	uint32_t ah_used;	/* The number of slots allocated */
+	uint64_t ah_size;	/* The size of the file */
+	uint64_t ah_data_used;	/* The offset of the first free byte of data */
+	uint32_t ah_touch;	/* Written by publishers to notify subscribers */
+	uint32_t ah_reserved;
+	uint64_t ah_log_head;	/* The number of entries ever added to ah_log */
+
+	/*
+	 * Recently changed slots. Each entry holds the low 32 bits of its
+	 * position plus one in the upper half, and the slot number in the
+	 * lower half, so a reader can tell if it was overwritten.
+	 */
+	uint64_t ah_log[ARENA_LOG_SIZE];
+};
+
+struct arena_slot {
+	char	 as_name[ARENA_NAME_MAX];
+	uint32_t as_seq;	/* Sequence counter; odd while being written */
+	uint32_t as_reserved;
+	uint64_t as_off;	/* The offset of the value within the file */
+	uint64_t as_capacity;	/* Bytes available for the value and its NUL */
+	uint64_t as_len;	/* Length of the value, excluding the NUL */
+};
+
+typedef struct arena_s * arena_t;
+
+/* Open the arena at <path>, creating it if <writable> is true */
+arena_t arena_open(const char *path, bool writable);
+void arena_close(arena_t a);
+
+int arena_get_fd(arena_t a);
+const char *arena_get_path(arena_t a);
+
+/* Return the slot for <name>, or -1 if it does not exist */
+int arena_slot_lookup(arena_t a, const char *name);
+
+/* Return the slot for <name>, allocating it if needed */
+int arena_slot_alloc(arena_t a, const char *name);
+
+/* The number of slots that have been allocated */
+int arena_slot_count(arena_t a);
+
+/* Copy the name of a slot into <buf>, which must hold ARENA_NAME_MAX bytes */
+int arena_slot_name(arena_t a, int slot, char *buf);
+
+/*
+ * Allocate the disk space for values of up to <size> bytes in a slot,
+ * so that they are never moved
+ */
+int arena_reserve(arena_t a, int slot, size_t size);
+
+/* Replace the value of a slot without notifying anyone */
+int arena_clear(arena_t a, int slot);
+
+/* Replace the value of a slot, log the change, and notify subscribers */
+int arena_write(arena_t a, int slot, const char *value, size_t len);
+
+/*
+ * The two halves of arena_write(), so that several values can be
+ * replaced before subscribers are notified once for all of them.
+ */
+int arena_update(arena_t a, int slot, const char *value, size_t len);
+int arena_notify(arena_t a);
+
+/*
+ * Get a pointer to the value of a slot in a writable arena, so that it
+ * can be modified in place. The pointer stays valid until the value is
+ * replaced with a longer one, or the arena is closed. Returns NULL if the
+ * value cannot be mapped.
+ */
+char *arena_value(arena_t a, int slot);
+
+/*
+ * Tell readers that a value modified in place has changed, by advancing
+ * the sequence number and logging the slot. Call arena_notify() after.
+ */
+int arena_touch(arena_t a, int slot);
+
+/* These have the same semantics as the statefile_*() equivalents */
+ssize_t arena_read(arena_t a, int slot, char **buf, size_t *bufsz,
+		uint32_t *seq);
+ssize_t arena_peek(arena_t a, int slot, const char **value, uint32_t *seq);
+int arena_validate(arena_t a, int slot, uint32_t seq);
+
+/* The current position of the change log */
+uint64_t arena_log_position(arena_t a);
+
+/*
+ * Copy up to <max> changed slots from the log into <slots>, starting at
+ * <*pos>, and advance <*pos>. Returns the number of slots copied, or -1
+ * if the log wrapped around and changes were lost.
+ */
+ssize_t arena_changes(arena_t a, uint64_t *pos, uint32_t *slots, size_t max);
+
+#endif /* ARENA_H_ */
@@ -0,0 +1,118 @@
+/*
+ * Copyright (c) 2015 Mark Heily <mark@heily.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+/*
+ * Measure the throughput of state_get() as the number of threads that
+ * call it grows. Every thread reads the same names, which are not
+ * changing, so this is the cost of the lookup and of checking that the
+ * copy is current. It should scale with the number of CPUs.
+ *
+ * A table is printed on stderr, and each result as a line of JSON on
+ * stdout.
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../include/state.h"
+
+#define NAMES		64
+#define GETS		1000000	/* Per thread */
+#define MAX_THREADS	64
+
+static char names[NAMES][64];
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void *reader(void *arg)
+{
+	char *value;
+	size_t n;
+
+	for (n = 0; n < GETS; n++) {
+		if (state_get(names[n % NAMES], &value) < 0) {
+			fprintf(stderr, "state_get(3) of %s failed\n", names[n % NAMES]);
+			exit(1);
+		}
+	}
+	return arg;
+}
+
+static int run(int nthreads)
+{
+	pthread_t threads[MAX_THREADS];
+	double start, elapsed;
+	int i;
+
+	start = now();
+	for (i = 0; i < nthreads; i++) {
+		if (pthread_create(&threads[i], NULL, reader, NULL) != 0)
+			return -1;
+	}
+	for (i = 0; i < nthreads; i++)
+		(void) pthread_join(threads[i], NULL);
+	elapsed = now() - start;
+
+	printf("{\"bench\":\"get_threads\",\"threads\":%d,\"keys\":%d,"
+			"\"ops_per_sec\":%.0f,\"ns_per_op\":%.1f}\n",
+			nthreads, NAMES,
+			nthreads * (double) GETS / (elapsed / 1e9),
+			elapsed / GETS);
+	fprintf(stderr, "%-10d %14.0f %14.1f\n", nthreads,
+			nthreads * (double) GETS / (elapsed / 1e9),
+			elapsed / GETS);
+	return 0;
+}
+
+int main(void)
+{
+	long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+	int i, nthreads;
+
+	if (state_init(0, 0) < 0)
+		exit(1);
+	for (i = 0; i < NAMES; i++) {
+		snprintf(names[i], sizeof(names[i]), "user.getbench.%d", i);
+		if (state_bind(names[i]) < 0 || state_subscribe(names[i]) < 0 ||
+				state_publish(names[i], "a value", 7) < 0) {
+			fprintf(stderr, "unable to set up %s\n", names[i]);
+			exit(1);
+		}
+	}
+
+	fprintf(stderr, "%-10s %14s %14s\n", "THREADS", "GETS/SEC", "WALL (ns)");
+	for (nthreads = 1; nthreads <= MAX_THREADS; nthreads *= 2) {
+		if (run(nthreads) < 0) {
+			fprintf(stderr, "unable to start %d threads\n", nthreads);
+			exit(1);
+		}
+		if (nthreads >= 2 * ncpu)
+			break;
+	}
+	state_atexit();
+	exit(0);
+}
@@ -0,0 +1,142 @@
+/*
+ * Copyright (c) 2015 Mark Heily <mark@heily.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+/*
+ * Measure the cost of looking up a name or a watch descriptor in the
+ * hash tables used by libstate, as the number of keys grows. The chain
+ * length stays constant; any growth at the largest sizes comes from
+ * cache misses, not from the table.
+ *
+ * As with the other benchmarks, a table is printed on stderr and each
+ * result as a line of JSON on stdout.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../hash.h"
+
+#define LOOKUPS 1000000
+
+struct key {
+	struct hash_node name_node;
+	struct hash_node wd_node;
+	char name[64];
+	int wd;
+};
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static struct key *lookup_name(struct hash_table *ht, const char *name)
+{
+	struct hash_node *hn;
+	struct key *k;
+	uint32_t hash = hash_string(name);
+
+	HASH_TABLE_FOREACH(hn, ht, hash) {
+		k = hn->hn_data;
+		if (hn->hn_hash == hash && strcmp(k->name, name) == 0)
+			return k;
+	}
+	return NULL;
+}
+
+static struct key *lookup_wd(struct hash_table *ht, int wd)
+{
+	struct hash_node *hn;
+	struct key *k;
+
+	HASH_TABLE_FOREACH(hn, ht, hash_int(wd)) {
+		k = hn->hn_data;
+		if (k->wd == wd)
+			return k;
+	}
+	return NULL;
+}
+
+static int run(size_t nkeys)
+{
+	struct hash_table by_name, by_wd;
+	struct key *keys;
+	double start, name_ns, wd_ns;
+	size_t i, n;
+
+	keys = calloc(nkeys, sizeof(*keys));
+	if (!keys || hash_table_init(&by_name) < 0 || hash_table_init(&by_wd) < 0)
+		return -1;
+	for (i = 0; i < nkeys; i++) {
+		snprintf(keys[i].name, sizeof(keys[i].name), "user.bench.key.%zu", i);
+		keys[i].wd = i + 1;
+		hash_table_insert(&by_name, &keys[i].name_node,
+				hash_string(keys[i].name), &keys[i]);
+		hash_table_insert(&by_wd, &keys[i].wd_node,
+				hash_int(keys[i].wd), &keys[i]);
+	}
+
+	srandom(nkeys);
+	start = now();
+	for (n = 0; n < LOOKUPS; n++) {
+		i = random() % nkeys;
+		if (lookup_name(&by_name, keys[i].name) != &keys[i])
+			return -1;
+	}
+	name_ns = (now() - start) / LOOKUPS;
+
+	start = now();
+	for (n = 0; n < LOOKUPS; n++) {
+		i = random() % nkeys;
+		if (lookup_wd(&by_wd, keys[i].wd) != &keys[i])
+			return -1;
+	}
+	wd_ns = (now() - start) / LOOKUPS;
+
+	if (lookup_name(&by_name, "user.bench.missing") != NULL)
+		return -1;
+
+	printf("{\"bench\":\"hash\",\"keys\":%zu,"
+			"\"name_ns_per_op\":%.1f,\"wd_ns_per_op\":%.1f}\n",
+			nkeys, name_ns, wd_ns);
+	fprintf(stderr, "%-10zu %14.1f %14.1f\n", nkeys, name_ns, wd_ns);
+
+	hash_table_free(&by_name);
+	hash_table_free(&by_wd);
+	free(keys);
+	return 0;
+}
+
+int main(void)
+{
+	const size_t sizes[] = { 10, 100, 1000, 10000, 100000, 0 };
+	int i;
+
+	fprintf(stderr, "%-10s %14s %14s\n", "KEYS", "NAME (ns)", "WD (ns)");
+	for (i = 0; sizes[i] != 0; i++) {
+		if (run(sizes[i]) < 0) {
+			fprintf(stderr, "lookup failed with %zu keys\n", sizes[i]);
+			exit(1);
+		}
+	}
+	exit(0);
+}
@@ -0,0 +1,401 @@
+/*
+ * Copyright (c) 2015 Mark Heily <mark@heily.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+/*
+ * Measure libstate under load: how many values can be published and read
+ * per second as the number of names grows, and how long it takes for a
+ * published value to reach subscribers in other processes as their
+ * number grows.
+ *
+ * A table is printed on stderr, and each result is printed on stdout as
+ * a JSON object on a line of its own, so that results can be compared
+ * between releases. A configuration that cannot be set up, for example
+ * because it needs more file descriptors or inotify instances than the
+ * system allows, is reported with an "error" field instead.
+ */
+
+#include <errno.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../include/state.h"
+
+#define PUBLISHES	200000	/* Per throughput run, at least one per name */
+#define GETS		1000000	/* Per throughput run */
+#define SAMPLES		1000	/* Values published per latency run */
+#define SAMPLE_INTERVAL	1000	/* Microseconds between them */
+#define SETUP_TIMEOUT	30	/* Seconds for subscribers to get ready */
+#define IDLE_TIMEOUT	5000	/* Milliseconds a subscriber waits for a value */
+
+static const size_t key_counts[] = { 1, 100, 10000, 100000, 0 };
+static const int subscriber_counts[] = { 1, 10, 100, 1000, 0 };
+
+/* Shared with the subscriber processes of a latency run */
+struct shared {
+	int	 sh_ready;	/* Subscribers that are waiting for values */
+	int	 sh_failed;	/* Subscribers that could not be set up */
+	int	 sh_errno;	/* Why the first of them failed */
+	uint64_t sh_latency[];	/* SAMPLES per subscriber, in ns, or zero if not seen */
+};
+
+static int flags;
+static const char *backend = "file";
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void key_name(char *buf, size_t size, size_t i)
+{
+	snprintf(buf, size, "user.bench.%zu", i);
+}
+
+/* Report that a configuration could not be run, and why, if <err> is set */
+static void report_error(const char *bench, int nsubs, size_t nkeys,
+		const char *error, int err)
+{
+	const char *reason = err ? strerror(err) : "unknown error";
+
+	printf("{\"bench\":\"%s\",\"backend\":\"%s\",\"subscribers\":%d,"
+			"\"keys\":%zu,\"error\":\"%s: %s\"}\n",
+			bench, backend, nsubs, nkeys, error, reason);
+	fprintf(stderr, "%-8s %-6s %6d %8zu  %s: %s\n", bench, backend, nsubs,
+			nkeys, error, reason);
+}
+
+static void report_rate(const char *bench, size_t nkeys, double ops,
+		double seconds)
+{
+	printf("{\"bench\":\"%s\",\"backend\":\"%s\",\"subscribers\":0,"
+			"\"keys\":%zu,\"ops_per_sec\":%.0f,\"ns_per_op\":%.1f}\n",
+			bench, backend, nkeys, ops / seconds, seconds * 1e9 / ops);
+	fprintf(stderr, "%-8s %-6s %6d %8zu  %12.0f ops/s %10.1f ns/op\n",
+			bench, backend, 0, nkeys, ops / seconds, seconds * 1e9 / ops);
+}
+
+/* Bind, and optionally subscribe to, <nkeys> names in a new context */
+static state_ctx_t setup_keys(size_t nkeys, bool subscribe)
+{
+	state_ctx_t ctx;
+	char name[64];
+	size_t i;
+	int saved_errno;
+
+	if ((ctx = state_ctx_new(flags)) == NULL)
+		return NULL;
+	for (i = 0; i < nkeys; i++) {
+		key_name(name, sizeof(name), i);
+		if (state_ctx_bind(ctx, name) < 0 ||
+				state_ctx_publish(ctx, name, "0", 1) < 0 ||
+				(subscribe && state_ctx_subscribe(ctx, name) < 0)) {
+			saved_errno = errno;
+			state_ctx_free(ctx);
+			errno = saved_errno;
+			return NULL;
+		}
+	}
+	return ctx;
+}
+
+/* Publish a new value to each name in turn */
+static void bench_publish(size_t nkeys)
+{
+	state_ctx_t ctx;
+	char name[64], value[32];
+	size_t i, n = PUBLISHES < nkeys ? nkeys : PUBLISHES;
+	uint64_t start;
+
+	errno = 0;
+	if ((ctx = setup_keys(nkeys, false)) == NULL) {
+		report_error("publish", 0, nkeys, "setup failed", errno);
+		return;
+	}
+	start = now_ns();
+	for (i = 0; i < n; i++) {
+		key_name(name, sizeof(name), i % nkeys);
+		snprintf(value, sizeof(value), "%zu", i + 1);
+		if (state_ctx_publish(ctx, name, value, strlen(value)) < 0) {
+			report_error("publish", 0, nkeys, "state_publish failed", errno);
+			state_ctx_free(ctx);
+			return;
+		}
+	}
+	report_rate("publish", nkeys, n, (now_ns() - start) / 1e9);
+	state_ctx_free(ctx);
+}
+
+/* Read each name in turn, while nothing is changing */
+static void bench_get(size_t nkeys)
+{
+	state_ctx_t ctx;
+	char (*names)[32], *value;
+	size_t i;
+	uint64_t start;
+
+	errno = 0;
+	if ((names = calloc(nkeys, sizeof(*names))) == NULL ||
+			(ctx = setup_keys(nkeys, true)) == NULL) {
+		report_error("get", 0, nkeys, "setup failed", errno);
+		free(names);
+		return;
+	}
+	for (i = 0; i < nkeys; i++)
+		key_name(names[i], sizeof(names[i]), i);
+	start = now_ns();
+	for (i = 0; i < GETS; i++) {
+		if (state_ctx_get(ctx, names[i % nkeys], &value) < 0) {
+			report_error("get", 0, nkeys, "state_get failed", errno);
+			break;
+		}
+	}
+	if (i == GETS)
+		report_rate("get", nkeys, GETS, (now_ns() - start) / 1e9);
+	state_ctx_free(ctx);
+	free(names);
+}
+
+/*
+ * A subscriber process. Each value is "<sample> <time>", and the
+ * latency of each sample is stored in <lat>, until "done" is published.
+ */
+static void subscriber(struct shared *sh, uint64_t *lat, size_t nkeys)
+{
+	struct state_event evs[64];
+	state_ctx_t ctx;
+	char name[64];
+	unsigned long sample;
+	unsigned long long sent;
+	uint64_t now;
+	size_t i;
+	ssize_t n;
+	int expected = 0;
+
+	errno = 0;
+	if ((ctx = state_ctx_new(flags)) == NULL)
+		goto failed;
+	for (i = 0; i < nkeys; i++) {
+		key_name(name, sizeof(name), i);
+		if (state_ctx_subscribe(ctx, name) < 0)
+			goto failed;
+	}
+	__atomic_add_fetch(&sh->sh_ready, 1, __ATOMIC_RELEASE);
+
+	while ((n = state_ctx_wait(ctx, evs, 64, IDLE_TIMEOUT)) > 0) {
+		now = now_ns();
+		for (i = 0; i < (size_t) n; i++) {
+			if (evs[i].len == 4 && memcmp(evs[i].value, "done", 4) == 0)
+				_exit(0);
+			if (sscanf(evs[i].value, "%lu %llu", &sample, &sent) == 2 &&
+					sample < SAMPLES)
+				lat[sample] = now - sent;
+		}
+	}
+	_exit(0);
+
+failed:
+	(void) __atomic_compare_exchange_n(&sh->sh_errno, &expected, errno,
+			false, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&sh->sh_failed, 1, __ATOMIC_RELEASE);
+	_exit(1);
+}
+
+static int compare_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+
+	return (x > y) - (x < y);
+}
+
+static double percentile_us(const uint64_t *sorted, size_t n, double p)
+{
+	return sorted[(size_t) (p * (n - 1))] / 1e3;
+}
+
+/* Wait for the subscribers to be ready. Returns -1 if any failed. */
+static int wait_ready(struct shared *sh, int nsubs)
+{
+	uint64_t deadline = now_ns() + SETUP_TIMEOUT * 1000000000ull;
+
+	while (__atomic_load_n(&sh->sh_ready, __ATOMIC_ACQUIRE) < nsubs) {
+		if (__atomic_load_n(&sh->sh_failed, __ATOMIC_ACQUIRE) > 0 ||
+				now_ns() > deadline)
+			return -1;
+		usleep(1000);
+	}
+	return 0;
+}
+
+/* Publish SAMPLES values, and measure how long each takes to arrive */
+static void bench_latency(int nsubs, size_t nkeys)
+{
+	struct shared *sh;
+	state_ctx_t ctx = NULL;
+	uint64_t *all;
+	pid_t *pids;
+	char name[64], value[64];
+	size_t i, n, size;
+	int j, started = 0;
+	const char *error = NULL;
+	int err = 0;
+
+	size = sizeof(*sh) + (size_t) nsubs * SAMPLES * sizeof(uint64_t);
+	sh = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	pids = calloc(nsubs, sizeof(*pids));
+	all = calloc((size_t) nsubs * SAMPLES, sizeof(*all));
+	if (sh == MAP_FAILED || pids == NULL || all == NULL) {
+		error = "setup failed";
+		err = ENOMEM;
+		goto out;
+	}
+
+	/* The names must exist before anyone subscribes */
+	errno = 0;
+	if ((ctx = setup_keys(nkeys, false)) == NULL) {
+		error = "setup failed";
+		err = errno;
+		goto out;
+	}
+	fflush(stdout);
+	for (started = 0; started < nsubs; started++) {
+		if ((pids[started] = fork()) < 0) {
+			error = "fork failed";
+			err = errno;
+			goto out;
+		}
+		if (pids[started] == 0)
+			subscriber(sh, sh->sh_latency + (size_t) started * SAMPLES, nkeys);
+	}
+	if (wait_ready(sh, nsubs) < 0) {
+		error = "subscribers could not be set up";
+		err = __atomic_load_n(&sh->sh_errno, __ATOMIC_RELAXED);
+		if (err == 0 && __atomic_load_n(&sh->sh_failed, __ATOMIC_RELAXED) == 0)
+			err = ETIMEDOUT;
+		goto out;
+	}
+
+	for (i = 0; i < SAMPLES; i++) {
+		key_name(name, sizeof(name), i % nkeys);
+		snprintf(value, sizeof(value), "%zu %llu", i,
+				(unsigned long long) now_ns());
+		if (state_ctx_publish(ctx, name, value, strlen(value)) < 0) {
+			error = "state_publish failed";
+			err = errno;
+			goto out;
+		}
+		usleep(SAMPLE_INTERVAL);
+	}
+
+out:
+	for (i = 0; ctx && i < nkeys && i < (size_t) started; i++) {
+		key_name(name, sizeof(name), i);
+		(void) state_ctx_publish(ctx, name, "done", 4);
+	}
+	for (j = 0; j < started; j++) {
+		if (error)
+			(void) kill(pids[j], SIGTERM);
+		(void) waitpid(pids[j], NULL, 0);
+	}
+	if (error) {
+		report_error("latency", nsubs, nkeys, error, err);
+	} else {
+		for (i = n = 0; i < (size_t) nsubs * SAMPLES; i++) {
+			if (sh->sh_latency[i] != 0)
+				all[n++] = sh->sh_latency[i];
+		}
+		if (n == 0) {
+			report_error("latency", nsubs, nkeys, "no values arrived", ETIMEDOUT);
+		} else {
+			qsort(all, n, sizeof(*all), compare_u64);
+			printf("{\"bench\":\"latency\",\"backend\":\"%s\","
+					"\"subscribers\":%d,\"keys\":%zu,"
+					"\"published\":%d,\"received\":%zu,"
+					"\"p50_us\":%.1f,\"p99_us\":%.1f,\"p999_us\":%.1f}\n",
+					backend, nsubs, nkeys, SAMPLES, n,
+					percentile_us(all, n, 0.5),
+					percentile_us(all, n, 0.99),
+					percentile_us(all, n, 0.999));
+			fprintf(stderr, "%-8s %-6s %6d %8zu  p50 %8.1f us  p99 %8.1f us"
+					"  p999 %8.1f us  (%zu/%zu received)\n",
+					"latency", backend, nsubs, nkeys,
+					percentile_us(all, n, 0.5),
+					percentile_us(all, n, 0.99),
+					percentile_us(all, n, 0.999),
+					n, (size_t) nsubs * SAMPLES);
+		}
+	}
+	if (ctx)
+		state_ctx_free(ctx);
+	if (sh != MAP_FAILED)
+		(void) munmap(sh, size);
+	free(pids);
+	free(all);
+}
+
+static void usage(void)
+{
+	fprintf(stderr, "usage: pubbench [-a] [-k max_keys] [-s max_subscribers]\n");
+	exit(2);
+}
+
+int main(int argc, char *argv[])
+{
+	size_t max_keys = 100000;
+	int c, i, max_subs = 1000;
+
+	while ((c = getopt(argc, argv, "ak:s:")) != -1) {
+		switch (c) {
+		case 'a':
+			flags |= STATE_ARENA;
+			backend = "arena";
+			break;
+		case 'k':
+			max_keys = strtoul(optarg, NULL, 10);
+			break;
+		case 's':
+			max_subs = atoi(optarg);
+			break;
+		default:
+			usage();
+		}
+	}
+
+	fprintf(stderr, "%-8s %-6s %6s %8s  %s\n", "BENCH", "MODE", "SUBS",
+			"KEYS", "RESULT");
+	for (i = 0; key_counts[i] != 0 && key_counts[i] <= max_keys; i++) {
+		bench_publish(key_counts[i]);
+		bench_get(key_counts[i]);
+	}
+
+	/* Fan-out to more processes, and then to more names */
+	for (i = 0; subscriber_counts[i] != 0 && subscriber_counts[i] <= max_subs; i++)
+		bench_latency(subscriber_counts[i], 1);
+	for (i = 1; key_counts[i] != 0 && key_counts[i] <= max_keys; i++)
+		bench_latency(1, key_counts[i]);
+	exit(0);
+}
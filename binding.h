@@ -17,23 +17,67 @@
 #ifndef BINDING_H_
 #define BINDING_H_
 
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/queue.h>
+
+#include "arena.h"
+#include "hash.h"
+#include "history.h"
+#include "statefile.h"
+
+/*
+ * A binding made by state_bind_counter(). The value is changed in place,
+ * and sampled by the flusher thread to notify subscribers.
+ */
+struct state_counter_s {
+	void	*sc_value;	/* The payload, within the shared mapping */
+	int64_t	 sc_sampled;	/* The value when subscribers were last notified */
+	uint64_t sc_interval;	/* The time between samples, or zero */
+	uint64_t sc_next;	/* When the next sample is due */
+};
+
 struct state_binding_s {
-	SLIST_ENTRY(state_binding_s) entry;
-	int fd;
+	struct hash_node name_node;	/* Indexed by <name> */
+	struct statefile file;
+	arena_t arena;	/* If not NULL, the state is stored here instead of <file> */
+	int slot;	/* The slot within <arena> */
 	char *name;
 	char *path;
 	size_t maxlen; /* Maximum amount of state data that can be published */
+
+	/* A copy of the last value published, so it is not written twice */
+	char *value;
+	size_t value_len, value_size;
+	bool has_value;
+
+	/*
+	 * Throttling, set by state_bind_throttled(). A <value> that cannot be
+	 * written yet is left pending until <deadline>, and then written by
+	 * the flusher thread. Times are in nanoseconds of CLOCK_MONOTONIC.
+	 */
+	uint64_t interval;	/* Minimum time between writes, or zero */
+	uint64_t debounce;	/* How long a value must be left alone, or zero */
+	uint64_t last;		/* When the last value was written */
+	uint64_t deadline;	/* When <value> is due to be written */
+	bool has_pending;	/* If true, this is on the pending list */
+	LIST_ENTRY(state_binding_s) pending_entry;
+
+	history_t history;	/* Set by state_bind_history(), or NULL */
+	struct state_counter_s *counter;	/* If not NULL, this is a counter */
+	LIST_ENTRY(state_binding_s) counter_entry;
 };
 typedef struct state_binding_s * state_binding_t;
 
 static inline void state_binding_free(state_binding_t sb)
 {
 	if (sb) {
-		if (sb->fd >= 0) {
-			(void) close(sb->fd);
-		}
+		statefile_close(&sb->file);
+		history_close(sb->history);
 		free(sb->name);
 		free(sb->path);
+		free(sb->value);
+		free(sb->counter);
 		free(sb);
 	}
 }
@@ -0,0 +1,923 @@
+/*
+ * Copyright (c) 2015 Mark Heily <mark@heily.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#ifdef __linux__
+#define _GNU_SOURCE /* for struct ucred */
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "platform.h"
+
+#if USE_KQUEUE
+#include <sys/event.h>
+#else
+#include <sys/epoll.h>
+#endif
+
+#include "broker.h"
+#include "hash.h"
+#include "log.h"
+
+/* The maximum number of descriptors to handle in one call to broker_dispatch() */
+#define BROKER_BATCH 256
+
+/* The initial size of the receive and transmit buffers of a client */
+#define BROKER_BUFSZ 4096
+
+/* A client that falls this far behind on reading notifications is dropped */
+#define BROKER_TX_MAX (64 * 1024 * 1024)
+
+struct broker_key;
+struct broker_client;
+
+/* A subscription by a client to a key, or to every key that begins with a prefix */
+struct broker_sub {
+	LIST_ENTRY(broker_sub) bs_key_entry;	/* On bk_subs, or b_prefixes */
+	LIST_ENTRY(broker_sub) bs_client_entry;	/* On bc_subs */
+	struct broker_client *bs_client;
+	struct broker_key *bs_key;	/* NULL for a prefix */
+	char   *bs_prefix;
+	size_t  bs_prefixlen;
+};
+
+struct broker_key {
+	struct hash_node bk_node;	/* Indexed by <bk_name> */
+	unsigned int bk_commit;	/* The last commit that notified subscribers */
+	uid_t   bk_owner;	/* The user, for a name beginning with "user." */
+	char   *bk_name;
+	uint16_t bk_namelen;
+	char   *bk_value;	/* NULL until the first publish */
+	size_t  bk_len;
+	LIST_HEAD(, broker_sub) bk_subs;
+};
+
+/* Each user other than root, to limit the names they can create */
+struct broker_user {
+	struct hash_node bu_node;	/* Indexed by <bu_uid> */
+	uid_t   bu_uid;
+	unsigned int bu_nkeys;	/* The number of keys created by the user */
+};
+
+/* A publish that is waiting for BROKER_COMMIT */
+struct broker_pending {
+	STAILQ_ENTRY(broker_pending) bp_entry;
+	struct broker_key *bp_key;
+	char   *bp_value;
+	size_t  bp_len;
+};
+
+struct broker_client {
+	LIST_ENTRY(broker_client) bc_entry;	/* On b_clients, or b_closed */
+	LIST_ENTRY(broker_client) bc_dirty_entry;	/* On b_dirty */
+	int     bc_fd;
+	uid_t   bc_uid;
+	bool    bc_dirty;	/* There are notifications to send */
+	bool    bc_blocked;	/* Waiting for the socket to become writable */
+	bool    bc_closed;	/* On b_closed, to be freed at the end of the dispatch */
+	bool    bc_txn;		/* Between BROKER_BEGIN and BROKER_COMMIT */
+	STAILQ_HEAD(, broker_pending) bc_pending;
+	size_t  bc_npending;	/* The number of entries on bc_pending */
+	size_t  bc_pendingsz;	/* The size of their values */
+	char   *bc_rx;
+	size_t  bc_rxlen, bc_rxsz;
+	char   *bc_tx;
+	size_t  bc_txoff, bc_txlen, bc_txsz;
+	LIST_HEAD(, broker_sub) bc_subs;
+};
+
+struct broker_s {
+	int     b_fd;		/* The listening socket */
+	int     b_pollfd;	/* kqueue(2) or epoll(7) descriptor */
+	char   *b_path;
+	struct hash_table b_keys;
+	struct hash_table b_users;
+	LIST_HEAD(, broker_client) b_clients;
+	LIST_HEAD(, broker_client) b_closed;
+	LIST_HEAD(, broker_client) b_dirty;
+	LIST_HEAD(, broker_sub) b_prefixes;
+	unsigned int b_commit;	/* Incremented by each BROKER_COMMIT */
+};
+
+struct broker_event {
+	struct broker_client *be_client;	/* NULL for the listening socket */
+	bool    be_readable;
+	bool    be_writable;
+};
+
+static void client_close(broker_t b, struct broker_client *bc);
+
+#if USE_KQUEUE
+
+static int poll_new(void)
+{
+	return kqueue();
+}
+
+static int poll_add(broker_t b, int fd, struct broker_client *bc)
+{
+	struct kevent kev;
+
+	EV_SET(&kev, fd, EVFILT_READ, EV_ADD, 0, 0, bc);
+	if (kevent(b->b_pollfd, &kev, 1, NULL, 0, NULL) < 0) {
+		log_errno("kevent(2)");
+		return -1;
+	}
+	return 0;
+}
+
+static int poll_set_blocked(broker_t b, struct broker_client *bc, bool blocked)
+{
+	struct kevent kev;
+
+	EV_SET(&kev, bc->bc_fd, EVFILT_WRITE, blocked ? EV_ADD : EV_DELETE, 0, 0, bc);
+	if (kevent(b->b_pollfd, &kev, 1, NULL, 0, NULL) < 0) {
+		log_errno("kevent(2)");
+		return -1;
+	}
+	return 0;
+}
+
+static ssize_t poll_read(broker_t b, struct broker_event *evs, size_t nevents)
+{
+	const struct timespec ts = { 0, 0 };
+	struct kevent kev[BROKER_BATCH];
+	int i, nret;
+
+	nret = kevent(b->b_pollfd, NULL, 0, kev, nevents, &ts);
+	if (nret < 0) {
+		log_errno("kevent(2)");
+		return -1;
+	}
+	for (i = 0; i < nret; i++) {
+		evs[i].be_client = kev[i].udata;
+		evs[i].be_readable = kev[i].filter == EVFILT_READ;
+		evs[i].be_writable = kev[i].filter == EVFILT_WRITE;
+	}
+	return nret;
+}
+
+#else
+
+static int poll_new(void)
+{
+	return epoll_create1(EPOLL_CLOEXEC);
+}
+
+static int poll_add(broker_t b, int fd, struct broker_client *bc)
+{
+	struct epoll_event ev;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.ptr = bc;
+	if (epoll_ctl(b->b_pollfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+		log_errno("epoll_ctl(2)");
+		return -1;
+	}
+	return 0;
+}
+
+static int poll_set_blocked(broker_t b, struct broker_client *bc, bool blocked)
+{
+	struct epoll_event ev;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN | (blocked ? EPOLLOUT : 0);
+	ev.data.ptr = bc;
+	if (epoll_ctl(b->b_pollfd, EPOLL_CTL_MOD, bc->bc_fd, &ev) < 0) {
+		log_errno("epoll_ctl(2)");
+		return -1;
+	}
+	return 0;
+}
+
+static ssize_t poll_read(broker_t b, struct broker_event *evs, size_t nevents)
+{
+	struct epoll_event ev[BROKER_BATCH];
+	int i, nret;
+
+	nret = epoll_wait(b->b_pollfd, ev, nevents, 0);
+	if (nret < 0) {
+		if (errno == EINTR)
+			return 0;
+		log_errno("epoll_wait(2)");
+		return -1;
+	}
+	for (i = 0; i < nret; i++) {
+		evs[i].be_client = ev[i].data.ptr;
+		evs[i].be_readable = (ev[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) != 0;
+		evs[i].be_writable = (ev[i].events & EPOLLOUT) != 0;
+	}
+	return nret;
+}
+
+#endif /* USE_KQUEUE */
+
+static int peer_uid(int fd, uid_t *uid)
+{
+#ifdef SO_PEERCRED
+	struct ucred cr;
+	socklen_t len = sizeof(cr);
+
+	if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cr, &len) < 0) {
+		log_errno("getsockopt(2)");
+		return -1;
+	}
+	*uid = cr.uid;
+#else
+	gid_t gid;
+
+	if (getpeereid(fd, uid, &gid) < 0) {
+		log_errno("getpeereid(3)");
+		return -1;
+	}
+#endif
+	return 0;
+}
+
+static bool name_is_user(const char *name, size_t namelen)
+{
+	const char *user_prefix = "user.";
+
+	return namelen >= strlen(user_prefix) &&
+			memcmp(name, user_prefix, strlen(user_prefix)) == 0;
+}
+
+/* Count a new key against the user that created it */
+static int user_add_key(broker_t b, uid_t uid)
+{
+	struct broker_user *bu = NULL;
+	struct hash_node *hn;
+
+	if (uid == 0)
+		return 0;
+	HASH_TABLE_FOREACH(hn, &b->b_users, hash_int(uid))
+	{
+		bu = hn->hn_data;
+		if (bu->bu_uid == uid)
+			break;
+	}
+	if (hn == NULL) {
+		if ((bu = calloc(1, sizeof(*bu))) == NULL) {
+			log_errno("calloc(3)");
+			return -1;
+		}
+		bu->bu_uid = uid;
+		hash_table_insert(&b->b_users, &bu->bu_node, hash_int(uid), bu);
+	}
+	if (bu->bu_nkeys >= BROKER_USER_KEYS_MAX) {
+		log_warning("uid %d has created too many names", (int) uid);
+		return -1;
+	}
+	bu->bu_nkeys++;
+	return 0;
+}
+
+/* Find the key for <name> as seen by <uid>, creating it if <create> is true */
+static struct broker_key *key_lookup(broker_t b, uid_t uid, const char *name,
+		uint16_t namelen, bool create)
+{
+	struct broker_key *bk;
+	struct hash_node *hn;
+	uint32_t hash;
+	uid_t owner;
+	char *buf;
+
+	/* The hash covers the NUL-terminated name */
+	if ((buf = malloc(namelen + 1)) == NULL) {
+		log_errno("malloc(3)");
+		return NULL;
+	}
+	memcpy(buf, name, namelen);
+	buf[namelen] = '\0';
+	owner = name_is_user(name, namelen) ? uid : 0;
+	hash = hash_string(buf);
+
+	HASH_TABLE_FOREACH(hn, &b->b_keys, hash)
+	{
+		bk = hn->hn_data;
+		if (bk->bk_owner == owner && bk->bk_namelen == namelen &&
+				memcmp(bk->bk_name, name, namelen) == 0) {
+			free(buf);
+			return bk;
+		}
+	}
+	if (!create || user_add_key(b, uid) < 0 ||
+			(bk = calloc(1, sizeof(*bk))) == NULL) {
+		free(buf);
+		return NULL;
+	}
+	bk->bk_owner = owner;
+	bk->bk_name = buf;
+	bk->bk_namelen = namelen;
+	LIST_INIT(&bk->bk_subs);
+	hash_table_insert(&b->b_keys, &bk->bk_node, hash, bk);
+	return bk;
+}
+
+/* Queue a notification of the current value of <bk> for a client */
+static void client_notify(broker_t b, struct broker_client *bc,
+		struct broker_key *bk)
+{
+	struct broker_msg msg;
+	size_t need, pending;
+	char *p;
+
+	if (bc->bc_closed)
+		return;
+	need = sizeof(msg) + bk->bk_namelen + bk->bk_len;
+	pending = bc->bc_txlen - bc->bc_txoff;
+	if (pending + need > BROKER_TX_MAX) {
+		log_warning("client %d is not reading notifications; dropping it",
+				bc->bc_fd);
+		client_close(b, bc);
+		return;
+	}
+
+	/* Reclaim the space that was already sent before growing the buffer */
+	if (bc->bc_txlen + need > bc->bc_txsz && bc->bc_txoff > 0) {
+		memmove(bc->bc_tx, bc->bc_tx + bc->bc_txoff, pending);
+		bc->bc_txoff = 0;
+		bc->bc_txlen = pending;
+	}
+	if (bc->bc_txlen + need > bc->bc_txsz) {
+		size_t newsz = bc->bc_txsz ? bc->bc_txsz : BROKER_BUFSZ;
+
+		while (newsz < bc->bc_txlen + need)
+			newsz *= 2;
+		if ((p = realloc(bc->bc_tx, newsz)) == NULL) {
+			log_errno("realloc(3)");
+			client_close(b, bc);
+			return;
+		}
+		bc->bc_tx = p;
+		bc->bc_txsz = newsz;
+	}
+
+	msg.bm_len = bk->bk_namelen + bk->bk_len;
+	msg.bm_type = BROKER_NOTIFY;
+	msg.bm_namelen = bk->bk_namelen;
+	p = bc->bc_tx + bc->bc_txlen;
+	memcpy(p, &msg, sizeof(msg));
+	memcpy(p + sizeof(msg), bk->bk_name, bk->bk_namelen);
+	memcpy(p + sizeof(msg) + bk->bk_namelen, bk->bk_value, bk->bk_len);
+	bc->bc_txlen += need;
+
+	if (!bc->bc_dirty) {
+		bc->bc_dirty = true;
+		LIST_INSERT_HEAD(&b->b_dirty, bc, bc_dirty_entry);
+	}
+}
+
+/* Send as much of the queued notifications as the socket will take */
+static int client_flush(broker_t b, struct broker_client *bc)
+{
+	ssize_t nret;
+
+	while (bc->bc_txoff < bc->bc_txlen) {
+		nret = write(bc->bc_fd, bc->bc_tx + bc->bc_txoff,
+				bc->bc_txlen - bc->bc_txoff);
+		if (nret < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN) {
+				if (!bc->bc_blocked && poll_set_blocked(b, bc, true) < 0)
+					return -1;
+				bc->bc_blocked = true;
+				return 0;
+			}
+			log_errno("write(2)");
+			return -1;
+		}
+		bc->bc_txoff += nret;
+	}
+	bc->bc_txoff = bc->bc_txlen = 0;
+	if (bc->bc_blocked && poll_set_blocked(b, bc, false) < 0)
+		return -1;
+	bc->bc_blocked = false;
+	return 0;
+}
+
+static int client_subscribe(broker_t b, struct broker_client *bc,
+		const char *name, uint16_t namelen, bool prefix)
+{
+	struct broker_key *bk = NULL;
+	struct broker_sub *bs;
+
+	if (bc->bc_closed)
+		return -1;
+	if (!prefix) {
+		if ((bk = key_lookup(b, bc->bc_uid, name, namelen, true)) == NULL)
+			return -1;
+		LIST_FOREACH(bs, &bk->bk_subs, bs_key_entry) {
+			if (bs->bs_client == bc)
+				return 0;
+		}
+	}
+	if ((bs = calloc(1, sizeof(*bs))) == NULL) {
+		log_errno("calloc(3)");
+		return -1;
+	}
+	bs->bs_client = bc;
+	bs->bs_key = bk;
+	if (prefix) {
+		if ((bs->bs_prefix = malloc(namelen)) == NULL) {
+			log_errno("malloc(3)");
+			free(bs);
+			return -1;
+		}
+		memcpy(bs->bs_prefix, name, namelen);
+		bs->bs_prefixlen = namelen;
+		LIST_INSERT_HEAD(&b->b_prefixes, bs, bs_key_entry);
+	} else {
+		LIST_INSERT_HEAD(&bk->bk_subs, bs, bs_key_entry);
+	}
+	LIST_INSERT_HEAD(&bc->bc_subs, bs, bs_client_entry);
+
+	/* The current value is always the first notification */
+	if (bk && bk->bk_value)
+		client_notify(b, bc, bk);
+	return 0;
+}
+
+static void client_unsubscribe(struct broker_client *bc, const char *name,
+		uint16_t namelen, bool prefix)
+{
+	struct broker_sub *bs;
+
+	LIST_FOREACH(bs, &bc->bc_subs, bs_client_entry) {
+		if (prefix) {
+			if (bs->bs_key == NULL && bs->bs_prefixlen == namelen &&
+					memcmp(bs->bs_prefix, name, namelen) == 0)
+				break;
+		} else {
+			if (bs->bs_key && bs->bs_key->bk_namelen == namelen &&
+					memcmp(bs->bs_key->bk_name, name, namelen) == 0)
+				break;
+		}
+	}
+	if (bs == NULL)
+		return;
+	LIST_REMOVE(bs, bs_key_entry);
+	LIST_REMOVE(bs, bs_client_entry);
+	free(bs->bs_prefix);
+	free(bs);
+}
+
+static int key_set(struct broker_key *bk, const char *value, size_t len)
+{
+	char *buf;
+
+	if ((buf = realloc(bk->bk_value, len + 1)) == NULL) {
+		log_errno("realloc(3)");
+		return -1;
+	}
+	memcpy(buf, value, len);
+	buf[len] = '\0';
+	bk->bk_value = buf;
+	bk->bk_len = len;
+	return 0;
+}
+
+/*
+ * Notify every subscriber of a key; the writes are batched by broker_dispatch().
+ * A client that is dropped here keeps its subscriptions until client_free().
+ */
+static void key_fanout(broker_t b, struct broker_key *bk)
+{
+	struct broker_sub *bs, *tmp;
+
+	LIST_FOREACH_SAFE(bs, &bk->bk_subs, bs_key_entry, tmp) {
+		client_notify(b, bs->bs_client, bk);
+	}
+	LIST_FOREACH_SAFE(bs, &b->b_prefixes, bs_key_entry, tmp) {
+		if (bs->bs_prefixlen <= bk->bk_namelen &&
+				memcmp(bs->bs_prefix, bk->bk_name, bs->bs_prefixlen) == 0 &&
+				(!name_is_user(bk->bk_name, bk->bk_namelen) ||
+				 bk->bk_owner == bs->bs_client->bc_uid))
+			client_notify(b, bs->bs_client, bk);
+	}
+}
+
+static int client_publish(broker_t b, struct broker_client *bc,
+		const char *name, uint16_t namelen, const char *value, size_t len)
+{
+	struct broker_pending *bp;
+	struct broker_key *bk;
+
+	if (bc->bc_closed)
+		return -1;
+	if (!name_is_user(name, namelen) && bc->bc_uid != 0) {
+		log_warning("client %d is not allowed to publish to %.*s",
+				bc->bc_fd, (int) namelen, name);
+		return -1;
+	}
+	if ((bk = key_lookup(b, bc->bc_uid, name, namelen, true)) == NULL)
+		return -1;
+	if (!bc->bc_txn) {
+		if (key_set(bk, value, len) < 0)
+			return -1;
+		key_fanout(b, bk);
+		return 0;
+	}
+
+	if (bc->bc_npending >= BROKER_TXN_MAX ||
+			bc->bc_pendingsz + len > BROKER_TXN_BYTES) {
+		log_warning("client %d has too many publishes in a transaction",
+				bc->bc_fd);
+		return -1;
+	}
+	if ((bp = calloc(1, sizeof(*bp))) == NULL ||
+			(bp->bp_value = malloc(len)) == NULL) {
+		log_errno("malloc(3)");
+		free(bp);
+		return -1;
+	}
+	bp->bp_key = bk;
+	memcpy(bp->bp_value, value, len);
+	bp->bp_len = len;
+	STAILQ_INSERT_TAIL(&bc->bc_pending, bp, bp_entry);
+	bc->bc_npending++;
+	bc->bc_pendingsz += len;
+	return 0;
+}
+
+static void client_discard(struct broker_client *bc)
+{
+	struct broker_pending *bp;
+
+	while ((bp = STAILQ_FIRST(&bc->bc_pending)) != NULL) {
+		STAILQ_REMOVE_HEAD(&bc->bc_pending, bp_entry);
+		free(bp->bp_value);
+		free(bp);
+	}
+	bc->bc_npending = bc->bc_pendingsz = 0;
+	bc->bc_txn = false;
+}
+
+/* Apply every pending publish, and only then notify subscribers, once per key */
+static int client_commit(broker_t b, struct broker_client *bc)
+{
+	struct broker_pending *bp;
+	int rv = 0;
+
+	b->b_commit++;
+	STAILQ_FOREACH(bp, &bc->bc_pending, bp_entry) {
+		if (key_set(bp->bp_key, bp->bp_value, bp->bp_len) < 0)
+			rv = -1;
+	}
+	STAILQ_FOREACH(bp, &bc->bc_pending, bp_entry) {
+		if (bp->bp_key->bk_commit != b->b_commit && bp->bp_key->bk_value) {
+			bp->bp_key->bk_commit = b->b_commit;
+			key_fanout(b, bp->bp_key);
+		}
+	}
+	client_discard(bc);
+	return rv;
+}
+
+/* Handle one message. Returns -1 if the client should be dropped. */
+static int client_handle(broker_t b, struct broker_client *bc,
+		const struct broker_msg *msg, const char *body)
+{
+	const char *name = body;
+	const char *value = body + msg->bm_namelen;
+	size_t len = msg->bm_len - msg->bm_namelen;
+
+	switch (msg->bm_type) {
+	case BROKER_SUBSCRIBE:
+		return client_subscribe(b, bc, name, msg->bm_namelen, false);
+	case BROKER_SUBSCRIBE_PREFIX:
+		return client_subscribe(b, bc, name, msg->bm_namelen, true);
+	case BROKER_UNSUBSCRIBE:
+		client_unsubscribe(bc, name, msg->bm_namelen, false);
+		return 0;
+	case BROKER_UNSUBSCRIBE_PREFIX:
+		client_unsubscribe(bc, name, msg->bm_namelen, true);
+		return 0;
+	case BROKER_PUBLISH:
+		return client_publish(b, bc, name, msg->bm_namelen, value, len);
+	case BROKER_BEGIN:
+		if (bc->bc_txn) {
+			log_warning("client %d began a transaction twice", bc->bc_fd);
+			return -1;
+		}
+		bc->bc_txn = true;
+		return 0;
+	case BROKER_COMMIT:
+		if (!bc->bc_txn) {
+			log_warning("client %d committed without beginning", bc->bc_fd);
+			return -1;
+		}
+		return client_commit(b, bc);
+	default:
+		log_warning("client %d sent an unknown message type %u",
+				bc->bc_fd, msg->bm_type);
+		return -1;
+	}
+}
+
+/* Read whatever has arrived from a client, and handle every complete message */
+static int client_read(broker_t b, struct broker_client *bc)
+{
+	struct broker_msg msg;
+	size_t off, need;
+	ssize_t nret;
+	char *p;
+
+	/* Make room for at least the header of the next message */
+	if (bc->bc_rxsz - bc->bc_rxlen < sizeof(msg)) {
+		need = bc->bc_rxsz ? bc->bc_rxsz * 2 : BROKER_BUFSZ;
+		if ((p = realloc(bc->bc_rx, need)) == NULL) {
+			log_errno("realloc(3)");
+			return -1;
+		}
+		bc->bc_rx = p;
+		bc->bc_rxsz = need;
+	}
+	nret = read(bc->bc_fd, bc->bc_rx + bc->bc_rxlen, bc->bc_rxsz - bc->bc_rxlen);
+	if (nret < 0) {
+		if (errno == EINTR || errno == EAGAIN)
+			return 0;
+		log_errno("read(2)");
+		return -1;
+	}
+	if (nret == 0) {
+		log_debug("client %d disconnected", bc->bc_fd);
+		return -1;
+	}
+	bc->bc_rxlen += nret;
+
+	for (off = 0; bc->bc_rxlen - off >= sizeof(msg); off += need) {
+		memcpy(&msg, bc->bc_rx + off, sizeof(msg));
+		if (msg.bm_len > BROKER_MSG_MAX - sizeof(msg) ||
+				(msg.bm_namelen == 0 && msg.bm_type != BROKER_BEGIN &&
+				 msg.bm_type != BROKER_COMMIT) ||
+				msg.bm_namelen > BROKER_NAME_MAX ||
+				msg.bm_namelen > msg.bm_len) {
+			log_warning("client %d sent a malformed message", bc->bc_fd);
+			return -1;
+		}
+		need = sizeof(msg) + msg.bm_len;
+		if (bc->bc_rxlen - off < need)
+			break;
+		if (client_handle(b, bc, &msg, bc->bc_rx + off + sizeof(msg)) < 0)
+			return -1;
+
+		/* Dropped by a notification of its own, or of a failed write */
+		if (bc->bc_closed)
+			return -1;
+	}
+
+	/* Keep the partial message, and make sure it will fit */
+	memmove(bc->bc_rx, bc->bc_rx + off, bc->bc_rxlen - off);
+	bc->bc_rxlen -= off;
+	if (bc->bc_rxlen >= sizeof(msg)) {
+		memcpy(&msg, bc->bc_rx, sizeof(msg));
+		need = sizeof(msg) + msg.bm_len;
+		if (need > bc->bc_rxsz) {
+			if ((p = realloc(bc->bc_rx, need)) == NULL) {
+				log_errno("realloc(3)");
+				return -1;
+			}
+			bc->bc_rx = p;
+			bc->bc_rxsz = need;
+		}
+	}
+	return 0;
+}
+
+static void broker_accept(broker_t b)
+{
+	struct broker_client *bc;
+	int fd;
+
+	for (;;) {
+		fd = accept(b->b_fd, NULL, NULL);
+		if (fd < 0) {
+			if (errno != EAGAIN && errno != EINTR)
+				log_errno("accept(2)");
+			return;
+		}
+		if ((bc = calloc(1, sizeof(*bc))) == NULL) {
+			log_errno("calloc(3)");
+			(void) close(fd);
+			continue;
+		}
+		bc->bc_fd = fd;
+		LIST_INIT(&bc->bc_subs);
+		STAILQ_INIT(&bc->bc_pending);
+		LIST_INSERT_HEAD(&b->b_clients, bc, bc_entry);
+		if (fcntl(fd, F_SETFL, O_NONBLOCK) < 0 ||
+				peer_uid(fd, &bc->bc_uid) < 0 ||
+				poll_add(b, fd, bc) < 0) {
+			client_close(b, bc);
+			continue;
+		}
+		log_debug("client %d connected, uid %d", fd, (int) bc->bc_uid);
+	}
+}
+
+/*
+ * Stop serving a client. It is freed at the end of broker_dispatch(), so
+ * that this is safe while its subscriptions or pending publishes are
+ * being walked.
+ */
+static void client_close(broker_t b, struct broker_client *bc)
+{
+	if (bc->bc_closed)
+		return;
+	if (bc->bc_dirty) {
+		LIST_REMOVE(bc, bc_dirty_entry);
+		bc->bc_dirty = false;
+	}
+	LIST_REMOVE(bc, bc_entry);
+	LIST_INSERT_HEAD(&b->b_closed, bc, bc_entry);
+	bc->bc_closed = true;
+	(void) close(bc->bc_fd);
+	bc->bc_fd = -1;
+}
+
+static void client_free(struct broker_client *bc)
+{
+	struct broker_sub *bs;
+
+	client_discard(bc);
+	while ((bs = LIST_FIRST(&bc->bc_subs)) != NULL) {
+		LIST_REMOVE(bs, bs_key_entry);
+		LIST_REMOVE(bs, bs_client_entry);
+		free(bs->bs_prefix);
+		free(bs);
+	}
+	free(bc->bc_rx);
+	free(bc->bc_tx);
+	free(bc);
+}
+
+broker_t broker_new(const char *path)
+{
+	struct sockaddr_un sa;
+	broker_t b;
+
+	if (strlen(path) >= sizeof(sa.sun_path)) {
+		log_error("socket path is too long: %s", path);
+		return NULL;
+	}
+	if ((b = calloc(1, sizeof(*b))) == NULL)
+		return NULL;
+	b->b_fd = b->b_pollfd = -1;
+	LIST_INIT(&b->b_clients);
+	LIST_INIT(&b->b_closed);
+	LIST_INIT(&b->b_dirty);
+	LIST_INIT(&b->b_prefixes);
+	if (hash_table_init(&b->b_keys) < 0 || hash_table_init(&b->b_users) < 0 ||
+			(b->b_path = strdup(path)) == NULL)
+		goto err_out;
+
+	/* A client that goes away should not take the daemon with it */
+	(void) signal(SIGPIPE, SIG_IGN);
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sun_family = AF_UNIX;
+	strncpy(sa.sun_path, path, sizeof(sa.sun_path) - 1);
+	(void) unlink(path);
+	if ((b->b_fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+		log_errno("socket(2)");
+		goto err_out;
+	}
+	if (bind(b->b_fd, (struct sockaddr *) &sa, sizeof(sa)) < 0) {
+		log_errno("bind(2) to %s", path);
+		goto err_out;
+	}
+	/* Every user may connect; names are protected by checking credentials */
+	if (chmod(path, 0666) < 0) {
+		log_errno("chmod(2) of %s", path);
+		goto err_out;
+	}
+	if (listen(b->b_fd, SOMAXCONN) < 0 ||
+			fcntl(b->b_fd, F_SETFL, O_NONBLOCK) < 0) {
+		log_errno("listen(2)");
+		goto err_out;
+	}
+	if ((b->b_pollfd = poll_new()) < 0) {
+		log_errno("creating a poll descriptor");
+		goto err_out;
+	}
+	if (poll_add(b, b->b_fd, NULL) < 0)
+		goto err_out;
+	return b;
+
+err_out:
+	broker_free(b);
+	return NULL;
+}
+
+void broker_free(broker_t b)
+{
+	struct broker_client *bc;
+	struct broker_key *bk;
+	struct hash_node *hn;
+	size_t i;
+
+	if (!b)
+		return;
+	while ((bc = LIST_FIRST(&b->b_clients)) != NULL)
+		client_close(b, bc);
+	while ((bc = LIST_FIRST(&b->b_closed)) != NULL) {
+		LIST_REMOVE(bc, bc_entry);
+		client_free(bc);
+	}
+	if (b->b_keys.ht_buckets) {
+		HASH_TABLE_DRAIN(hn, &b->b_keys, i) {
+			bk = hn->hn_data;
+			free(bk->bk_name);
+			free(bk->bk_value);
+			free(bk);
+		}
+		hash_table_free(&b->b_keys);
+	}
+	if (b->b_users.ht_buckets) {
+		HASH_TABLE_DRAIN(hn, &b->b_users, i) {
+			free(hn->hn_data);
+		}
+		hash_table_free(&b->b_users);
+	}
+	if (b->b_fd >= 0) {
+		(void) close(b->b_fd);
+		(void) unlink(b->b_path);
+	}
+	if (b->b_pollfd >= 0)
+		(void) close(b->b_pollfd);
+	free(b->b_path);
+	free(b);
+}
+
+int broker_get_fd(broker_t b)
+{
+	return b->b_pollfd;
+}
+
+int broker_dispatch(broker_t b)
+{
+	struct broker_event evs[BROKER_BATCH];
+	struct broker_client *bc;
+	ssize_t i, nret;
+
+	nret = poll_read(b, evs, BROKER_BATCH);
+	if (nret < 0)
+		return -1;
+	for (i = 0; i < nret; i++) {
+		bc = evs[i].be_client;
+		if (bc == NULL) {
+			broker_accept(b);
+			continue;
+		}
+		if (bc->bc_closed)
+			continue;
+		if (evs[i].be_writable && client_flush(b, bc) < 0) {
+			client_close(b, bc);
+			continue;
+		}
+		if (evs[i].be_readable && client_read(b, bc) < 0)
+			client_close(b, bc);
+	}
+
+	/* Send everything queued above with one write per client */
+	while ((bc = LIST_FIRST(&b->b_dirty)) != NULL) {
+		LIST_REMOVE(bc, bc_dirty_entry);
+		bc->bc_dirty = false;
+		if (client_flush(b, bc) < 0)
+			client_close(b, bc);
+	}
+
+	while ((bc = LIST_FIRST(&b->b_closed)) != NULL) {
+		LIST_REMOVE(bc, bc_entry);
+		client_free(bc);
+	}
+	return 0;
+}
@@ -0,0 +1,86 @@
+/*
+ * Copyright (c) 2015 Mark Heily <mark@heily.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#ifndef BROKER_H_
+#define BROKER_H_
+
+#include <stdint.h>
+#include <sys/types.h>
+
+/*
+ * The broker is an optional mode of stated, where clients that pass
+ * STATE_BROKER to state_init() connect to a Unix domain socket instead of
+ * using the filesystem. Every message on the socket is a struct broker_msg
+ * followed by the name and the value, neither of which is NUL-terminated.
+ * Integers are in host byte order, since both ends are on the same host.
+ *
+ * Names beginning with "user." are private to the user that publishes
+ * them, as with the per-user state directory. Only root can publish
+ * other names.
+ */
+
+#define BROKER_SOCKET		".broker"	/* Within STATE_PREFIX */
+#define BROKER_NAME_MAX		1024
+#define BROKER_MSG_MAX		(16 * 1024 * 1024)	/* Including the header */
+#define BROKER_TXN_MAX		65536	/* Publishes in one transaction */
+#define BROKER_TXN_BYTES	(64 * 1024 * 1024)	/* Bytes of values in one transaction */
+#define BROKER_USER_KEYS_MAX	65536	/* Names created by each user other than root */
+
+enum {
+	BROKER_SUBSCRIBE = 1,		/* Client to broker; no value */
+	BROKER_UNSUBSCRIBE,		/* Client to broker; no value */
+	BROKER_SUBSCRIBE_PREFIX,	/* Client to broker; the name is a prefix */
+	BROKER_UNSUBSCRIBE_PREFIX,	/* Client to broker; the name is a prefix */
+	BROKER_PUBLISH,			/* Client to broker */
+	BROKER_NOTIFY,			/* Broker to client */
+	BROKER_BEGIN,			/* Client to broker; no name or value */
+	BROKER_COMMIT,			/* Client to broker; no name or value */
+};
+
+/*
+ * Publishes between BROKER_BEGIN and BROKER_COMMIT are held back, and
+ * applied together when the commit arrives. Subscribers never see some
+ * of the values without the others, and get all of their notifications
+ * in the same write.
+ *
+ * The socket is open to every user, so a client is dropped if it holds
+ * back more than BROKER_TXN_MAX publishes or BROKER_TXN_BYTES of values,
+ * or if its user creates more than BROKER_USER_KEYS_MAX names.
+ */
+
+struct broker_msg {
+	uint32_t bm_len;	/* The length of the name and the value */
+	uint16_t bm_type;
+	uint16_t bm_namelen;
+};
+
+typedef struct broker_s * broker_t;
+
+/* Listen for clients on <path> */
+broker_t broker_new(const char *path);
+void broker_free(broker_t b);
+
+/* A descriptor that becomes readable when broker_dispatch() has work to do */
+int broker_get_fd(broker_t b);
+
+/*
+ * Accept new clients, handle every message that has arrived, and send the
+ * resulting notifications, without blocking.
+ */
+int broker_dispatch(broker_t b);
+
+#endif /* BROKER_H_ */
@@ -14,54 +14,171 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+#ifdef __linux__
+#define _GNU_SOURCE	/* for asprintf(3) */
+#endif
+
+#include <dirent.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <pthread.h>
 #include <string.h>
 #include <stdbool.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdint.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
 #include <sys/types.h>
-#include <sys/event.h>
 #include <sys/uio.h>
+#include <sys/un.h>
+#include <time.h>
 #include <unistd.h>
 
 #include <sys/queue.h>
 
 #include "log.h"
+#include "arena.h"
 #include "binding.h"
+#include "broker.h"
+#include "counter.h"
+#include "dispatch.h"
+#include "epoch.h"
+#include "history.h"
+#include "ioengine.h"
 #include "platform.h"
+#include "statefile.h"
 #include "subscription.h"
+#include "watch.h"
 #include "include/state.h"
 
-static struct {
-	int kqfd;
+/* The maximum number of kernel events to dequeue at once */
+#define STATE_CHECK_BATCH 256
+
+/* The maximum number of kernel events to examine in one coalescing drain */
+#define STATE_COALESCE_MAX_EVENTS (16 * STATE_CHECK_BATCH)
+
+/* The number of times to retry reading a value that keeps changing */
+#define STATE_PEEK_MAX_RETRIES 1000
+
+#ifndef MIN
+#define MIN(a,b) (((a) < (b)) ? (a) : (b))
+#endif
+
+/* A namespace whose state is stored in an arena, when STATE_ARENA is set */
+struct arena_ns {
+	arena_t	an_arena;	/* NULL until first used */
+	int	an_wd;		/* -1 until the first subscription */
+	uint64_t an_pos;	/* How far the change log has been read */
+	bool	an_rescan;	/* The change log wrapped; check every subscription */
+	struct hash_table an_subs;	/* Subscriptions, by slot */
+	LIST_HEAD(, subscription_s) an_unresolved; /* Subscriptions without a slot */
+};
+
+/* The initial size of the buffer for messages from the broker */
+#define BROKER_BUFSZ	(64 * 1024)
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0	/* SO_NOSIGPIPE is set on the socket instead */
+#endif
+
+#define ARENA_NS_SYSTEM	0
+#define ARENA_NS_USER	1
+
+/* A history being read by state_check_history() */
+struct history_reader {
+	char	*hr_name;
+	history_t hr_history;
+	LIST_ENTRY(history_reader) hr_entry;
+};
+
+/*
+ * Everything that belongs to one context. The functions without "ctx" in
+ * their name use state_default_ctx.
+ */
+struct state_ctx_s {
+	LIST_ENTRY(state_ctx_s) entry;	/* On state_contexts.list */
+	uint64_t id;		/* Never reused */
+	watch_t watch;
 	char *userprefix;
 	char *userstatedir;
-	SLIST_HEAD(, subscription_s) subscriptions;
-	SLIST_HEAD(, state_binding_s) bindings;
+	struct hash_table subscriptions;		/* by name */
+	struct hash_table subscriptions_by_wd;	/* by watch identifier */
+	struct hash_table bindings;		/* by name */
+	SLIST_HEAD(, subscription_s) dead_subscriptions;
+	struct arena_ns arenas[2];	/* Indexed by ARENA_NS_* */
+	LIST_HEAD(, prefix_s) prefixes;
+	bool rescan;		/* The kernel lost events; check every subscription */
+
+	/* The connection to stated, when STATE_BROKER is in effect */
+	int broker_fd;
+	char *broker_buf;	/* Messages that have been received but not handled */
+	size_t broker_off, broker_len, broker_size;
+
+	/* Throttled bindings with a value waiting to be written */
+	LIST_HEAD(, state_binding_s) pending;
+	pthread_t flusher;
+	pthread_cond_t flusher_cond;	/* Signalled when <pending> changes */
+	bool flusher_running;
+	bool flusher_stop;
+
+	/* Bindings made by state_bind_counter(), which the flusher samples */
+	LIST_HEAD(, state_binding_s) counters;
+
+	/* Histories opened by state_check_history() */
+	LIST_HEAD(, history_reader) histories;
+
+	/* Reported by state_get_stats() */
+	unsigned long long published;	/* Updated atomically */
+	unsigned long long suppressed;
+
+	/* Subscriptions by name, for readers that do not take <mtx> */
+	struct sub_index *sub_index;
+
+	/* Created by the first call to state_dispatch_f() */
+	dispatch_t dispatch;
+
+	/* Used to notify subscribers of several state files at once */
+	ioengine_t ioengine;
+	bool ioengine_probed;	/* ioengine_new() has been tried */
+
 	pthread_mutex_t mtx;
+	int flags;		/* Passed to state_init() */
+	unsigned int drain;	/* Incremented by each call to state_check_many() */
 	bool initialized;
-} libstate_data;
+};
 
-static int create_user_dirs(void)
+static struct state_ctx_s state_default_ctx;
+
+/* Every context that is initialized */
+static struct {
+	pthread_mutex_t mtx;
+	uint64_t next_id;
+	LIST_HEAD(, state_ctx_s) list;
+} state_contexts = {
+	.mtx = PTHREAD_MUTEX_INITIALIZER,
+	.next_id = 1,
+	.list = LIST_HEAD_INITIALIZER(state_contexts.list),
+};
+
+static int create_user_dirs(state_ctx_t ctx)
 {
 	if (getenv("HOME") == NULL) {
 		//TODO: use getpwuid to lookup the home directory
 		return -1;
 	}
-	if (asprintf(&libstate_data.userprefix, "%s/.libstate", getenv("HOME"))
+	if (asprintf(&ctx->userprefix, "%s/.libstate", getenv("HOME"))
 			< 0)
 		return -1;
-	if (asprintf(&libstate_data.userstatedir, "%s/run",
-			libstate_data.userprefix) < 0)
+	if (asprintf(&ctx->userstatedir, "%s/run",
+			ctx->userprefix) < 0)
 		return -1;
-	if (access(libstate_data.userprefix, F_OK) != 0) {
-		if (mkdir(libstate_data.userprefix, 0700) < 0)
+	if (access(ctx->userprefix, F_OK) != 0) {
+		if (mkdir(ctx->userprefix, 0700) < 0)
 			return -1;
 	}
-	if (access(libstate_data.userstatedir, F_OK) != 0) {
-		if (mkdir(libstate_data.userstatedir, 0700) < 0)
+	if (access(ctx->userstatedir, F_OK) != 0) {
+		if (mkdir(ctx->userstatedir, 0700) < 0)
 			return -1;
 	}
 	return 0;
@@ -77,15 +194,20 @@ static int validate_name(char *name)
 	return 0;
 }
 
-static char *name_to_path(const char *name)
+static bool name_is_user(const char *name)
+{
+	const char *user_prefix = "user.";
+
+	return strncmp(name, user_prefix, strlen(user_prefix)) == 0;
+}
+
+static char *name_to_path(state_ctx_t ctx, const char *name)
 {
 	char *id = NULL;
 	char *path = NULL;
 	bool is_user_path = false;
 
-	const char *user_prefix = "user.";
-
-	if (strncmp(name, user_prefix, strlen(user_prefix)) == 0) {
+	if (name_is_user(name)) {
 		id = strdup(name + 5);
 		is_user_path = true;
 	} else {
@@ -100,7 +222,7 @@ static char *name_to_path(const char *name)
 		goto err_out;
 
 	if (is_user_path) {
-		if (asprintf(&path, "%s/%s", libstate_data.userstatedir, id)
+		if (asprintf(&path, "%s/%s", ctx->userstatedir, id)
 				< 0) {
 			goto err_out;
 		}
@@ -118,367 +240,3116 @@ static char *name_to_path(const char *name)
 	return NULL;
 }
 
-static state_binding_t state_binding_lookup(const char *name)
+/*
+ * The history of a name is kept in a hidden file next to where its state
+ * file would be, so that prefix subscriptions do not see it.
+ */
+static char *name_to_history_path(state_ctx_t ctx, const char *name)
 {
-	state_binding_t sbp;
+	char *path, *base, *hpath = NULL;
+
+	if ((path = name_to_path(ctx, name)) == NULL)
+		return NULL;
+	base = strrchr(path, '/');
+	*base++ = '\0';
+	if (asprintf(&hpath, "%s/.%s.history", path, base) < 0)
+		hpath = NULL;
+	free(path);
+	return hpath;
+}
 
-	pthread_mutex_lock(&libstate_data.mtx);
-	SLIST_FOREACH(sbp, &libstate_data.bindings, entry)
-	{
-		if (strcmp(sbp->name, name) == 0) {
-			pthread_mutex_unlock(&libstate_data.mtx);
-			return sbp;
+/* Return the arena namespace that holds <name>, opening the arena if needed */
+static struct arena_ns *arena_ns_get(state_ctx_t ctx, const char *name)
+{
+	struct arena_ns *ns;
+	char *id, *path = NULL;
+	int rv;
+
+	if (name_is_user(name)) {
+		ns = &ctx->arenas[ARENA_NS_USER];
+		id = ctx->userstatedir;
+	} else {
+		ns = &ctx->arenas[ARENA_NS_SYSTEM];
+		id = STATE_PREFIX;
+	}
+	if (validate_name((char *) name) < 0)
+		return NULL;
+
+	pthread_mutex_lock(&ctx->mtx);
+	if (ns->an_arena == NULL) {
+		if (asprintf(&path, "%s/%s", id, ARENA_FILE) < 0) {
+			pthread_mutex_unlock(&ctx->mtx);
+			return NULL;
 		}
+		/* Unprivileged processes can only subscribe to the system arena */
+		ns->an_arena = arena_open(path, access(path, W_OK) == 0 ||
+				(access(path, F_OK) != 0 && errno == ENOENT));
+		free(path);
 	}
-	pthread_mutex_unlock(&libstate_data.mtx);
-	return NULL;
+	rv = (ns->an_arena == NULL) ? -1 : 0;
+	pthread_mutex_unlock(&ctx->mtx);
+	return (rv < 0) ? NULL : ns;
 }
 
-static subscription_t subscription_lookup(const char *name)
+/* Start watching the arena of a namespace. The caller must hold ctx->mtx */
+static int arena_ns_watch_locked(state_ctx_t ctx, struct arena_ns *ns)
 {
-	subscription_t sub;
+	if (ns->an_wd >= 0)
+		return 0;
+	ns->an_pos = arena_log_position(ns->an_arena);
+	ns->an_wd = watch_add(ctx->watch, arena_get_fd(ns->an_arena),
+			arena_get_path(ns->an_arena));
+	return (ns->an_wd < 0) ? -1 : 0;
+}
 
-	pthread_mutex_lock(&libstate_data.mtx);
-	SLIST_FOREACH(sub, &libstate_data.subscriptions, entry)
-	{
-		if (strcmp(sub->sub_name, name) == 0) {
-			pthread_mutex_unlock(&libstate_data.mtx);
-			return sub;
-		}
-	}
-	pthread_mutex_unlock(&libstate_data.mtx);
-	return NULL;
+static void arena_ns_free(struct arena_ns *ns)
+{
+	arena_close(ns->an_arena);
+	ns->an_arena = NULL;
+	ns->an_wd = -1;
+	ns->an_rescan = false;
+	hash_table_free(&ns->an_subs);
 }
 
-/* Update the current state of a subscription */
-static int subscription_update(subscription_t sub)
+/* Give an unresolved subscription its slot. The caller must hold ctx->mtx */
+static void arena_ns_resolve_locked(struct arena_ns *ns, subscription_t sub,
+		int slot)
 {
-	struct stat sb;
-	size_t newlen;
-	ssize_t nret;
+	LIST_REMOVE(sub, sub_unresolved_entry);
+	__atomic_store_n(&sub->sub_slot, slot, __ATOMIC_RELEASE);
+	hash_table_insert(&ns->an_subs, &sub->sub_slot_node, hash_int(slot), sub);
+}
 
-	retry: if (fstat(sub->sub_fd, &sb) < 0) {
-		log_errno("fstat");
+static int broker_connect(state_ctx_t ctx)
+{
+	struct sockaddr_un sa;
+	int fd, one = 1;
+
+	(void) one;
+	memset(&sa, 0, sizeof(sa));
+	sa.sun_family = AF_UNIX;
+	if (snprintf(sa.sun_path, sizeof(sa.sun_path), "%s/%s", STATE_PREFIX,
+			BROKER_SOCKET) >= (int) sizeof(sa.sun_path))
 		return -1;
-	}
-	if (sb.st_size == SIZE_MAX)
+	if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+		log_errno("socket(2)");
 		return -1;
-	if (sub->sub_bufsz <= sb.st_size) {
-		char *newbuf = realloc(sub->sub_buf, sb.st_size + 1);
-		if (newbuf == NULL) {
-			log_errno("realloc");
-			return -1;
-		}
-		sub->sub_buf = newbuf;
-		sub->sub_bufsz = sb.st_size + 1;
 	}
-	nret = pread(sub->sub_fd, sub->sub_buf, sb.st_size, 0);
-	if (nret < 0) {
-		log_errno("pread(2)");
+#ifdef SO_NOSIGPIPE
+	(void) setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &one, sizeof(one));
+#endif
+	if (connect(fd, (struct sockaddr *) &sa, sizeof(sa)) < 0) {
+		log_errno("connect(2) to %s", sa.sun_path);
+		(void) close(fd);
 		return -1;
 	}
-	if (nret < sizeof(size_t)) {
-		log_warning("state file %s is invalid; too short",
-				sub->sub_path);
+	if (watch_add_fd(ctx->watch, fd) < 0) {
+		(void) close(fd);
 		return -1;
 	}
-	memcpy(&newlen, sub->sub_buf, sizeof(newlen));
-	if (newlen >= nret) {
-		/* FIXME: DoS risk, could loop forever with a malicious statefile */
-		log_debug("size of statefile grew; will re-read it");
-		goto retry;
-	}
-	sub->sub_buflen = newlen;
+	ctx->broker_fd = fd;
 	return 0;
 }
 
+/*
+ * Write out a list of buffers to the broker, with as few system calls as
+ * possible. Messages from different threads must not be interleaved, so
+ * the caller must hold ctx->mtx.
+ */
+static int broker_writev_locked(state_ctx_t ctx, struct iovec *iov, size_t iovcnt)
+{
+	struct msghdr mh;
+	ssize_t nret;
 
-int state_init(int abi_version, int flags)
+	memset(&mh, 0, sizeof(mh));
+	while (iovcnt > 0) {
+		mh.msg_iov = iov;
+		mh.msg_iovlen = MIN(iovcnt, IOV_MAX);
+		nret = sendmsg(ctx->broker_fd, &mh, MSG_NOSIGNAL);
+		if (nret < 0) {
+			if (errno == EINTR)
+				continue;
+			log_errno("sendmsg(2)");
+			return -1;
+		}
+		/* Skip past whatever was sent */
+		while (iovcnt > 0 && (size_t) nret >= iov->iov_len) {
+			nret -= iov->iov_len;
+			iov++;
+			iovcnt--;
+		}
+		if (iovcnt > 0) {
+			iov->iov_base = (char *) iov->iov_base + nret;
+			iov->iov_len -= nret;
+		}
+	}
+	return 0;
+}
+
+/* Fill in the header and buffers of one message. Uses three elements of <iov>. */
+static int broker_msg_init(struct broker_msg *msg, struct iovec *iov, int type,
+		const char *name, const char *value, size_t len)
 {
-	/* These are not used yet */
-	(void) abi_version;
-	(void) flags;
+	size_t namelen = name ? strlen(name) : 0;
 
-	/* FIXME: not threadsafe */
-	if (libstate_data.initialized)
-		return -1;
-	SLIST_INIT(&libstate_data.bindings);
-	SLIST_INIT(&libstate_data.subscriptions);
-	if ((libstate_data.kqfd = kqueue()) < 0)
-		return -1;
-	if (create_user_dirs() < 0)
+	if (namelen > BROKER_NAME_MAX ||
+			len > BROKER_MSG_MAX - sizeof(*msg) - namelen) {
+		log_error("name or value is too long for the broker");
 		return -1;
-	pthread_mutex_init(&libstate_data.mtx, NULL);
-	libstate_data.initialized = true;
+	}
+	msg->bm_len = namelen + len;
+	msg->bm_type = type;
+	msg->bm_namelen = namelen;
+	iov[0].iov_base = msg;
+	iov[0].iov_len = sizeof(*msg);
+	iov[1].iov_base = (void *) name;
+	iov[1].iov_len = namelen;
+	iov[2].iov_base = (void *) value;
+	iov[2].iov_len = len;
 	return 0;
 }
 
-int state_openlog(const char *path)
+/* Send a message to the broker. The caller must hold ctx->mtx */
+static int broker_send_locked(state_ctx_t ctx, int type, const char *name, const char *value,
+		size_t len)
 {
-	return log_open(path);
+	struct broker_msg msg;
+	struct iovec iov[3];
+
+	if (name[0] == '\0' ||
+			broker_msg_init(&msg, iov, type, name, value, len) < 0)
+		return -1;
+	return broker_writev_locked(ctx, iov, 3);
 }
 
-int state_closelog(void)
+/* Send a message to the broker */
+static int broker_send(state_ctx_t ctx, int type, const char *name, const char *value,
+		size_t len)
 {
-	return log_close();
+	int rv;
+
+	pthread_mutex_lock(&ctx->mtx);
+	rv = broker_send_locked(ctx, type, name, value, len);
+	pthread_mutex_unlock(&ctx->mtx);
+	return rv;
 }
 
-void state_atexit(void)
+/* Whether the broker will accept <n> values in one transaction */
+static bool broker_txn_fits(const struct state_value *values, size_t n)
 {
-	state_binding_t sbp, sbp_tmp;
-	subscription_t sub, sub_tmp;
+	size_t i, total = 0;
 
-	if (!libstate_data.initialized)
-		return;
+	if (n > BROKER_TXN_MAX)
+		return false;
+	for (i = 0; i < n; i++)
+		total += values[i].len;
+	return total <= BROKER_TXN_BYTES;
+}
 
-	free(libstate_data.userprefix);
-	free(libstate_data.userstatedir);
-	(void) close(libstate_data.kqfd);
-	SLIST_FOREACH_SAFE(sbp, &libstate_data.bindings, entry, sbp_tmp) {
-		SLIST_REMOVE(&libstate_data.bindings, sbp, state_binding_s,
-				entry);
-		state_binding_free(sbp);
-	}
-	SLIST_FOREACH_SAFE(sub, &libstate_data.subscriptions, entry, sub_tmp) {
-		SLIST_REMOVE(&libstate_data.subscriptions, sub, subscription_s,
-				entry);
-		subscription_free(sub);
+/* Send several publishes to the broker, wrapped in a transaction. The caller must hold ctx->mtx */
+static int broker_send_multi_locked(state_ctx_t ctx, const struct state_value *values,
+		size_t n)
+{
+	struct broker_msg *msgs;
+	struct iovec *iov;
+	size_t i, iovcnt = 3 * (n + 2);
+	int rv = -1;
+
+	msgs = calloc(n + 2, sizeof(*msgs));
+	iov = calloc(iovcnt, sizeof(*iov));
+	if (msgs == NULL || iov == NULL) {
+		log_errno("calloc(3)");
+		goto out;
 	}
-	log_debug("shutting down");
-	(void) pthread_mutex_destroy(&libstate_data.mtx);
-	(void) log_close();
-	libstate_data.initialized = false;
+	if (broker_msg_init(&msgs[0], &iov[0], BROKER_BEGIN, NULL, NULL, 0) < 0 ||
+			broker_msg_init(&msgs[n + 1], &iov[3 * (n + 1)], BROKER_COMMIT,
+			NULL, NULL, 0) < 0)
+		goto out;
+	for (i = 0; i < n; i++) {
+		if (broker_msg_init(&msgs[i + 1], &iov[3 * (i + 1)], BROKER_PUBLISH,
+				values[i].name, values[i].value, values[i].len) < 0)
+			goto out;
+	}
+	rv = broker_writev_locked(ctx, iov, iovcnt);
+
+out:
+	free(msgs);
+	free(iov);
+	return rv;
 }
 
-int state_bind(const char *name)
+/* The caller must hold ctx->mtx */
+static state_binding_t state_binding_lookup_locked(state_ctx_t ctx, const char *name)
 {
-	state_binding_t sb = NULL;
-
-	sb = calloc(1, sizeof(*sb));
-	if (!sb)
-		goto err_out;
-	sb->name = strdup(name);
-	if (!sb->name)
-		goto err_out;
-	sb->path = name_to_path(name);
-	if (!sb->path)
-		goto err_out;
+	struct hash_node *hn;
+	state_binding_t sbp;
+	uint32_t hash = hash_string(name);
 
-	if ((sb->fd = open(sb->path, O_CREAT | O_TRUNC | O_WRONLY, 0644)) < 0) {
-		log_errno("open(2) of %s", sb->path);
-		goto err_out;
+	HASH_TABLE_FOREACH(hn, &ctx->bindings, hash)
+	{
+		sbp = hn->hn_data;
+		if (hn->hn_hash == hash && strcmp(sbp->name, name) == 0)
+			return sbp;
 	}
+	return NULL;
+}
 
-	pthread_mutex_lock(&libstate_data.mtx);
-	SLIST_INSERT_HEAD(&libstate_data.bindings, sb, entry);
-	pthread_mutex_unlock(&libstate_data.mtx);
-
-	return 0;
+/* The current time of CLOCK_MONOTONIC, in nanoseconds */
+static uint64_t monotonic_ns(void)
+{
+	struct timespec ts;
 
-	err_out:
-	log_error("unable to bind to %s", name);
-	state_binding_free(sb);
-	return -1;
+	(void) clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
 }
 
-int state_unbind(const char *name)
+/*
+ * Write a value to wherever a binding keeps it, and notify subscribers.
+ * The caller must hold ctx->mtx
+ */
+static int binding_write_locked(state_ctx_t ctx, state_binding_t sb, const char *value,
+		size_t len)
 {
-	state_binding_t sb;
+	int rv;
 
-	sb = state_binding_lookup(name);
-	if (sb == NULL) {
-		log_error("name not bound: %s", name);
-		return (-1);
+	if (ctx->broker_fd >= 0) {
+		rv = broker_send_locked(ctx, BROKER_PUBLISH, sb->name, value, len);
+	} else if (sb->arena) {
+		rv = arena_write(sb->arena, sb->slot, value, len);
+	} else {
+		rv = statefile_write(&sb->file, value, len);
 	}
-	pthread_mutex_lock(&libstate_data.mtx);
-	SLIST_REMOVE(&libstate_data.bindings, sb, state_binding_s, entry);
-	pthread_mutex_lock(&libstate_data.mtx);
-	state_binding_free(sb);
-	log_debug("unbound %s", name);
+	if (rv == 0)
+		__atomic_add_fetch(&ctx->published, 1, __ATOMIC_RELAXED);
+	return rv;
+}
 
+/*
+ * Remember the value being published to a binding. Returns 1 if it is the
+ * same as the last one, 0 if it is new, or -1 if an error occurs. The
+ * caller must hold ctx->mtx
+ */
+static int binding_cache_locked(state_binding_t sb, const char *value,
+		size_t len)
+{
+	char *buf;
+
+	if (sb->has_value && sb->value_len == len &&
+			memcmp(sb->value, value, len) == 0)
+		return 1;
+	if (len + 1 > sb->value_size) {
+		if ((buf = realloc(sb->value, len + 1)) == NULL) {
+			log_errno("realloc(3)");
+			return -1;
+		}
+		sb->value = buf;
+		sb->value_size = len + 1;
+	}
+	memcpy(sb->value, value, len);
+	sb->value[len] = '\0';
+	sb->value_len = len;
+	sb->has_value = true;
 	return 0;
 }
 
-int state_subscribe(const char *name)
+/*
+ * The engine for batches of writes, which is created on first use, since
+ * most processes never write a batch. The caller must hold ctx->mtx
+ */
+static ioengine_t ctx_ioengine_locked(state_ctx_t ctx)
 {
-	subscription_t sub;
-	struct kevent kev;
-	int rv;
+	if (!ctx->ioengine_probed) {
+		ctx->ioengine = ioengine_new();
+		ctx->ioengine_probed = true;
+	}
+	return ctx->ioengine;
+}
 
-	sub = subscription_new();
-	if (!sub)
-		return -1;
-	sub->sub_name = strdup(name);
-	sub->sub_path = name_to_path(name);
-	if (!sub->sub_name || !sub->sub_path)
-		goto err_out;
+/* State files and arenas that the flusher has updated, but whose subscribers are not notified yet */
+struct flush_batch {
+	struct statefile *fb_files[IOENGINE_BATCH];
+	size_t fb_count;
+	arena_t fb_arenas[2];	/* One for each namespace */
+};
 
-	sub->sub_fd = open(sub->sub_path, O_CREAT | O_RDONLY, 0644);
-	if (sub->sub_fd < 0) {
-		log_errno("open(2) of %s", sub->sub_path);
-		goto err_out;
+/* The caller must hold ctx->mtx */
+static void flush_batch_notify_locked(state_ctx_t ctx, struct flush_batch *fb)
+{
+	int i;
+
+	for (i = 0; i < 2; i++) {
+		if (fb->fb_arenas[i] && arena_notify(fb->fb_arenas[i]) < 0)
+			log_error("unable to notify subscribers of %s",
+					arena_get_path(fb->fb_arenas[i]));
+		fb->fb_arenas[i] = NULL;
 	}
+	if (fb->fb_count == 0)
+		return;
+	if (statefile_notify_many(fb->fb_files, fb->fb_count,
+			ctx_ioengine_locked(ctx)) < 0)
+		log_error("unable to notify subscribers of %zu values", fb->fb_count);
+	fb->fb_count = 0;
+}
 
-	pthread_mutex_lock(&libstate_data.mtx);
-	SLIST_INSERT_HEAD(&libstate_data.subscriptions, sub, entry);
-	pthread_mutex_unlock(&libstate_data.mtx);
+/*
+ * Write the pending value of a binding now. If <fb> is not NULL, a value
+ * in a state file may only be stored, and added to <fb> so that
+ * subscribers are notified later. The caller must hold ctx->mtx
+ */
+static int binding_flush_locked(state_ctx_t ctx, state_binding_t sb,
+		struct flush_batch *fb)
+{
+	int rv;
 
-	EV_SET(&kev, sub->sub_fd, EVFILT_VNODE, EV_ADD | EV_CLEAR,
-			NOTE_WRITE | NOTE_DELETE, 0, 0);
-	rv = kevent(libstate_data.kqfd, &kev, 1, NULL, 0, NULL);
-	if (rv < 0) {
-		log_errno("kevent(2)");
-		goto err_out;
+	if (!sb->has_pending)
+		return 0;
+	LIST_REMOVE(sb, pending_entry);
+	sb->has_pending = false;
+	sb->last = monotonic_ns();
+	if (fb == NULL || ctx->broker_fd >= 0 || sb->arena) {
+		rv = binding_write_locked(ctx, sb, sb->value, sb->value_len);
+		if (rv < 0)
+			sb->has_value = false;
+		return rv;
 	}
 
+	if (fb->fb_count == IOENGINE_BATCH)
+		flush_batch_notify_locked(ctx, fb);
+	if (statefile_update(&sb->file, sb->value, sb->value_len) < 0) {
+		/* Do not skip the same value next time, since it was not written */
+		sb->has_value = false;
+		return -1;
+	}
+	fb->fb_files[fb->fb_count++] = &sb->file;
+	__atomic_add_fetch(&ctx->published, 1, __ATOMIC_RELAXED);
 	return 0;
-
-err_out:
-	subscription_free(sub);
-	return -1;
 }
 
-int state_unsubscribe(const char *name)
+/*
+ * Publish the value of a counter if it has changed since the last sample,
+ * and add it to <fb> so that subscribers are notified later. The caller
+ * must hold ctx->mtx
+ */
+static void counter_sample_locked(state_ctx_t ctx, state_binding_t sb,
+		struct flush_batch *fb)
 {
-	subscription_t sub;
-	struct kevent kev;
-	int rv;
+	struct state_counter_s *sc = sb->counter;
+	int64_t value = counter_load(sc->sc_value);
+	int i;
 
-	pthread_mutex_lock(&libstate_data.mtx);
-	SLIST_FOREACH(sub, &libstate_data.subscriptions, entry)
-	{
-		if (strcmp(sub->sub_name, name) == 0) {
-			SLIST_REMOVE(&libstate_data.subscriptions, sub, subscription_s, entry);
-			pthread_mutex_unlock(&libstate_data.mtx);
-			subscription_free(sub);
-			return 0;
+	if (value == sc->sc_sampled)
+		return;
+	sc->sc_sampled = value;
+	if (sb->arena) {
+		if (arena_touch(sb->arena, sb->slot) < 0)
+			return;
+		for (i = 0; i < 2; i++) {
+			if (fb->fb_arenas[i] == NULL || fb->fb_arenas[i] == sb->arena) {
+				fb->fb_arenas[i] = sb->arena;
+				break;
+			}
 		}
+	} else {
+		if (fb->fb_count == IOENGINE_BATCH)
+			flush_batch_notify_locked(ctx, fb);
+		statefile_touch(&sb->file);
+		fb->fb_files[fb->fb_count++] = &sb->file;
 	}
-	pthread_mutex_unlock(&libstate_data.mtx);
-
-	return -1;
+	__atomic_add_fetch(&ctx->published, 1, __ATOMIC_RELAXED);
 }
 
-
-int state_publish(const char *name, const char *state, size_t len)
+/*
+ * Sample the counters that are due. Returns when the next sample is due,
+ * or zero if no counter is sampled periodically. The caller must hold
+ * ctx->mtx
+ */
+static uint64_t counters_sample_locked(state_ctx_t ctx, uint64_t now,
+		struct flush_batch *fb)
 {
-	const char nul = '\0';
-	ssize_t written;
 	state_binding_t sb;
-	struct iovec iov[3];
-
-	iov[0].iov_base = &len;
-	iov[0].iov_len = sizeof(len);
-	iov[1].iov_base = (char *) state;
-	iov[1].iov_len = len;
-	iov[2].iov_base = (char *) &nul;
-	iov[2].iov_len = 1;
+	struct state_counter_s *sc;
+	uint64_t next = 0;
+
+	LIST_FOREACH(sb, &ctx->counters, counter_entry) {
+		sc = sb->counter;
+		if (sc->sc_interval == 0)
+			continue;
+		if (sc->sc_next <= now) {
+			counter_sample_locked(ctx, sb, fb);
+			sc->sc_next = now + sc->sc_interval;
+		}
+		if (next == 0 || sc->sc_next < next)
+			next = sc->sc_next;
+	}
+	return next;
+}
 
-	sb = state_binding_lookup(name);
-	if (sb == NULL) {
-		log_error("tried to publish to an unbound name: %s", name);
-		return (-1);
+/* Forget the pending value of a binding. The caller must hold ctx->mtx */
+static void binding_discard_locked(state_binding_t sb)
+{
+	if (sb->has_pending) {
+		LIST_REMOVE(sb, pending_entry);
+		sb->has_pending = false;
 	}
+}
 
-	written = pwritev(sb->fd, iov, 3, 0);
-	if (written < (len + sizeof(len) + 1)) {
-		if (written < 0) {
-			log_errno("pwritev(3)");
+/* Write the pending values that are due, until told to stop */
+static void *binding_flusher(void *arg)
+{
+	state_ctx_t ctx = arg;
+	state_binding_t sb, next_sb;
+	struct flush_batch fb = { .fb_count = 0 };
+	struct timespec ts;
+	uint64_t now, next;
+
+	pthread_mutex_lock(&ctx->mtx);
+	while (!ctx->flusher_stop) {
+		now = monotonic_ns();
+		next = counters_sample_locked(ctx, now, &fb);
+		for (sb = LIST_FIRST(&ctx->pending); sb != NULL; sb = next_sb) {
+			next_sb = LIST_NEXT(sb, pending_entry);
+			if (sb->deadline <= now) {
+				if (binding_flush_locked(ctx, sb, &fb) < 0)
+					log_error("unable to publish %s", sb->name);
+			} else if (next == 0 || sb->deadline < next) {
+				next = sb->deadline;
+			}
+		}
+		flush_batch_notify_locked(ctx, &fb);
+		if (next == 0) {
+			pthread_cond_wait(&ctx->flusher_cond, &ctx->mtx);
 		} else {
-			log_error("short write");
+			ts.tv_sec = next / 1000000000;
+			ts.tv_nsec = next % 1000000000;
+			(void) pthread_cond_timedwait(&ctx->flusher_cond,
+					&ctx->mtx, &ts);
 		}
-		return -1;
 	}
 
-	return 0;
+	/* Subscribers always get the final value */
+	while ((sb = LIST_FIRST(&ctx->pending)) != NULL) {
+		if (binding_flush_locked(ctx, sb, &fb) < 0)
+			log_error("unable to publish %s", sb->name);
+	}
+	flush_batch_notify_locked(ctx, &fb);
+	pthread_mutex_unlock(&ctx->mtx);
+	return NULL;
 }
 
-int state_get(const char *key, char **value)
+/* Start the flusher thread if needed. The caller must hold ctx->mtx */
+static int binding_flusher_start_locked(state_ctx_t ctx)
 {
-	subscription_t sub;
+	pthread_condattr_t attr;
+	int rv;
 
-	if ((sub = subscription_lookup(key)) == NULL) {
-		log_debug("subscription lookup for `%s' failed", key);
-		*value = NULL;
+	if (ctx->flusher_running)
+		return 0;
+	if ((rv = pthread_condattr_init(&attr)) != 0 ||
+			(rv = pthread_condattr_setclock(&attr, CLOCK_MONOTONIC)) != 0 ||
+			(rv = pthread_cond_init(&ctx->flusher_cond, &attr)) != 0) {
+		log_error("unable to create a condition variable: %s", strerror(rv));
 		return -1;
 	}
-
-	if (subscription_update(sub) < 0) {
-		log_debug("failed to update subscription");
-		*value = NULL;
+	(void) pthread_condattr_destroy(&attr);
+	ctx->flusher_stop = false;
+	rv = pthread_create(&ctx->flusher, NULL, binding_flusher, ctx);
+	if (rv != 0) {
+		log_error("pthread_create(3): %s", strerror(rv));
+		(void) pthread_cond_destroy(&ctx->flusher_cond);
 		return -1;
 	}
-
-	*value = sub->sub_buf + sizeof(size_t);
-	return sub->sub_buflen;
+	ctx->flusher_running = true;
+	return 0;
 }
 
-ssize_t state_check(char **key, char **value)
+/* Stop the flusher thread, after it writes every pending value */
+static void binding_flusher_stop(state_ctx_t ctx)
 {
-	const struct timespec ts =
-	{ 0, 0 };
-	subscription_t subp, sub = NULL;
-	struct kevent kev;
-	ssize_t nret;
+	pthread_mutex_lock(&ctx->mtx);
+	if (!ctx->flusher_running) {
+		pthread_mutex_unlock(&ctx->mtx);
+		return;
+	}
+	ctx->flusher_stop = true;
+	pthread_cond_signal(&ctx->flusher_cond);
+	pthread_mutex_unlock(&ctx->mtx);
+	(void) pthread_join(ctx->flusher, NULL);
+	(void) pthread_cond_destroy(&ctx->flusher_cond);
+	ctx->flusher_running = false;
+}
 
-	if (key == NULL || value == NULL)
-		return -1;
+/*
+ * Publish to a throttled binding, after binding_cache_locked() has stored
+ * the value. It is written at once if the binding allows it, and
+ * otherwise left for the flusher thread. The caller must hold
+ * ctx->mtx
+ */
+static int binding_throttle_locked(state_ctx_t ctx, state_binding_t sb, const char *value,
+		size_t len)
+{
+	uint64_t now = monotonic_ns();
 
-	nret = kevent(libstate_data.kqfd, NULL, 0, &kev, 1, &ts);
-	if (nret < 0) {
-		log_errno("kevent(2)");
-		goto err_out;
+	/* The leading edge of a rate limit is written straight away */
+	if (sb->debounce == 0 && !sb->has_pending &&
+			(sb->last == 0 || now - sb->last >= sb->interval)) {
+		sb->last = now;
+		return binding_write_locked(ctx, sb, value, len);
 	}
-	if (nret == 0) {
-		log_debug("no events were pending");
-		*key = *value = NULL;
-		return 0;
+
+	sb->deadline = now + sb->debounce;
+	if (sb->interval && sb->last + sb->interval > sb->deadline)
+		sb->deadline = sb->last + sb->interval;
+	if (!sb->has_pending) {
+		LIST_INSERT_HEAD(&ctx->pending, sb, pending_entry);
+		sb->has_pending = true;
 	}
+	pthread_cond_signal(&ctx->flusher_cond);
+	return 0;
+}
+
+/* The caller must hold ctx->mtx */
+static subscription_t subscription_lookup_locked(state_ctx_t ctx, const char *name)
+{
+	struct hash_node *hn;
+	subscription_t sub;
+	uint32_t hash = hash_string(name);
 
-	pthread_mutex_lock(&libstate_data.mtx);
-	SLIST_FOREACH(subp, &libstate_data.subscriptions, entry)
+	HASH_TABLE_FOREACH(hn, &ctx->subscriptions, hash)
 	{
-		if (subp->sub_fd == kev.ident) {
-			sub = subp;
-			break;
-		}
-	}
-	pthread_mutex_unlock(&libstate_data.mtx);
-	if (subp == NULL) {
-		log_error(
-				"recieved an event for fd %d which is not associated with a subscription",
-				(int )kev.ident);
-		goto err_out;
+		sub = hn->hn_data;
+		if (hn->hn_hash == hash && strcmp(sub->sub_name, name) == 0)
+			return sub;
 	}
+	return NULL;
+}
+
+static subscription_t subscription_lookup(state_ctx_t ctx, const char *name)
+{
+	subscription_t sub;
 
-	if (kev.fflags & NOTE_WRITE) {
-		log_debug("fd %u written", (unsigned int) kev.ident);
+	pthread_mutex_lock(&ctx->mtx);
+	sub = subscription_lookup_locked(ctx, name);
+	pthread_mutex_unlock(&ctx->mtx);
+	return sub;
+}
 
-		if (subscription_update(sub) < 0) {
-			log_error("failed to update the state of %s", sub->sub_name);
-			goto err_out;
+static subscription_t subscription_lookup_wd(state_ctx_t ctx, int wd)
+{
+	struct hash_node *hn;
+	subscription_t sub;
+	uint32_t hash = hash_int(wd);
+
+	pthread_mutex_lock(&ctx->mtx);
+	HASH_TABLE_FOREACH(hn, &ctx->subscriptions_by_wd, hash)
+	{
+		sub = hn->hn_data;
+		if (sub->sub_wd == wd) {
+			pthread_mutex_unlock(&ctx->mtx);
+			return sub;
 		}
 	}
-	if (kev.fflags & NOTE_DELETE) {
-		log_debug("state file %s was deleted; removing subscription", sub->sub_path);
-		pthread_mutex_lock(&libstate_data.mtx);
-		SLIST_REMOVE(&libstate_data.subscriptions, sub, subscription_s,
-				entry);
-		pthread_mutex_unlock(&libstate_data.mtx);
-		subscription_free(sub);
-	}
+	pthread_mutex_unlock(&ctx->mtx);
+	return NULL;
+}
 
-	*key = sub->sub_name;
-	*value = sub->sub_buf + sizeof(size_t);
-	return sub->sub_buflen;
+/*
+ * An index of subscriptions by name that can be searched without holding
+ * ctx->mtx. It uses open addressing, so a reader only follows
+ * pointers to subscriptions, which are freed through epoch_retire().
+ * Writers hold the mutex, and replace the whole index with a larger copy
+ * when it fills up.
+ */
+struct sub_index {
+	size_t	si_mask;	/* The number of slots, minus one */
+	size_t	si_used;	/* Slots that are not empty, including removed ones */
+	size_t	si_count;	/* Slots that hold a subscription */
+	subscription_t si_slots[];
+};
 
-err_out:
-	*key = NULL;
-	*value = NULL;
-	return -1;
+/* Marks a slot whose subscription was removed */
+static char sub_index_removed;
+#define SUB_INDEX_REMOVED ((subscription_t) &sub_index_removed)
+
+#define SUB_INDEX_MIN	16
+
+/* Identifies the next subscription to be created, in any context */
+static uint64_t sub_next_id = 1;
+
+static struct sub_index *sub_index_new(size_t nslots)
+{
+	struct sub_index *si;
+
+	si = calloc(1, sizeof(*si) + nslots * sizeof(si->si_slots[0]));
+	if (si == NULL) {
+		log_errno("calloc(3)");
+		return NULL;
+	}
+	si->si_mask = nslots - 1;
+	return si;
+}
+
+/* Store a subscription in an empty or removed slot */
+static void sub_index_store(struct sub_index *si, subscription_t sub)
+{
+	subscription_t cur;
+	size_t i;
+
+	for (i = sub->sub_hash & si->si_mask; ; i = (i + 1) & si->si_mask) {
+		cur = si->si_slots[i];
+		if (cur == NULL || cur == SUB_INDEX_REMOVED)
+			break;
+	}
+	if (cur == NULL)
+		si->si_used++;
+	si->si_count++;
+	__atomic_store_n(&si->si_slots[i], sub, __ATOMIC_RELEASE);
+}
+
+/* Replace the index with a copy that has room for more subscriptions */
+static int sub_index_grow_locked(state_ctx_t ctx)
+{
+	struct sub_index *old = ctx->sub_index, *si;
+	size_t i, nslots = SUB_INDEX_MIN;
+
+	while (nslots < 4 * ((old ? old->si_count : 0) + 1))
+		nslots *= 2;
+	if ((si = sub_index_new(nslots)) == NULL)
+		return -1;
+	if (old) {
+		for (i = 0; i <= old->si_mask; i++) {
+			if (old->si_slots[i] != NULL &&
+					old->si_slots[i] != SUB_INDEX_REMOVED)
+				sub_index_store(si, old->si_slots[i]);
+		}
+	}
+	__atomic_store_n(&ctx->sub_index, si, __ATOMIC_RELEASE);
+	if (old)
+		(void) epoch_retire(free, old);
+	return 0;
+}
+
+/* The caller must hold ctx->mtx */
+static void sub_index_insert_locked(state_ctx_t ctx, subscription_t sub)
+{
+	struct sub_index *si = ctx->sub_index;
+
+	/* Keep at least half of the slots empty, so that probes stay short */
+	if ((si == NULL || 2 * (si->si_used + 1) > si->si_mask + 1) &&
+			sub_index_grow_locked(ctx) < 0 &&
+			(si == NULL || si->si_used + 1 > si->si_mask)) {
+		log_error("unable to index %s", sub->sub_name);
+		return;
+	}
+	sub_index_store(ctx->sub_index, sub);
+}
+
+/* The caller must hold ctx->mtx */
+static void sub_index_remove_locked(state_ctx_t ctx, subscription_t sub)
+{
+	struct sub_index *si = ctx->sub_index;
+	size_t i;
+
+	if (si == NULL)
+		return;
+	for (i = sub->sub_hash & si->si_mask; si->si_slots[i] != NULL;
+			i = (i + 1) & si->si_mask) {
+		if (si->si_slots[i] == sub) {
+			__atomic_store_n(&si->si_slots[i], SUB_INDEX_REMOVED,
+					__ATOMIC_RELEASE);
+			si->si_count--;
+			return;
+		}
+	}
+}
+
+/* Find a subscription by name. The caller must be in an epoch_enter() section */
+static subscription_t sub_index_lookup(state_ctx_t ctx, const char *name)
+{
+	struct sub_index *si;
+	subscription_t sub;
+	uint32_t hash = hash_string(name);
+	size_t i;
+
+	si = __atomic_load_n(&ctx->sub_index, __ATOMIC_ACQUIRE);
+	if (si == NULL)
+		return NULL;
+	for (i = hash & si->si_mask; ; i = (i + 1) & si->si_mask) {
+		sub = __atomic_load_n(&si->si_slots[i], __ATOMIC_ACQUIRE);
+		if (sub == NULL)
+			return NULL;
+		if (sub != SUB_INDEX_REMOVED && sub->sub_hash == hash &&
+				strcmp(sub->sub_name, name) == 0)
+			return sub;
+	}
+}
+
+static void subscription_free_cb(void *arg)
+{
+	subscription_free(arg);
+}
+
+/* Free a subscription once no reader can be using it */
+static void subscription_retire(subscription_t sub)
+{
+	(void) epoch_retire(subscription_free_cb, sub);
+}
+
+/* The caller must hold ctx->mtx */
+static prefix_t prefix_lookup_locked(state_ctx_t ctx, const char *prefix)
+{
+	prefix_t ps;
+
+	LIST_FOREACH(ps, &ctx->prefixes, ps_entry) {
+		if (strcmp(ps->ps_prefix, prefix) == 0)
+			return ps;
+	}
+	return NULL;
+}
+
+/* Find a prefix subscription in <ns> that covers <name>. The caller must hold ctx->mtx */
+static prefix_t prefix_match_locked(state_ctx_t ctx, struct arena_ns *ns, const char *name)
+{
+	prefix_t ps;
+
+	LIST_FOREACH(ps, &ctx->prefixes, ps_entry) {
+		if (ps->ps_ns == ns && strncmp(name, ps->ps_prefix, ps->ps_len) == 0)
+			return ps;
+	}
+	return NULL;
+}
+
+static void subscription_insert_locked(state_ctx_t ctx, subscription_t sub);
+
+/*
+ * Subscribe to a name on behalf of a prefix, when it is first seen in an
+ * arena or in a message from the broker. The caller must hold ctx->mtx
+ */
+static subscription_t prefix_add_child_locked(state_ctx_t ctx, prefix_t ps, const char *name,
+		int slot)
+{
+	subscription_t sub;
+
+	sub = subscription_new();
+	if (!sub)
+		return NULL;
+	if ((sub->sub_name = strdup(name)) == NULL) {
+		subscription_free(sub);
+		return NULL;
+	}
+	sub->sub_ns = ps->ps_ns;
+	sub->sub_slot = slot;
+	sub->sub_prefix = ps;
+	subscription_insert_locked(ctx, sub);
+	return sub;
+}
+
+/*
+ * Find the subscription to a slot in an arena. If there is none, the slot
+ * may have been created after a subscription to its name or to a prefix
+ * of its name was made. The caller must hold ctx->mtx
+ */
+static subscription_t subscription_lookup_slot_locked(state_ctx_t ctx, struct arena_ns *ns,
+		int slot)
+{
+	char name[ARENA_NAME_MAX];
+	struct hash_node *hn;
+	subscription_t sub;
+	prefix_t ps;
+	uint32_t hash = hash_int(slot);
+
+	HASH_TABLE_FOREACH(hn, &ns->an_subs, hash)
+	{
+		sub = hn->hn_data;
+		if (sub->sub_slot == slot)
+			return sub;
+	}
+
+	if (LIST_EMPTY(&ns->an_unresolved) && LIST_EMPTY(&ctx->prefixes))
+		return NULL;
+	if (arena_slot_name(ns->an_arena, slot, name) < 0)
+		return NULL;
+	sub = subscription_lookup_locked(ctx, name);
+	if (sub) {
+		if (sub->sub_ns != ns || sub->sub_slot >= 0)
+			return NULL;
+		arena_ns_resolve_locked(ns, sub, slot);
+		return sub;
+	}
+	if ((ps = prefix_match_locked(ctx, ns, name)) != NULL)
+		return prefix_add_child_locked(ctx, ps, name, slot);
+	return NULL;
+}
+
+static subscription_t subscription_lookup_slot(state_ctx_t ctx, struct arena_ns *ns, int slot)
+{
+	subscription_t sub;
+
+	pthread_mutex_lock(&ctx->mtx);
+	sub = subscription_lookup_slot_locked(ctx, ns, slot);
+	pthread_mutex_unlock(&ctx->mtx);
+	return sub;
+}
+
+/* The caller must hold ctx->mtx */
+static void subscription_insert_locked(state_ctx_t ctx, subscription_t sub)
+{
+	sub->sub_hash = hash_string(sub->sub_name);
+	sub->sub_id = __atomic_fetch_add(&sub_next_id, 1, __ATOMIC_RELAXED);
+	hash_table_insert(&ctx->subscriptions, &sub->sub_name_node,
+			sub->sub_hash, sub);
+	sub_index_insert_locked(ctx, sub);
+	if (sub->sub_prefix) {
+		LIST_INSERT_HEAD(&sub->sub_prefix->ps_children, sub,
+				sub_prefix_entry);
+		if (sub->sub_new)
+			LIST_INSERT_HEAD(&sub->sub_prefix->ps_new, sub, sub_new_entry);
+	}
+	if (sub->sub_wd >= 0) {
+		hash_table_insert(&ctx->subscriptions_by_wd,
+				&sub->sub_wd_node, hash_int(sub->sub_wd), sub);
+	} else if (sub->sub_ns == NULL) {
+		/* Notifications come from the broker */
+	} else if (sub->sub_slot >= 0) {
+		hash_table_insert(&sub->sub_ns->an_subs, &sub->sub_slot_node,
+				hash_int(sub->sub_slot), sub);
+	} else {
+		LIST_INSERT_HEAD(&sub->sub_ns->an_unresolved, sub,
+				sub_unresolved_entry);
+	}
+}
+
+/* Detach a subscription from the prefix it was made for */
+static void subscription_orphan_locked(subscription_t sub)
+{
+	if (sub->sub_new) {
+		LIST_REMOVE(sub, sub_new_entry);
+		sub->sub_new = false;
+	}
+	if (sub->sub_prefix) {
+		LIST_REMOVE(sub, sub_prefix_entry);
+		sub->sub_prefix = NULL;
+	}
+}
+
+/* The caller must hold ctx->mtx */
+static void subscription_remove_locked(state_ctx_t ctx, subscription_t sub)
+{
+	subscription_orphan_locked(sub);
+	hash_table_remove(&ctx->subscriptions, &sub->sub_name_node);
+	sub_index_remove_locked(ctx, sub);
+	if (sub->sub_wd >= 0) {
+		hash_table_remove(&ctx->subscriptions_by_wd,
+				&sub->sub_wd_node);
+	} else if (sub->sub_ns == NULL) {
+		/* Notifications come from the broker */
+	} else if (sub->sub_slot >= 0) {
+		hash_table_remove(&sub->sub_ns->an_subs, &sub->sub_slot_node);
+	} else {
+		LIST_REMOVE(sub, sub_unresolved_entry);
+	}
+}
+
+/* Free subscriptions whose state files were deleted during the last check */
+static void subscription_reap(state_ctx_t ctx)
+{
+	subscription_t sub;
+
+	pthread_mutex_lock(&ctx->mtx);
+	while ((sub = SLIST_FIRST(&ctx->dead_subscriptions)) != NULL) {
+		SLIST_REMOVE_HEAD(&ctx->dead_subscriptions, sub_dead_entry);
+		subscription_retire(sub);
+	}
+	pthread_mutex_unlock(&ctx->mtx);
+}
+
+/* The slot of a subscription in its arena, which a writer may resolve at any time */
+static int subscription_slot(subscription_t sub)
+{
+	return __atomic_load_n(&sub->sub_slot, __ATOMIC_ACQUIRE);
+}
+
+/* Try to find the slot of a subscription that was created before its publisher */
+static void subscription_resolve(state_ctx_t ctx, subscription_t sub)
+{
+	int slot;
+
+	if (sub->sub_ns == NULL || subscription_slot(sub) >= 0)
+		return;
+	slot = arena_slot_lookup(sub->sub_ns->an_arena, sub->sub_name);
+	if (slot < 0)
+		return;
+	pthread_mutex_lock(&ctx->mtx);
+	if (sub->sub_slot < 0)
+		arena_ns_resolve_locked(sub->sub_ns, sub, slot);
+	pthread_mutex_unlock(&ctx->mtx);
+}
+
+/*
+ * Return true if a copy of the state of a subscription, with the sequence
+ * number <seq>, is up to date. Not used with the broker.
+ */
+static bool subscription_validate(subscription_t sub, uint32_t seq)
+{
+	if (sub->sub_ns)
+		return arena_validate(sub->sub_ns->an_arena, subscription_slot(sub),
+				seq);
+	return statefile_validate(&sub->sub_file, seq);
+}
+
+/*
+ * Copy the state of a subscription into <*buf>, growing it as needed.
+ * Not used with the broker. Safe to call from several threads at once.
+ */
+static ssize_t subscription_read(state_ctx_t ctx, subscription_t sub, char **buf,
+		size_t *bufsz, uint32_t *seq)
+{
+	ssize_t len;
+	int slot;
+
+	if (sub->sub_ns) {
+		subscription_resolve(ctx, sub);
+		if ((slot = subscription_slot(sub)) < 0) {
+			log_warning("nothing has been published to %s", sub->sub_name);
+			return -1;
+		}
+		len = arena_read(sub->sub_ns->an_arena, slot, buf, bufsz, seq);
+	} else {
+		len = statefile_read(&sub->sub_file, buf, bufsz, seq);
+	}
+	if (len < 0)
+		log_warning("unable to read the state file %s", sub->sub_path);
+	return len;
+}
+
+/* Update the current state of a subscription */
+static int subscription_update(state_ctx_t ctx, subscription_t sub)
+{
+	ssize_t len;
+
+	/* The broker sends every new value, so there is nothing to read */
+	if (ctx->broker_fd >= 0) {
+		if (sub->sub_buf == NULL) {
+			log_warning("no value has been received for %s", sub->sub_name);
+			return -1;
+		}
+		return 0;
+	}
+
+	len = subscription_read(ctx, sub, &sub->sub_buf, &sub->sub_bufsz,
+			&sub->sub_seq);
+	if (len < 0)
+		return -1;
+	sub->sub_buflen = len;
+	return 0;
+}
+
+/*
+ * Each thread keeps its own copies of the values that it reads with
+ * state_get(), so that readers never write to memory shared with other
+ * threads, and a value stays valid until the same thread reads that
+ * name again.
+ */
+struct value_copy {
+	uint64_t cp_id;		/* The sub_id of the subscription, or zero if unused */
+	uint64_t cp_ctx;	/* The id of the context of the subscription */
+	uint32_t cp_seq;	/* The sequence number of the copy */
+	bool	 cp_valid;	/* <cp_buf> holds a copy of the value */
+	char	*cp_buf;
+	size_t	 cp_len, cp_size;
+};
+
+struct value_cache {
+	struct value_copy *vc_copies;	/* Open-addressed by cp_id */
+	size_t	vc_mask;		/* The number of copies, minus one */
+	size_t	vc_count;		/* Copies in use */
+};
+
+#define VALUE_CACHE_MIN 16
+
+static __thread struct value_cache value_cache;
+static pthread_key_t value_cache_key;
+static pthread_once_t value_cache_once = PTHREAD_ONCE_INIT;
+
+static uint32_t hash_id(uint64_t id)
+{
+	return (uint32_t) ((id * 0x9e3779b97f4a7c15ull) >> 32);
+}
+
+static void value_cache_free(void *arg)
+{
+	struct value_cache *vc = arg;
+	size_t i;
+
+	if (vc->vc_copies == NULL)
+		return;
+	for (i = 0; i <= vc->vc_mask; i++)
+		free(vc->vc_copies[i].cp_buf);
+	free(vc->vc_copies);
+	vc->vc_copies = NULL;
+	vc->vc_mask = vc->vc_count = 0;
+}
+
+static void value_cache_key_create(void)
+{
+	if (pthread_key_create(&value_cache_key, value_cache_free) != 0)
+		log_error("unable to create a thread-specific data key");
+}
+
+static int id_compare(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+
+	return (x > y) - (x < y);
+}
+
+/* Return true if <id> is in the sorted array <ids> */
+static bool id_find(uint64_t id, const uint64_t *ids, size_t n)
+{
+	return n > 0 && bsearch(&id, ids, n, sizeof(*ids), id_compare) != NULL;
+}
+
+/* Return true if a copy is of a subscription that still exists */
+static bool value_copy_is_live(state_ctx_t ctx, const struct value_copy *cp,
+		const uint64_t *subs, size_t nsubs, const uint64_t *ctxs, size_t nctxs)
+{
+	if (cp->cp_ctx == ctx->id)
+		return id_find(cp->cp_id, subs, nsubs);
+
+	/* Copies made for another context are kept until it is freed */
+	return id_find(cp->cp_ctx, ctxs, nctxs);
+}
+
+/*
+ * Make room for more copies, and drop the copies of subscriptions that no
+ * longer exist. The caller must be in an epoch_enter() section
+ */
+static int value_cache_grow(state_ctx_t ctx, struct value_cache *vc)
+{
+	struct value_copy *copies, *cp;
+	struct sub_index *si;
+	state_ctx_t other;
+	uint64_t *subs = NULL, *ctxs = NULL;
+	size_t i, j, nsubs = 0, nctxs = 0, nkeep = 0, nslots = VALUE_CACHE_MIN;
+	int rv = -1;
+
+	si = __atomic_load_n(&ctx->sub_index, __ATOMIC_ACQUIRE);
+	if (vc->vc_count > 0 && si != NULL) {
+		if ((subs = malloc((si->si_mask + 1) * sizeof(*subs))) == NULL) {
+			log_errno("malloc(3)");
+			goto out;
+		}
+		for (i = 0; i <= si->si_mask; i++) {
+			subscription_t sub = __atomic_load_n(&si->si_slots[i],
+					__ATOMIC_ACQUIRE);
+			if (sub != NULL && sub != SUB_INDEX_REMOVED)
+				subs[nsubs++] = sub->sub_id;
+		}
+		qsort(subs, nsubs, sizeof(*subs), id_compare);
+	}
+	if (vc->vc_count > 0) {
+		pthread_mutex_lock(&state_contexts.mtx);
+		LIST_FOREACH(other, &state_contexts.list, entry)
+			nctxs++;
+		if ((ctxs = malloc((nctxs + 1) * sizeof(*ctxs))) == NULL) {
+			pthread_mutex_unlock(&state_contexts.mtx);
+			log_errno("malloc(3)");
+			goto out;
+		}
+		nctxs = 0;
+		LIST_FOREACH(other, &state_contexts.list, entry)
+			ctxs[nctxs++] = other->id;
+		pthread_mutex_unlock(&state_contexts.mtx);
+		qsort(ctxs, nctxs, sizeof(*ctxs), id_compare);
+	}
+
+	for (i = 0; vc->vc_copies != NULL && i <= vc->vc_mask; i++) {
+		cp = &vc->vc_copies[i];
+		if (cp->cp_id == 0)
+			continue;
+		if (value_copy_is_live(ctx, cp, subs, nsubs, ctxs, nctxs))
+			nkeep++;
+	}
+	while (nslots < 4 * (nkeep + 1))
+		nslots *= 2;
+	if ((copies = calloc(nslots, sizeof(*copies))) == NULL) {
+		log_errno("calloc(3)");
+		goto out;
+	}
+
+	for (i = 0; vc->vc_copies != NULL && i <= vc->vc_mask; i++) {
+		cp = &vc->vc_copies[i];
+		if (cp->cp_id == 0)
+			continue;
+		if (!value_copy_is_live(ctx, cp, subs, nsubs, ctxs, nctxs)) {
+			free(cp->cp_buf);
+			continue;
+		}
+		for (j = hash_id(cp->cp_id) & (nslots - 1); copies[j].cp_id != 0;
+				j = (j + 1) & (nslots - 1))
+			;
+		copies[j] = *cp;
+	}
+	if (vc->vc_copies == NULL) {
+		(void) pthread_once(&value_cache_once, value_cache_key_create);
+		(void) pthread_setspecific(value_cache_key, vc);
+	}
+	free(vc->vc_copies);
+	vc->vc_copies = copies;
+	vc->vc_mask = nslots - 1;
+	vc->vc_count = nkeep;
+	rv = 0;
+
+out:
+	free(subs);
+	free(ctxs);
+	return rv;
+}
+
+/*
+ * Find the calling thread's copy of the value of a subscription, adding
+ * an empty one if there is none. The caller must be in an epoch_enter() section
+ */
+static struct value_copy *value_cache_get(state_ctx_t ctx, subscription_t sub)
+{
+	struct value_cache *vc = &value_cache;
+	struct value_copy *cp;
+	size_t i;
+
+	if (vc->vc_copies != NULL) {
+		for (i = hash_id(sub->sub_id) & vc->vc_mask;
+				vc->vc_copies[i].cp_id != 0; i = (i + 1) & vc->vc_mask) {
+			if (vc->vc_copies[i].cp_id == sub->sub_id)
+				return &vc->vc_copies[i];
+		}
+	}
+	if ((vc->vc_copies == NULL || 2 * (vc->vc_count + 1) > vc->vc_mask + 1) &&
+			value_cache_grow(ctx, vc) < 0)
+		return NULL;
+	for (i = hash_id(sub->sub_id) & vc->vc_mask; vc->vc_copies[i].cp_id != 0;
+			i = (i + 1) & vc->vc_mask)
+		;
+	cp = &vc->vc_copies[i];
+	cp->cp_id = sub->sub_id;
+	cp->cp_ctx = ctx->id;
+	vc->vc_count++;
+	return cp;
+}
+
+/*
+ * Bring the calling thread's copy of the value of a subscription up to
+ * date. The caller must be in an epoch_enter() section
+ */
+static struct value_copy *value_cache_update(state_ctx_t ctx, subscription_t sub)
+{
+	struct value_copy *cp;
+	ssize_t len;
+	char *buf;
+
+	if ((cp = value_cache_get(ctx, sub)) == NULL)
+		return NULL;
+
+	/* The broker's values are stored by state_check_many() under the mutex */
+	if (ctx->broker_fd >= 0) {
+		pthread_mutex_lock(&ctx->mtx);
+		if (sub->sub_buf == NULL) {
+			pthread_mutex_unlock(&ctx->mtx);
+			log_warning("no value has been received for %s", sub->sub_name);
+			return NULL;
+		}
+		if (!cp->cp_valid || cp->cp_seq != sub->sub_seq) {
+			if (cp->cp_size <= sub->sub_buflen) {
+				if ((buf = realloc(cp->cp_buf, sub->sub_buflen + 1)) == NULL) {
+					pthread_mutex_unlock(&ctx->mtx);
+					log_errno("realloc(3)");
+					return NULL;
+				}
+				cp->cp_buf = buf;
+				cp->cp_size = sub->sub_buflen + 1;
+			}
+			memcpy(cp->cp_buf, sub->sub_buf, sub->sub_buflen + 1);
+			cp->cp_len = sub->sub_buflen;
+			cp->cp_seq = sub->sub_seq;
+			cp->cp_valid = true;
+		}
+		pthread_mutex_unlock(&ctx->mtx);
+		return cp;
+	}
+
+	if (cp->cp_valid && subscription_validate(sub, cp->cp_seq))
+		return cp;
+	len = subscription_read(ctx, sub, &cp->cp_buf, &cp->cp_size, &cp->cp_seq);
+	if (len < 0) {
+		cp->cp_valid = false;
+		return NULL;
+	}
+	cp->cp_len = len;
+	cp->cp_valid = true;
+	return cp;
+}
+
+
+/* Start watching the state file, or the arena, that holds the state of a subscription */
+static int subscription_open(state_ctx_t ctx, subscription_t sub)
+{
+	int rv;
+
+	if (ctx->broker_fd >= 0)
+		return broker_send(ctx, BROKER_SUBSCRIBE, sub->sub_name, NULL, 0);
+
+	if (ctx->flags & STATE_ARENA) {
+		if ((sub->sub_ns = arena_ns_get(ctx, sub->sub_name)) == NULL)
+			return -1;
+		sub->sub_slot = arena_slot_lookup(sub->sub_ns->an_arena,
+				sub->sub_name);
+
+		pthread_mutex_lock(&ctx->mtx);
+		rv = arena_ns_watch_locked(ctx, sub->sub_ns);
+		pthread_mutex_unlock(&ctx->mtx);
+		return rv;
+	}
+
+	sub->sub_path = name_to_path(ctx, sub->sub_name);
+	if (!sub->sub_path)
+		return -1;
+
+	if (statefile_open(&sub->sub_file, sub->sub_path) < 0)
+		return -1;
+
+	sub->sub_wd = watch_add(ctx->watch, sub->sub_file.sf_fd,
+			sub->sub_path);
+	if (sub->sub_wd < 0)
+		return -1;
+	return 0;
+}
+
+/*
+ * Subscribe to every state file in the directory of a prefix that
+ * matches it, and is not subscribed to already. If <report> is true, the
+ * files that already hold a value are queued to be returned by the next
+ * call to state_check_many(), since their notifications were missed.
+ */
+static int prefix_scan(state_ctx_t ctx, prefix_t ps, bool report)
+{
+	DIR *dirp;
+	struct dirent *ent;
+	struct stat sb;
+	subscription_t sub;
+	char *name;
+	int rv = 0;
+
+	ps->ps_rescan = false;
+	if ((dirp = opendir(ps->ps_dir)) == NULL) {
+		log_errno("opendir(3) of %s", ps->ps_dir);
+		return -1;
+	}
+	while ((ent = readdir(dirp)) != NULL) {
+		if (ent->d_name[0] == '.')
+			continue;
+		if (asprintf(&name, "%s%s", ps->ps_dir_prefix, ent->d_name) < 0) {
+			rv = -1;
+			break;
+		}
+		if (strncmp(name, ps->ps_prefix, ps->ps_len) != 0 ||
+				subscription_lookup(ctx, name) != NULL) {
+			free(name);
+			continue;
+		}
+
+		if ((sub = subscription_new()) == NULL) {
+			free(name);
+			rv = -1;
+			break;
+		}
+		sub->sub_name = name;
+		if (subscription_open(ctx, sub) < 0) {
+			subscription_free(sub);
+			rv = -1;
+			continue;
+		}
+		sub->sub_prefix = ps;
+
+		/* An empty file was created by a subscriber, and has no value yet */
+		if (report && fstat(sub->sub_file.sf_fd, &sb) == 0 &&
+				sb.st_size > 0 && subscription_update(ctx, sub) == 0)
+			sub->sub_new = true;
+
+		pthread_mutex_lock(&ctx->mtx);
+		subscription_insert_locked(ctx, sub);
+		pthread_mutex_unlock(&ctx->mtx);
+	}
+	(void) closedir(dirp);
+	return rv;
+}
+
+/* Initialize a context, which must be zeroed */
+static int state_ctx_setup(state_ctx_t ctx, int flags)
+{
+	int i;
+
+	if (flags & ~(STATE_COALESCE | STATE_ARENA | STATE_BROKER) ||
+			((flags & STATE_ARENA) && (flags & STATE_BROKER))) {
+		log_error("invalid flags: %d", flags);
+		return -1;
+	}
+
+	/* FIXME: not threadsafe */
+	if (ctx->initialized)
+		return -1;
+	SLIST_INIT(&ctx->dead_subscriptions);
+	if (hash_table_init(&ctx->bindings) < 0 ||
+			hash_table_init(&ctx->subscriptions) < 0 ||
+			hash_table_init(&ctx->subscriptions_by_wd) < 0)
+		goto err_out;
+	for (i = 0; i < 2; i++) {
+		struct arena_ns *ns = &ctx->arenas[i];
+
+		ns->an_arena = NULL;
+		ns->an_wd = -1;
+		ns->an_rescan = false;
+		LIST_INIT(&ns->an_unresolved);
+		if (hash_table_init(&ns->an_subs) < 0)
+			goto err_out;
+	}
+	LIST_INIT(&ctx->prefixes);
+	ctx->rescan = false;
+	LIST_INIT(&ctx->pending);
+	LIST_INIT(&ctx->counters);
+	LIST_INIT(&ctx->histories);
+	ctx->published = ctx->suppressed = 0;
+	ctx->broker_fd = -1;
+	if ((ctx->watch = watch_new()) == NULL)
+		goto err_out;
+	if (create_user_dirs(ctx) < 0)
+		goto err_out;
+	if ((flags & STATE_BROKER) && broker_connect(ctx) < 0)
+		goto err_out;
+	pthread_mutex_init(&ctx->mtx, NULL);
+	ctx->flags = flags;
+	ctx->initialized = true;
+
+	pthread_mutex_lock(&state_contexts.mtx);
+	ctx->id = state_contexts.next_id++;
+	LIST_INSERT_HEAD(&state_contexts.list, ctx, entry);
+	pthread_mutex_unlock(&state_contexts.mtx);
+	return 0;
+
+err_out:
+	/* Nothing else has been set up yet, and the context can be set up again */
+	watch_free(ctx->watch);
+	ctx->watch = NULL;
+	free(ctx->userprefix);
+	ctx->userprefix = NULL;
+	free(ctx->userstatedir);
+	ctx->userstatedir = NULL;
+	hash_table_free(&ctx->bindings);
+	hash_table_free(&ctx->subscriptions);
+	hash_table_free(&ctx->subscriptions_by_wd);
+	for (i = 0; i < 2; i++)
+		hash_table_free(&ctx->arenas[i].an_subs);
+	return -1;
+}
+
+int state_init(int abi_version, int flags)
+{
+	/* This is not used yet */
+	(void) abi_version;
+
+	return state_ctx_setup(&state_default_ctx, flags);
+}
+
+state_ctx_t state_ctx_new(int flags)
+{
+	state_ctx_t ctx;
+
+	if ((ctx = calloc(1, sizeof(*ctx))) == NULL) {
+		log_errno("calloc(3)");
+		return NULL;
+	}
+	if (state_ctx_setup(ctx, flags) < 0) {
+		free(ctx);
+		return NULL;
+	}
+	return ctx;
+}
+
+state_ctx_t state_ctx_default(void)
+{
+	return &state_default_ctx;
+}
+
+int state_openlog(const char *path)
+{
+	return log_open(path);
+}
+
+int state_closelog(void)
+{
+	return log_close();
+}
+
+/* Free everything that belongs to a context */
+static void state_ctx_cleanup(state_ctx_t ctx)
+{
+	struct flush_batch fb = { .fb_count = 0 };
+	struct history_reader *hr;
+	struct hash_node *hn;
+	state_binding_t sb;
+	prefix_t ps;
+	size_t i;
+
+	if (!ctx->initialized)
+		return;
+
+	pthread_mutex_lock(&state_contexts.mtx);
+	LIST_REMOVE(ctx, entry);
+	pthread_mutex_unlock(&state_contexts.mtx);
+
+	/* The callbacks may still be using everything else */
+	dispatch_free(ctx->dispatch);
+	ctx->dispatch = NULL;
+
+	/* This writes any throttled values, so it must come before the rest */
+	binding_flusher_stop(ctx);
+	pthread_mutex_lock(&ctx->mtx);
+	LIST_FOREACH(sb, &ctx->counters, counter_entry) {
+		counter_sample_locked(ctx, sb, &fb);
+	}
+	flush_batch_notify_locked(ctx, &fb);
+	pthread_mutex_unlock(&ctx->mtx);
+	ioengine_free(ctx->ioengine);
+	ctx->ioengine = NULL;
+	ctx->ioengine_probed = false;
+
+	free(ctx->userprefix);
+	ctx->userprefix = NULL;
+	free(ctx->userstatedir);
+	ctx->userstatedir = NULL;
+	watch_free(ctx->watch);
+	ctx->watch = NULL;
+	if (ctx->broker_fd >= 0) {
+		(void) close(ctx->broker_fd);
+		ctx->broker_fd = -1;
+	}
+	free(ctx->broker_buf);
+	ctx->broker_buf = NULL;
+	ctx->broker_off = ctx->broker_len = 0;
+	ctx->broker_size = 0;
+	HASH_TABLE_DRAIN(hn, &ctx->bindings, i) {
+		state_binding_free(hn->hn_data);
+	}
+	HASH_TABLE_DRAIN(hn, &ctx->subscriptions, i) {
+		subscription_free(hn->hn_data);
+	}
+	subscription_reap(ctx);
+	epoch_synchronize();
+	free(ctx->sub_index);
+	ctx->sub_index = NULL;
+	while ((ps = LIST_FIRST(&ctx->prefixes)) != NULL) {
+		LIST_REMOVE(ps, ps_entry);
+		prefix_free(ps);
+	}
+	arena_ns_free(&ctx->arenas[ARENA_NS_SYSTEM]);
+	arena_ns_free(&ctx->arenas[ARENA_NS_USER]);
+	while ((hr = LIST_FIRST(&ctx->histories)) != NULL) {
+		LIST_REMOVE(hr, hr_entry);
+		history_close(hr->hr_history);
+		free(hr->hr_name);
+		free(hr);
+	}
+	hash_table_free(&ctx->bindings);
+	hash_table_free(&ctx->subscriptions);
+	hash_table_free(&ctx->subscriptions_by_wd);
+	log_debug("shutting down");
+	(void) pthread_mutex_destroy(&ctx->mtx);
+	ctx->initialized = false;
+}
+
+void state_ctx_free(state_ctx_t ctx)
+{
+	if (ctx == NULL)
+		return;
+	state_ctx_cleanup(ctx);
+	if (ctx != &state_default_ctx)
+		free(ctx);
+}
+
+void state_atexit(void)
+{
+	state_ctx_cleanup(&state_default_ctx);
+	(void) log_close();
+}
+
+/*
+ * Create a binding. If <capacity> is not zero, values are limited to that
+ * many bytes, and the space for them is allocated now.
+ */
+static int binding_create(state_ctx_t ctx, const char *name, unsigned int max_rate,
+		unsigned int debounce_ms, size_t capacity)
+{
+	state_binding_t sb = NULL;
+
+	sb = calloc(1, sizeof(*sb));
+	if (!sb)
+		goto err_out;
+	statefile_init(&sb->file);
+	if (max_rate > 0)
+		sb->interval = 1000000000 / max_rate;
+	sb->debounce = (uint64_t) debounce_ms * 1000000;
+	sb->maxlen = capacity;
+	sb->name = strdup(name);
+	if (!sb->name)
+		goto err_out;
+
+	if (ctx->flags & STATE_BROKER) {
+		if (validate_name((char *) name) < 0)
+			goto err_out;
+	} else if (ctx->flags & STATE_ARENA) {
+		struct arena_ns *ns = arena_ns_get(ctx, name);
+
+		if (ns == NULL)
+			goto err_out;
+		sb->arena = ns->an_arena;
+		if ((sb->slot = arena_slot_alloc(sb->arena, name)) < 0)
+			goto err_out;
+		if (arena_clear(sb->arena, sb->slot) < 0)
+			goto err_out;
+		if (capacity && arena_reserve(sb->arena, sb->slot, capacity) < 0)
+			goto err_out;
+	} else {
+		sb->path = name_to_path(ctx, name);
+		if (!sb->path)
+			goto err_out;
+		if (statefile_create(&sb->file, sb->path) < 0)
+			goto err_out;
+		if (capacity && statefile_reserve(&sb->file, capacity) < 0)
+			goto err_out;
+	}
+
+	pthread_mutex_lock(&ctx->mtx);
+	if ((sb->interval || sb->debounce) && binding_flusher_start_locked(ctx) < 0) {
+		pthread_mutex_unlock(&ctx->mtx);
+		goto err_out;
+	}
+	hash_table_insert(&ctx->bindings, &sb->name_node,
+			hash_string(sb->name), sb);
+	pthread_mutex_unlock(&ctx->mtx);
+
+	return 0;
+
+	err_out:
+	log_error("unable to bind to %s", name);
+	state_binding_free(sb);
+	return -1;
+}
+
+int state_ctx_bind(state_ctx_t ctx, const char *name)
+{
+	return binding_create(ctx, name, 0, 0, 0);
+}
+
+int state_ctx_bind_throttled(state_ctx_t ctx, const char *name, unsigned int max_rate,
+		unsigned int debounce_ms)
+{
+	return binding_create(ctx, name, max_rate, debounce_ms, 0);
+}
+
+int state_ctx_bind_reserved(state_ctx_t ctx, const char *name, size_t capacity)
+{
+	if (capacity == 0) {
+		log_error("no capacity given for %s", name);
+		return -1;
+	}
+	return binding_create(ctx, name, 0, 0, capacity);
+}
+
+state_counter_t state_ctx_bind_counter(state_ctx_t ctx, const char *name,
+		unsigned int sample_hz)
+{
+	char value[COUNTER_SIZE];
+	struct state_counter_s *sc;
+	state_binding_t sb;
+	char *data;
+
+	if (ctx->flags & STATE_BROKER) {
+		log_error("counters are not supported by the broker: %s", name);
+		return NULL;
+	}
+	if ((sc = calloc(1, sizeof(*sc))) == NULL) {
+		log_errno("calloc(3)");
+		return NULL;
+	}
+	if (sample_hz > 0)
+		sc->sc_interval = 1000000000 / sample_hz;
+	if (state_ctx_bind(ctx, name) < 0) {
+		free(sc);
+		return NULL;
+	}
+
+	pthread_mutex_lock(&ctx->mtx);
+	sb = state_binding_lookup_locked(ctx, name);
+	counter_encode(value, 0);
+	if (binding_write_locked(ctx, sb, value, sizeof(value)) < 0)
+		goto err_out;
+	if (sb->arena)
+		data = arena_value(sb->arena, sb->slot);
+	else
+		data = statefile_value(&sb->file);
+	if (data == NULL)
+		goto err_out;
+	sc->sc_value = data + STATE_TYPED_HEADER;
+	if ((uintptr_t) sc->sc_value % sizeof(int64_t) != 0) {
+		log_error("the value of %s is not aligned", name);
+		goto err_out;
+	}
+	if (sc->sc_interval && binding_flusher_start_locked(ctx) < 0)
+		goto err_out;
+	sc->sc_next = monotonic_ns() + sc->sc_interval;
+	sb->counter = sc;
+	LIST_INSERT_HEAD(&ctx->counters, sb, counter_entry);
+	if (sc->sc_interval)
+		pthread_cond_signal(&ctx->flusher_cond);
+	pthread_mutex_unlock(&ctx->mtx);
+	return sc;
+
+err_out:
+	pthread_mutex_unlock(&ctx->mtx);
+	free(sc);
+	(void) state_ctx_unbind(ctx, name);
+	return NULL;
+}
+
+int64_t state_counter_add(state_counter_t counter, int64_t delta)
+{
+	return counter_add(counter->sc_value, delta);
+}
+
+void state_counter_set(state_counter_t counter, int64_t value)
+{
+	counter_store(counter->sc_value, value);
+}
+
+int state_ctx_bind_history(state_ctx_t ctx, const char *name,
+		unsigned int depth)
+{
+	state_binding_t sb;
+	history_t h;
+	char *path;
+
+	if (ctx->flags & STATE_BROKER) {
+		log_error("history is not supported by the broker: %s", name);
+		return -1;
+	}
+	if ((path = name_to_history_path(ctx, name)) == NULL)
+		return -1;
+	h = history_create(path, depth);
+	free(path);
+	if (h == NULL)
+		return -1;
+	if (state_ctx_bind(ctx, name) < 0) {
+		history_close(h);
+		return -1;
+	}
+	pthread_mutex_lock(&ctx->mtx);
+	sb = state_binding_lookup_locked(ctx, name);
+	sb->history = h;
+	pthread_mutex_unlock(&ctx->mtx);
+	return 0;
+}
+
+/* The caller must hold ctx->mtx */
+static struct history_reader *history_reader_get_locked(state_ctx_t ctx,
+		const char *name)
+{
+	struct history_reader *hr;
+	char *path;
+
+	LIST_FOREACH(hr, &ctx->histories, hr_entry) {
+		if (strcmp(hr->hr_name, name) == 0)
+			break;
+	}
+	if (hr && !history_replaced(hr->hr_history))
+		return hr;
+	if (hr == NULL) {
+		if ((hr = calloc(1, sizeof(*hr))) == NULL) {
+			log_errno("calloc(3)");
+			return NULL;
+		}
+		if ((hr->hr_name = strdup(name)) == NULL) {
+			log_errno("strdup(3)");
+			free(hr);
+			return NULL;
+		}
+		LIST_INSERT_HEAD(&ctx->histories, hr, hr_entry);
+	}
+
+	/* Open the history for the first time, or again after it was replaced */
+	history_close(hr->hr_history);
+	hr->hr_history = NULL;
+	if ((path = name_to_history_path(ctx, name)) == NULL)
+		return NULL;
+	hr->hr_history = history_open(path);
+	free(path);
+	return hr->hr_history ? hr : NULL;
+}
+
+ssize_t state_ctx_check_history(state_ctx_t ctx, const char *name,
+		uint64_t *seq, struct state_transition *ts, size_t max)
+{
+	struct history_reader *hr;
+	ssize_t rv = -1;
+
+	if (seq == NULL || (ts == NULL && max > 0))
+		return -1;
+	pthread_mutex_lock(&ctx->mtx);
+	if ((hr = history_reader_get_locked(ctx, name)) != NULL)
+		rv = history_read(hr->hr_history, seq, ts, max);
+	else
+		log_debug("%s does not have a history", name);
+	pthread_mutex_unlock(&ctx->mtx);
+	return rv;
+}
+
+int state_ctx_unbind(state_ctx_t ctx, const char *name)
+{
+	struct flush_batch fb = { .fb_count = 0 };
+	state_binding_t sb;
+
+	pthread_mutex_lock(&ctx->mtx);
+	sb = state_binding_lookup_locked(ctx, name);
+	if (sb == NULL) {
+		pthread_mutex_unlock(&ctx->mtx);
+		log_error("name not bound: %s", name);
+		return (-1);
+	}
+	hash_table_remove(&ctx->bindings, &sb->name_node);
+	if (binding_flush_locked(ctx, sb, NULL) < 0)
+		log_error("unable to publish %s", name);
+	if (sb->counter) {
+		LIST_REMOVE(sb, counter_entry);
+		counter_sample_locked(ctx, sb, &fb);
+		flush_batch_notify_locked(ctx, &fb);
+	}
+	pthread_mutex_unlock(&ctx->mtx);
+	state_binding_free(sb);
+	log_debug("unbound %s", name);
+
+	return 0;
+}
+
+int state_ctx_subscribe(state_ctx_t ctx, const char *name)
+{
+	subscription_t sub;
+
+	/* Take over a subscription that was made for a prefix */
+	pthread_mutex_lock(&ctx->mtx);
+	sub = subscription_lookup_locked(ctx, name);
+	if (sub && sub->sub_prefix) {
+		subscription_orphan_locked(sub);
+		pthread_mutex_unlock(&ctx->mtx);
+
+		/* The broker only sent it for the prefix until now */
+		if (ctx->broker_fd >= 0)
+			return broker_send(ctx, BROKER_SUBSCRIBE, name, NULL, 0);
+		return 0;
+	}
+	pthread_mutex_unlock(&ctx->mtx);
+
+	sub = subscription_new();
+	if (!sub)
+		return -1;
+	sub->sub_name = strdup(name);
+	if (!sub->sub_name)
+		goto err_out;
+
+	if (subscription_open(ctx, sub) < 0)
+		goto err_out;
+
+	pthread_mutex_lock(&ctx->mtx);
+	subscription_insert_locked(ctx, sub);
+	pthread_mutex_unlock(&ctx->mtx);
+
+	return 0;
+
+err_out:
+	subscription_free(sub);
+	return -1;
+}
+
+int state_ctx_unsubscribe(state_ctx_t ctx, const char *name)
+{
+	subscription_t sub;
+
+	pthread_mutex_lock(&ctx->mtx);
+	sub = subscription_lookup_locked(ctx, name);
+	if (sub == NULL) {
+		pthread_mutex_unlock(&ctx->mtx);
+		return -1;
+	}
+	subscription_remove_locked(ctx, sub);
+	pthread_mutex_unlock(&ctx->mtx);
+
+	if (sub->sub_wd >= 0)
+		(void) watch_remove(ctx->watch, sub->sub_wd);
+	if (ctx->broker_fd >= 0)
+		(void) broker_send(ctx, BROKER_UNSUBSCRIBE, name, NULL, 0);
+	subscription_retire(sub);
+	return 0;
+}
+
+
+int state_ctx_subscribe_prefix(state_ctx_t ctx, const char *prefix)
+{
+	prefix_t ps;
+
+	if ((ps = prefix_new()) == NULL)
+		return -1;
+	if ((ps->ps_prefix = strdup(prefix)) == NULL)
+		goto err_out;
+	ps->ps_len = strlen(prefix);
+
+	if (ctx->broker_fd >= 0) {
+		if (broker_send(ctx, BROKER_SUBSCRIBE_PREFIX, prefix, NULL, 0) < 0)
+			goto err_out;
+		pthread_mutex_lock(&ctx->mtx);
+		LIST_INSERT_HEAD(&ctx->prefixes, ps, ps_entry);
+		pthread_mutex_unlock(&ctx->mtx);
+		return 0;
+	}
+
+	if (ctx->flags & STATE_ARENA) {
+		if ((ps->ps_ns = arena_ns_get(ctx, prefix)) == NULL)
+			goto err_out;
+		pthread_mutex_lock(&ctx->mtx);
+		if (arena_ns_watch_locked(ctx, ps->ps_ns) < 0) {
+			pthread_mutex_unlock(&ctx->mtx);
+			goto err_out;
+		}
+		LIST_INSERT_HEAD(&ctx->prefixes, ps, ps_entry);
+		pthread_mutex_unlock(&ctx->mtx);
+		return 0;
+	}
+
+	if (name_is_user(prefix)) {
+		ps->ps_dir = strdup(ctx->userstatedir);
+		ps->ps_dir_prefix = "user.";
+	} else {
+		ps->ps_dir = strdup(STATE_PREFIX);
+	}
+	if (!ps->ps_dir)
+		goto err_out;
+	if ((ps->ps_dirfd = open(ps->ps_dir, O_RDONLY | O_DIRECTORY)) < 0) {
+		log_errno("open(2) of %s", ps->ps_dir);
+		goto err_out;
+	}
+	ps->ps_wd = watch_add_dir(ctx->watch, ps->ps_dirfd, ps->ps_dir);
+	if (ps->ps_wd < 0)
+		goto err_out;
+
+	pthread_mutex_lock(&ctx->mtx);
+	LIST_INSERT_HEAD(&ctx->prefixes, ps, ps_entry);
+	pthread_mutex_unlock(&ctx->mtx);
+
+	/* Names that already exist are reported the next time they change */
+	return prefix_scan(ctx, ps, false);
+
+err_out:
+	if (ps->ps_wd >= 0)
+		(void) watch_remove(ctx->watch, ps->ps_wd);
+	prefix_free(ps);
+	return -1;
+}
+
+int state_ctx_unsubscribe_prefix(state_ctx_t ctx, const char *prefix)
+{
+	prefix_t ps;
+	subscription_t sub;
+
+	pthread_mutex_lock(&ctx->mtx);
+	ps = prefix_lookup_locked(ctx, prefix);
+	if (ps == NULL) {
+		pthread_mutex_unlock(&ctx->mtx);
+		return -1;
+	}
+	LIST_REMOVE(ps, ps_entry);
+	while ((sub = LIST_FIRST(&ps->ps_children)) != NULL) {
+		subscription_remove_locked(ctx, sub);
+		if (sub->sub_wd >= 0)
+			(void) watch_remove(ctx->watch, sub->sub_wd);
+		subscription_retire(sub);
+	}
+	pthread_mutex_unlock(&ctx->mtx);
+
+	if (ps->ps_wd >= 0)
+		(void) watch_remove(ctx->watch, ps->ps_wd);
+	if (ctx->broker_fd >= 0)
+		(void) broker_send(ctx, BROKER_UNSUBSCRIBE_PREFIX, prefix, NULL, 0);
+	prefix_free(ps);
+	return 0;
+}
+
+int state_ctx_publish(state_ctx_t ctx, const char *name, const char *state, size_t len)
+{
+	state_binding_t sb;
+	int rv;
+
+	pthread_mutex_lock(&ctx->mtx);
+	sb = state_binding_lookup_locked(ctx, name);
+	if (sb == NULL) {
+		pthread_mutex_unlock(&ctx->mtx);
+		log_error("tried to publish to an unbound name: %s", name);
+		return (-1);
+	}
+	if (sb->counter) {
+		pthread_mutex_unlock(&ctx->mtx);
+		log_error("tried to publish to a counter: %s", name);
+		return (-1);
+	}
+	if (sb->maxlen && len > sb->maxlen) {
+		pthread_mutex_unlock(&ctx->mtx);
+		log_error("%zu bytes do not fit in the %zu reserved for %s",
+				len, sb->maxlen, name);
+		return (-1);
+	}
+	if ((rv = binding_cache_locked(sb, state, len)) != 0) {
+		if (rv > 0)
+			ctx->suppressed++;
+		pthread_mutex_unlock(&ctx->mtx);
+		return rv < 0 ? -1 : 0;
+	}
+	if (sb->history)
+		(void) history_append(sb->history, state, len);
+	if (sb->interval || sb->debounce) {
+		rv = binding_throttle_locked(ctx, sb, state, len);
+		pthread_mutex_unlock(&ctx->mtx);
+		return rv;
+	}
+
+	/*
+	 * Write while holding the lock, so that the binding cannot be freed,
+	 * and the file always ends up with the value that was cached last.
+	 */
+	rv = binding_write_locked(ctx, sb, state, len);
+	if (rv < 0) {
+		/* Do not skip the same value next time, since it was not written */
+		sb->has_value = false;
+	}
+	pthread_mutex_unlock(&ctx->mtx);
+	return rv;
+}
+
+int state_ctx_publish_multi(state_ctx_t ctx, const struct state_value *values, size_t n)
+{
+	state_binding_t *sbs;
+	struct statefile **files;
+	struct state_value *changed;
+	arena_t arenas[2] = { NULL, NULL };
+	ioengine_t engine;
+	size_t i, nfiles = 0, nchanged = 0;
+	int j, cached, rv = 0;
+
+	if (values == NULL)
+		return -1;
+	if (n == 0)
+		return 0;
+	if (ctx->broker_fd >= 0 && !broker_txn_fits(values, n)) {
+		log_error("%zu values are too many to publish at once", n);
+		return -1;
+	}
+	sbs = calloc(n, sizeof(*sbs));
+	files = calloc(n, sizeof(*files));
+	if (sbs == NULL || files == NULL) {
+		log_errno("calloc(3)");
+		free(sbs);
+		free(files);
+		return -1;
+	}
+
+	/*
+	 * Check every name before changing anything. The lock is held until
+	 * the values are written, as in state_ctx_publish().
+	 */
+	pthread_mutex_lock(&ctx->mtx);
+	for (i = 0; i < n; i++) {
+		sbs[i] = state_binding_lookup_locked(ctx, values[i].name);
+		if (sbs[i] == NULL || sbs[i]->counter) {
+			log_error("%s has not been bound, or is a counter",
+					values[i].name);
+			rv = -1;
+			goto out;
+		}
+		if (sbs[i]->maxlen && values[i].len > sbs[i]->maxlen) {
+			log_error("%zu bytes do not fit in the %zu reserved for %s",
+					values[i].len, sbs[i]->maxlen, values[i].name);
+			rv = -1;
+			goto out;
+		}
+	}
+
+	/*
+	 * Throttling does not apply, and these values replace any pending ones.
+	 * As with state_ctx_publish(), an unchanged value is skipped, unless
+	 * it is only cached because it is still pending.
+	 */
+	for (i = 0; i < n; i++) {
+		cached = binding_cache_locked(sbs[i], values[i].value, values[i].len);
+		if (cached > 0 && !sbs[i]->has_pending) {
+			ctx->suppressed++;
+			sbs[i] = NULL;
+			continue;
+		}
+		nchanged++;
+		if (cached < 0)
+			sbs[i]->has_value = false;
+		else if (cached == 0 && sbs[i]->history)
+			(void) history_append(sbs[i]->history, values[i].value,
+					values[i].len);
+		if (sbs[i]->interval || sbs[i]->debounce) {
+			binding_discard_locked(sbs[i]);
+			sbs[i]->last = monotonic_ns();
+		}
+	}
+	if (nchanged == 0)
+		goto out;
+	if (ctx->broker_fd >= 0) {
+		/* The transaction only contains the values that changed */
+		if ((changed = calloc(nchanged, sizeof(*changed))) == NULL) {
+			log_errno("calloc(3)");
+			rv = -1;
+		} else {
+			for (i = 0, j = 0; i < n; i++) {
+				if (sbs[i])
+					changed[j++] = values[i];
+			}
+			rv = broker_send_multi_locked(ctx, changed, nchanged);
+			free(changed);
+		}
+		if (rv < 0) {
+			for (i = 0; i < n; i++) {
+				if (sbs[i])
+					sbs[i]->has_value = false;
+			}
+		}
+		goto out;
+	}
+	engine = (ctx->flags & STATE_ARENA) ? NULL : ctx_ioengine_locked(ctx);
+
+	/* Store every value before notifying anyone about any of them */
+	for (i = 0; i < n; i++) {
+		if (sbs[i] == NULL)
+			continue;
+		if (sbs[i]->arena) {
+			if (arena_update(sbs[i]->arena, sbs[i]->slot, values[i].value,
+					values[i].len) < 0) {
+				sbs[i]->has_value = false;
+				rv = -1;
+				continue;
+			}
+			/* Each arena is notified once, however many values changed */
+			for (j = 0; j < 2; j++) {
+				if (arenas[j] == NULL || arenas[j] == sbs[i]->arena) {
+					arenas[j] = sbs[i]->arena;
+					break;
+				}
+			}
+		} else if (statefile_update(&sbs[i]->file, values[i].value,
+				values[i].len) < 0) {
+			sbs[i]->has_value = false;
+			rv = -1;
+		} else {
+			files[nfiles++] = &sbs[i]->file;
+		}
+	}
+
+	/* With io_uring, this is one system call for every state file */
+	if (statefile_notify_many(files, nfiles, engine) < 0)
+		rv = -1;
+	for (j = 0; j < 2; j++) {
+		if (arenas[j] && arena_notify(arenas[j]) < 0)
+			rv = -1;
+	}
+
+out:
+	pthread_mutex_unlock(&ctx->mtx);
+	free(files);
+	free(sbs);
+	if (rv == 0)
+		__atomic_add_fetch(&ctx->published, nchanged, __ATOMIC_RELAXED);
+	return rv;
+}
+
+int state_ctx_get(state_ctx_t ctx, const char *key, char **value)
+{
+	subscription_t sub;
+	struct value_copy *cp;
+	int rv = -1;
+
+	*value = NULL;
+	if (epoch_enter() < 0)
+		return -1;
+	if ((sub = sub_index_lookup(ctx, key)) == NULL) {
+		log_debug("subscription lookup for `%s' failed", key);
+	} else if ((cp = value_cache_update(ctx, sub)) == NULL) {
+		log_debug("failed to update subscription");
+	} else {
+		*value = cp->cp_buf;
+		rv = cp->cp_len;
+	}
+	epoch_exit();
+	return rv;
+}
+
+int state_ctx_get_if_changed(state_ctx_t ctx, const char *key, unsigned int *gen, char **value)
+{
+	subscription_t sub;
+	struct value_copy *cp;
+	int rv = -1;
+
+	if (gen == NULL || value == NULL)
+		return -1;
+	if (epoch_enter() < 0)
+		return -1;
+	if ((sub = sub_index_lookup(ctx, key)) == NULL) {
+		log_debug("subscription lookup for `%s' failed", key);
+	} else if ((cp = value_cache_update(ctx, sub)) == NULL) {
+		log_debug("failed to update subscription");
+	} else if (cp->cp_seq / 2 == *gen) {
+		/* Every write adds two to the sequence number */
+		rv = 0;
+	} else {
+		*gen = cp->cp_seq / 2;
+		*value = cp->cp_buf;
+		rv = 1;
+	}
+	epoch_exit();
+	return rv;
+}
+
+ssize_t state_ctx_peek(state_ctx_t ctx, const char *key, const char **value, unsigned int *seq)
+{
+	struct value_copy *cp;
+	subscription_t sub;
+	uint32_t seq32;
+	ssize_t len = -1;
+	int slot;
+
+	if (epoch_enter() < 0) {
+		*value = NULL;
+		return -1;
+	}
+	if ((sub = sub_index_lookup(ctx, key)) == NULL) {
+		log_debug("subscription lookup for `%s' failed", key);
+	} else if (ctx->broker_fd >= 0) {
+		/*
+		 * state_check_many() may replace the buffer of the subscription
+		 * at any time, so hand out the per-thread copy that state_get() uses
+		 */
+		if ((cp = value_cache_update(ctx, sub)) != NULL) {
+			*value = cp->cp_buf;
+			seq32 = cp->cp_seq;
+			len = cp->cp_len;
+		}
+	} else if (sub->sub_ns) {
+		subscription_resolve(ctx, sub);
+		if ((slot = subscription_slot(sub)) >= 0)
+			len = arena_peek(sub->sub_ns->an_arena, slot, value, &seq32);
+	} else {
+		len = statefile_peek(&sub->sub_file, value, &seq32);
+	}
+	epoch_exit();
+	if (len < 0) {
+		*value = NULL;
+		return -1;
+	}
+	*seq = seq32;
+	return len;
+}
+
+ssize_t state_ctx_get_range(state_ctx_t ctx, const char *key, size_t off,
+		size_t len, void *buf)
+{
+	const char *value;
+	unsigned int seq;
+	ssize_t vlen;
+	size_t n;
+	int i;
+
+	for (i = 0; i < STATE_PEEK_MAX_RETRIES; i++) {
+		if ((vlen = state_ctx_peek(ctx, key, &value, &seq)) < 0)
+			return -1;
+		n = (off < (size_t) vlen) ? MIN(len, (size_t) vlen - off) : 0;
+		if (n > 0)
+			memcpy(buf, value + off, n);
+		if (state_ctx_peek_valid(ctx, key, seq))
+			return n;
+	}
+	log_warning("gave up reading %s, which is constantly changing", key);
+	return -1;
+}
+
+int state_ctx_peek_valid(state_ctx_t ctx, const char *key, unsigned int seq)
+{
+	subscription_t sub;
+	int rv = 0;
+
+	if (epoch_enter() < 0)
+		return 0;
+	if ((sub = sub_index_lookup(ctx, key)) == NULL)
+		rv = 0;
+	else if (ctx->broker_fd >= 0) {
+		pthread_mutex_lock(&ctx->mtx);
+		rv = sub->sub_seq == seq;
+		pthread_mutex_unlock(&ctx->mtx);
+	} else if (sub->sub_ns)
+		rv = subscription_slot(sub) >= 0 && subscription_validate(sub, seq);
+	else
+		rv = subscription_validate(sub, seq);
+	epoch_exit();
+	return rv;
+}
+
+/* The subscriptions found to have changed by one call to state_check_many() */
+struct drain {
+	subscription_t *d_subs;
+	size_t	d_n;
+	size_t	d_max;
+	unsigned int d_id;
+	bool	d_coalesce;
+};
+
+/* Add a subscription to a drain. Returns -1 if there is no room left */
+static int drain_add(struct drain *d, subscription_t sub)
+{
+	if (sub->sub_drain == d->d_id && d->d_coalesce)
+		return 0;
+	if (d->d_n == d->d_max)
+		return -1;
+	if (sub->sub_drain != d->d_id) {
+		sub->sub_drain = d->d_id;
+		sub->sub_error = false;
+	}
+	d->d_subs[d->d_n++] = sub;
+	return 0;
+}
+
+/*
+ * Check every subscription in an arena, after its change log wrapped around
+ * and the names of some changed slots were lost.
+ * Returns -1 if the drain filled up first.
+ */
+static int arena_ns_rescan(state_ctx_t ctx, struct arena_ns *ns, struct drain *d)
+{
+	struct hash_node *hn;
+	subscription_t sub;
+	uint32_t i;
+	int slot, nslots, rv = 0;
+
+	pthread_mutex_lock(&ctx->mtx);
+
+	/* Pick up any slots that were created while the log was wrapping */
+	if (!LIST_EMPTY(&ns->an_unresolved) || !LIST_EMPTY(&ctx->prefixes)) {
+		nslots = arena_slot_count(ns->an_arena);
+		for (slot = 0; slot < nslots; slot++)
+			(void) subscription_lookup_slot_locked(ctx, ns, slot);
+	}
+	HASH_TABLE_FOREACH_ALL(hn, &ns->an_subs, i)
+	{
+		sub = hn->hn_data;
+		if (arena_validate(ns->an_arena, sub->sub_slot, sub->sub_seq))
+			continue;
+		if (drain_add(d, sub) < 0) {
+			rv = -1;
+			break;
+		}
+		sub->sub_stale = true;
+	}
+	pthread_mutex_unlock(&ctx->mtx);
+	return rv;
+}
+
+/*
+ * Add the subscriptions to slots listed in the change log of an arena.
+ * Returns 1 if changes were left behind because the drain is full.
+ */
+static int arena_ns_drain(state_ctx_t ctx, struct arena_ns *ns, struct drain *d)
+{
+	uint32_t slots[STATE_CHECK_BATCH];
+	subscription_t sub;
+	ssize_t i, nret, want;
+
+	do {
+		/* Each change uses at most one entry in the drain */
+		want = MIN(d->d_max - d->d_n, STATE_CHECK_BATCH);
+		if (want == 0)
+			return (arena_log_position(ns->an_arena) != ns->an_pos ||
+					ns->an_rescan) ? 1 : 0;
+		nret = arena_changes(ns->an_arena, &ns->an_pos, slots, want);
+		if (nret < 0) {
+			log_debug("the change log of %s overflowed",
+					arena_get_path(ns->an_arena));
+			ns->an_rescan = true;
+			break;
+		}
+		for (i = 0; i < nret; i++) {
+			sub = subscription_lookup_slot(ctx, ns, slots[i]);
+			if (sub == NULL)
+				continue;
+			sub->sub_stale = true;
+			(void) drain_add(d, sub);
+		}
+	} while (nret == want);
+
+	if (ns->an_rescan) {
+		if (arena_ns_rescan(ctx, ns, d) < 0)
+			return 1;
+		ns->an_rescan = false;
+	}
+	return 0;
+}
+
+/*
+ * Check every subscription to a state file, and every prefix, after the
+ * kernel lost events. Returns -1 if the drain filled up first.
+ */
+static int subscriptions_rescan(state_ctx_t ctx, struct drain *d)
+{
+	struct hash_node *hn;
+	subscription_t sub;
+	prefix_t ps;
+	size_t i;
+	int rv = 0;
+
+	pthread_mutex_lock(&ctx->mtx);
+	LIST_FOREACH(ps, &ctx->prefixes, ps_entry) {
+		ps->ps_rescan = true;
+	}
+	HASH_TABLE_FOREACH_ALL(hn, &ctx->subscriptions_by_wd, i)
+	{
+		sub = hn->hn_data;
+		if (sub->sub_drain == d->d_id ||
+				statefile_validate(&sub->sub_file, sub->sub_seq))
+			continue;
+		if (drain_add(d, sub) < 0) {
+			rv = -1;
+			break;
+		}
+		sub->sub_stale = true;
+	}
+	pthread_mutex_unlock(&ctx->mtx);
+	return rv;
+}
+
+/* If <wd> belongs to a directory watched for a prefix, flag it to be scanned */
+static bool prefix_lookup_wd(state_ctx_t ctx, int wd)
+{
+	prefix_t ps;
+	bool found = false;
+
+	pthread_mutex_lock(&ctx->mtx);
+	LIST_FOREACH(ps, &ctx->prefixes, ps_entry) {
+		if (ps->ps_wd == wd) {
+			ps->ps_rescan = true;
+			found = true;
+		}
+	}
+	pthread_mutex_unlock(&ctx->mtx);
+	return found;
+}
+
+/*
+ * Scan the directories that have changed for new files, and add those
+ * that have a value to the drain. <*kick> is set if some did not fit.
+ */
+static int prefix_drain(state_ctx_t ctx, struct drain *d, bool *kick)
+{
+	subscription_t sub;
+	prefix_t ps;
+	int rv = 0;
+
+	LIST_FOREACH(ps, &ctx->prefixes, ps_entry) {
+		if (ps->ps_rescan && prefix_scan(ctx, ps, true) < 0)
+			rv = -1;
+		pthread_mutex_lock(&ctx->mtx);
+		while ((sub = LIST_FIRST(&ps->ps_new)) != NULL) {
+			if (drain_add(d, sub) < 0) {
+				*kick = true;
+				break;
+			}
+			LIST_REMOVE(sub, sub_new_entry);
+			sub->sub_new = false;
+		}
+		pthread_mutex_unlock(&ctx->mtx);
+	}
+	return rv;
+}
+
+/* Replace the copy of the state held by a subscription. The caller must hold ctx->mtx */
+static int subscription_store(subscription_t sub, const char *value, size_t len)
+{
+	char *buf;
+
+	if (sub->sub_bufsz <= len) {
+		if ((buf = realloc(sub->sub_buf, len + 1)) == NULL) {
+			log_errno("realloc(3)");
+			return -1;
+		}
+		sub->sub_buf = buf;
+		sub->sub_bufsz = len + 1;
+	}
+	memcpy(sub->sub_buf, value, len);
+	sub->sub_buf[len] = '\0';
+	sub->sub_buflen = len;
+	sub->sub_seq += 2;
+	return 0;
+}
+
+/*
+ * Find the subscription that a notification from the broker is for.
+ * The caller must hold ctx->mtx
+ */
+static subscription_t broker_lookup_locked(state_ctx_t ctx, const char *name)
+{
+	subscription_t sub;
+	prefix_t ps;
+
+	sub = subscription_lookup_locked(ctx, name);
+	if (sub == NULL && (ps = prefix_match_locked(ctx, NULL, name)) != NULL)
+		sub = prefix_add_child_locked(ctx, ps, name, -1);
+	return sub;
+}
+
+/*
+ * Receive the notifications sent by the broker, and add the subscriptions
+ * they are for to the drain. Returns 1 if some were left behind because
+ * the drain is full, or -1 if an error occurs.
+ */
+static int broker_drain(state_ctx_t ctx, struct drain *d)
+{
+	struct broker_msg msg;
+	subscription_t sub;
+	char name[BROKER_NAME_MAX + 1];
+	char *p;
+	size_t need;
+	ssize_t nret;
+	int rv = 0;
+
+	for (;;) {
+		/* Handle every complete message in the buffer */
+		while (ctx->broker_len - ctx->broker_off >= sizeof(msg)) {
+			p = ctx->broker_buf + ctx->broker_off;
+			memcpy(&msg, p, sizeof(msg));
+			if (msg.bm_type != BROKER_NOTIFY || msg.bm_namelen == 0 ||
+					msg.bm_namelen > BROKER_NAME_MAX ||
+					msg.bm_namelen > msg.bm_len) {
+				log_error("received a malformed message from the broker");
+				return -1;
+			}
+			need = sizeof(msg) + msg.bm_len;
+			if (ctx->broker_len - ctx->broker_off < need)
+				break;
+			memcpy(name, p + sizeof(msg), msg.bm_namelen);
+			name[msg.bm_namelen] = '\0';
+
+			/* state_get() and state_peek() copy the value under the lock */
+			pthread_mutex_lock(&ctx->mtx);
+			if ((sub = broker_lookup_locked(ctx, name)) != NULL) {
+				if (drain_add(d, sub) < 0) {
+					pthread_mutex_unlock(&ctx->mtx);
+					return 1;
+				}
+				if (subscription_store(sub, p + sizeof(msg) + msg.bm_namelen,
+						msg.bm_len - msg.bm_namelen) < 0) {
+					sub->sub_error = true;
+					rv = -1;
+				}
+			}
+			pthread_mutex_unlock(&ctx->mtx);
+			ctx->broker_off += need;
+		}
+
+		/* Keep the partial message, and make sure that it will fit */
+		p = ctx->broker_buf;
+		if (ctx->broker_off > 0)
+			memmove(p, p + ctx->broker_off,
+					ctx->broker_len - ctx->broker_off);
+		ctx->broker_len -= ctx->broker_off;
+		ctx->broker_off = 0;
+		need = BROKER_BUFSZ;
+		if (ctx->broker_len >= sizeof(msg)) {
+			memcpy(&msg, p, sizeof(msg));
+			if (need < sizeof(msg) + msg.bm_len)
+				need = sizeof(msg) + msg.bm_len;
+		}
+		if (need > ctx->broker_size) {
+			if ((p = realloc(p, need)) == NULL) {
+				log_errno("realloc(3)");
+				return -1;
+			}
+			ctx->broker_buf = p;
+			ctx->broker_size = need;
+		}
+
+		nret = recv(ctx->broker_fd, p + ctx->broker_len,
+				ctx->broker_size - ctx->broker_len,
+				MSG_DONTWAIT);
+		if (nret < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN)
+				break;
+			log_errno("recv(2)");
+			return -1;
+		}
+		if (nret == 0) {
+			log_error("the broker closed the connection");
+			return -1;
+		}
+		ctx->broker_len += nret;
+	}
+	return rv;
+}
+
+/*
+ * Return the pending notifications, after waiting up to <timeout_ms> for
+ * the first of them. The wait is done by watch_wait(), which is a single
+ * kevent(2) with kqueue, but epoll_wait(2) followed by read(2) on Linux.
+ */
+static ssize_t check_many(state_ctx_t ctx, struct state_event *evs, size_t max,
+		int timeout_ms)
+{
+	struct watch_event wev[STATE_CHECK_BATCH];
+	struct drain d;
+	subscription_t sub;
+	ssize_t i, nret, want;
+	size_t j, nevents = 0;
+	bool failed = false, kick = false;
+
+	if (evs == NULL || max == 0)
+		return -1;
+
+	/* The previous call handed out pointers into these, so free them now */
+	subscription_reap(ctx);
+
+	d.d_subs = calloc(max, sizeof(*d.d_subs));
+	if (d.d_subs == NULL) {
+		log_errno("calloc(3)");
+		return -1;
+	}
+	d.d_n = 0;
+	d.d_max = max;
+	d.d_coalesce = (ctx->flags & STATE_COALESCE) != 0;
+	d.d_id = ++ctx->drain;
+
+	/*
+	 * Another thread may unsubscribe while the subscriptions in the drain
+	 * are being used, and they are freed through epoch_retire()
+	 */
+	if (epoch_enter() < 0) {
+		free(d.d_subs);
+		return -1;
+	}
+
+	/*
+	 * Never ask for more events than there are free slots in <evs>.
+	 * When coalescing, events for a subscription that already has a slot
+	 * do not use up a new one, so keep reading until the queue is empty.
+	 */
+	do {
+		want = MIN(max - d.d_n, STATE_CHECK_BATCH);
+		if (timeout_ms != 0) {
+			nret = watch_wait(ctx->watch, wev, want, timeout_ms);
+			timeout_ms = 0;
+		} else {
+			nret = watch_read(ctx->watch, wev, want);
+		}
+		if (nret < 0) {
+			failed = true;
+			break;
+		}
+		nevents += nret;
+		for (i = 0; i < nret; i++) {
+			if (wev[i].we_ident == WATCH_OVERFLOW) {
+				ctx->rescan = true;
+				continue;
+			}
+
+			/* Arenas are checked below, whether or not they had an event */
+			if (wev[i].we_ident == ctx->arenas[ARENA_NS_SYSTEM].an_wd ||
+					wev[i].we_ident == ctx->arenas[ARENA_NS_USER].an_wd)
+				continue;
+
+			sub = subscription_lookup_wd(ctx, wev[i].we_ident);
+			if (sub == NULL && prefix_lookup_wd(ctx, wev[i].we_ident))
+				continue;
+
+			/* inotify(7) may still deliver events queued before a watch was removed */
+			if (sub == NULL) {
+				log_debug("ignoring an event for watch %d which is not "
+						"associated with a subscription", wev[i].we_ident);
+				continue;
+			}
+			if (wev[i].we_written) {
+				log_debug("watch %d written", wev[i].we_ident);
+				sub->sub_stale = true;
+			}
+			if (wev[i].we_deleted || (wev[i].we_attrib &&
+					statefile_unlinked(&sub->sub_file) == 1)) {
+				log_debug("state file %s was deleted; removing subscription", sub->sub_path);
+				/* The watch only ends by itself once the file is closed */
+				if (!wev[i].we_deleted)
+					(void) watch_remove(ctx->watch, sub->sub_wd);
+				pthread_mutex_lock(&ctx->mtx);
+				subscription_remove_locked(ctx, sub);
+				SLIST_INSERT_HEAD(&ctx->dead_subscriptions, sub,
+						sub_dead_entry);
+				pthread_mutex_unlock(&ctx->mtx);
+			}
+			(void) drain_add(&d, sub);
+		}
+	} while (nret == want && d.d_n < max && nevents < STATE_COALESCE_MAX_EVENTS);
+
+	/* Keep rescanning on later calls until everything fits */
+	if (ctx->rescan) {
+		if (subscriptions_rescan(ctx, &d) < 0)
+			kick = true;
+		else
+			ctx->rescan = false;
+	}
+	for (j = 0; j < 2; j++) {
+		if (ctx->arenas[j].an_wd >= 0 &&
+				arena_ns_drain(ctx, &ctx->arenas[j], &d) > 0)
+			kick = true;
+	}
+	if (prefix_drain(ctx, &d, &kick) < 0)
+		failed = true;
+	if (ctx->broker_fd >= 0) {
+		switch (broker_drain(ctx, &d)) {
+		case -1:
+			failed = true;
+			break;
+		case 1:
+			kick = true;
+			break;
+		}
+	}
+
+	/* Keep the event fd readable until the arenas have been drained */
+	if (kick && watch_kick(ctx->watch) < 0)
+		failed = true;
+
+	/* Read each changed state file once, no matter how many events it had */
+	for (j = 0; j < d.d_n; j++) {
+		sub = d.d_subs[j];
+		if (sub->sub_stale) {
+			sub->sub_stale = false;
+			if (subscription_update(ctx, sub) < 0) {
+				log_error("failed to update the state of %s", sub->sub_name);
+				sub->sub_error = true;
+				failed = true;
+			}
+		}
+	}
+
+	/*
+	 * Fill in the values only after every update is done, because the
+	 * buffer of a subscription may be reallocated by the update.
+	 */
+	for (i = 0, j = 0; j < d.d_n; j++) {
+		sub = d.d_subs[j];
+		if (sub->sub_error)
+			continue;
+		evs[i].key = sub->sub_name;
+		if (sub->sub_buf) {
+			evs[i].value = sub->sub_buf;
+			evs[i].len = sub->sub_buflen;
+		} else {
+			evs[i].value = NULL;
+			evs[i].len = 0;
+		}
+		i++;
+	}
+	epoch_exit();
+	free(d.d_subs);
+
+	if (i == 0) {
+		if (failed)
+			return -1;
+		log_debug("no events were pending");
+	}
+	return i;
+}
+
+ssize_t state_ctx_check_many(state_ctx_t ctx, struct state_event *evs, size_t max)
+{
+	return check_many(ctx, evs, max, 0);
+}
+
+ssize_t state_ctx_wait(state_ctx_t ctx, struct state_event *evs, size_t max,
+		int timeout_ms)
+{
+	uint64_t deadline = 0, now;
+	ssize_t nret;
+
+	if (timeout_ms > 0)
+		deadline = monotonic_ns() + (uint64_t) timeout_ms * 1000000;
+	for (;;) {
+		nret = check_many(ctx, evs, max, timeout_ms);
+		if (nret != 0 || timeout_ms == 0)
+			return nret;
+
+		/* The wakeup was for something that produced no notification */
+		if (timeout_ms > 0) {
+			now = monotonic_ns();
+			if (now >= deadline)
+				return 0;
+			timeout_ms = (deadline - now + 999999) / 1000000;
+		}
+	}
+}
+
+ssize_t state_ctx_check(state_ctx_t ctx, char **key, char **value)
+{
+	struct state_event ev;
+	ssize_t nret;
+
+	if (key == NULL || value == NULL)
+		return -1;
+
+	nret = state_ctx_check_many(ctx, &ev, 1);
+	if (nret <= 0) {
+		*key = NULL;
+		*value = NULL;
+		return nret;
+	}
+
+	*key = ev.key;
+	*value = ev.value;
+	return ev.len;
+}
+
+/* Subscribe to a name or prefix, and register a callback for it */
+static int dispatch_register(state_ctx_t ctx, const char *name, bool prefix,
+		void *context, state_callback_f func)
+{
+	dispatch_t d;
+	bool subscribed;
+	subscription_t sub;
+
+	if (name == NULL || func == NULL)
+		return -1;
+
+	pthread_mutex_lock(&ctx->mtx);
+	if (ctx->dispatch == NULL)
+		ctx->dispatch = dispatch_new(ctx, DISPATCH_THREADS);
+	d = ctx->dispatch;
+	if (prefix) {
+		subscribed = prefix_lookup_locked(ctx, name) != NULL;
+	} else {
+		sub = subscription_lookup_locked(ctx, name);
+		subscribed = sub != NULL && sub->sub_prefix == NULL;
+	}
+	pthread_mutex_unlock(&ctx->mtx);
+	if (d == NULL)
+		return -1;
+
+	/* Register first, so the first notification is not discarded */
+	if (dispatch_add(d, name, prefix, func, context) < 0)
+		return -1;
+	if (subscribed)
+		return 0;
+	if ((prefix ? state_ctx_subscribe_prefix(ctx, name) :
+			state_ctx_subscribe(ctx, name)) < 0) {
+		(void) dispatch_remove(d, name);
+		return -1;
+	}
+	return 0;
+}
+
+int state_ctx_dispatch_f(state_ctx_t ctx, const char *name, void *context,
+		state_callback_f func)
+{
+	return dispatch_register(ctx, name, false, context, func);
+}
+
+int state_ctx_dispatch_prefix_f(state_ctx_t ctx, const char *prefix,
+		void *context, state_callback_f func)
+{
+	return dispatch_register(ctx, prefix, true, context, func);
+}
+
+int state_ctx_dispatch_cancel(state_ctx_t ctx, const char *name)
+{
+	dispatch_t d;
+
+	pthread_mutex_lock(&ctx->mtx);
+	d = ctx->dispatch;
+	pthread_mutex_unlock(&ctx->mtx);
+	if (d == NULL || name == NULL)
+		return -1;
+	return dispatch_remove(d, name);
+}
+
+/* Read every state file in <dir> whose name begins with <prefix> */
+static ssize_t snapshot_dir(const char *dir, const char *dir_prefix,
+		const char *prefix, state_callback_f func, void *context)
+{
+	DIR *dirp;
+	struct dirent *ent;
+	struct statefile sf;
+	char *name, *buf = NULL;
+	size_t bufsz = 0, plen = strlen(prefix);
+	uint32_t seq;
+	ssize_t len, count = 0;
+
+	if ((dirp = opendir(dir)) == NULL) {
+		if (errno == ENOENT)
+			return 0;
+		log_errno("opendir(3) of %s", dir);
+		return -1;
+	}
+	while ((ent = readdir(dirp)) != NULL) {
+		if (ent->d_name[0] == '.')
+			continue;
+		if (asprintf(&name, "%s%s", dir_prefix, ent->d_name) < 0) {
+			count = -1;
+			break;
+		}
+		if (strncmp(name, prefix, plen) == 0) {
+			statefile_init(&sf);
+			if (statefile_open_existing(&sf, dirfd(dirp), ent->d_name) == 0 &&
+					(len = statefile_read(&sf, &buf, &bufsz, &seq)) >= 0) {
+				func(context, name, buf, len);
+				count++;
+			}
+			statefile_close(&sf);
+		}
+		free(name);
+	}
+	(void) closedir(dirp);
+	free(buf);
+	return count;
+}
+
+/* Read every slot in the arena that holds <ns_name> whose name begins with <prefix> */
+static ssize_t snapshot_arena(state_ctx_t ctx, const char *ns_name,
+		const char *prefix, state_callback_f func, void *context)
+{
+	struct arena_ns *ns;
+	char name[ARENA_NAME_MAX], *buf = NULL;
+	size_t bufsz = 0, plen = strlen(prefix);
+	uint32_t seq;
+	ssize_t len, count = 0;
+	int slot, nslots;
+
+	if ((ns = arena_ns_get(ctx, ns_name)) == NULL)
+		return -1;
+	nslots = arena_slot_count(ns->an_arena);
+	for (slot = 0; slot < nslots; slot++) {
+		if (arena_slot_name(ns->an_arena, slot, name) < 0 ||
+				strncmp(name, prefix, plen) != 0)
+			continue;
+		if ((len = arena_read(ns->an_arena, slot, &buf, &bufsz, &seq)) < 0)
+			continue;
+		func(context, name, buf, len);
+		count++;
+	}
+	free(buf);
+	return count;
+}
+
+ssize_t state_ctx_snapshot(state_ctx_t ctx, const char *prefix,
+		state_callback_f func, void *context)
+{
+	const char *user = "user.";
+	ssize_t n, count = 0;
+
+	if (func == NULL)
+		return -1;
+	if (prefix == NULL)
+		prefix = "";
+	if (ctx->flags & STATE_BROKER) {
+		log_error("snapshots are not supported by the broker");
+		return -1;
+	}
+
+	/* The system namespace holds every name that does not begin with "user." */
+	if (!name_is_user(prefix)) {
+		if (ctx->flags & STATE_ARENA)
+			n = snapshot_arena(ctx, "", prefix, func, context);
+		else
+			n = snapshot_dir(STATE_PREFIX, "", prefix, func, context);
+		if (n < 0)
+			return -1;
+		count += n;
+	}
+	if (strncmp(prefix, user, MIN(strlen(prefix), strlen(user))) == 0) {
+		if (ctx->flags & STATE_ARENA)
+			n = snapshot_arena(ctx, user, prefix, func, context);
+		else
+			n = snapshot_dir(ctx->userstatedir, user, prefix, func, context);
+		if (n < 0)
+			return -1;
+		count += n;
+	}
+	return count;
+}
+
+int state_ctx_get_stats(state_ctx_t ctx, struct state_stats *stats)
+{
+	if (!ctx->initialized || stats == NULL)
+		return -1;
+	pthread_mutex_lock(&ctx->mtx);
+	stats->published = __atomic_load_n(&ctx->published,
+			__ATOMIC_RELAXED);
+	stats->suppressed = ctx->suppressed;
+	pthread_mutex_unlock(&ctx->mtx);
+	return 0;
+}
+
+int state_ctx_get_event_fd(state_ctx_t ctx)
+{
+	if (!ctx->initialized)
+		return -1;
+	return watch_get_fd(ctx->watch);
+}
+
+/* The original API, which uses the default context */
+
+int state_bind(const char *name)
+{
+	return state_ctx_bind(&state_default_ctx, name);
+}
+
+int state_bind_throttled(const char *name, unsigned int max_rate,
+		unsigned int debounce_ms)
+{
+	return state_ctx_bind_throttled(&state_default_ctx, name, max_rate,
+			debounce_ms);
+}
+
+state_counter_t state_bind_counter(const char *name, unsigned int sample_hz)
+{
+	return state_ctx_bind_counter(&state_default_ctx, name, sample_hz);
+}
+
+int state_bind_reserved(const char *name, size_t capacity)
+{
+	return state_ctx_bind_reserved(&state_default_ctx, name, capacity);
+}
+
+ssize_t state_get_range(const char *key, size_t off, size_t len, void *buf)
+{
+	return state_ctx_get_range(&state_default_ctx, key, off, len, buf);
+}
+
+ssize_t state_snapshot(const char *prefix, state_callback_f func, void *context)
+{
+	return state_ctx_snapshot(&state_default_ctx, prefix, func, context);
+}
+
+int state_bind_history(const char *name, unsigned int depth)
+{
+	return state_ctx_bind_history(&state_default_ctx, name, depth);
+}
+
+ssize_t state_check_history(const char *name, uint64_t *seq,
+		struct state_transition *ts, size_t max)
+{
+	return state_ctx_check_history(&state_default_ctx, name, seq, ts, max);
+}
+
+int state_unbind(const char *name)
+{
+	return state_ctx_unbind(&state_default_ctx, name);
+}
+
+int state_subscribe(const char *name)
+{
+	return state_ctx_subscribe(&state_default_ctx, name);
+}
+
+int state_unsubscribe(const char *name)
+{
+	return state_ctx_unsubscribe(&state_default_ctx, name);
+}
+
+int state_subscribe_prefix(const char *prefix)
+{
+	return state_ctx_subscribe_prefix(&state_default_ctx, prefix);
+}
+
+int state_unsubscribe_prefix(const char *prefix)
+{
+	return state_ctx_unsubscribe_prefix(&state_default_ctx, prefix);
+}
+
+int state_publish(const char *name, const char *state, size_t len)
+{
+	return state_ctx_publish(&state_default_ctx, name, state, len);
+}
+
+int state_publish_multi(const struct state_value *values, size_t n)
+{
+	return state_ctx_publish_multi(&state_default_ctx, values, n);
+}
+
+int state_get(const char *key, char **value)
+{
+	return state_ctx_get(&state_default_ctx, key, value);
+}
+
+int state_get_if_changed(const char *key, unsigned int *gen, char **value)
+{
+	return state_ctx_get_if_changed(&state_default_ctx, key, gen, value);
+}
+
+ssize_t state_peek(const char *key, const char **value, unsigned int *seq)
+{
+	return state_ctx_peek(&state_default_ctx, key, value, seq);
+}
+
+int state_peek_valid(const char *key, unsigned int seq)
+{
+	return state_ctx_peek_valid(&state_default_ctx, key, seq);
+}
+
+ssize_t state_check_many(struct state_event *evs, size_t max)
+{
+	return state_ctx_check_many(&state_default_ctx, evs, max);
+}
+
+ssize_t state_wait(struct state_event *evs, size_t max, int timeout_ms)
+{
+	return state_ctx_wait(&state_default_ctx, evs, max, timeout_ms);
+}
+
+ssize_t state_check(char **key, char **value)
+{
+	return state_ctx_check(&state_default_ctx, key, value);
+}
+
+int state_get_stats(struct state_stats *stats)
+{
+	return state_ctx_get_stats(&state_default_ctx, stats);
 }
 
 int state_get_event_fd(void)
 {
-	return libstate_data.kqfd;
+	return state_ctx_get_event_fd(&state_default_ctx);
+}
+
+int state_dispatch_f(const char *name, void *context, state_callback_f func)
+{
+	return state_ctx_dispatch_f(&state_default_ctx, name, context, func);
+}
+
+int state_dispatch_prefix_f(const char *prefix, void *context,
+		state_callback_f func)
+{
+	return state_ctx_dispatch_prefix_f(&state_default_ctx, prefix, context,
+			func);
+}
+
+int state_dispatch_cancel(const char *name)
+{
+	return state_ctx_dispatch_cancel(&state_default_ctx, name);
 }
@@ -0,0 +1,84 @@
+/*
+ * Copyright (c) 2015 Mark Heily <mark@heily.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef COUNTER_H_
+#define COUNTER_H_
+
+#include <stdint.h>
+
+#include "include/state.h"
+
+/*
+ * The payload of a STATE_TYPE_COUNTER is a little-endian integer that is
+ * updated in place, so it is always accessed atomically. It is aligned
+ * to 8 bytes in both state files and arenas.
+ */
+
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define COUNTER_SWAP(v)	(v)
+#else
+#define COUNTER_SWAP(v)	__builtin_bswap64(v)
+#endif
+
+static inline int64_t counter_load(const void *p)
+{
+	return (int64_t) COUNTER_SWAP(__atomic_load_n((const uint64_t *) p,
+			__ATOMIC_RELAXED));
+}
+
+static inline void counter_store(void *p, int64_t value)
+{
+	__atomic_store_n((uint64_t *) p, COUNTER_SWAP((uint64_t) value),
+			__ATOMIC_RELAXED);
+}
+
+/* Returns the new value */
+static inline int64_t counter_add(void *p, int64_t delta)
+{
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	return (int64_t) (__atomic_add_fetch((uint64_t *) p, (uint64_t) delta,
+			__ATOMIC_RELAXED));
+#else
+	uint64_t old, new;
+
+	old = __atomic_load_n((uint64_t *) p, __ATOMIC_RELAXED);
+	do {
+		new = COUNTER_SWAP(COUNTER_SWAP(old) + (uint64_t) delta);
+	} while (!__atomic_compare_exchange_n((uint64_t *) p, &old, new, true,
+			__ATOMIC_RELAXED, __ATOMIC_RELAXED));
+	return (int64_t) COUNTER_SWAP(new);
+#endif
+}
+
+/* The size of an encoded counter */
+#define COUNTER_SIZE	(STATE_TYPED_HEADER + 8)
+
+/* Encode a counter into <buf>, which must hold COUNTER_SIZE bytes */
+static inline void counter_encode(char *buf, int64_t value)
+{
+	int i;
+
+	buf[0] = '\0';
+	buf[1] = 'T';
+	buf[2] = STATE_TYPED_VERSION;
+	buf[3] = STATE_TYPE_COUNTER;
+	for (i = 0; i < 4; i++)
+		buf[4 + i] = (char) ((COUNTER_SIZE - STATE_TYPED_HEADER) >> (8 * i));
+	for (i = 0; i < 8; i++)
+		buf[STATE_TYPED_HEADER + i] = (char) ((uint64_t) value >> (8 * i));
+}
+
+#endif /* COUNTER_H_ */
@@ -0,0 +1,471 @@
+/*
+ * Copyright (c) 2015 Mark Heily <mark@heily.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/queue.h>
+#include <unistd.h>
+
+#include "dispatch.h"
+#include "epoch.h"
+#include "hash.h"
+#include "log.h"
+
+/* A function registered by dispatch_add() */
+struct dispatch_callback {
+	struct hash_node dc_node;	/* In d_names, unless it is for a prefix */
+	LIST_ENTRY(dispatch_callback) dc_prefix_entry;	/* In d_prefixes */
+	char	*dc_name;
+	size_t	 dc_len;
+	bool	 dc_prefix;
+	bool	 dc_removed;	/* dispatch_remove() is waiting for calls to finish */
+	state_callback_f dc_func;
+	void	*dc_context;
+	unsigned int dc_refs;	/* One while registered, and one per call in progress */
+};
+
+/* A copy of one notification */
+struct dispatch_event {
+	STAILQ_ENTRY(dispatch_event) de_entry;
+	char	*de_value;	/* NULL if the name has no value */
+	ssize_t	 de_len;
+};
+
+/* The notifications for one name that have not been delivered yet */
+struct dispatch_key {
+	struct hash_node dk_node;	/* In d_keys */
+	TAILQ_ENTRY(dispatch_key) dk_ready_entry;	/* In d_ready */
+	char	*dk_name;
+	STAILQ_HEAD(, dispatch_event) dk_events;
+	bool	 dk_running;	/* A worker is calling the callbacks */
+};
+
+struct dispatch_s {
+	state_ctx_t d_ctx;
+	pthread_mutex_t d_mtx;
+	pthread_cond_t d_cond;	/* Signalled when there is work, or a call finished */
+	struct hash_table d_names;	/* Callbacks for a single name */
+	LIST_HEAD(, dispatch_callback) d_prefixes;	/* Callbacks for a prefix */
+	struct hash_table d_keys;	/* Pending notifications by name */
+	TAILQ_HEAD(, dispatch_key) d_ready;	/* Keys with events and no worker */
+	pthread_t *d_threads;
+	unsigned int d_nthreads;
+	int	 d_wake[2];	/* A pipe to interrupt the worker in poll(2) */
+	bool	 d_polling;	/* A worker is waiting on the event fd */
+	bool	 d_stop;
+};
+
+/* The dispatcher that the current thread is a worker for */
+static __thread dispatch_t dispatch_self;
+
+static struct dispatch_callback *callback_find_locked(dispatch_t d,
+		const char *name, bool prefix)
+{
+	struct dispatch_callback *dc;
+	struct hash_node *hn;
+	uint32_t hash;
+
+	if (prefix) {
+		LIST_FOREACH(dc, &d->d_prefixes, dc_prefix_entry) {
+			if (strcmp(dc->dc_name, name) == 0)
+				return dc;
+		}
+		return NULL;
+	}
+	hash = hash_string(name);
+	HASH_TABLE_FOREACH(hn, &d->d_names, hash) {
+		dc = hn->hn_data;
+		if (hn->hn_hash == hash && strcmp(dc->dc_name, name) == 0)
+			return dc;
+	}
+	return NULL;
+}
+
+/* The callback for a name is the one registered for it, or for its longest prefix */
+static struct dispatch_callback *callback_lookup_locked(dispatch_t d,
+		const char *name)
+{
+	struct dispatch_callback *dc, *best = NULL;
+
+	if ((dc = callback_find_locked(d, name, false)) != NULL)
+		return dc;
+	LIST_FOREACH(dc, &d->d_prefixes, dc_prefix_entry) {
+		if (strncmp(dc->dc_name, name, dc->dc_len) == 0 &&
+				(best == NULL || dc->dc_len > best->dc_len))
+			best = dc;
+	}
+	return best;
+}
+
+static void callback_release_locked(struct dispatch_callback *dc)
+{
+	if (--dc->dc_refs > 0)
+		return;
+	free(dc->dc_name);
+	free(dc);
+}
+
+static struct dispatch_key *key_lookup_locked(dispatch_t d, const char *name,
+		uint32_t hash)
+{
+	struct dispatch_key *dk;
+	struct hash_node *hn;
+
+	HASH_TABLE_FOREACH(hn, &d->d_keys, hash) {
+		dk = hn->hn_data;
+		if (hn->hn_hash == hash && strcmp(dk->dk_name, name) == 0)
+			return dk;
+	}
+	return NULL;
+}
+
+static void key_free(struct dispatch_key *dk)
+{
+	struct dispatch_event *de;
+
+	while ((de = STAILQ_FIRST(&dk->dk_events)) != NULL) {
+		STAILQ_REMOVE_HEAD(&dk->dk_events, de_entry);
+		free(de->de_value);
+		free(de);
+	}
+	free(dk->dk_name);
+	free(dk);
+}
+
+/* Copy a notification onto the queue for its name */
+static int dispatch_enqueue_locked(dispatch_t d, const struct state_event *ev)
+{
+	struct dispatch_key *dk;
+	struct dispatch_event *de;
+	uint32_t hash;
+
+	/* Nobody wants it */
+	if (callback_lookup_locked(d, ev->key) == NULL)
+		return 0;
+
+	if ((de = calloc(1, sizeof(*de))) == NULL)
+		goto err_out;
+	if (ev->value) {
+		if ((de->de_value = malloc(ev->len + 1)) == NULL)
+			goto err_out;
+		memcpy(de->de_value, ev->value, ev->len + 1);
+		de->de_len = ev->len;
+	}
+
+	hash = hash_string(ev->key);
+	dk = key_lookup_locked(d, ev->key, hash);
+	if (dk == NULL) {
+		if ((dk = calloc(1, sizeof(*dk))) == NULL)
+			goto err_out;
+		if ((dk->dk_name = strdup(ev->key)) == NULL) {
+			free(dk);
+			goto err_out;
+		}
+		STAILQ_INIT(&dk->dk_events);
+		hash_table_insert(&d->d_keys, &dk->dk_node, hash, dk);
+	}
+	if (STAILQ_EMPTY(&dk->dk_events) && !dk->dk_running)
+		TAILQ_INSERT_TAIL(&d->d_ready, dk, dk_ready_entry);
+	STAILQ_INSERT_TAIL(&dk->dk_events, de, de_entry);
+	return 0;
+
+err_out:
+	log_errno("unable to queue a notification for %s", ev->key);
+	if (de)
+		free(de->de_value);
+	free(de);
+	return -1;
+}
+
+/*
+ * Call the callbacks for up to DISPATCH_BATCH notifications of a name, in
+ * the order they arrived. Other workers may queue more of them meanwhile.
+ */
+static void dispatch_run_locked(dispatch_t d, struct dispatch_key *dk)
+{
+	struct dispatch_callback *dc;
+	struct dispatch_event *de;
+	state_callback_f func;
+	void *context;
+	bool removed;
+	int i;
+
+	TAILQ_REMOVE(&d->d_ready, dk, dk_ready_entry);
+	dk->dk_running = true;
+	for (i = 0; i < DISPATCH_BATCH && !d->d_stop; i++) {
+		if ((de = STAILQ_FIRST(&dk->dk_events)) == NULL)
+			break;
+		STAILQ_REMOVE_HEAD(&dk->dk_events, de_entry);
+		if ((dc = callback_lookup_locked(d, dk->dk_name)) != NULL) {
+			dc->dc_refs++;
+			func = dc->dc_func;
+			context = dc->dc_context;
+			pthread_mutex_unlock(&d->d_mtx);
+
+			func(context, dk->dk_name, de->de_value, de->de_len);
+
+			pthread_mutex_lock(&d->d_mtx);
+			removed = dc->dc_removed;
+			callback_release_locked(dc);
+			if (removed)
+				pthread_cond_broadcast(&d->d_cond);
+		}
+		free(de->de_value);
+		free(de);
+	}
+	dk->dk_running = false;
+
+	/* Let the other names have a turn before running this one again */
+	if (STAILQ_EMPTY(&dk->dk_events)) {
+		hash_table_remove(&d->d_keys, &dk->dk_node);
+		key_free(dk);
+	} else {
+		TAILQ_INSERT_TAIL(&d->d_ready, dk, dk_ready_entry);
+	}
+}
+
+/* Wait for notifications. Returns 1 if some are pending. */
+static int dispatch_poll(dispatch_t d)
+{
+	struct pollfd pfd[2];
+	char buf[64];
+
+	if ((pfd[0].fd = state_ctx_get_event_fd(d->d_ctx)) < 0)
+		return -1;
+	pfd[0].events = POLLIN;
+	pfd[1].fd = d->d_wake[0];
+	pfd[1].events = POLLIN;
+	if (poll(pfd, 2, -1) < 0) {
+		if (errno == EINTR)
+			return 0;
+		log_errno("poll(2)");
+		return -1;
+	}
+	if (pfd[1].revents & POLLIN) {
+		while (read(d->d_wake[0], buf, sizeof(buf)) > 0)
+			;
+	}
+	return (pfd[0].revents & POLLIN) ? 1 : 0;
+}
+
+static void *dispatch_worker(void *arg)
+{
+	dispatch_t d = arg;
+	struct state_event evs[DISPATCH_BATCH];
+	struct dispatch_key *dk;
+	ssize_t i, nret;
+
+	dispatch_self = d;
+	pthread_mutex_lock(&d->d_mtx);
+	while (!d->d_stop) {
+		if ((dk = TAILQ_FIRST(&d->d_ready)) != NULL) {
+			dispatch_run_locked(d, dk);
+		} else if (!d->d_polling) {
+			/*
+			 * Only one worker reads notifications at a time, so the
+			 * strings in <evs> stay valid until they are copied.
+			 */
+			d->d_polling = true;
+			pthread_mutex_unlock(&d->d_mtx);
+			if (dispatch_poll(d) <= 0 || epoch_enter() < 0) {
+				pthread_mutex_lock(&d->d_mtx);
+				d->d_polling = false;
+				pthread_cond_broadcast(&d->d_cond);
+				continue;
+			}
+
+			/* The epoch keeps <evs> valid if the application unsubscribes */
+			nret = state_ctx_check_many(d->d_ctx, evs, DISPATCH_BATCH);
+			pthread_mutex_lock(&d->d_mtx);
+			for (i = 0; i < nret; i++)
+				(void) dispatch_enqueue_locked(d, &evs[i]);
+			epoch_exit();
+			if (nret < 0) {
+				/* Do not spin if the error keeps happening */
+				pthread_mutex_unlock(&d->d_mtx);
+				log_error("failed to check for notifications");
+				(void) usleep(100000);
+				pthread_mutex_lock(&d->d_mtx);
+			}
+			d->d_polling = false;
+			pthread_cond_broadcast(&d->d_cond);
+		} else {
+			pthread_cond_wait(&d->d_cond, &d->d_mtx);
+		}
+	}
+	pthread_mutex_unlock(&d->d_mtx);
+	return NULL;
+}
+
+dispatch_t dispatch_new(state_ctx_t ctx, unsigned int nthreads)
+{
+	dispatch_t d;
+	int i;
+
+	if ((d = calloc(1, sizeof(*d))) == NULL) {
+		log_errno("calloc(3)");
+		return NULL;
+	}
+	d->d_ctx = ctx;
+	d->d_wake[0] = d->d_wake[1] = -1;
+	LIST_INIT(&d->d_prefixes);
+	TAILQ_INIT(&d->d_ready);
+	pthread_mutex_init(&d->d_mtx, NULL);
+	pthread_cond_init(&d->d_cond, NULL);
+	if (hash_table_init(&d->d_names) < 0 || hash_table_init(&d->d_keys) < 0) {
+		log_errno("hash_table_init");
+		goto err_out;
+	}
+	if (pipe(d->d_wake) < 0) {
+		log_errno("pipe(2)");
+		goto err_out;
+	}
+	for (i = 0; i < 2; i++) {
+		if (fcntl(d->d_wake[i], F_SETFL, O_NONBLOCK) < 0 ||
+				fcntl(d->d_wake[i], F_SETFD, FD_CLOEXEC) < 0) {
+			log_errno("fcntl(2)");
+			goto err_out;
+		}
+	}
+	if ((d->d_threads = calloc(nthreads, sizeof(pthread_t))) == NULL) {
+		log_errno("calloc(3)");
+		goto err_out;
+	}
+	for (; d->d_nthreads < nthreads; d->d_nthreads++) {
+		if (pthread_create(&d->d_threads[d->d_nthreads], NULL,
+				dispatch_worker, d) != 0) {
+			log_error("unable to create a dispatch thread");
+			goto err_out;
+		}
+	}
+	return d;
+
+err_out:
+	dispatch_free(d);
+	return NULL;
+}
+
+void dispatch_free(dispatch_t d)
+{
+	struct dispatch_callback *dc;
+	struct hash_node *hn;
+	unsigned int i;
+	size_t j;
+
+	if (d == NULL)
+		return;
+
+	pthread_mutex_lock(&d->d_mtx);
+	d->d_stop = true;
+	pthread_cond_broadcast(&d->d_cond);
+	pthread_mutex_unlock(&d->d_mtx);
+	if (d->d_wake[1] >= 0)
+		(void) write(d->d_wake[1], "", 1);
+	for (i = 0; i < d->d_nthreads; i++)
+		(void) pthread_join(d->d_threads[i], NULL);
+	free(d->d_threads);
+
+	if (d->d_keys.ht_buckets) {
+		HASH_TABLE_DRAIN(hn, &d->d_keys, j) {
+			key_free(hn->hn_data);
+		}
+	}
+	if (d->d_names.ht_buckets) {
+		HASH_TABLE_DRAIN(hn, &d->d_names, j) {
+			callback_release_locked(hn->hn_data);
+		}
+	}
+	while ((dc = LIST_FIRST(&d->d_prefixes)) != NULL) {
+		LIST_REMOVE(dc, dc_prefix_entry);
+		callback_release_locked(dc);
+	}
+	hash_table_free(&d->d_keys);
+	hash_table_free(&d->d_names);
+	for (i = 0; i < 2; i++) {
+		if (d->d_wake[i] >= 0)
+			(void) close(d->d_wake[i]);
+	}
+	(void) pthread_cond_destroy(&d->d_cond);
+	(void) pthread_mutex_destroy(&d->d_mtx);
+	free(d);
+}
+
+int dispatch_add(dispatch_t d, const char *name, bool prefix,
+		state_callback_f func, void *context)
+{
+	struct dispatch_callback *dc;
+
+	pthread_mutex_lock(&d->d_mtx);
+
+	/* Replace the function that was registered before */
+	if ((dc = callback_find_locked(d, name, prefix)) != NULL) {
+		dc->dc_func = func;
+		dc->dc_context = context;
+		pthread_mutex_unlock(&d->d_mtx);
+		return 0;
+	}
+
+	if ((dc = calloc(1, sizeof(*dc))) == NULL ||
+			(dc->dc_name = strdup(name)) == NULL) {
+		pthread_mutex_unlock(&d->d_mtx);
+		log_errno("calloc(3)");
+		free(dc);
+		return -1;
+	}
+	dc->dc_len = strlen(name);
+	dc->dc_prefix = prefix;
+	dc->dc_func = func;
+	dc->dc_context = context;
+	dc->dc_refs = 1;
+	if (prefix)
+		LIST_INSERT_HEAD(&d->d_prefixes, dc, dc_prefix_entry);
+	else
+		hash_table_insert(&d->d_names, &dc->dc_node,
+				hash_string(name), dc);
+	pthread_mutex_unlock(&d->d_mtx);
+	return 0;
+}
+
+int dispatch_remove(dispatch_t d, const char *name)
+{
+	struct dispatch_callback *dc;
+
+	pthread_mutex_lock(&d->d_mtx);
+	if ((dc = callback_find_locked(d, name, false)) != NULL) {
+		hash_table_remove(&d->d_names, &dc->dc_node);
+	} else if ((dc = callback_find_locked(d, name, true)) != NULL) {
+		LIST_REMOVE(dc, dc_prefix_entry);
+	} else {
+		pthread_mutex_unlock(&d->d_mtx);
+		log_error("no callback is registered for %s", name);
+		return -1;
+	}
+
+	/* A callback that removes itself cannot wait for itself to return */
+	dc->dc_removed = true;
+	if (dispatch_self != d) {
+		while (dc->dc_refs > 1)
+			pthread_cond_wait(&d->d_cond, &d->d_mtx);
+	}
+	callback_release_locked(dc);
+	pthread_mutex_unlock(&d->d_mtx);
+	return 0;
+}
@@ -0,0 +1,55 @@
+/*
+ * Copyright (c) 2015 Mark Heily <mark@heily.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef DISPATCH_H_
+#define DISPATCH_H_
+
+#include <stdbool.h>
+
+#include "include/state.h"
+
+/*
+ * A pool of worker threads that call a function for each notification.
+ *
+ * The workers take turns waiting on the event fd of a context. The one
+ * that is waiting reads a batch of notifications with state_ctx_check_many(),
+ * copies them onto a queue for each name, and hands the queues to the
+ * other workers. A queue is only run by one worker at a time, so the
+ * callbacks for a name are called in order, while different names are
+ * handled in parallel.
+ */
+
+#define DISPATCH_THREADS	4
+#define DISPATCH_BATCH		64
+
+typedef struct dispatch_s * dispatch_t;
+
+dispatch_t dispatch_new(state_ctx_t ctx, unsigned int nthreads);
+
+/* Stop the workers and free everything. This must not be called by a callback. */
+void dispatch_free(dispatch_t d);
+
+/* Call <func> for <name>, or for every name that begins with <name> if <prefix> is true */
+int dispatch_add(dispatch_t d, const char *name, bool prefix,
+		state_callback_f func, void *context);
+
+/*
+ * Stop calling the function registered for <name>. Unless this is called
+ * by a callback, it waits until no call to the function is in progress.
+ */
+int dispatch_remove(dispatch_t d, const char *name);
+
+#endif /* DISPATCH_H_ */
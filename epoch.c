@@ -0,0 +1,203 @@
+/*
+ * Copyright (c) 2015 Mark Heily <mark@heily.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/queue.h>
+
+#include "epoch.h"
+#include "log.h"
+
+/* One per thread that has entered a critical section */
+struct epoch_record {
+	struct epoch_record *er_next;	/* Records are never removed from the list */
+	uint64_t er_active;	/* The epoch when the reader entered, or zero */
+	unsigned int er_nest;	/* Only used by the owning thread */
+	bool	 er_in_use;	/* Owned by a thread that has not exited */
+};
+
+/* An object that will be freed once no reader can be using it */
+struct epoch_retired {
+	STAILQ_ENTRY(epoch_retired) et_entry;
+	uint64_t et_epoch;	/* The epoch when it was retired */
+	void	(*et_func)(void *);
+	void	*et_ptr;
+};
+
+static struct {
+	uint64_t epoch;		/* Advanced by every call to epoch_retire() */
+	struct epoch_record *records;
+	STAILQ_HEAD(, epoch_retired) retired;	/* In the order they were retired */
+	pthread_mutex_t mtx;	/* Protects <retired> */
+	pthread_key_t key;	/* Releases the record of a thread when it exits */
+	pthread_once_t once;
+} epoch_data = {
+	.epoch = 1,
+	.retired = STAILQ_HEAD_INITIALIZER(epoch_data.retired),
+	.mtx = PTHREAD_MUTEX_INITIALIZER,
+	.once = PTHREAD_ONCE_INIT,
+};
+
+static __thread struct epoch_record *epoch_self;
+
+static void epoch_record_release(void *arg)
+{
+	struct epoch_record *er = arg;
+
+	er->er_nest = 0;
+	__atomic_store_n(&er->er_active, 0, __ATOMIC_RELEASE);
+	__atomic_store_n(&er->er_in_use, false, __ATOMIC_RELEASE);
+}
+
+static void epoch_key_create(void)
+{
+	if (pthread_key_create(&epoch_data.key, epoch_record_release) != 0)
+		log_error("unable to create a thread-specific data key");
+}
+
+/* Find the record of the calling thread, or take one over */
+static struct epoch_record *epoch_record_get(void)
+{
+	struct epoch_record *er;
+	bool expected;
+
+	if (epoch_self)
+		return epoch_self;
+	(void) pthread_once(&epoch_data.once, epoch_key_create);
+
+	/* Reuse the record of a thread that has exited */
+	er = __atomic_load_n(&epoch_data.records, __ATOMIC_ACQUIRE);
+	for (; er != NULL; er = er->er_next) {
+		expected = false;
+		if (__atomic_compare_exchange_n(&er->er_in_use, &expected, true,
+				false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+			goto found;
+	}
+
+	if ((er = calloc(1, sizeof(*er))) == NULL) {
+		log_errno("calloc(3)");
+		return NULL;
+	}
+	er->er_in_use = true;
+	er->er_next = __atomic_load_n(&epoch_data.records, __ATOMIC_RELAXED);
+	while (!__atomic_compare_exchange_n(&epoch_data.records, &er->er_next,
+			er, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+		;
+
+found:
+	epoch_self = er;
+	(void) pthread_setspecific(epoch_data.key, er);
+	return er;
+}
+
+int epoch_enter(void)
+{
+	struct epoch_record *er;
+
+	if ((er = epoch_record_get()) == NULL)
+		return -1;
+	if (er->er_nest++ == 0) {
+		__atomic_store_n(&er->er_active,
+				__atomic_load_n(&epoch_data.epoch, __ATOMIC_ACQUIRE),
+				__ATOMIC_RELAXED);
+		/* Announce the epoch before reading any shared pointer */
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	}
+	return 0;
+}
+
+void epoch_exit(void)
+{
+	struct epoch_record *er = epoch_self;
+
+	if (--er->er_nest == 0)
+		__atomic_store_n(&er->er_active, 0, __ATOMIC_RELEASE);
+}
+
+/* Free the objects that were retired before the oldest active reader entered */
+static void epoch_reclaim(void)
+{
+	STAILQ_HEAD(, epoch_retired) done = STAILQ_HEAD_INITIALIZER(done);
+	struct epoch_record *er;
+	struct epoch_retired *et;
+	uint64_t min = UINT64_MAX, active;
+
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	er = __atomic_load_n(&epoch_data.records, __ATOMIC_ACQUIRE);
+	for (; er != NULL; er = er->er_next) {
+		active = __atomic_load_n(&er->er_active, __ATOMIC_ACQUIRE);
+		if (active != 0 && active < min)
+			min = active;
+	}
+
+	pthread_mutex_lock(&epoch_data.mtx);
+	while ((et = STAILQ_FIRST(&epoch_data.retired)) != NULL &&
+			et->et_epoch < min) {
+		STAILQ_REMOVE_HEAD(&epoch_data.retired, et_entry);
+		STAILQ_INSERT_TAIL(&done, et, et_entry);
+	}
+	pthread_mutex_unlock(&epoch_data.mtx);
+
+	while ((et = STAILQ_FIRST(&done)) != NULL) {
+		STAILQ_REMOVE_HEAD(&done, et_entry);
+		et->et_func(et->et_ptr);
+		free(et);
+	}
+}
+
+int epoch_retire(void (*func)(void *), void *ptr)
+{
+	struct epoch_retired *et;
+
+	if ((et = malloc(sizeof(*et))) == NULL) {
+		/* Leaking the object is better than freeing it under a reader */
+		log_errno("malloc(3)");
+		return -1;
+	}
+	et->et_func = func;
+	et->et_ptr = ptr;
+	pthread_mutex_lock(&epoch_data.mtx);
+	et->et_epoch = __atomic_fetch_add(&epoch_data.epoch, 1, __ATOMIC_SEQ_CST);
+	STAILQ_INSERT_TAIL(&epoch_data.retired, et, et_entry);
+	pthread_mutex_unlock(&epoch_data.mtx);
+
+	epoch_reclaim();
+	return 0;
+}
+
+void epoch_synchronize(void)
+{
+	struct epoch_retired *et;
+	uint64_t target;
+	bool done;
+
+	target = __atomic_load_n(&epoch_data.epoch, __ATOMIC_ACQUIRE);
+	for (;;) {
+		epoch_reclaim();
+		pthread_mutex_lock(&epoch_data.mtx);
+		et = STAILQ_FIRST(&epoch_data.retired);
+		done = (et == NULL || et->et_epoch >= target);
+		pthread_mutex_unlock(&epoch_data.mtx);
+		if (done)
+			return;
+		(void) sched_yield();
+	}
+}
@@ -0,0 +1,45 @@
+/*
+ * Copyright (c) 2015 Mark Heily <mark@heily.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#ifndef EPOCH_H_
+#define EPOCH_H_
+
+/*
+ * Epoch-based reclamation, so that readers can use shared objects without
+ * taking a lock.
+ *
+ * A reader brackets its use of the objects with epoch_enter() and
+ * epoch_exit(). A writer first makes an object unreachable for new
+ * readers, and then passes it to epoch_retire(). The object is freed
+ * once every reader that might have found it has called epoch_exit().
+ *
+ * Each thread announces itself in a record of its own, so readers never
+ * write to memory that is shared with other threads. Writers scan the
+ * records to decide what can be freed.
+ */
+
+/* Enter a read-side critical section. Calls may be nested. */
+int epoch_enter(void);
+void epoch_exit(void);
+
+/* Call <func>(<ptr>) once no reader can be using <ptr> */
+int epoch_retire(void (*func)(void *), void *ptr);
+
+/* Wait until everything retired so far has been freed */
+void epoch_synchronize(void);
+
+#endif /* EPOCH_H_ */
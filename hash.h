@@ -0,0 +1,147 @@
+/*
+ * Copyright (c) 2015 Mark Heily <mark@heily.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#ifndef HASH_H_
+#define HASH_H_
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/queue.h>
+
+/*
+ * A chained hash table. Nodes are embedded in the objects being indexed,
+ * so an object can be a member of more than one table at the same time.
+ */
+
+struct hash_node {
+	LIST_ENTRY(hash_node) hn_entry;
+	uint32_t hn_hash;
+	void    *hn_data;	/* The object that contains this node */
+};
+
+LIST_HEAD(hash_bucket, hash_node);
+
+struct hash_table {
+	struct hash_bucket *ht_buckets;
+	size_t ht_mask;		/* The number of buckets, minus one */
+	size_t ht_count;	/* The number of nodes in the table */
+};
+
+#define HASH_TABLE_MIN_BUCKETS 16
+
+/* Iterate over every node that could match <hash> */
+#define HASH_TABLE_FOREACH(var, ht, hash) \
+	LIST_FOREACH(var, &(ht)->ht_buckets[(hash) & (ht)->ht_mask], hn_entry)
+
+/* Iterate over every node in the table */
+#define HASH_TABLE_FOREACH_ALL(var, ht, i) \
+	for ((i) = 0; (i) <= (ht)->ht_mask; (i)++) \
+		LIST_FOREACH(var, &(ht)->ht_buckets[(i)], hn_entry)
+
+/* Remove every node from the table, one at a time */
+#define HASH_TABLE_DRAIN(var, ht, i) \
+	for ((i) = 0; (i) <= (ht)->ht_mask; (i)++) \
+		while (((var) = LIST_FIRST(&(ht)->ht_buckets[(i)])) != NULL && \
+		    (hash_table_remove((ht), (var)), 1))
+
+/* FNV-1a */
+static inline uint32_t hash_string(const char *s)
+{
+	uint32_t h = 2166136261u;
+
+	for (; *s != '\0'; s++) {
+		h ^= (unsigned char) *s;
+		h *= 16777619u;
+	}
+	return h;
+}
+
+static inline uint32_t hash_int(int i)
+{
+	uint32_t h = (uint32_t) i;
+
+	h ^= h >> 16;
+	h *= 0x45d9f3bu;
+	h ^= h >> 16;
+	return h;
+}
+
+static inline int hash_table_init(struct hash_table *ht)
+{
+	size_t i;
+
+	ht->ht_buckets = calloc(HASH_TABLE_MIN_BUCKETS, sizeof(*ht->ht_buckets));
+	if (ht->ht_buckets == NULL)
+		return -1;
+	for (i = 0; i < HASH_TABLE_MIN_BUCKETS; i++)
+		LIST_INIT(&ht->ht_buckets[i]);
+	ht->ht_mask = HASH_TABLE_MIN_BUCKETS - 1;
+	ht->ht_count = 0;
+	return 0;
+}
+
+/* This does not free the nodes; the caller must remove them first */
+static inline void hash_table_free(struct hash_table *ht)
+{
+	free(ht->ht_buckets);
+	ht->ht_buckets = NULL;
+	ht->ht_mask = 0;
+	ht->ht_count = 0;
+}
+
+static inline void hash_table_grow(struct hash_table *ht)
+{
+	struct hash_bucket *newbuckets;
+	struct hash_node *hn;
+	size_t i, newsize = (ht->ht_mask + 1) * 2;
+
+	newbuckets = calloc(newsize, sizeof(*newbuckets));
+	if (newbuckets == NULL)
+		return; /* Lookups will be slower, but still correct */
+	for (i = 0; i < newsize; i++)
+		LIST_INIT(&newbuckets[i]);
+	for (i = 0; i <= ht->ht_mask; i++) {
+		while ((hn = LIST_FIRST(&ht->ht_buckets[i])) != NULL) {
+			LIST_REMOVE(hn, hn_entry);
+			LIST_INSERT_HEAD(&newbuckets[hn->hn_hash & (newsize - 1)],
+					hn, hn_entry);
+		}
+	}
+	free(ht->ht_buckets);
+	ht->ht_buckets = newbuckets;
+	ht->ht_mask = newsize - 1;
+}
+
+static inline void hash_table_insert(struct hash_table *ht,
+		struct hash_node *hn, uint32_t hash, void *data)
+{
+	if (ht->ht_count > ht->ht_mask)
+		hash_table_grow(ht);
+	hn->hn_hash = hash;
+	hn->hn_data = data;
+	LIST_INSERT_HEAD(&ht->ht_buckets[hash & ht->ht_mask], hn, hn_entry);
+	ht->ht_count++;
+}
+
+static inline void hash_table_remove(struct hash_table *ht,
+		struct hash_node *hn)
+{
+	LIST_REMOVE(hn, hn_entry);
+	ht->ht_count--;
+}
+
+#endif /* HASH_H_ */
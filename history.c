@@ -0,0 +1,276 @@
+/*
+ * Copyright (c) 2015 Mark Heily <mark@heily.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifdef __linux__
+#define _GNU_SOURCE	/* for asprintf(3) */
+#endif
+
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "history.h"
+#include "log.h"
+
+/* The number of times to retry reading an entry that keeps changing */
+#define HISTORY_MAX_RETRIES	1000
+
+struct history_s {
+	int	 h_fd;
+	struct history_header *h_hdr;
+	size_t	 h_mapsz;
+	bool	 h_writable;
+};
+
+static size_t history_size(uint32_t depth)
+{
+	return sizeof(struct history_header) +
+		(size_t) depth * sizeof(struct history_entry);
+}
+
+static struct history_entry *history_entry(history_t h, uint64_t pos)
+{
+	struct history_entry *ents = (struct history_entry *) (h->h_hdr + 1);
+
+	return &ents[(pos - 1) % h->h_hdr->hh_depth];
+}
+
+/* Map the file, and check that it has a valid header */
+static int history_map(history_t h, int prot)
+{
+	struct history_header *hdr;
+	struct stat sb;
+	void *p;
+
+	if (fstat(h->h_fd, &sb) < 0) {
+		log_errno("fstat(2)");
+		return -1;
+	}
+	if (sb.st_size < (off_t) sizeof(*hdr))
+		return -1;
+	p = mmap(NULL, sb.st_size, prot, MAP_SHARED, h->h_fd, 0);
+	if (p == MAP_FAILED) {
+		log_errno("mmap(2)");
+		return -1;
+	}
+	hdr = p;
+	if (hdr->hh_magic != HISTORY_MAGIC || hdr->hh_version != HISTORY_VERSION ||
+			hdr->hh_depth == 0 || hdr->hh_depth > HISTORY_DEPTH_MAX ||
+			(size_t) sb.st_size < history_size(hdr->hh_depth)) {
+		(void) munmap(p, sb.st_size);
+		return -1;
+	}
+	h->h_hdr = hdr;
+	h->h_mapsz = sb.st_size;
+	return 0;
+}
+
+static history_t history_new(void)
+{
+	history_t h;
+
+	if ((h = calloc(1, sizeof(*h))) == NULL) {
+		log_errno("calloc(3)");
+		return NULL;
+	}
+	h->h_fd = -1;
+	return h;
+}
+
+void history_close(history_t h)
+{
+	if (h == NULL)
+		return;
+	if (h->h_hdr)
+		(void) munmap(h->h_hdr, h->h_mapsz);
+	if (h->h_fd >= 0)
+		(void) close(h->h_fd);
+	free(h);
+}
+
+/* Write a new, empty history to a temporary file, and rename it to <path> */
+static int history_replace(const char *path, unsigned int depth)
+{
+	struct history_header hdr;
+	char *tmp;
+	int fd, rv = -1;
+
+	if (asprintf(&tmp, "%s.%d", path, (int) getpid()) < 0)
+		return -1;
+	if ((fd = open(tmp, O_CREAT | O_TRUNC | O_RDWR, 0644)) < 0) {
+		log_errno("open(2) of %s", tmp);
+		free(tmp);
+		return -1;
+	}
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.hh_magic = HISTORY_MAGIC;
+	hdr.hh_version = HISTORY_VERSION;
+	hdr.hh_depth = depth;
+	if (ftruncate(fd, history_size(depth)) < 0) {
+		log_errno("ftruncate(2) of %s", tmp);
+	} else if (pwrite(fd, &hdr, sizeof(hdr), 0) < (ssize_t) sizeof(hdr)) {
+		log_errno("pwrite(2) of %s", tmp);
+	} else if (rename(tmp, path) < 0) {
+		log_errno("rename(2) of %s", tmp);
+	} else {
+		rv = 0;
+	}
+	(void) close(fd);
+	if (rv < 0)
+		(void) unlink(tmp);
+	free(tmp);
+	return rv;
+}
+
+history_t history_create(const char *path, unsigned int depth)
+{
+	history_t h;
+	int fd;
+
+	if (depth == 0 || depth > HISTORY_DEPTH_MAX) {
+		log_error("invalid history depth: %u", depth);
+		return NULL;
+	}
+	if ((h = history_new()) == NULL)
+		return NULL;
+	h->h_writable = true;
+
+	/* Keep the existing history, since subscribers may be reading it */
+	if ((fd = open(path, O_RDWR)) >= 0) {
+		h->h_fd = fd;
+		if (history_map(h, PROT_READ | PROT_WRITE) == 0 &&
+				h->h_hdr->hh_depth == depth)
+			return h;
+		if (h->h_hdr) {
+			__atomic_store_n(&h->h_hdr->hh_replaced, 1, __ATOMIC_RELEASE);
+			(void) munmap(h->h_hdr, h->h_mapsz);
+			h->h_hdr = NULL;
+		}
+		(void) close(fd);
+		h->h_fd = -1;
+	}
+
+	if (history_replace(path, depth) < 0)
+		goto err_out;
+	if ((h->h_fd = open(path, O_RDWR)) < 0) {
+		log_errno("open(2) of %s", path);
+		goto err_out;
+	}
+	if (history_map(h, PROT_READ | PROT_WRITE) < 0)
+		goto err_out;
+	return h;
+
+err_out:
+	log_error("unable to create the history in %s", path);
+	history_close(h);
+	return NULL;
+}
+
+history_t history_open(const char *path)
+{
+	history_t h;
+
+	if ((h = history_new()) == NULL)
+		return NULL;
+	if ((h->h_fd = open(path, O_RDONLY)) < 0 ||
+			history_map(h, PROT_READ) < 0) {
+		log_debug("no history in %s", path);
+		history_close(h);
+		return NULL;
+	}
+	return h;
+}
+
+int history_append(history_t h, const char *value, size_t len)
+{
+	struct history_entry *e;
+	uint64_t pos;
+	uint32_t seq;
+
+	if (!h->h_writable)
+		return -1;
+	pos = h->h_hdr->hh_head + 1;
+	e = history_entry(h, pos);
+	seq = e->he_seq & ~1u; /* Recover from an interrupted write */
+	__atomic_store_n(&e->he_seq, seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	__atomic_store_n(&e->he_pos, pos, __ATOMIC_RELAXED);
+	__atomic_store_n(&e->he_len, len > UINT32_MAX ? UINT32_MAX : len,
+			__ATOMIC_RELAXED);
+	memcpy(e->he_value, value,
+			len < STATE_HISTORY_VALUE_MAX ? len : STATE_HISTORY_VALUE_MAX);
+	__atomic_store_n(&e->he_seq, seq + 2, __ATOMIC_RELEASE);
+	__atomic_store_n(&h->h_hdr->hh_head, pos, __ATOMIC_RELEASE);
+	return 0;
+}
+
+/*
+ * Copy the entry at <pos> into <t>. Returns 1 if successful, or 0 if it
+ * has already been overwritten.
+ */
+static int history_copy(history_t h, uint64_t pos, struct state_transition *t)
+{
+	struct history_entry *e = history_entry(h, pos);
+	uint32_t seq;
+	size_t len;
+	int i;
+
+	for (i = 0; i < HISTORY_MAX_RETRIES; i++) {
+		seq = __atomic_load_n(&e->he_seq, __ATOMIC_ACQUIRE);
+		if (seq & 1)
+			continue;
+		if (__atomic_load_n(&e->he_pos, __ATOMIC_RELAXED) != pos)
+			return 0;
+		t->seq = pos;
+		t->len = __atomic_load_n(&e->he_len, __ATOMIC_RELAXED);
+		len = t->len < STATE_HISTORY_VALUE_MAX ? t->len : STATE_HISTORY_VALUE_MAX;
+		memcpy(t->value, e->he_value, len);
+		t->value[len] = '\0';
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&e->he_seq, __ATOMIC_RELAXED) == seq)
+			return 1;
+	}
+	/* The publisher is lapping this reader */
+	return 0;
+}
+
+ssize_t history_read(history_t h, uint64_t *pos, struct state_transition *ts,
+		size_t max)
+{
+	uint64_t head, next, depth = h->h_hdr->hh_depth;
+	size_t n = 0;
+
+	head = __atomic_load_n(&h->h_hdr->hh_head, __ATOMIC_ACQUIRE);
+	next = *pos + 1;
+	if (*pos > head)
+		next = 1;	/* The history was started again */
+	if (head > depth && next <= head - depth)
+		next = head - depth + 1;
+	for (; next <= head && n < max; next++)
+		n += history_copy(h, next, &ts[n]);
+	*pos = next - 1;
+	return n;
+}
+
+int history_replaced(history_t h)
+{
+	return __atomic_load_n(&h->h_hdr->hh_replaced, __ATOMIC_ACQUIRE) != 0;
+}
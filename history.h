@@ -0,0 +1,82 @@
+/*
+ * Copyright (c) 2015 Mark Heily <mark@heily.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef HISTORY_H_
+#define HISTORY_H_
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "include/state.h"
+
+/*
+ * The recent values of a name, kept in a file next to its state file by
+ * state_bind_history(). The file holds a header followed by a ring of
+ * <hh_depth> entries, each protected by its own sequence lock:
+ *
+ *   struct history_header
+ *   struct history_entry[hh_depth]
+ *
+ * Only the publisher writes to the file. If it is bound again with a
+ * different depth, a new file is renamed over the old one, and the old
+ * one is marked as replaced so that readers know to open it again.
+ */
+
+#define HISTORY_MAGIC		0x54534948	/* "HIST" in little-endian */
+#define HISTORY_VERSION		1
+#define HISTORY_DEPTH_MAX	65536
+
+struct history_header {
+	uint32_t hh_magic;	/* HISTORY_MAGIC */
+	uint32_t hh_version;	/* HISTORY_VERSION */
+	uint32_t hh_depth;	/* The number of entries in the ring */
+	uint32_t hh_replaced;	/* Set when a new file takes the place of this one */
+	uint64_t hh_head;	/* The position of the newest entry, or zero */
+	uint64_t hh_reserved;
+};
+
+struct history_entry {
+	uint32_t he_seq;	/* Sequence counter; odd while being written */
+	uint32_t he_len;	/* Length of the value when it was published */
+	uint64_t he_pos;	/* The position of this entry, starting at one */
+	char	 he_value[STATE_HISTORY_VALUE_MAX];	/* Not NUL-terminated */
+};
+
+typedef struct history_s * history_t;
+
+/* Open the history at <path> for writing, creating it if needed */
+history_t history_create(const char *path, unsigned int depth);
+
+/* Open the history at <path> for reading. Returns NULL if it does not exist. */
+history_t history_open(const char *path);
+
+void history_close(history_t h);
+
+/* Add a value to the history. The caller must serialize calls. */
+int history_append(history_t h, const char *value, size_t len);
+
+/*
+ * Copy up to <max> entries after position <*pos> into <ts>, oldest first,
+ * and advance <*pos>. Entries that have already been overwritten are
+ * skipped. Returns the number of entries copied, or -1 on error.
+ */
+ssize_t history_read(history_t h, uint64_t *pos, struct state_transition *ts,
+		size_t max);
+
+/* True if the file has been replaced, and must be opened again */
+int history_replaced(history_t h);
+
+#endif /* HISTORY_H_ */
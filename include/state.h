@@ -22,13 +22,39 @@
  * A state notification mechanism
  */
 
+#include <stdint.h>
 #include <sys/stat.h>
 
+/**
+  Flags that can be passed to state_init()
+*/
+#define STATE_COALESCE	0x0001	/**< Collapse all pending notifications for a name into one */
+#define STATE_ARENA	0x0002	/**< Keep every name in one shared file instead of a file per name */
+#define STATE_BROKER	0x0004	/**< Publish and subscribe through stated instead of the filesystem */
+
 /**
   Initialize the state notification mechanism.
 
+  If STATE_COALESCE is set in *flags*, each call to state_check() or
+  state_check_many() returns at most one notification for a given name,
+  carrying the latest value. This is useful when only the current value
+  matters, and intermediate values can be skipped.
+
+  If STATE_ARENA is set in *flags*, the values of all names in a namespace
+  are kept in a single shared arena file, so binding or subscribing to a
+  name does not use up a file descriptor or a kernel watch. Publishers and
+  subscribers must agree on this flag; names published with it are not
+  visible to processes that do not use it, and vice versa.
+
+  If STATE_BROKER is set in *flags*, the process connects to stated,
+  which must be running with the -b option, and publishes and subscribes
+  by sending messages over a single Unix domain socket. The daemon fans
+  out each publish to the subscribers, and the current value of a name
+  is sent as the first notification after subscribing to it. This cannot
+  be combined with STATE_ARENA.
+
   @param ABI_version The ABI version number for compatibility. This should be set to zero.
-  @param flags Reserved for future use. This should be set to zero.
+  @param flags Zero, or a bitwise OR of STATE_COALESCE, STATE_ARENA, and STATE_BROKER.
   @return 0 if successful, or -1 if an error occurs.
 */
 int state_init(int abi_version, int flags);
@@ -49,6 +75,42 @@ void state_atexit(void);
  */
 int state_bind(const char *name);
 
+/**
+  Acquire the ability to publish notifications about a *name*, and limit
+  how often they are written.
+
+  This is for names that change very often, such as progress counters,
+  where subscribers only need to see the latest value. A value that is
+  published too soon is held back, and replaced by any later value, until
+  a background thread writes it. The last value published always reaches
+  subscribers, including when the name is unbound or state_atexit() is
+  called. state_publish_multi() bypasses the limits.
+
+  @param name	the name to acquire
+  @param max_rate	the maximum number of values written per second,
+			or zero for no limit. The first value after a quiet
+			period is written at once.
+  @param debounce_ms	if not zero, a value is only written once no new
+			value has been published for this many milliseconds
+
+  @return 0 if successful, or -1 if an error occurs.
+ */
+int state_bind_throttled(const char *name, unsigned int max_rate,
+		unsigned int debounce_ms);
+
+/**
+  Acquire the right to publish information about <name>, with the space
+  for a value of up to *capacity* bytes allocated up front.
+
+  This is for large values. Publishing never has to grow the file that
+  holds the value, so it cannot fail for lack of disk space, and
+  subscribers never have to map the file again. A value longer than
+  *capacity* cannot be published.
+
+  @return 0 if successful, or -1 if an error occurs.
+ */
+int state_bind_reserved(const char *name, size_t capacity);
+
 /**
   Stop publishing information about <name>
 
@@ -73,6 +135,32 @@ int state_subscribe(const char *name);
 */
 int state_unsubscribe(const char *name);
 
+/**
+  Subscribe to notifications about every name that begins with *prefix*,
+  including names that are bound after the subscription is made.
+
+  A name is reported the first time it changes after the subscription is
+  made, and can then be used with state_get() like any other subscription.
+  Calling state_subscribe() for one of these names makes it an ordinary
+  subscription, which is kept by state_unsubscribe_prefix().
+
+  With STATE_ARENA, the whole prefix is covered by the single watch on the
+  arena, and no file descriptors are used per name. Otherwise, the state
+  directory is watched for new names, and each name found still needs a
+  descriptor of its own.
+
+  @param prefix	The beginning of the names of interest, such as "user.svc."
+  @return 0 if successful, or -1 if an error occurs.
+*/
+int state_subscribe_prefix(const char *prefix);
+
+/**
+  Stop subscribing to notifications about names that begin with <prefix>
+
+  @return 0 if successful, or -1 if an error occurs.
+*/
+int state_unsubscribe_prefix(const char *prefix);
+
 /**
   Publish a notification about *name* and update the *state*.
   You must call state_bind() before using this function.
@@ -81,10 +169,50 @@ int state_unsubscribe(const char *name);
   @param state	The new state to report
   @param len	The length of the *state* variable
 
+  If *state* is the same as the last value published for *name*, nothing
+  is written and no notification is generated.
+
   @return 0 if successful, or -1 if an error occurs.
 */
 int state_publish(const char *name, const char *state, size_t len);
 
+/**
+  One of the values passed to state_publish_multi().
+*/
+struct state_value {
+	const char *name;	/**< The name to generate a notification for */
+	const char *value;	/**< The new state to report */
+	size_t	 len;		/**< The length of the *value* string */
+};
+
+/**
+  Publish several related names together.
+
+  Every value is stored before any subscriber is notified, so the
+  notifications arrive as one batch instead of one wakeup per name.
+  With STATE_BROKER, the values are also applied atomically, so no
+  subscriber can see some of them without the others.
+  You must call state_bind() for every name before using this function;
+  if any of them is not bound, nothing is published. A value that is the
+  same as the last one published for its name is skipped, and counted as
+  suppressed by state_get_stats().
+
+  @param values	The names and their new states
+  @param n	The number of elements in *values*
+
+  @return 0 if successful, or -1 if an error occurs.
+*/
+int state_publish_multi(const struct state_value *values, size_t n);
+
+/**
+  A state change notification returned by state_check_many().
+*/
+struct state_event {
+	char	*key;	/**< The published name */
+	char	*value;	/**< The current value of the state */
+	ssize_t	 len;	/**< The length of the *value* string */
+};
+
 /** 
   Check for pending notifications, and return the current state.
 
@@ -97,9 +225,58 @@ int state_publish(const char *name, const char *state, size_t len);
 */
 ssize_t state_check(char **key, char **value);
 
+/**
+  Check for up to *max* pending notifications at once.
+
+  This retrieves all pending kernel events in as few system calls as
+  possible, and is more efficient than calling state_check() in a loop.
+  The strings in *evs* remain valid until the next call to state_check()
+  or state_check_many(), or until another thread unsubscribes from the
+  name, whichever comes first.
+
+  @param evs An array that will be filled in with the notifications
+  @param max The number of elements in *evs*
+
+  @return the number of notifications stored in *evs*, or,
+	  0 if no new notifications were available,
+	  or -1 if an error occurs.
+*/
+ssize_t state_check_many(struct state_event *evs, size_t max);
+
+/**
+  Wait for notifications, and return them.
+
+  This is equivalent to waiting for state_get_event_fd() to become
+  readable and then calling state_check_many(), but in a single call that
+  does not need an event loop. With kqueue(2), the same kevent(2) call
+  waits for the kernel events and retrieves them. On Linux, it is still
+  two system calls, epoll_wait(2) and then read(2) of the inotify(7)
+  descriptor, so it costs the same as poll(2) and state_check_many().
+  The strings in *evs* remain valid until the next call to state_check(),
+  state_check_many() or state_wait(), or until another thread
+  unsubscribes from the name.
+
+  @param evs An array that will be filled in with the notifications
+  @param max The number of elements in *evs*
+  @param timeout_ms The maximum number of milliseconds to wait, or -1 to
+	 wait forever. With zero, this does not block, like state_check_many().
+
+  @return the number of notifications stored in *evs*, or,
+	  0 if the timeout expired before any notification arrived,
+	  or -1 if an error occurs.
+*/
+ssize_t state_wait(struct state_event *evs, size_t max, int timeout_ms);
+
 /**
   Get the current state of a <name>.
 
+  This does not take any locks, and may be called from several threads
+  at once, while other threads subscribe and unsubscribe. Each thread
+  gets its own copy of the value, which remains valid until the same
+  thread calls state_get() or state_get_if_changed() for the same name
+  again, or the name is unsubscribed. With STATE_BROKER, the copy is
+  made while holding a lock.
+
   @param name the name of the notification
   @param value a string that will be modified to point at the current state
 
@@ -107,6 +284,266 @@ ssize_t state_check(char **key, char **value);
 */
 int state_get(const char *key, char **value);
 
+/**
+  Get the current state of a <name>, but only if it has changed.
+
+  Each name has a generation number that increases every time a new
+  value is published. If the generation in *gen* is still current, this
+  returns immediately without copying the value or making a system call,
+  which makes it cheap to poll a large number of names. Like state_get(),
+  this does not take any locks.
+
+  @param name the name of the notification
+  @param gen the generation the caller last saw; this should be zero
+	 the first time, and is updated when a new value is returned
+  @param value a string that will be modified to point at the current
+	 state, if it has changed
+
+  @return 1 if the state has changed, 0 if it has not,
+	  or -1 if an error occurred
+*/
+int state_get_if_changed(const char *key, unsigned int *gen, char **value);
+
+/**
+  Get a pointer to the current state of a <name>, without copying it.
+
+  The pointer refers directly to the memory shared with the publisher,
+  so the value may be overwritten while it is being used. After using it,
+  call state_peek_valid() with the returned sequence number; if that
+  returns zero, the value was modified and must be read again.
+  The pointer remains usable until the next call to a function that
+  takes the same name. With STATE_BROKER, the value is instead copied
+  under a lock, as with state_get(), and the pointer refers to the copy.
+
+  @param name the name of the notification
+  @param value will be modified to point at the current state
+  @param seq will be filled in with the sequence number of the state
+
+  @return the length of the <value> string, or -1 if an error occurred
+*/
+ssize_t state_peek(const char *key, const char **value, unsigned int *seq);
+
+/**
+  Check whether a value returned by state_peek() is still current.
+
+  @param name the name of the notification
+  @param seq the sequence number returned by state_peek()
+
+  @return 1 if the value has not been modified, or 0 if it has.
+*/
+int state_peek_valid(const char *key, unsigned int seq);
+
+/**
+  Copy part of the current value of a name into a buffer, straight from
+  the shared memory, so that a large value does not have to be copied in
+  full to read a few bytes of it. You must call state_subscribe() first.
+
+  @param name the name of the notification
+  @param off the offset of the first byte to copy
+  @param len the size of *buf*
+  @param buf the buffer to copy into, which is not NUL-terminated
+
+  @return the number of bytes copied, which is less than *len* if the
+	  value ends sooner, or -1 if an error occurs.
+*/
+ssize_t state_get_range(const char *key, size_t off, size_t len, void *buf);
+
+/**
+  The types of value understood by state_decode().
+
+  A typed value starts with an 8-byte header: a NUL byte, the letter 'T',
+  the version of the layout (STATE_TYPED_VERSION), the type, and the
+  length of the payload as a 32-bit little-endian integer. The payload
+  follows: a little-endian two's complement integer for STATE_TYPE_I64,
+  a little-endian IEEE 754 double for STATE_TYPE_F64, a single byte that
+  is 0 or 1 for STATE_TYPE_BOOL, and the bytes themselves for
+  STATE_TYPE_BLOB. A STATE_TYPE_COUNTER has the same payload as a
+  STATE_TYPE_I64, but it is modified in place, as described below. Any
+  other value is a STATE_TYPE_STRING.
+*/
+#define STATE_TYPE_STRING	0	/**< Published with state_publish() */
+#define STATE_TYPE_I64		1	/**< A signed 64-bit integer */
+#define STATE_TYPE_F64		2	/**< A double */
+#define STATE_TYPE_BOOL		3	/**< True or false */
+#define STATE_TYPE_BLOB		4	/**< Arbitrary bytes */
+#define STATE_TYPE_COUNTER	5	/**< A signed 64-bit integer bound with state_bind_counter() */
+
+#define STATE_TYPED_VERSION	1	/**< The version of the typed value layout */
+#define STATE_TYPED_HEADER	8	/**< The size of the typed value header */
+
+/**
+  Publish a typed value. You must call state_bind() before using these.
+
+  Subscribers receive the encoded value in notifications, and can read it
+  with state_decode(), or with the state_get_*() function of the same type.
+
+  @return 0 if successful, or -1 if an error occurs.
+*/
+int state_publish_i64(const char *name, int64_t value);
+int state_publish_f64(const char *name, double value);
+int state_publish_bool(const char *name, int value);
+int state_publish_blob(const char *name, const void *data, size_t len);
+
+/**
+  Get the current value of a typed name, without parsing or allocating
+  memory. A string value, such as one published by an older program with
+  state_publish(), is converted if it holds a number, or "true" or
+  "false".
+
+  @return 0 if successful, or -1 if an error occurs, or the value is of
+	  another type.
+*/
+int state_get_i64(const char *name, int64_t *value);
+int state_get_f64(const char *name, double *value);
+int state_get_bool(const char *name, int *value);
+
+/**
+  Get the current value of a blob. *data* remains valid for as long as
+  a value returned by state_get() would.
+
+  @return the length of the blob, or -1 if an error occurs, or the value
+	  is not a blob.
+*/
+ssize_t state_get_blob(const char *name, const void **data);
+
+/**
+  A counter or gauge, which is a signed 64-bit integer in shared memory.
+*/
+typedef struct state_counter_s * state_counter_t;
+
+/**
+  Bind to a name, and publish a counter with a value of zero.
+
+  The counter is changed with state_counter_add() and state_counter_set(),
+  which are a single atomic instruction on the shared memory, without any
+  system calls or locks. Subscribers read the current value with
+  state_get_i64(), which is a plain load.
+
+  Since nothing is written through the kernel, subscribers are not
+  notified of every change. Instead, the value is sampled *sample_hz*
+  times a second by a background thread, and a notification is published
+  if it has changed since the last sample. If *sample_hz* is zero,
+  notifications are only sent by state_unbind().
+
+  The counter belongs to the process that bound it, but any number of
+  threads in that process may update it at once. It is freed by
+  state_unbind(), and cannot be published to with state_publish().
+  Counters are not supported with STATE_BROKER.
+
+  @return the counter, or NULL if an error occurs.
+*/
+state_counter_t state_bind_counter(const char *name, unsigned int sample_hz);
+
+/**
+  Add *delta*, which may be negative, to a counter.
+
+  @return the new value of the counter.
+*/
+int64_t state_counter_add(state_counter_t counter, int64_t delta);
+
+/**
+  Replace the value of a counter, for use as a gauge.
+*/
+void state_counter_set(state_counter_t counter, int64_t value);
+
+/**
+  The number of bytes of each value that are kept in a history.
+*/
+#define STATE_HISTORY_VALUE_MAX	240
+
+/**
+  A value returned by state_check_history().
+*/
+struct state_transition {
+	uint64_t seq;		/**< The position in the history, starting at one */
+	size_t	 len;		/**< The length of the value that was published */
+	char	 value[STATE_HISTORY_VALUE_MAX + 1];	/**< The value, truncated and NUL-terminated */
+};
+
+/**
+  Bind to a name, and keep a history of the last *depth* values
+  published to it, so that subscribers can see every transition even if
+  they only check once in a while.
+
+  The history is kept next to the state of the name, and is written by
+  state_publish() and state_publish_multi(), including values that a
+  throttled binding would not write. Values longer than
+  STATE_HISTORY_VALUE_MAX are truncated. Binding the name again with the
+  same depth continues the existing history. History is not supported
+  with STATE_BROKER.
+
+  @return 0 if successful, or -1 if an error occurs.
+*/
+int state_bind_history(const char *name, unsigned int depth);
+
+/**
+  Get the transitions of a name that have happened since *seq*, oldest
+  first, and advance *seq* past them. Start with *seq* set to zero to get
+  every transition that is still in the history. If more than *depth*
+  transitions happened since the last call, the oldest are lost, which
+  the caller can detect as a gap in the *seq* fields.
+
+  @param name the name of the notification
+  @param seq the position of the last transition that was seen
+  @param ts an array to store the transitions in
+  @param max the size of the *ts* array
+
+  @return the number of transitions stored in *ts*, which is less than
+	  *max* if there are no more, or -1 if an error occurs, such as the
+	  name not having a history.
+*/
+ssize_t state_check_history(const char *name, uint64_t *seq,
+		struct state_transition *ts, size_t max);
+
+/**
+  A value decoded by state_decode().
+*/
+struct state_typed {
+	int	 type;		/**< One of the STATE_TYPE_* constants */
+	int64_t	 i64;		/**< The value of a STATE_TYPE_I64 or STATE_TYPE_COUNTER */
+	double	 f64;		/**< The value of a STATE_TYPE_F64 */
+	int	 boolean;	/**< The value of a STATE_TYPE_BOOL */
+	const char *data;	/**< The bytes of a STATE_TYPE_BLOB or STATE_TYPE_STRING */
+	size_t	 len;		/**< The length of *data* */
+};
+
+/**
+  Decode a value, such as one returned in a struct state_event.
+
+  @return 0 if successful, or -1 if the value has a typed header that is
+	  truncated, or of a newer version or an unknown type.
+*/
+int state_decode(const char *value, size_t len, struct state_typed *tv);
+
+/**
+  Format any value as text, like snprintf(3). Numbers are printed in
+  decimal, booleans as "true" or "false", and blobs in hexadecimal.
+
+  @return the length of the text, which was truncated if it is not
+	  less than *size*, or -1 if the value could not be decoded.
+*/
+int state_format(const char *value, size_t len, char *buf, size_t size);
+
+/**
+  Counters returned by state_get_stats().
+*/
+struct state_stats {
+	unsigned long long published;	/**< Values written by this process */
+	unsigned long long suppressed;	/**< Publishes skipped because the value was unchanged */
+};
+
+/**
+  Get statistics about the notifications published by this process.
+
+  A call to state_publish(), or an element of state_publish_multi(), with
+  the same value as the last one published for that name is counted as
+  suppressed: nothing is written, and subscribers are not woken up.
+
+  @param stats Will be filled in with the current counters
+  @return 0 if successful, or -1 if an error occurs.
+*/
+int state_get_stats(struct state_stats *stats);
+
 /**
   Get a file descriptor that can be monitored for readability.
   When one more notifications are pending, the file descriptor will
@@ -135,31 +572,173 @@ int state_get(const char *key, char **value);
 int state_get_event_fd(void);
 
 /**
-  Submit a block to be executed when one or more state change notifications are pending.
+  A notification context.
+
+  Each context has its own event file descriptor, subscriptions,
+  bindings and pending notifications, and its own lock, so threads that
+  each use a separate context do not contend with each other. The
+  functions without a context argument use a default context, which is
+  set up by state_init().
+*/
+typedef struct state_ctx_s * state_ctx_t;
+
+/**
+  Create a new notification context.
+
+  This may be called from any thread, before or after state_init().
+  The same *flags* as state_init() are accepted.
+
+  @param flags Zero, or a bitwise OR of STATE_COALESCE, STATE_ARENA, and STATE_BROKER.
+  @return the new context, or NULL if an error occurs.
+*/
+state_ctx_t state_ctx_new(int flags);
+
+/**
+  Free a context created by state_ctx_new(), and everything that
+  belongs to it. No other thread may be using the context.
+*/
+void state_ctx_free(state_ctx_t ctx);
+
+/**
+  Get the default context, which is used by the functions that do
+  not take a context argument.
+*/
+state_ctx_t state_ctx_default(void);
 
-  This is basically a convenience function that implements the example code
-  shown in the documentation for notify_get_fd(). 
+/*
+  These are equivalent to the functions with the same name without the
+  ctx_ part, but operate on *ctx* instead of the default context.
+*/
+int state_ctx_bind(state_ctx_t ctx, const char *name);
+int state_ctx_bind_throttled(state_ctx_t ctx, const char *name,
+		unsigned int max_rate, unsigned int debounce_ms);
+int state_ctx_bind_reserved(state_ctx_t ctx, const char *name,
+		size_t capacity);
+int state_ctx_unbind(state_ctx_t ctx, const char *name);
+int state_ctx_subscribe(state_ctx_t ctx, const char *name);
+int state_ctx_unsubscribe(state_ctx_t ctx, const char *name);
+int state_ctx_subscribe_prefix(state_ctx_t ctx, const char *prefix);
+int state_ctx_unsubscribe_prefix(state_ctx_t ctx, const char *prefix);
+int state_ctx_publish(state_ctx_t ctx, const char *name, const char *state,
+		size_t len);
+int state_ctx_publish_multi(state_ctx_t ctx, const struct state_value *values,
+		size_t n);
+ssize_t state_ctx_check(state_ctx_t ctx, char **key, char **value);
+ssize_t state_ctx_check_many(state_ctx_t ctx, struct state_event *evs,
+		size_t max);
+ssize_t state_ctx_wait(state_ctx_t ctx, struct state_event *evs, size_t max,
+		int timeout_ms);
+int state_ctx_get(state_ctx_t ctx, const char *key, char **value);
+int state_ctx_get_if_changed(state_ctx_t ctx, const char *key,
+		unsigned int *gen, char **value);
+ssize_t state_ctx_peek(state_ctx_t ctx, const char *key, const char **value,
+		unsigned int *seq);
+int state_ctx_peek_valid(state_ctx_t ctx, const char *key, unsigned int seq);
+ssize_t state_ctx_get_range(state_ctx_t ctx, const char *key, size_t off,
+		size_t len, void *buf);
+int state_ctx_get_stats(state_ctx_t ctx, struct state_stats *stats);
+int state_ctx_get_event_fd(state_ctx_t ctx);
+int state_ctx_publish_i64(state_ctx_t ctx, const char *name, int64_t value);
+int state_ctx_publish_f64(state_ctx_t ctx, const char *name, double value);
+int state_ctx_publish_bool(state_ctx_t ctx, const char *name, int value);
+int state_ctx_publish_blob(state_ctx_t ctx, const char *name, const void *data,
+		size_t len);
+int state_ctx_get_i64(state_ctx_t ctx, const char *name, int64_t *value);
+int state_ctx_get_f64(state_ctx_t ctx, const char *name, double *value);
+int state_ctx_get_bool(state_ctx_t ctx, const char *name, int *value);
+ssize_t state_ctx_get_blob(state_ctx_t ctx, const char *name,
+		const void **data);
+state_counter_t state_ctx_bind_counter(state_ctx_t ctx, const char *name,
+		unsigned int sample_hz);
+int state_ctx_bind_history(state_ctx_t ctx, const char *name,
+		unsigned int depth);
+ssize_t state_ctx_check_history(state_ctx_t ctx, const char *name,
+		uint64_t *seq, struct state_transition *ts, size_t max);
 
-  You must include <dispatch/dispatch.h> and compile with -fblocks to have
-  access to this function.
+/**
+  A function to be called with each notification about a name.
 
-  @param name the name of the notification to wait for
-  @param queue the dispatch queue to run the block on
-  @param block the block of code to be executed
+  @param context the pointer that was passed when the function was registered
+  @param name the published name
+  @param value the new state, which is only valid until the function returns
+  @param len the length of the *value* string
 */
-#if defined(__block) && defined(dispatch_queue_t)
-void state_dispatch(char *name, dispatch_queue_t queue, void (^block)(void));
-#endif
+typedef void (*state_callback_f)(void *context, const char *name,
+		const char *value, ssize_t len);
 
 /**
-  Execute a callback function when one or more notifications are pending.
+  Call a function for each notification about a *name*.
+
+  This subscribes to *name* if needed, and starts a pool of worker
+  threads the first time it is called. The workers wait on the event fd,
+  read the notifications in batches, and call the function registered
+  for each name. The calls for one name are made one at a time, in the
+  order the notifications arrived, while different names are handled in
+  parallel.
+
+  Once a function has been registered, the workers consume every
+  notification, so state_check() and state_check_many() must not be
+  called. Use a separate context from state_ctx_new() to handle some
+  names in the application's own event loop. Notifications for names
+  with no function registered are discarded.
+
+  Registering a function for a name that already has one replaces it.
+
+  @param name the name of interest
+  @param context a pointer that is passed to *func*
+  @param func the function to call
+  @return 0 if successful, or -1 if an error occurs.
+*/
+int state_dispatch_f(const char *name, void *context, state_callback_f func);
 
-  This is equivalent to state_dispatch(), but without using blocks.
+/**
+  Call a function for each notification about a name that begins with
+  *prefix*, as if state_subscribe_prefix() and state_dispatch_f() had been
+  used. A function registered for the whole name, or for a longer prefix
+  of it, takes precedence.
+
+  @return 0 if successful, or -1 if an error occurs.
 */
-#ifdef dispatch_queue_t
-void state_dispatch_f(char *name, dispatch_queue_t queue, void *context, void (*func)(void *));
-#endif
+int state_dispatch_prefix_f(const char *prefix, void *context,
+		state_callback_f func);
+
+/**
+  Stop calling the function registered for a *name* or a prefix.
+
+  When this returns, the function is no longer running, unless this was
+  called from the function itself. The subscription is kept.
 
+  @return 0 if successful, or -1 if nothing was registered for *name*.
+*/
+int state_dispatch_cancel(const char *name);
+
+int state_ctx_dispatch_f(state_ctx_t ctx, const char *name, void *context,
+		state_callback_f func);
+int state_ctx_dispatch_prefix_f(state_ctx_t ctx, const char *prefix,
+		void *context, state_callback_f func);
+int state_ctx_dispatch_cancel(state_ctx_t ctx, const char *name);
+
+/**
+  Call a function with the current value of every name that begins with
+  *prefix*, in both the system and the user namespace.
+
+  This reads the state directly, with one pass over each directory, or
+  over each arena when STATE_ARENA is in effect, so nothing needs to be
+  subscribed to. The values are each consistent, but they are read one
+  after another, not all at the same instant. Names that have been
+  bound but not published yet have an empty value. Snapshots are not
+  supported with STATE_BROKER.
+
+  @param prefix the prefix of the names to read, or NULL for every name
+  @param func the function to call for each name, whose *value* is only
+	 valid until it returns
+  @param context a pointer that is passed to *func*
+  @return the number of names read, or -1 if an error occurs.
+*/
+ssize_t state_snapshot(const char *prefix, state_callback_f func,
+		void *context);
+ssize_t state_ctx_snapshot(state_ctx_t ctx, const char *prefix,
+		state_callback_f func, void *context);
 
 /**
   Open a logfile.
@@ -0,0 +1,279 @@
+/*
+ * Copyright (c) 2015 Mark Heily <mark@heily.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "platform.h"
+
+#if USE_IO_URING
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
+
+#include "ioengine.h"
+#include "log.h"
+
+/* Write one buffer, returning true if all of it was written */
+static bool sync_write(const struct io_write *iw)
+{
+	ssize_t nret;
+
+	do {
+		nret = pwrite(iw->iw_fd, iw->iw_buf, iw->iw_len, iw->iw_off);
+	} while (nret < 0 && errno == EINTR);
+	if (nret < 0) {
+		log_errno("pwrite(2)");
+		return false;
+	}
+	return (size_t) nret == iw->iw_len;
+}
+
+#if USE_IO_URING
+
+/* The parts of a ring that are shared with the kernel */
+struct uring_queue {
+	unsigned int *head;
+	unsigned int *tail;
+	unsigned int *mask;
+	unsigned int *array;	/* Submission queue only */
+};
+
+struct ioengine_s {
+	int	 ie_fd;
+	pthread_mutex_t ie_mtx;	/* Only one batch is in flight at a time */
+	bool	 ie_broken;	/* The kernel rejected a request; use pwrite(2) */
+	struct uring_queue ie_sq, ie_cq;
+	struct io_uring_sqe *ie_sqes;
+	struct io_uring_cqe *ie_cqes;
+	void	*ie_sq_ring, *ie_cq_ring;
+	size_t	 ie_sq_ring_sz, ie_cq_ring_sz, ie_sqes_sz;
+};
+
+static int uring_setup(unsigned int entries, struct io_uring_params *p)
+{
+	return (int) syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int uring_enter(int fd, unsigned int to_submit, unsigned int min_complete)
+{
+	return (int) syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+			IORING_ENTER_GETEVENTS, NULL, 0);
+}
+
+ioengine_t ioengine_new(void)
+{
+	struct io_uring_params p;
+	ioengine_t e;
+	char *sq, *cq;
+
+	if ((e = calloc(1, sizeof(*e))) == NULL) {
+		log_errno("calloc(3)");
+		return NULL;
+	}
+	e->ie_sq_ring = e->ie_cq_ring = e->ie_sqes = MAP_FAILED;
+	pthread_mutex_init(&e->ie_mtx, NULL);
+
+	memset(&p, 0, sizeof(p));
+	if ((e->ie_fd = uring_setup(IOENGINE_BATCH, &p)) < 0) {
+		log_debug("io_uring is not available (%s); using pwrite(2)",
+				strerror(errno));
+		goto err_out;
+	}
+	e->ie_sq_ring_sz = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	e->ie_cq_ring_sz = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (e->ie_cq_ring_sz > e->ie_sq_ring_sz)
+			e->ie_sq_ring_sz = e->ie_cq_ring_sz;
+		e->ie_cq_ring_sz = e->ie_sq_ring_sz;
+	}
+	e->ie_sq_ring = mmap(NULL, e->ie_sq_ring_sz, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, e->ie_fd, IORING_OFF_SQ_RING);
+	if (e->ie_sq_ring == MAP_FAILED) {
+		log_errno("mmap(2) of the io_uring submission queue");
+		goto err_out;
+	}
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		e->ie_cq_ring = e->ie_sq_ring;
+	} else {
+		e->ie_cq_ring = mmap(NULL, e->ie_cq_ring_sz, PROT_READ | PROT_WRITE,
+				MAP_SHARED | MAP_POPULATE, e->ie_fd, IORING_OFF_CQ_RING);
+		if (e->ie_cq_ring == MAP_FAILED) {
+			log_errno("mmap(2) of the io_uring completion queue");
+			goto err_out;
+		}
+	}
+	e->ie_sqes_sz = p.sq_entries * sizeof(struct io_uring_sqe);
+	e->ie_sqes = mmap(NULL, e->ie_sqes_sz, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, e->ie_fd, IORING_OFF_SQES);
+	if (e->ie_sqes == MAP_FAILED) {
+		log_errno("mmap(2) of the io_uring submission entries");
+		goto err_out;
+	}
+
+	sq = e->ie_sq_ring;
+	e->ie_sq.head = (unsigned int *) (sq + p.sq_off.head);
+	e->ie_sq.tail = (unsigned int *) (sq + p.sq_off.tail);
+	e->ie_sq.mask = (unsigned int *) (sq + p.sq_off.ring_mask);
+	e->ie_sq.array = (unsigned int *) (sq + p.sq_off.array);
+	cq = e->ie_cq_ring;
+	e->ie_cq.head = (unsigned int *) (cq + p.cq_off.head);
+	e->ie_cq.tail = (unsigned int *) (cq + p.cq_off.tail);
+	e->ie_cq.mask = (unsigned int *) (cq + p.cq_off.ring_mask);
+	e->ie_cqes = (struct io_uring_cqe *) (cq + p.cq_off.cqes);
+	log_debug("using io_uring for batched writes");
+	return e;
+
+err_out:
+	ioengine_free(e);
+	return NULL;
+}
+
+void ioengine_free(ioengine_t e)
+{
+	if (e == NULL)
+		return;
+	if (e->ie_sqes != MAP_FAILED)
+		(void) munmap(e->ie_sqes, e->ie_sqes_sz);
+	if (e->ie_cq_ring != MAP_FAILED && e->ie_cq_ring != e->ie_sq_ring)
+		(void) munmap(e->ie_cq_ring, e->ie_cq_ring_sz);
+	if (e->ie_sq_ring != MAP_FAILED)
+		(void) munmap(e->ie_sq_ring, e->ie_sq_ring_sz);
+	if (e->ie_fd >= 0)
+		(void) close(e->ie_fd);
+	(void) pthread_mutex_destroy(&e->ie_mtx);
+	free(e);
+}
+
+/*
+ * Submit up to IOENGINE_BATCH writes, and wait for all of them with the
+ * same system call. <done> is set for each write that completed. The
+ * caller must hold ie_mtx
+ */
+static void uring_write_locked(ioengine_t e, const struct io_write *ws,
+		size_t n, bool *done)
+{
+	struct io_uring_sqe *sqe;
+	struct io_uring_cqe *cqe;
+	unsigned int head, tail, idx;
+	size_t i, reaped;
+	int submitted, nret;
+
+	tail = *e->ie_sq.tail;
+	for (i = 0; i < n; i++) {
+		idx = tail & *e->ie_sq.mask;
+		sqe = &e->ie_sqes[idx];
+		memset(sqe, 0, sizeof(*sqe));
+		sqe->opcode = IORING_OP_WRITE;
+		sqe->fd = ws[i].iw_fd;
+		sqe->addr = (uintptr_t) ws[i].iw_buf;
+		sqe->len = ws[i].iw_len;
+		sqe->off = ws[i].iw_off;
+		sqe->user_data = i;
+		e->ie_sq.array[idx] = idx;
+		tail++;
+	}
+	__atomic_store_n(e->ie_sq.tail, tail, __ATOMIC_RELEASE);
+
+	do {
+		submitted = uring_enter(e->ie_fd, n, n);
+	} while (submitted < 0 && errno == EINTR);
+	if (submitted < 0 || (size_t) submitted < n) {
+		/* Entries left on the ring would be submitted by the next call */
+		log_errno("io_uring_enter(2)");
+		e->ie_broken = true;
+		if (submitted < 0)
+			return;
+	}
+
+	/* The buffers belong to the caller, so every completion must be seen */
+	for (reaped = 0; reaped < (size_t) submitted; ) {
+		head = *e->ie_cq.head;
+		if (head == __atomic_load_n(e->ie_cq.tail, __ATOMIC_ACQUIRE)) {
+			nret = uring_enter(e->ie_fd, 0, submitted - reaped);
+			if (nret < 0 && errno != EINTR) {
+				log_errno("io_uring_enter(2)");
+				(void) usleep(1000);
+			}
+			continue;
+		}
+		cqe = &e->ie_cqes[head & *e->ie_cq.mask];
+		i = cqe->user_data;
+		if (cqe->res == (int) ws[i].iw_len) {
+			done[i] = true;
+		} else if (cqe->res == -EINVAL || cqe->res == -EOPNOTSUPP) {
+			/* IORING_OP_WRITE is not supported by this kernel */
+			e->ie_broken = true;
+		}
+		__atomic_store_n(e->ie_cq.head, head + 1, __ATOMIC_RELEASE);
+		reaped++;
+	}
+}
+
+#else
+
+struct ioengine_s {
+	int	 ie_unused;
+};
+
+ioengine_t ioengine_new(void)
+{
+	return NULL;
+}
+
+void ioengine_free(ioengine_t e)
+{
+	(void) e;
+}
+
+#endif /* USE_IO_URING */
+
+int ioengine_write(ioengine_t e, const struct io_write *ws, size_t n)
+{
+	bool done[IOENGINE_BATCH];
+	size_t i, off, count;
+	int rv = 0;
+
+	for (off = 0; off < n; off += count) {
+		count = n - off;
+		if (count > IOENGINE_BATCH)
+			count = IOENGINE_BATCH;
+		memset(done, 0, sizeof(done));
+#if USE_IO_URING
+		/* A single write gains nothing from the ring */
+		if (e != NULL && count > 1) {
+			pthread_mutex_lock(&e->ie_mtx);
+			if (!e->ie_broken)
+				uring_write_locked(e, ws + off, count, done);
+			pthread_mutex_unlock(&e->ie_mtx);
+		}
+#else
+		(void) e;
+#endif
+		/* Anything the ring did not write is retried synchronously */
+		for (i = 0; i < count; i++) {
+			if (!done[i] && !sync_write(&ws[off + i]))
+				rv = -1;
+		}
+	}
+	return rv;
+}
@@ -0,0 +1,48 @@
+/*
+ * Copyright (c) 2015 Mark Heily <mark@heily.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef IOENGINE_H_
+#define IOENGINE_H_
+
+#include <stdbool.h>
+#include <sys/types.h>
+
+/*
+ * Writes that are submitted together. Where io_uring(7) is available,
+ * they are queued on a ring and submitted with a single system call,
+ * and otherwise each one is a pwrite(2). The choice is made at runtime,
+ * since the kernel or a seccomp(2) policy may not allow io_uring.
+ */
+
+#define IOENGINE_BATCH	64	/* The number of writes submitted at once */
+
+struct io_write {
+	int	 iw_fd;
+	const void *iw_buf;	/* Must remain valid until ioengine_write() returns */
+	size_t	 iw_len;
+	off_t	 iw_off;
+};
+
+typedef struct ioengine_s * ioengine_t;
+
+/* Returns NULL if io_uring cannot be used, so every write is synchronous */
+ioengine_t ioengine_new(void);
+void ioengine_free(ioengine_t e);
+
+/* Do every write in <ws>. <e> may be NULL. Returns -1 if any of them failed */
+int ioengine_write(ioengine_t e, const struct io_write *ws, size_t n);
+
+#endif /* IOENGINE_H_ */
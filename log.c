@@ -31,6 +31,9 @@ int log_open(const char *path)
 
 int log_close(void)
 {
-	if (!logfile) return -1;
-	return fclose(logfile);
+	FILE *f = logfile;
+
+	if (!f) return -1;
+	logfile = NULL;
+	return fclose(f);
 }
@@ -14,6 +14,10 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+#ifdef __linux__
+#define _GNU_SOURCE	/* for asprintf(3) */
+#endif
+
 #include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
@@ -27,38 +31,61 @@
 #include <syslog.h>
 #include <sys/queue.h>
 #include <sys/types.h>
-#include <sys/event.h>
 #include <sys/wait.h>
 #include <unistd.h>
 
 #include "include/state.h"
+#include "arena.h"
+#include "broker.h"
 #include "log.h"
 #include "platform.h"
 
+#if USE_KQUEUE
+#include <sys/event.h>
+#else
+#include <poll.h>
+#include <sys/signalfd.h>
+#endif
+
 struct state_s {
+	arena_t arena;
+	broker_t broker;	/* NULL unless the broker is enabled */
+#if USE_KQUEUE
 	int kqfd;
+#else
+	int sigfd;
+#endif
 } state;
 
 struct options_s {
 	bool daemon;
+	bool broker;
+	bool mount;
 	int log_level;
 	char *notifydir;
 	size_t tmpfs_size;
 } options = {
 	.daemon = true,
+	.broker = false,
+	.mount = true,
 	.log_level = 0,
 	.notifydir = STATE_PREFIX,
 	.tmpfs_size = 268435456,
 };
 
 void usage() {
-	printf("todo: usage\n");
+	printf("usage: stated [-bfn]\n"
+		"  -b  accept clients on a Unix domain socket, and fan out\n"
+		"      their notifications (see STATE_BROKER)\n"
+		"  -f  run in the foreground, logging to stderr\n"
+		"  -n  do not mount a tmpfs on the state directory\n");
 }
 
 static void signal_handler(int signum) {
 	(void) signum;
 }
 
+#if USE_KQUEUE
 static void setup_signal_handlers()
 {
 	const int signals[] = {SIGHUP, SIGUSR1, SIGCHLD, SIGINT, SIGTERM, 0};
@@ -71,6 +98,22 @@ static void setup_signal_handlers()
         if (signal(signals[i], signal_handler) == SIG_ERR) abort();
     }
 }
+#else
+static void setup_signal_handlers()
+{
+	const int signals[] = {SIGHUP, SIGUSR1, SIGCHLD, SIGINT, SIGTERM, 0};
+	sigset_t mask;
+	int i;
+
+	(void) signal_handler;
+	sigemptyset(&mask);
+	for (i = 0; signals[i] != 0; i++) {
+		sigaddset(&mask, signals[i]);
+	}
+	if (sigprocmask(SIG_BLOCK, &mask, NULL) < 0) abort();
+	if ((state.sigfd = signalfd(-1, &mask, SFD_CLOEXEC)) < 0) abort();
+}
+#endif
 
 static void mount_data_dirs() {
 	char *buf;
@@ -91,6 +134,35 @@ static void mount_data_dirs() {
 	free(buf);
 }
 
+/* Create the arena used by clients that pass STATE_ARENA to state_init() */
+static void create_arena() {
+	char *path;
+
+	if (asprintf(&path, "%s/%s", options.notifydir, ARENA_FILE) < 0)
+		abort();
+	if ((state.arena = arena_open(path, true)) == NULL)
+		abort();
+	free(path);
+}
+
+static void create_broker() {
+#if USE_KQUEUE
+	struct kevent kev;
+#endif
+	char *path;
+
+	if (asprintf(&path, "%s/%s", options.notifydir, BROKER_SOCKET) < 0)
+		abort();
+	if ((state.broker = broker_new(path)) == NULL)
+		abort();
+	free(path);
+#if USE_KQUEUE
+	EV_SET(&kev, broker_get_fd(state.broker), EVFILT_READ, EV_ADD, 0, 0,
+			state.broker);
+	if (kevent(state.kqfd, &kev, 1, NULL, 0, NULL) < 0) abort();
+#endif
+}
+
 static void umount_data_dirs() {
 	char *buf;
 
@@ -103,9 +175,33 @@ static void umount_data_dirs() {
 }
 
 static void do_shutdown() {
-	umount_data_dirs();
+	broker_free(state.broker);
+	arena_close(state.arena);
+	if (options.mount)
+		umount_data_dirs();
+}
+
+static void handle_signal(unsigned long signum)
+{
+	switch (signum) {
+	case SIGHUP:
+		break;
+	case SIGUSR1:
+		break;
+	case SIGCHLD:
+		break;
+	case SIGINT:
+	case SIGTERM:
+		log_notice("caught signal %lu, exiting", signum);
+		do_shutdown();
+		exit(0);
+		break;
+	default:
+		log_error("caught unexpected signal");
+	}
 }
 
+#if USE_KQUEUE
 static void main_loop() {
 	struct kevent kev;
 
@@ -120,30 +216,77 @@ static void main_loop() {
 			}
 		}
 		if (kev.udata == &setup_signal_handlers) {
-			switch (kev.ident) {
-			case SIGHUP:
-				break;
-			case SIGUSR1:
-				break;
-			case SIGCHLD:
-				break;
-			case SIGINT:
-			case SIGTERM:
-				log_notice("caught signal %lu, exiting", kev.ident);
-				do_shutdown();
-				exit(0);
-				break;
-			default:
-				log_error("caught unexpected signal");
-			}
+			handle_signal(kev.ident);
+		} else if (state.broker && kev.udata == state.broker) {
+			(void) broker_dispatch(state.broker);
 		} else {
 			log_warning("spurious wakeup, no known handlers");
 		}
 	}
 }
+#else
+static void main_loop() {
+	struct signalfd_siginfo ssi;
+	struct pollfd pfd[2];
+	ssize_t nret;
+
+	log_debug("main loop");
+	pfd[0].fd = state.sigfd;
+	pfd[0].events = POLLIN;
+	pfd[1].fd = state.broker ? broker_get_fd(state.broker) : -1;
+	pfd[1].events = POLLIN;
+	for (;;) {
+		if (poll(pfd, 2, -1) < 0) {
+			if (errno == EINTR) {
+				continue;
+			} else {
+				log_errno("poll");
+				abort();
+			}
+		}
+		if (pfd[1].revents & POLLIN)
+			(void) broker_dispatch(state.broker);
+		if (!(pfd[0].revents & POLLIN))
+			continue;
+		nret = read(state.sigfd, &ssi, sizeof(ssi));
+		if (nret < 0) {
+			if (errno == EINTR) {
+				continue;
+			} else {
+				log_errno("read");
+				abort();
+			}
+		}
+		if (nret != sizeof(ssi)) {
+			log_warning("short read from signalfd");
+			continue;
+		}
+		handle_signal(ssi.ssi_signo);
+	}
+}
+#endif
 
 int main(int argc, char *argv[]) 
 {
+	int c;
+
+	while ((c = getopt(argc, argv, "bfn")) != -1) {
+		switch (c) {
+		case 'b':
+			options.broker = true;
+			break;
+		case 'f':
+			options.daemon = false;
+			break;
+		case 'n':
+			options.mount = false;
+			break;
+		default:
+			usage();
+			exit(EX_USAGE);
+		}
+	}
+
 	if (options.daemon && daemon(0, 0) < 0) {
 		fprintf(stderr, "Unable to daemonize");
 		exit(EX_OSERR);
@@ -152,10 +295,16 @@ int main(int argc, char *argv[])
 		log_open("/dev/stderr");
 	}
 
+#if USE_KQUEUE
 	if ((state.kqfd = kqueue()) < 0) abort();
+#endif
 
 	setup_signal_handlers();
-	mount_data_dirs();
+	if (options.mount)
+		mount_data_dirs();
+	create_arena();
+	if (options.broker)
+		create_broker();
 	main_loop();
 	exit(EXIT_SUCCESS);
 }
@@ -0,0 +1,78 @@
+/*
+ * Copyright (c) 2015 Mark Heily <mark@heily.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#ifndef PREFIX_H_
+#define PREFIX_H_
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <sys/queue.h>
+#include <unistd.h>
+
+struct arena_ns;
+struct subscription_s;
+
+/*
+ * A subscription to every name that begins with <ps_prefix>, including
+ * names that are bound after it was made. Each matching name is given a
+ * subscription of its own, on the children list, when it is first seen.
+ */
+struct prefix_s {
+	LIST_ENTRY(prefix_s) ps_entry;
+	char   *ps_prefix;
+	size_t  ps_len;
+	LIST_HEAD(, subscription_s) ps_children;
+
+	/* Used when STATE_ARENA is in effect */
+	struct arena_ns *ps_ns;
+
+	/* Otherwise, the directory of state files is watched for new files */
+	char   *ps_dir;
+	const char *ps_dir_prefix;	/* Prepended to a file name to get the name */
+	int     ps_dirfd;
+	int     ps_wd;	/* Identifier returned by watch_add_dir() */
+	bool    ps_rescan;	/* The directory changed, but has not been scanned */
+	LIST_HEAD(, subscription_s) ps_new; /* New files that have not been reported yet */
+};
+typedef struct prefix_s * prefix_t;
+
+static prefix_t prefix_new()
+{
+	prefix_t ps;
+
+	ps = calloc(1, sizeof(*ps));
+	if (!ps) return NULL;
+	LIST_INIT(&ps->ps_children);
+	LIST_INIT(&ps->ps_new);
+	ps->ps_dir_prefix = "";
+	ps->ps_dirfd = -1;
+	ps->ps_wd = -1;
+	return ps;
+}
+
+static inline void prefix_free(prefix_t ps)
+{
+	if (ps) {
+		if (ps->ps_dirfd >= 0)
+			(void) close(ps->ps_dirfd);
+		free(ps->ps_prefix);
+		free(ps->ps_dir);
+		free(ps);
+	}
+}
+
+#endif /* PREFIX_H_ */
@@ -18,6 +18,7 @@
 #include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <poll.h>
 #include <inttypes.h>
 #include <signal.h>
 #include <stdbool.h>
@@ -28,60 +29,356 @@
 #include <sys/types.h>
 #include <unistd.h>
 
+#include "../hash.h"
 #include "../include/state.h"
 
+/* The longest line that is accepted by "statectl batch" */
+#define LINE_MAX_LEN	65536
+
+/* The number of values that are published together by "statectl batch" */
+#define BATCH_MAX	256
+
+/* A name that has been bound or subscribed to */
+struct name {
+	struct hash_node n_node;
+	char	*n_name;
+	bool	 n_bound;
+	bool	 n_subscribed;
+};
+
+static struct hash_table names;
+
+/* String values waiting to be published together */
+static struct state_value pending[BATCH_MAX];
+static char *pending_buf[BATCH_MAX];
+static size_t npending;
+
 static void usage()
 {
-	puts("TODO: print usage");
+	puts("usage: statectl get <name>\n"
+	     "       statectl set [-t string|i64|f64|bool] <name> <value>\n"
+	     "       statectl batch\n"
+	     "       statectl watch <name>...");
+}
+
+static struct name *name_lookup(const char *key)
+{
+	struct hash_node *hn;
+	struct name *n;
+	uint32_t hash = hash_string(key);
+
+	HASH_TABLE_FOREACH(hn, &names, hash) {
+		n = hn->hn_data;
+		if (hn->hn_hash == hash && strcmp(n->n_name, key) == 0)
+			return n;
+	}
+	if ((n = calloc(1, sizeof(*n))) == NULL ||
+			(n->n_name = strdup(key)) == NULL) {
+		puts("ERROR: out of memory");
+		exit(EX_OSERR);
+	}
+	hash_table_insert(&names, &n->n_node, hash, n);
+	return n;
+}
+
+static int bind_once(const char *key)
+{
+	struct name *n = name_lookup(key);
+
+	if (!n->n_bound) {
+		if (state_bind(key) < 0) {
+			puts("ERROR: unable to bind to key");
+			return -1;
+		}
+		n->n_bound = true;
+	}
+	return 0;
 }
 
-static void get_state(const char *key)
+static int subscribe_once(const char *key)
+{
+	struct name *n = name_lookup(key);
+
+	if (!n->n_subscribed) {
+		if (state_subscribe(key) < 0)
+			return -1;
+		n->n_subscribed = true;
+	}
+	return 0;
+}
+
+/* Print a value, decoding it if it is typed */
+static int print_value(const char *value, ssize_t len)
+{
+	char *text;
+	int textlen;
+
+	textlen = state_format(value, len, NULL, 0);
+	if (textlen < 0 || (text = malloc(textlen + 1)) == NULL) {
+		puts("ERROR: unable to decode the value");
+		return -1;
+	}
+	(void) state_format(value, len, text, textlen + 1);
+	printf("%s", text);
+	free(text);
+	return 0;
+}
+
+static int get_state(const char *key)
 {
 	char *value;
 	ssize_t len;
 
-	if (state_subscribe(key) < 0) {
-		printf("");
-		exit(EX_DATAERR);
+	if (subscribe_once(key) < 0)
+		return -1;
+	if ((len = state_get(key, &value)) < 0)
+		return -1;
+	return print_value(value, len);
+}
+
+static int set_state(const char *type, const char *key, const char *value)
+{
+	char *end;
+	int rv = -1;
+
+	if (bind_once(key) < 0)
+		return -1;
+	errno = 0;
+	if (strcmp(type, "string") == 0) {
+		rv = state_publish(key, value, strlen(value));
+	} else if (strcmp(type, "i64") == 0) {
+		rv = state_publish_i64(key, strtoll(value, &end, 10));
+	} else if (strcmp(type, "f64") == 0) {
+		rv = state_publish_f64(key, strtod(value, &end));
+	} else if (strcmp(type, "bool") == 0) {
+		end = "";
+		if (strcmp(value, "true") == 0 || strcmp(value, "1") == 0)
+			rv = state_publish_bool(key, 1);
+		else if (strcmp(value, "false") == 0 || strcmp(value, "0") == 0)
+			rv = state_publish_bool(key, 0);
+		else
+			end = "invalid";
+	} else {
+		printf("ERROR: unknown type %s\n", type);
+		return -1;
 	}
-	len = state_get(key, &value);
-	if (len < 0) {
-		printf("");
-		exit(EX_DATAERR);
+	if (strcmp(type, "string") != 0 && (*end != '\0' || end == value ||
+			errno == ERANGE)) {
+		printf("ERROR: %s is not a valid %s\n", value, type);
+		return -1;
 	}
-	printf("%s", value);
+	if (rv < 0) {
+		puts("ERROR: unable to publish new value");
+		return -1;
+	}
+	return 0;
 }
 
-static void set_state(const char *key, const char *value)
+/* Publish the queued string values at once */
+static int commit(void)
 {
-	if (state_bind(key) < 0) {
-		puts("ERROR: unable to bind to key");
-		exit(EX_DATAERR);
+	size_t i;
+	int rv = 0;
+
+	if (npending == 0)
+		return 0;
+	if (state_publish_multi(pending, npending) < 0) {
+		puts("ERROR: unable to publish new values");
+		rv = -1;
 	}
-	if (state_publish(key, value, strlen(value)) < 0) {
-		puts("ERROR: unable to publish new value");
-		exit(EX_DATAERR);
+	for (i = 0; i < npending; i++)
+		free(pending_buf[i]);
+	npending = 0;
+	return rv;
+}
+
+/* Queue a string value to be published by commit() */
+static int queue_state(const char *key, const char *value)
+{
+	size_t keylen = strlen(key) + 1;
+	char *buf;
+
+	if (bind_once(key) < 0)
+		return -1;
+	if (npending == BATCH_MAX && commit() < 0)
+		return -1;
+	if ((buf = malloc(keylen + strlen(value) + 1)) == NULL) {
+		puts("ERROR: out of memory");
+		return -1;
+	}
+	memcpy(buf, key, keylen);
+	strcpy(buf + keylen, value);
+	pending_buf[npending] = buf;
+	pending[npending].name = buf;
+	pending[npending].value = buf + keylen;
+	pending[npending].len = strlen(value);
+	npending++;
+	return 0;
+}
+
+/* Split off the next word of <*line>, which is separated by blanks */
+static char *next_word(char **line)
+{
+	char *word;
+
+	*line += strspn(*line, " \t");
+	if (**line == '\0')
+		return NULL;
+	word = *line;
+	*line += strcspn(*line, " \t");
+	if (**line != '\0')
+		*(*line)++ = '\0';
+	return word;
+}
+
+/* Run one line of "statectl batch" */
+static int batch_line(char *line)
+{
+	char *cmd, *type = "string", *key, *value;
+
+	if ((cmd = next_word(&line)) == NULL || cmd[0] == '#')
+		return 0;
+	if (strcmp(cmd, "commit") == 0)
+		return commit();
+	if (strcmp(cmd, "get") == 0) {
+		if ((key = next_word(&line)) == NULL || next_word(&line) != NULL) {
+			puts("ERROR: usage: get <name>");
+			return -1;
+		}
+		/* Values set earlier in the batch are visible */
+		if (commit() < 0)
+			return -1;
+		if (get_state(key) < 0) {
+			puts("");
+			return -1;
+		}
+		puts("");
+		return 0;
+	}
+	if (strcmp(cmd, "set") == 0) {
+		key = next_word(&line);
+		if (key && strcmp(key, "-t") == 0) {
+			type = next_word(&line);
+			key = next_word(&line);
+		}
+		/* The value is the rest of the line, so it may contain blanks */
+		line += strspn(line, " \t");
+		value = line;
+		if (type == NULL || key == NULL) {
+			puts("ERROR: usage: set [-t type] <name> <value>");
+			return -1;
+		}
+		if (strcmp(type, "string") == 0)
+			return queue_state(key, value);
+		if (commit() < 0)
+			return -1;
+		return set_state(type, key, value);
+	}
+	printf("ERROR: unknown command %s\n", cmd);
+	return -1;
+}
+
+/*
+ * Read commands from stdin, one per line, and run them in this process.
+ * Consecutive string values are published together with
+ * state_publish_multi(). Returns the number of commands that failed.
+ */
+static int batch(void)
+{
+	char *line;
+	size_t len;
+	int errors = 0;
+
+	if ((line = malloc(LINE_MAX_LEN)) == NULL) {
+		puts("ERROR: out of memory");
+		exit(EX_OSERR);
+	}
+	while (fgets(line, LINE_MAX_LEN, stdin) != NULL) {
+		len = strlen(line);
+		if (len > 0 && line[len - 1] == '\n')
+			line[--len] = '\0';
+		if (batch_line(line) < 0)
+			errors++;
+		fflush(stdout);
+	}
+	if (commit() < 0)
+		errors++;
+	free(line);
+	return errors;
+}
+
+/* Print "<name> <value>" for each change to the names, until interrupted */
+static void watch(char **keys, int nkeys)
+{
+	struct state_event evs[64];
+	struct pollfd pfd;
+	ssize_t i, n;
+
+	for (i = 0; i < nkeys; i++) {
+		if (subscribe_once(keys[i]) < 0) {
+			printf("ERROR: unable to subscribe to %s\n", keys[i]);
+			exit(EX_DATAERR);
+		}
+	}
+	pfd.fd = state_get_event_fd();
+	pfd.events = POLLIN;
+	for (;;) {
+		if (poll(&pfd, 1, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("poll");
+			exit(EX_OSERR);
+		}
+		while ((n = state_check_many(evs, 64)) > 0) {
+			for (i = 0; i < n; i++) {
+				printf("%s ", evs[i].key);
+				(void) print_value(evs[i].value, evs[i].len);
+				putchar('\n');
+			}
+		}
+		if (n < 0) {
+			puts("ERROR: unable to read notifications");
+			exit(EX_DATAERR);
+		}
+		fflush(stdout);
 	}
 }
 
 int main(int argc, char *argv[])
 {
-	if (argc < 3) {
+	int rv = 0;
+
+	if (argc < 2 || (argc < 3 && strcmp(argv[1], "batch") != 0)) {
 		usage();
 		exit(EX_USAGE);
 	}
 	state_init(0,0);
+	if (hash_table_init(&names) < 0) {
+		puts("ERROR: out of memory");
+		exit(EX_OSERR);
+	}
 	if (strcmp(argv[1], "get") == 0) {
-		get_state(argv[2]);
+		rv = get_state(argv[2]);
+	} else if (strcmp(argv[1], "set") == 0 && argc >= 4 &&
+			strcmp(argv[2], "-t") == 0) {
+		if (argc < 6) {
+			usage();
+			exit(EX_USAGE);
+		}
+		rv = set_state(argv[3], argv[4], argv[5]);
 	} else if (strcmp(argv[1], "set") == 0) {
 		if (argc < 4) {
 			usage();
 			exit(EX_USAGE);
 		}
-		set_state(argv[2], argv[3]);
+		rv = set_state("string", argv[2], argv[3]);
+	} else if (strcmp(argv[1], "batch") == 0) {
+		rv = batch() == 0 ? 0 : -1;
+	} else if (strcmp(argv[1], "watch") == 0) {
+		watch(argv + 2, argc - 2);
 	} else {
 		usage();
 		exit(EX_USAGE);
 	}
-	exit(EXIT_SUCCESS);
+	exit(rv < 0 ? EX_DATAERR : EXIT_SUCCESS);
 }
@@ -0,0 +1,441 @@
+/*
+ * Copyright (c) 2015 Mark Heily <mark@heily.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#include <fcntl.h>
+#include <sched.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "log.h"
+#include "statefile.h"
+
+/* The number of times a reader will retry before giving up */
+#define STATEFILE_MAX_RETRIES 1000
+
+static size_t page_round(size_t len)
+{
+	size_t pagesz = (size_t) sysconf(_SC_PAGESIZE);
+
+	return (len + pagesz - 1) & ~(pagesz - 1);
+}
+
+/* A mapping that was replaced by a larger one */
+struct statefile_mapping {
+	struct statefile_mapping *sm_next;
+	void	*sm_base;
+	size_t	 sm_size;
+};
+
+/* The number of bytes for the value that are covered by the mapping */
+static size_t mapped_capacity(const struct statefile *sf)
+{
+	return sf->sf_mapsz - sizeof(struct state_header);
+}
+
+/*
+ * The current mapping, as seen by a reader. The header is stored before
+ * the size, so a reader that sees the new size will also see the new header.
+ */
+static struct state_header *statefile_header(struct statefile *sf, size_t *size)
+{
+	*size = __atomic_load_n(&sf->sf_mapsz, __ATOMIC_ACQUIRE);
+	return __atomic_load_n(&sf->sf_hdr, __ATOMIC_RELAXED);
+}
+
+/* Unmap the file. There must be no readers left. */
+static void statefile_unmap(struct statefile *sf)
+{
+	struct statefile_mapping *sm;
+
+	if (sf->sf_hdr) {
+		(void) munmap(sf->sf_hdr, sf->sf_mapsz);
+		sf->sf_hdr = NULL;
+		sf->sf_mapsz = 0;
+	}
+	while ((sm = sf->sf_old) != NULL) {
+		sf->sf_old = sm->sm_next;
+		(void) munmap(sm->sm_base, sm->sm_size);
+		free(sm);
+	}
+}
+
+/*
+ * Map the entire file, if it has grown since it was last mapped, and
+ * check that it has a valid header.
+ */
+static int statefile_map(struct statefile *sf)
+{
+	struct statefile_mapping *sm;
+	struct state_header *hdr;
+	struct stat sb;
+	void *p;
+	int rv = -1;
+
+	pthread_mutex_lock(&sf->sf_mtx);
+	if (fstat(sf->sf_fd, &sb) < 0) {
+		log_errno("fstat(2)");
+		goto out;
+	}
+	if (sb.st_size < (off_t) sizeof(*hdr)) {
+		log_warning("state file is invalid; too short");
+		goto out;
+	}
+	if ((size_t) sb.st_size <= sf->sf_mapsz) {
+		/* Another reader got here first */
+		rv = 0;
+		goto out;
+	}
+	p = mmap(NULL, sb.st_size, sf->sf_prot, MAP_SHARED, sf->sf_fd, 0);
+	if (p == MAP_FAILED) {
+		log_errno("mmap(2)");
+		goto out;
+	}
+	hdr = p;
+	if (hdr->sh_magic != STATEFILE_MAGIC ||
+			hdr->sh_version != STATEFILE_VERSION) {
+		log_warning("state file is invalid; bad magic or version");
+		(void) munmap(p, sb.st_size);
+		goto out;
+	}
+	if (sf->sf_hdr) {
+		if ((sm = malloc(sizeof(*sm))) == NULL) {
+			log_errno("malloc(3)");
+			(void) munmap(p, sb.st_size);
+			goto out;
+		}
+		sm->sm_base = sf->sf_hdr;
+		sm->sm_size = sf->sf_mapsz;
+		sm->sm_next = sf->sf_old;
+		sf->sf_old = sm;
+	}
+	__atomic_store_n(&sf->sf_hdr, hdr, __ATOMIC_RELAXED);
+	__atomic_store_n(&sf->sf_mapsz, sb.st_size, __ATOMIC_RELEASE);
+	rv = 0;
+
+out:
+	pthread_mutex_unlock(&sf->sf_mtx);
+	return rv;
+}
+
+/* Make room for a value of <size> bytes, including the NUL */
+static int statefile_grow(struct statefile *sf, size_t size)
+{
+	struct state_header *hdr;
+	size_t newsz;
+
+	newsz = page_round(sizeof(*hdr) + size);
+	if (newsz < sf->sf_mapsz * 2)
+		newsz = sf->sf_mapsz * 2;
+	if (ftruncate(sf->sf_fd, newsz) < 0) {
+		log_errno("ftruncate(2)");
+		return -1;
+	}
+	if (statefile_map(sf) < 0)
+		return -1;
+	hdr = sf->sf_hdr;
+	__atomic_store_n(&hdr->sh_capacity, mapped_capacity(sf), __ATOMIC_RELEASE);
+	return 0;
+}
+
+int statefile_reserve(struct statefile *sf, size_t size)
+{
+	struct state_header *hdr;
+	size_t newsz;
+	int rv;
+
+	newsz = page_round(sizeof(*hdr) + size + 1);
+	if (newsz < sf->sf_mapsz)
+		newsz = sf->sf_mapsz;
+	if ((rv = posix_fallocate(sf->sf_fd, 0, newsz)) != 0) {
+		log_error("posix_fallocate(2): %s", strerror(rv));
+		return -1;
+	}
+	if (statefile_map(sf) < 0)
+		return -1;
+	hdr = sf->sf_hdr;
+	__atomic_store_n(&hdr->sh_capacity, mapped_capacity(sf), __ATOMIC_RELEASE);
+	return 0;
+}
+
+/* Rewrite the sequence number in place, so the kernel notifies subscribers */
+int statefile_notify(struct statefile *sf)
+{
+	uint32_t seq = sf->sf_hdr->sh_seq;
+
+	if (pwrite(sf->sf_fd, &seq, sizeof(seq),
+			offsetof(struct state_header, sh_seq)) < (ssize_t) sizeof(seq)) {
+		log_errno("pwrite(2)");
+		return -1;
+	}
+	return 0;
+}
+
+int statefile_notify_many(struct statefile **sfs, size_t n, ioengine_t e)
+{
+	struct io_write ws[IOENGINE_BATCH];
+	size_t i, off, count;
+	int rv = 0;
+
+	for (off = 0; off < n; off += count) {
+		count = n - off;
+		if (count > IOENGINE_BATCH)
+			count = IOENGINE_BATCH;
+		for (i = 0; i < count; i++) {
+			/* The copy must outlive an asynchronous write */
+			sfs[off + i]->sf_notify_seq = sfs[off + i]->sf_hdr->sh_seq;
+			ws[i].iw_fd = sfs[off + i]->sf_fd;
+			ws[i].iw_buf = &sfs[off + i]->sf_notify_seq;
+			ws[i].iw_len = sizeof(uint32_t);
+			ws[i].iw_off = offsetof(struct state_header, sh_seq);
+		}
+		if (ioengine_write(e, ws, count) < 0)
+			rv = -1;
+	}
+	return rv;
+}
+
+static void statefile_store(struct statefile *sf, const char *value, size_t len)
+{
+	struct state_header *hdr = sf->sf_hdr;
+	uint32_t seq = hdr->sh_seq & ~1u; /* Recover from an interrupted write */
+
+	__atomic_store_n(&hdr->sh_seq, seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	memcpy(STATEFILE_DATA(hdr), value, len);
+	STATEFILE_DATA(hdr)[len] = '\0';
+	__atomic_store_n(&hdr->sh_len, len, __ATOMIC_RELAXED);
+	__atomic_store_n(&hdr->sh_seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+char *statefile_value(struct statefile *sf)
+{
+	return STATEFILE_DATA(sf->sf_hdr);
+}
+
+void statefile_touch(struct statefile *sf)
+{
+	struct state_header *hdr = sf->sf_hdr;
+	uint32_t seq = __atomic_load_n(&hdr->sh_seq, __ATOMIC_RELAXED) & ~1u;
+
+	__atomic_store_n(&hdr->sh_seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+void statefile_init(struct statefile *sf)
+{
+	memset(sf, 0, sizeof(*sf));
+	sf->sf_fd = -1;
+	pthread_mutex_init(&sf->sf_mtx, NULL);
+}
+
+void statefile_close(struct statefile *sf)
+{
+	statefile_unmap(sf);
+	if (sf->sf_fd >= 0) {
+		(void) close(sf->sf_fd);
+		sf->sf_fd = -1;
+	}
+	(void) pthread_mutex_destroy(&sf->sf_mtx);
+}
+
+int statefile_create(struct statefile *sf, const char *path)
+{
+	struct state_header *hdr;
+	size_t size;
+
+	sf->sf_prot = PROT_READ | PROT_WRITE;
+	if ((sf->sf_fd = open(path, O_CREAT | O_RDWR, 0644)) < 0) {
+		log_errno("open(2) of %s", path);
+		return -1;
+	}
+
+	if (statefile_map(sf) == 0 &&
+			sf->sf_hdr->sh_capacity <= mapped_capacity(sf)) {
+		/* Reuse the existing file, since subscribers may have it mapped */
+		statefile_store(sf, "", 0);
+		return 0;
+	}
+
+	/* Nobody can have mapped an invalid file, so it is safe to shrink it */
+	statefile_unmap(sf);
+	size = page_round(sizeof(*hdr) + 1);
+	if (ftruncate(sf->sf_fd, 0) < 0 || ftruncate(sf->sf_fd, size) < 0) {
+		log_errno("ftruncate(2) of %s", path);
+		return -1;
+	}
+	hdr = mmap(NULL, size, sf->sf_prot, MAP_SHARED, sf->sf_fd, 0);
+	if (hdr == MAP_FAILED) {
+		log_errno("mmap(2) of %s", path);
+		return -1;
+	}
+	sf->sf_hdr = hdr;
+	sf->sf_mapsz = size;
+	hdr->sh_version = STATEFILE_VERSION;
+	hdr->sh_seq = 0;
+	hdr->sh_capacity = mapped_capacity(sf);
+	hdr->sh_len = 0;
+	__atomic_store_n(&hdr->sh_magic, STATEFILE_MAGIC, __ATOMIC_RELEASE);
+	return 0;
+}
+
+int statefile_open(struct statefile *sf, const char *path)
+{
+	sf->sf_prot = PROT_READ;
+	if ((sf->sf_fd = open(path, O_CREAT | O_RDONLY, 0644)) < 0) {
+		log_errno("open(2) of %s", path);
+		return -1;
+	}
+	/* The file is mapped on the first read, once a publisher has created it */
+	return 0;
+}
+
+int statefile_open_existing(struct statefile *sf, int dirfd, const char *name)
+{
+	struct stat sb;
+
+	sf->sf_prot = PROT_READ;
+	if ((sf->sf_fd = openat(dirfd, name, O_RDONLY)) < 0)
+		return -1;
+	if (fstat(sf->sf_fd, &sb) < 0 || sb.st_size < (off_t) sizeof(struct state_header))
+		return -1;
+	return 0;
+}
+
+int statefile_update(struct statefile *sf, const char *value, size_t len)
+{
+	if (len >= mapped_capacity(sf) && statefile_grow(sf, len + 1) < 0)
+		return -1;
+	statefile_store(sf, value, len);
+	return 0;
+}
+
+int statefile_write(struct statefile *sf, const char *value, size_t len)
+{
+	if (statefile_update(sf, value, len) < 0)
+		return -1;
+	return statefile_notify(sf);
+}
+
+/*
+ * Wait for a stable sequence number, and return the length of the value
+ * and the mapping that holds it. The mapping is refreshed if the value
+ * has grown past the end of it.
+ */
+static ssize_t statefile_begin_read(struct statefile *sf, uint32_t *seq,
+		struct state_header **hdrp)
+{
+	struct state_header *hdr;
+	size_t size;
+	uint64_t len;
+	int retries;
+
+	hdr = statefile_header(sf, &size);
+	if (hdr == NULL) {
+		if (statefile_map(sf) < 0)
+			return -1;
+		hdr = statefile_header(sf, &size);
+	}
+	for (retries = 0; retries < STATEFILE_MAX_RETRIES; retries++) {
+		*seq = __atomic_load_n(&hdr->sh_seq, __ATOMIC_ACQUIRE);
+		if (*seq & 1) {
+			(void) sched_yield();
+			continue;
+		}
+		len = __atomic_load_n(&hdr->sh_len, __ATOMIC_RELAXED);
+		if (len < size - sizeof(*hdr)) {
+			*hdrp = hdr;
+			return len;
+		}
+
+		/* The file grew, or the header is corrupt */
+		if (statefile_map(sf) < 0)
+			return -1;
+		hdr = statefile_header(sf, &size);
+		if (len >= size - sizeof(*hdr) && statefile_validate(sf, *seq)) {
+			log_warning("state file is invalid; length exceeds file size");
+			return -1;
+		}
+	}
+	log_warning("gave up reading a state file that is constantly changing");
+	return -1;
+}
+
+ssize_t statefile_read(struct statefile *sf, char **buf, size_t *bufsz,
+		uint32_t *seq)
+{
+	struct state_header *hdr;
+	ssize_t len;
+	int retries;
+
+	for (retries = 0; retries < STATEFILE_MAX_RETRIES; retries++) {
+		if ((len = statefile_begin_read(sf, seq, &hdr)) < 0)
+			return -1;
+		if (*bufsz <= (size_t) len) {
+			char *newbuf = realloc(*buf, len + 1);
+			if (newbuf == NULL) {
+				log_errno("realloc(3)");
+				return -1;
+			}
+			*buf = newbuf;
+			*bufsz = len + 1;
+		}
+		memcpy(*buf, STATEFILE_DATA(hdr), len);
+		(*buf)[len] = '\0';
+		if (statefile_validate(sf, *seq))
+			return len;
+	}
+	log_warning("gave up reading a state file that is constantly changing");
+	return -1;
+}
+
+ssize_t statefile_peek(struct statefile *sf, const char **value,
+		uint32_t *seq)
+{
+	struct state_header *hdr;
+	ssize_t len;
+
+	if ((len = statefile_begin_read(sf, seq, &hdr)) < 0)
+		return -1;
+	*value = STATEFILE_DATA(hdr);
+	return len;
+}
+
+int statefile_validate(struct statefile *sf, uint32_t seq)
+{
+	struct state_header *hdr;
+	size_t size;
+
+	if ((hdr = statefile_header(sf, &size)) == NULL)
+		return 0;
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	return __atomic_load_n(&hdr->sh_seq, __ATOMIC_RELAXED) == seq;
+}
+
+int statefile_unlinked(struct statefile *sf)
+{
+	struct stat sb;
+
+	if (fstat(sf->sf_fd, &sb) < 0) {
+		log_errno("fstat(2)");
+		return -1;
+	}
+	return sb.st_nlink == 0;
+}
@@ -0,0 +1,136 @@
+/*
+ * Copyright (c) 2015 Mark Heily <mark@heily.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#ifndef STATEFILE_H_
+#define STATEFILE_H_
+
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "ioengine.h"
+
+/*
+ * The on-disk format of a state file. The file is mapped into memory by
+ * both the publisher and the subscribers, and the value is protected by
+ * a sequence lock: sh_seq is odd while an update is in progress, and
+ * readers retry if it changed while they were copying the value.
+ *
+ * The file never shrinks while it is bound, so a reader never faults
+ * on a page that has been truncated away.
+ */
+struct state_header {
+	uint32_t sh_magic;	/* STATEFILE_MAGIC */
+	uint32_t sh_version;	/* STATEFILE_VERSION */
+	uint32_t sh_seq;	/* Sequence counter; odd while being written */
+	uint32_t sh_reserved;
+	uint64_t sh_capacity;	/* Bytes available for the value and its NUL */
+	uint64_t sh_len;	/* Length of the value, excluding the NUL */
+};
+
+#define STATEFILE_MAGIC		0x54415453	/* "STAT" in little-endian */
+#define STATEFILE_VERSION	1
+
+/* The value follows the header */
+#define STATEFILE_DATA(hdr)	((char *) (hdr) + sizeof(struct state_header))
+
+struct statefile_mapping;
+
+/*
+ * Several threads may read the same state file at once. The mapping is
+ * replaced by a larger one when the file grows, and the old one is kept
+ * until the file is closed, since other readers may still be using it.
+ */
+struct statefile {
+	int	sf_fd;
+	struct state_header *sf_hdr;	/* The current mapping, or NULL if not mapped */
+	size_t	sf_mapsz;		/* The size of the current mapping */
+	int	sf_prot;		/* Protection of the mapping */
+	pthread_mutex_t sf_mtx;		/* Serializes remapping */
+	struct statefile_mapping *sf_old;	/* Earlier mappings */
+	uint32_t sf_notify_seq;		/* Written by statefile_notify_many() */
+};
+
+void statefile_init(struct statefile *sf);
+void statefile_close(struct statefile *sf);
+
+/* Open a state file for publishing, creating it if needed */
+int statefile_create(struct statefile *sf, const char *path);
+
+/* Open a state file for subscribing, creating it if needed */
+int statefile_open(struct statefile *sf, const char *path);
+
+/*
+ * Allocate the disk space for a value of up to <size> bytes, so that
+ * updates do not have to grow the file, and subscribers do not have to
+ * map it again.
+ */
+int statefile_reserve(struct statefile *sf, size_t size);
+
+/*
+ * Open the state file <name> in the directory <dirfd> for reading, without
+ * creating it. Returns -1 if it does not exist, or has never been bound.
+ */
+int statefile_open_existing(struct statefile *sf, int dirfd, const char *name);
+
+/* Replace the value, and notify any subscribers */
+int statefile_write(struct statefile *sf, const char *value, size_t len);
+
+/* The two halves of statefile_write() */
+int statefile_update(struct statefile *sf, const char *value, size_t len);
+int statefile_notify(struct statefile *sf);
+
+/* Like statefile_notify(), but for several files with as few system calls as <e> allows */
+int statefile_notify_many(struct statefile **sfs, size_t n, ioengine_t e);
+
+/*
+ * Get a pointer to the value inside the mapping of a file opened with
+ * statefile_create(), so that it can be modified in place. It stays
+ * valid until the file is closed, but the value must not grow.
+ */
+char *statefile_value(struct statefile *sf);
+
+/*
+ * Tell readers that a value modified in place has changed, by advancing
+ * the sequence number. Call statefile_notify() after.
+ */
+void statefile_touch(struct statefile *sf);
+
+/*
+ * Copy the value into <*buf>, growing it as needed, and store the
+ * sequence number of the copy in <seq>. No system calls are made
+ * unless the file has grown since it was mapped.
+ */
+ssize_t statefile_read(struct statefile *sf, char **buf, size_t *bufsz,
+		uint32_t *seq);
+
+/*
+ * Get a pointer to the value inside the mapping without copying it.
+ * The value is only consistent if statefile_validate() returns true
+ * for <seq> after the caller is done with it.
+ */
+ssize_t statefile_peek(struct statefile *sf, const char **value,
+		uint32_t *seq);
+int statefile_validate(struct statefile *sf, uint32_t seq);
+
+/*
+ * Returns 1 if the file has been removed from its directory, 0 if it has
+ * not, or -1 on error
+ */
+int statefile_unlinked(struct statefile *sf);
+
+#endif /* STATEFILE_H_ */
@@ -0,0 +1,357 @@
+/*
+ * Copyright (c) 2015 Mark Heily <mark@heily.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#include <errno.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sysexits.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../hash.h"
+#include "../include/state.h"
+
+#define LIST_FORMAT	"%-32s %s\n"
+#define TOP_HEADER	"%-32s %9s %8s %8s  %s\n"
+#define TOP_FORMAT	"%-32s %9.1f %8s %8zd  %s\n"
+
+/* The longest value that is shown */
+#define VALUE_MAX	256
+
+/* A name seen by the last snapshot */
+struct key {
+	struct hash_node k_node;	/* Indexed by <k_name> */
+	char	*k_name;
+	char	 k_value[VALUE_MAX];	/* The first line of the value, as text */
+	ssize_t	 k_len;		/* The size of the value */
+	unsigned int k_gen;	/* The generation at the last sample */
+	bool	 k_subscribed;
+	double	 k_rate;	/* Values published per second */
+	double	 k_changed;	/* When the generation last changed, or zero */
+	unsigned long k_seen;	/* The number of the last snapshot that saw it */
+};
+
+struct keys {
+	struct hash_table ks_table;
+	struct key **ks_array;	/* For sorting */
+	size_t ks_count, ks_size;
+	unsigned long ks_snapshot;
+	bool ks_watch;		/* Measure how often each name is published */
+	double ks_now, ks_elapsed;
+};
+
+static volatile sig_atomic_t stop;
+
+static void usage(void)
+{
+	puts("usage: statestat [-a] [-w] [-i seconds] [-c count] [prefix]\n"
+	     "\n"
+	     "  -a          read the state from arenas\n"
+	     "  -w          show the most frequently published names, like top(1)\n"
+	     "  -i seconds  the time between updates with -w (default: 1)\n"
+	     "  -c count    exit after this many updates with -w");
+}
+
+static void on_signal(int signo)
+{
+	(void) signo;
+	stop = 1;
+}
+
+static double now_seconds(void)
+{
+	struct timespec ts;
+
+	(void) clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Copy the first line of a value into <buf>, decoding it if it is typed */
+static void value_text(const char *value, ssize_t len, char *buf)
+{
+	char *nl;
+
+	if (state_format(value, len, buf, VALUE_MAX) < 0)
+		(void) snprintf(buf, VALUE_MAX, "(invalid)");
+	if ((nl = strchr(buf, '\n')) != NULL)
+		*nl = '\0';
+}
+
+static struct key *key_lookup(struct keys *ks, const char *name)
+{
+	struct hash_node *hn;
+	struct key *k;
+	uint32_t hash = hash_string(name);
+
+	HASH_TABLE_FOREACH(hn, &ks->ks_table, hash) {
+		k = hn->hn_data;
+		if (hn->hn_hash == hash && strcmp(k->k_name, name) == 0)
+			return k;
+	}
+	if ((k = calloc(1, sizeof(*k))) == NULL ||
+			(k->k_name = strdup(name)) == NULL) {
+		perror("calloc");
+		exit(EX_OSERR);
+	}
+	hash_table_insert(&ks->ks_table, &k->k_node, hash, k);
+	return k;
+}
+
+static void key_free(struct key *k)
+{
+	free(k->k_name);
+	free(k);
+}
+
+/* Called by state_snapshot() for each name */
+static void key_update(void *context, const char *name, const char *value,
+		ssize_t len)
+{
+	struct keys *ks = context;
+	struct key *k = key_lookup(ks, name);
+	unsigned int gen;
+	char *current;
+
+	value_text(value, len, k->k_value);
+	k->k_len = len;
+	k->k_seen = ks->ks_snapshot;
+	if (!ks->ks_watch)
+		return;
+
+	/* The generation counts every value published, not just the ones we saw */
+	if (!k->k_subscribed) {
+		if (state_subscribe(name) < 0)
+			return;
+		k->k_subscribed = true;
+		(void) state_get_if_changed(name, &k->k_gen, &current);
+		return;
+	}
+	gen = k->k_gen;
+	if (state_get_if_changed(name, &k->k_gen, &current) > 0) {
+		k->k_rate = (k->k_gen - gen) / ks->ks_elapsed;
+		k->k_changed = ks->ks_now;
+	} else {
+		k->k_rate = 0;
+	}
+}
+
+static int by_name(const void *a, const void *b)
+{
+	return strcmp((*(struct key * const *) a)->k_name,
+			(*(struct key * const *) b)->k_name);
+}
+
+static int by_rate(const void *a, const void *b)
+{
+	const struct key *ka = *(struct key * const *) a;
+	const struct key *kb = *(struct key * const *) b;
+
+	if (ka->k_rate != kb->k_rate)
+		return ka->k_rate < kb->k_rate ? 1 : -1;
+	if (ka->k_changed != kb->k_changed)
+		return ka->k_changed < kb->k_changed ? 1 : -1;
+	return strcmp(ka->k_name, kb->k_name);
+}
+
+/* Take a snapshot, forget the names that are gone, and sort the rest */
+static void keys_refresh(struct keys *ks, const char *prefix,
+		int (*compare)(const void *, const void *))
+{
+	struct hash_node *hn;
+	struct key *k;
+	size_t i, n = 0;
+
+	ks->ks_snapshot++;
+	if (state_snapshot(prefix, key_update, ks) < 0) {
+		puts("ERROR: unable to read the state");
+		exit(EX_DATAERR);
+	}
+	if (ks->ks_table.ht_count > ks->ks_size) {
+		ks->ks_size = ks->ks_table.ht_count * 2;
+		ks->ks_array = realloc(ks->ks_array,
+				ks->ks_size * sizeof(*ks->ks_array));
+		if (ks->ks_array == NULL) {
+			perror("realloc");
+			exit(EX_OSERR);
+		}
+	}
+	HASH_TABLE_FOREACH_ALL(hn, &ks->ks_table, i) {
+		ks->ks_array[n++] = hn->hn_data;
+	}
+
+	/* Keep the names in this snapshot at the front of the array */
+	ks->ks_count = 0;
+	for (i = 0; i < n; i++) {
+		k = ks->ks_array[i];
+		if (k->k_seen == ks->ks_snapshot) {
+			ks->ks_array[ks->ks_count++] = k;
+			continue;
+		}
+		if (k->k_subscribed)
+			(void) state_unsubscribe(k->k_name);
+		hash_table_remove(&ks->ks_table, &k->k_node);
+		key_free(k);
+	}
+	qsort(ks->ks_array, ks->ks_count, sizeof(*ks->ks_array), compare);
+}
+
+static void list(struct keys *ks, const char *prefix)
+{
+	size_t i;
+
+	keys_refresh(ks, prefix, by_name);
+	printf(LIST_FORMAT, "NAME", "VALUE");
+	for (i = 0; i < ks->ks_count; i++)
+		printf(LIST_FORMAT, ks->ks_array[i]->k_name, ks->ks_array[i]->k_value);
+}
+
+/* Format the time since a name last changed */
+static void format_age(const struct key *k, double now, char *buf, size_t size)
+{
+	double age = now - k->k_changed;
+
+	if (k->k_changed == 0)
+		(void) snprintf(buf, size, "-");
+	else if (age < 60)
+		(void) snprintf(buf, size, "%.1fs", age);
+	else if (age < 3600)
+		(void) snprintf(buf, size, "%.0fm", age / 60);
+	else
+		(void) snprintf(buf, size, "%.0fh", age / 3600);
+}
+
+/* The number of names that fit on the terminal, or zero if there is no limit */
+static size_t screen_rows(void)
+{
+	struct winsize ws;
+
+	if (!isatty(STDOUT_FILENO) || ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) < 0 ||
+			ws.ws_row < 4)
+		return 0;
+	return ws.ws_row - 3;
+}
+
+static void top(struct keys *ks, const char *prefix, double interval,
+		long count)
+{
+	struct state_event evs[64];
+	struct key *k;
+	char age[16];
+	double last, deadline, total;
+	size_t i, rows;
+	long n;
+
+	last = now_seconds();
+	keys_refresh(ks, prefix, by_rate);
+	for (n = 0; !stop && (count == 0 || n < count); n++) {
+		/* Drain notifications while waiting, so the event queue never overflows */
+		deadline = last + interval;
+		while (!stop && (ks->ks_now = now_seconds()) < deadline) {
+			if (state_wait(evs, 64, (int) ((deadline - ks->ks_now) * 1000) + 1) < 0)
+				break;
+		}
+		ks->ks_elapsed = ks->ks_now - last;
+		last = ks->ks_now;
+		keys_refresh(ks, prefix, by_rate);
+
+		total = 0;
+		for (i = 0; i < ks->ks_count; i++)
+			total += ks->ks_array[i]->k_rate;
+		rows = screen_rows();
+		if (isatty(STDOUT_FILENO))
+			printf("\033[H\033[2J");
+		else if (n > 0)
+			putchar('\n');
+		printf("%zu names, %.1f values/s\n\n", ks->ks_count, total);
+		printf(TOP_HEADER, "NAME", "RATE/s", "AGE", "SIZE", "VALUE");
+		for (i = 0; i < ks->ks_count && (rows == 0 || i < rows); i++) {
+			k = ks->ks_array[i];
+			format_age(k, ks->ks_now, age, sizeof(age));
+			printf(TOP_FORMAT, k->k_name, k->k_rate, age, k->k_len, k->k_value);
+		}
+		fflush(stdout);
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	struct keys ks;
+	const char *prefix = NULL;
+	double interval = 1;
+	long count = 0;
+	bool watch = false;
+	int c, flags = 0;
+	char *end;
+
+	while ((c = getopt(argc, argv, "ac:hi:w")) != -1) {
+		switch (c) {
+		case 'a':
+			flags |= STATE_ARENA;
+			break;
+		case 'c':
+			count = strtol(optarg, &end, 10);
+			if (*end != '\0' || count <= 0) {
+				usage();
+				exit(EX_USAGE);
+			}
+			break;
+		case 'i':
+			interval = strtod(optarg, &end);
+			if (*end != '\0' || interval <= 0) {
+				usage();
+				exit(EX_USAGE);
+			}
+			break;
+		case 'w':
+			watch = true;
+			break;
+		default:
+			usage();
+			exit(c == 'h' ? EXIT_SUCCESS : EX_USAGE);
+		}
+	}
+	if (optind < argc)
+		prefix = argv[optind++];
+	if (optind < argc) {
+		usage();
+		exit(EX_USAGE);
+	}
+
+	if (state_init(0, flags) < 0) {
+		puts("ERROR: unable to initialize libstate");
+		exit(EX_OSERR);
+	}
+	memset(&ks, 0, sizeof(ks));
+	if (hash_table_init(&ks.ks_table) < 0) {
+		perror("hash_table_init");
+		exit(EX_OSERR);
+	}
+	if (watch) {
+		ks.ks_watch = true;
+		signal(SIGINT, on_signal);
+		signal(SIGTERM, on_signal);
+		top(&ks, prefix, interval, count);
+	} else {
+		list(&ks, prefix);
+	}
+	exit(EXIT_SUCCESS);
+}
@@ -19,14 +19,42 @@
 
 #include "include/state.h"
 #include "binding.h"
+#include "hash.h"
+#include "prefix.h"
+
+struct arena_ns;
 
 struct subscription_s {
-	SLIST_ENTRY(subscription_s) entry;
-	int     sub_fd;
+	struct hash_node sub_name_node;	/* Indexed by <sub_name> */
+	struct hash_node sub_wd_node;	/* Indexed by <sub_wd> */
+	SLIST_ENTRY(subscription_s) sub_dead_entry;
+
+	/* Used instead of <sub_file> and <sub_wd> when STATE_ARENA is in effect */
+	struct arena_ns *sub_ns;
+	int     sub_slot;	/* -1 until a publisher has created the slot */
+	struct hash_node sub_slot_node;	/* Indexed by <sub_slot> */
+	LIST_ENTRY(subscription_s) sub_unresolved_entry;
+
+	/* Set if this was made on behalf of state_subscribe_prefix() */
+	struct prefix_s *sub_prefix;
+	LIST_ENTRY(subscription_s) sub_prefix_entry;
+	bool    sub_new;	/* On the ps_new list of <sub_prefix> */
+	LIST_ENTRY(subscription_s) sub_new_entry;
+
+	struct statefile sub_file;
+	int     sub_wd;	/* Identifier returned by watch_add() */
 	char   *sub_name;
 	char   *sub_path;
+	uint32_t sub_hash;	/* hash_string(<sub_name>) */
+	uint64_t sub_id;	/* Never reused, so it can identify a freed subscription */
+
+	/* Bookkeeping for state_check_many() */
+	unsigned int sub_drain;	/* The last drain that returned this subscription */
+	bool    sub_stale;	/* The state file changed, but has not been re-read */
+	bool    sub_error;	/* The state file could not be re-read */
 
-	/* The current state of <sub_name> is stored below */
+	/* A copy of the current state of <sub_name> is stored below */
+	uint32_t sub_seq;	/* The sequence number of the copy */
 	char   *sub_buf;
 	size_t  sub_buflen, sub_bufsz;
 };
@@ -38,14 +66,16 @@ static subscription_t subscription_new()
 
 	sub = calloc(1, sizeof(*sub));
 	if (!sub) return NULL;
-	sub->sub_fd = -1;
+	statefile_init(&sub->sub_file);
+	sub->sub_wd = -1;
+	sub->sub_slot = -1;
 	return sub;
 }
 
 static inline void subscription_free(subscription_t sub)
 {
 	if (sub) {
-		if (sub->sub_fd >= 0) (void)close(sub->sub_fd);
+		statefile_close(&sub->sub_file);
 		free(sub->sub_name);
 		free(sub->sub_path);
 		free(sub->sub_buf);
@@ -14,12 +14,27 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "../include/state.h"
+#include "platform.h"
+#include "broker.h"
+
+#define BROKER_PATH STATE_PREFIX "/.broker"
 
 static int test_result;
 
@@ -101,6 +116,41 @@ int test_state_publish()
 	return 1;
 }
 
+int test_state_publish_unchanged()
+{
+	const char *name = "user.example.unchanged";
+	const char *other = "user.example.unchanged.other";
+	struct state_value values[] = { { name, "down", 4 }, { other, "x", 1 } };
+	struct state_event evs[8];
+	struct state_stats stats;
+
+	if (state_init(0, 0) < 0) fail();
+	if (state_bind(name) != 0) fail();
+	if (state_bind(other) != 0) fail();
+	if (state_subscribe(name) != 0) fail();
+	if (state_subscribe(other) != 0) fail();
+	if (state_publish(name, "up", 2) < 0) fail();
+	if (state_publish(name, "up", 2) < 0) fail();
+	if (state_publish(name, "up", 2) < 0) fail();
+	if (state_check_many(evs, 8) != 1) fail();
+	if (state_publish(name, "down", 4) < 0) fail();
+	if (state_check_many(evs, 8) != 1) fail();
+	if (strcmp(evs[0].value, "down") != 0) fail();
+	if (state_get_stats(&stats) < 0) fail();
+	if (stats.published != 2 || stats.suppressed != 2) fail();
+
+	/* Only the values that changed are published together */
+	if (state_publish_multi(values, 2) < 0) fail();
+	if (state_check_many(evs, 8) != 1) fail();
+	if (strcmp(evs[0].key, other) != 0) fail();
+	if (state_publish_multi(values, 2) < 0) fail();
+	if (state_check_many(evs, 8) != 0) fail();
+	if (state_get_stats(&stats) < 0) fail();
+	if (stats.published != 3 || stats.suppressed != 5) fail();
+	state_atexit();
+	return 1;
+}
+
 int test_state_subscribe()
 {
 	const char *name = "user.example.status";
@@ -150,6 +200,146 @@ int test_state_check()
 	return 1;
 }
 
+int test_state_check_many()
+{
+	const char *names[] = { "user.check_many.a", "user.check_many.b",
+		"user.check_many.c", NULL };
+	struct state_event evs[8];
+	ssize_t nevents;
+	int i, seen = 0;
+
+	if (state_init(0, 0) < 0) fail();
+	for (i = 0; names[i] != NULL; i++) {
+		if (state_bind(names[i]) < 0) fail();
+		if (state_subscribe(names[i]) < 0) fail();
+	}
+	for (i = 0; names[i] != NULL; i++) {
+		if (state_publish(names[i], names[i], strlen(names[i])) < 0) fail();
+	}
+	nevents = state_check_many(evs, 8);
+	if (nevents != 3) fail();
+	for (i = 0; i < nevents; i++) {
+		if (strcmp(evs[i].key, evs[i].value) != 0) fail();
+		if (evs[i].len != strlen(evs[i].key)) fail();
+		seen |= 1 << (evs[i].key[strlen(evs[i].key) - 1] - 'a');
+	}
+	if (seen != 7) fail();
+	if (state_check_many(evs, 8) != 0) fail();
+	state_atexit();
+
+	return 1;
+}
+
+static void *wait_publisher(void *arg)
+{
+	(void) usleep(50000);
+	(void) state_publish(arg, "late", 4);
+	return NULL;
+}
+
+int test_state_wait()
+{
+	const char *name = "user.example.wait";
+	struct state_event evs[8];
+	struct timespec start, end;
+	pthread_t tid;
+	long elapsed_ms;
+
+	if (state_init(0, 0) < 0) fail();
+	if (state_bind(name) < 0) fail();
+	if (state_subscribe(name) < 0) fail();
+
+	/* The timeout expires when nothing happens */
+	(void) clock_gettime(CLOCK_MONOTONIC, &start);
+	if (state_wait(evs, 8, 100) != 0) fail();
+	(void) clock_gettime(CLOCK_MONOTONIC, &end);
+	elapsed_ms = (end.tv_sec - start.tv_sec) * 1000 +
+		(end.tv_nsec - start.tv_nsec) / 1000000;
+	if (elapsed_ms < 90) fail();
+
+	/* A pending notification is returned at once */
+	if (state_publish(name, "now", 3) < 0) fail();
+	if (state_wait(evs, 8, -1) != 1) fail();
+	if (strcmp(evs[0].value, "now") != 0) fail();
+
+	/* A blocked call wakes up for a publish from another thread */
+	if (pthread_create(&tid, NULL, wait_publisher, (void *) name) != 0) fail();
+	if (state_wait(evs, 8, 5000) != 1) fail();
+	(void) pthread_join(tid, NULL);
+	if (strcmp(evs[0].key, name) != 0 || strcmp(evs[0].value, "late") != 0) fail();
+	state_atexit();
+
+	return 1;
+}
+
+int test_state_publish_multi()
+{
+	const struct state_value values[] = {
+		{ "user.multi.state", "running", 7 },
+		{ "user.multi.pid", "123", 3 },
+		{ "user.multi.port", "8080", 4 },
+	};
+	const struct state_value unbound[] = {
+		{ "user.multi.state", "stopped", 7 },
+		{ "user.multi.unbound", "x", 1 },
+	};
+	struct state_event evs[8];
+	char *value;
+	int i;
+
+	if (state_init(0, 0) < 0) fail();
+	for (i = 0; i < 3; i++) {
+		if (state_bind(values[i].name) < 0) fail();
+		if (state_subscribe(values[i].name) < 0) fail();
+	}
+	if (state_publish_multi(values, 3) < 0) fail();
+	if (state_check_many(evs, 8) != 3) fail();
+	for (i = 0; i < 3; i++) {
+		if (state_get(values[i].name, &value) != (int) values[i].len) fail();
+		if (strcmp(value, values[i].value) != 0) fail();
+	}
+
+	/* Nothing is published if any name is not bound */
+	if (state_publish_multi(unbound, 2) == 0) fail();
+	if (state_check_many(evs, 8) != 0) fail();
+	if (state_get("user.multi.state", &value) < 0) fail();
+	if (strcmp(value, "running") != 0) fail();
+	state_atexit();
+
+	return 1;
+}
+
+/* More values than are submitted to the io engine at once */
+#define MULTI_MANY	150
+int test_state_publish_many()
+{
+	static struct state_value values[MULTI_MANY];
+	static char names[MULTI_MANY][32], data[MULTI_MANY][8];
+	struct state_event evs[MULTI_MANY + 1];
+	char *value;
+	int i;
+
+	if (state_init(0, 0) < 0) fail();
+	for (i = 0; i < MULTI_MANY; i++) {
+		snprintf(names[i], sizeof(names[i]), "user.multi.many.%d", i);
+		snprintf(data[i], sizeof(data[i]), "%d", i * 7);
+		values[i].name = names[i];
+		values[i].value = data[i];
+		values[i].len = strlen(data[i]);
+		if (state_bind(names[i]) < 0) fail();
+		if (state_subscribe(names[i]) < 0) fail();
+	}
+	if (state_publish_multi(values, MULTI_MANY) < 0) fail();
+	if (state_check_many(evs, MULTI_MANY + 1) != MULTI_MANY) fail();
+	for (i = 0; i < MULTI_MANY; i++) {
+		if (state_get(names[i], &value) != (int) values[i].len) fail();
+		if (strcmp(value, data[i]) != 0) fail();
+	}
+	state_atexit();
+
+	return 1;
+}
+
 int test_state_get()
 {
 	const char *name = "user.example.status";
@@ -170,6 +360,140 @@ int test_state_get()
 	return 1;
 }
 
+int test_state_get_if_changed()
+{
+	const char *name = "user.example.get_if_changed";
+	unsigned int gen = 0, last;
+	char *value = NULL;
+
+	if (state_init(0, 0) < 0) fail();
+	if (state_bind(name) != 0) fail();
+	if (state_subscribe(name) < 0) fail();
+	if (state_publish(name, "one", 3) < 0) fail();
+	if (state_get_if_changed(name, &gen, &value) != 1) fail();
+	if (strcmp(value, "one") != 0) fail();
+	last = gen;
+	value = NULL;
+	if (state_get_if_changed(name, &gen, &value) != 0) fail();
+	if (value || gen != last) fail();
+	if (state_publish(name, "two", 3) < 0) fail();
+	if (state_get_if_changed(name, &gen, &value) != 1) fail();
+	if (strcmp(value, "two") != 0) fail();
+	if (gen <= last) fail();
+	if (state_get_if_changed("...an invalid name....", &gen, &value) >= 0) fail();
+	state_atexit();
+
+	return 1;
+}
+
+int test_typed_values()
+{
+	const char *names[] = { "user.typed.i64", "user.typed.f64",
+		"user.typed.bool", "user.typed.blob", "user.typed.text" };
+	const char blob[] = { 0, 1, (char) 0xff };
+	struct state_event evs[8];
+	struct state_typed tv;
+	const void *data;
+	char buf[64];
+	int64_t i64;
+	double f64;
+	int i, b;
+
+	if (state_init(0, 0) < 0) fail();
+	for (i = 0; i < 5; i++) {
+		if (state_bind(names[i]) < 0) fail();
+		if (state_subscribe(names[i]) < 0) fail();
+	}
+	if (state_publish_i64(names[0], -42) < 0) fail();
+	if (state_publish_f64(names[1], 3.25) < 0) fail();
+	if (state_publish_bool(names[2], 1) < 0) fail();
+	if (state_publish_blob(names[3], blob, sizeof(blob)) < 0) fail();
+	if (state_publish(names[4], "123", 3) < 0) fail();
+
+	if (state_get_i64(names[0], &i64) < 0 || i64 != -42) fail();
+	if (state_get_f64(names[1], &f64) < 0 || f64 != 3.25) fail();
+	if (state_get_bool(names[2], &b) < 0 || b != 1) fail();
+	if (state_get_blob(names[3], &data) != 3 || memcmp(data, blob, 3) != 0) fail();
+
+	/* Strings are converted, but other types are not */
+	if (state_get_i64(names[4], &i64) < 0 || i64 != 123) fail();
+	if (state_get_i64(names[1], &i64) != -1) fail();
+	if (state_get_bool(names[0], &b) != -1) fail();
+
+	/* The header has a fixed layout */
+	if (state_check_many(evs, 8) != 5) fail();
+	for (i = 0; i < 5; i++) {
+		if (strcmp(evs[i].key, names[0]) != 0)
+			continue;
+		if (evs[i].len != STATE_TYPED_HEADER + 8) fail();
+		if (memcmp(evs[i].value, "\0T\1\1\10\0\0\0\326\377", 10) != 0) fail();
+		if (state_decode(evs[i].value, evs[i].len, &tv) < 0) fail();
+		if (tv.type != STATE_TYPE_I64 || tv.i64 != -42) fail();
+	}
+
+	if (state_get(names[1], &evs[0].value) < 0) fail();
+	if (state_format(evs[0].value, STATE_TYPED_HEADER + 8, buf, sizeof(buf)) != 4) fail();
+	if (strcmp(buf, "3.25") != 0) fail();
+	if (state_format(evs[0].value, 4, buf, sizeof(buf)) != -1) fail();
+	state_atexit();
+
+	return 1;
+}
+
+int test_state_peek()
+{
+	const char *name = "user.example.peek";
+	const char *value;
+	unsigned int seq;
+	ssize_t len;
+
+	if (state_init(0, 0) < 0) fail();
+	if (state_bind(name) != 0) fail();
+	if (state_subscribe(name) < 0) fail();
+	if (state_publish(name, "one", 3) < 0) fail();
+	if ((len = state_peek(name, &value, &seq)) != 3) fail();
+	if (strcmp(value, "one") != 0) fail();
+	if (!state_peek_valid(name, seq)) fail();
+	if (state_publish(name, "two", 3) < 0) fail();
+	if (state_peek_valid(name, seq)) fail();
+	if ((len = state_peek(name, &value, &seq)) != 3) fail();
+	if (strcmp(value, "two") != 0) fail();
+	if (state_peek("...an invalid name....", &value, &seq) >= 0) fail();
+	state_atexit();
+
+	return 1;
+}
+
+int test_large_values()
+{
+	const char *name = "user.large_values";
+	const size_t biglen = 256 * 1024;
+	char *big, *key, *value;
+	ssize_t len;
+
+	if ((big = malloc(biglen + 1)) == NULL) fail();
+	memset(big, 'x', biglen);
+	big[biglen] = '\0';
+
+	if (state_init(0, 0) < 0) fail();
+	if (state_bind(name) < 0) fail();
+	if (state_subscribe(name) < 0) fail();
+	if (state_publish(name, "small", 5) < 0) fail();
+	if (state_get(name, &value) != 5) fail();
+
+	/* The state file must grow without disturbing the subscriber */
+	if (state_publish(name, big, biglen) < 0) fail();
+	if ((len = state_get(name, &value)) != biglen) fail();
+	if (strcmp(value, big) != 0) fail();
+	if (state_publish(name, "small again", 11) < 0) fail();
+	if ((len = state_check(&key, &value)) != 11) fail();
+	if (strcmp(value, "small again") != 0) fail();
+	state_atexit();
+	free(big);
+
+	return 1;
+}
+
 int test_multiple_state_changes()
 {
 	const char *name = "user.multiple_state_changes";
@@ -202,6 +526,1003 @@ int test_multiple_state_changes()
 	return 1;
 }
 
+/* A change is not lost when the kernel drops events because its queue is full */
+int test_event_overflow()
+{
+	const char *names[] = { "user.overflow.a", "user.overflow.b", "user.overflow.c" };
+	struct state_event evs[8];
+	char value[32];
+	ssize_t i, nevents;
+	long max = 16384;
+	int found = 0;
+	FILE *f;
+
+	if ((f = fopen("/proc/sys/fs/inotify/max_queued_events", "r")) != NULL) {
+		if (fscanf(f, "%ld", &max) != 1)
+			max = 16384;
+		(void) fclose(f);
+	}
+	if (state_init(0, 0) < 0) fail();
+	for (i = 0; i < 3; i++) {
+		if (state_bind(names[i]) < 0) fail();
+		if (state_publish(names[i], "0", 1) < 0) fail();
+		if (state_subscribe(names[i]) < 0) fail();
+	}
+	while (state_check_many(evs, 8) > 0)
+		;
+
+	/* Fill the queue with changes to the others, then change the first */
+	for (i = 0; i <= max; i++) {
+		snprintf(value, sizeof(value), "%zd", i + 1);
+		if (state_publish(names[1 + i % 2], value, strlen(value)) < 0) fail();
+	}
+	if (state_publish(names[0], "last", 4) < 0) fail();
+
+	while ((nevents = state_check_many(evs, 8)) > 0) {
+		for (i = 0; i < nevents; i++) {
+			if (strcmp(evs[i].key, names[0]) == 0 &&
+					strcmp(evs[i].value, "last") == 0)
+				found = 1;
+		}
+	}
+	if (nevents < 0 || !found) fail();
+	state_atexit();
+
+	return 1;
+}
+
+int test_coalesce()
+{
+	const char *name1 = "user.coalesce.1";
+	const char *name2 = "user.coalesce.2";
+	struct state_event evs[8];
+	ssize_t nevents;
+	int i;
+
+	if (state_init(0, STATE_COALESCE) < 0) fail();
+	if (state_bind(name1) < 0) fail();
+	if (state_bind(name2) < 0) fail();
+	if (state_subscribe(name1) < 0) fail();
+	if (state_subscribe(name2) < 0) fail();
+	if (state_publish(name1, "1", 1) < 0) fail();
+	if (state_publish(name2, "1", 1) < 0) fail();
+	if (state_publish(name1, "2", 1) < 0) fail();
+	if (state_publish(name2, "2", 1) < 0) fail();
+	if (state_publish(name1, "3", 1) < 0) fail();
+	nevents = state_check_many(evs, 8);
+	if (nevents != 2) fail();
+	for (i = 0; i < nevents; i++) {
+		if (strcmp(evs[i].key, name1) == 0) {
+			if (strcmp(evs[i].value, "3") != 0) fail();
+		} else if (strcmp(evs[i].key, name2) == 0) {
+			if (strcmp(evs[i].value, "2") != 0) fail();
+		} else {
+			fail();
+		}
+	}
+	if (state_check_many(evs, 8) != 0) fail();
+	state_atexit();
+
+	return 1;
+}
+
+static int event_fd_is_readable(void)
+{
+	struct pollfd pfd;
+
+	pfd.fd = state_get_event_fd();
+	pfd.events = POLLIN;
+	return poll(&pfd, 1, 0);
+}
+
+/* A subscription ends when its state file is removed */
+int test_unlinked()
+{
+	const char *name = "user.unlinked";
+	struct state_event evs[8];
+	char path[PATH_MAX];
+
+	if (state_init(0, 0) < 0) fail();
+	if (state_subscribe(name) < 0) fail();
+	if (state_check_many(evs, 8) != 0) fail();
+
+	snprintf(path, sizeof(path), "%s/.libstate/run/%s", getenv("HOME"),
+			name + strlen("user."));
+	if (unlink(path) < 0) fail();
+	if (event_fd_is_readable() != 1) fail();
+	if (state_check_many(evs, 8) < 0) fail();
+	if (state_check_many(evs, 8) != 0) fail();
+	if (state_unsubscribe(name) != -1) fail();
+
+	/* Subscribing again creates a new file */
+	if (state_subscribe(name) < 0) fail();
+	if (state_bind(name) < 0) fail();
+	if (state_publish(name, "1", 1) < 0) fail();
+	if (state_check_many(evs, 8) != 1) fail();
+	if (strcmp(evs[0].key, name) != 0 || strcmp(evs[0].value, "1") != 0) fail();
+	state_atexit();
+	(void) unlink(path);
+
+	return 1;
+}
+
+int test_event_fd_readiness()
+{
+	const char *name1 = "user.event_fd_readiness.1";
+	const char *name2 = "user.event_fd_readiness.2";
+	char *key, *value;
+
+	if (state_init(0, 0) < 0) fail();
+	if (state_bind(name1) < 0) fail();
+	if (state_bind(name2) < 0) fail();
+	if (state_subscribe(name1) < 0) fail();
+	if (state_subscribe(name2) < 0) fail();
+	if (event_fd_is_readable() != 0) fail();
+	if (state_publish(name1, "a", 1) < 0) fail();
+	if (state_publish(name2, "b", 1) < 0) fail();
+
+	/* The descriptor must stay readable until every event is consumed */
+	if (event_fd_is_readable() != 1) fail();
+	if (state_check(&key, &value) < 1) fail();
+	if (event_fd_is_readable() != 1) fail();
+	if (state_check(&key, &value) < 1) fail();
+	if (event_fd_is_readable() != 0) fail();
+	if (state_check(&key, &value) != 0) fail();
+	state_atexit();
+
+	return 1;
+}
+
+int test_arena()
+{
+	const char *name = "user.arena";
+	struct state_event evs[8];
+	char late[64], many[64];
+	const char *value;
+	unsigned int seq;
+	int i, fd1, fd2;
+
+	if (state_init(0, STATE_ARENA) < 0) fail();
+	if (state_bind(name) < 0) fail();
+	if (state_subscribe(name) < 0) fail();
+
+	/* Subscribing before the name is bound for the first time */
+	snprintf(late, sizeof(late), "user.arena.late.%d", (int) getpid());
+	if (state_subscribe(late) < 0) fail();
+	if (state_bind(late) < 0) fail();
+
+	/* Each additional name must not use another file descriptor */
+	if ((fd1 = dup(0)) < 0) fail();
+	close(fd1);
+	for (i = 0; i < 100; i++) {
+		snprintf(many, sizeof(many), "user.arena.many.%d", i);
+		if (state_bind(many) < 0) fail();
+		if (state_subscribe(many) < 0) fail();
+	}
+	if ((fd2 = dup(0)) < 0) fail();
+	close(fd2);
+	if (fd1 != fd2) fail();
+
+	if (state_check_many(evs, 8) != 0) fail();
+	if (event_fd_is_readable() != 0) fail();
+	if (state_publish(name, "a", 1) < 0) fail();
+	if (state_publish(late, "bb", 2) < 0) fail();
+	if (event_fd_is_readable() != 1) fail();
+	if (state_check_many(evs, 8) != 2) fail();
+	for (i = 0; i < 2; i++) {
+		if (strcmp(evs[i].key, name) == 0) {
+			if (strcmp(evs[i].value, "a") != 0) fail();
+		} else if (strcmp(evs[i].key, late) == 0) {
+			if (strcmp(evs[i].value, "bb") != 0 || evs[i].len != 2) fail();
+		} else {
+			fail();
+		}
+	}
+	if (event_fd_is_readable() != 0) fail();
+
+	/* Draining one change at a time must keep the descriptor readable */
+	if (state_publish(many, "1", 1) < 0) fail();
+	if (state_publish(name, "2", 1) < 0) fail();
+	if (state_check_many(evs, 1) != 1) fail();
+	if (strcmp(evs[0].key, many) != 0) fail();
+	if (event_fd_is_readable() != 1) fail();
+	if (state_check_many(evs, 1) != 1) fail();
+	if (strcmp(evs[0].key, name) != 0) fail();
+	if (state_check_many(evs, 1) != 0) fail();
+
+	/* Several values are published with a single notification */
+	struct state_value values[] = { { name, "4", 1 }, { late, "3", 1 } };
+	if (state_publish_multi(values, 2) < 0) fail();
+	if (state_check_many(evs, 8) != 2) fail();
+	if (event_fd_is_readable() != 0) fail();
+
+	if (state_peek(name, &value, &seq) != 1) fail();
+	if (strcmp(value, "4") != 0) fail();
+	if (!state_peek_valid(name, seq)) fail();
+	if (state_publish(name, "3", 1) < 0) fail();
+	if (state_peek_valid(name, seq)) fail();
+	state_atexit();
+
+	return 1;
+}
+
+/* Find the event for <name> in <evs>, or return NULL */
+static struct state_event *find_event(struct state_event *evs, ssize_t n,
+		const char *name)
+{
+	ssize_t i;
+
+	for (i = 0; i < n; i++) {
+		if (strcmp(evs[i].key, name) == 0)
+			return &evs[i];
+	}
+	return NULL;
+}
+
+static int check_prefix(int flags)
+{
+	const char *old = "user.prefix.old";
+	const char *other = "user.prefixes.other";
+	struct state_event evs[8], *ev;
+	char new[64], path[256];
+	char *value;
+	ssize_t n;
+
+	snprintf(new, sizeof(new), "user.prefix.new.%d", (int) getpid());
+	if (state_init(0, flags) < 0) fail();
+	if (state_bind(old) < 0) fail();
+	if (state_bind(other) < 0) fail();
+	if (state_publish(old, "0", 1) < 0) fail();
+	if (state_subscribe_prefix("user.prefix.") < 0) fail();
+	if (state_check_many(evs, 8) != 0) fail();
+
+	/* A name that existed before the subscription */
+	if (state_publish(old, "1", 1) < 0) fail();
+	if (state_publish(other, "1", 1) < 0) fail();
+	if ((n = state_check_many(evs, 8)) != 1) fail();
+	if (strcmp(evs[0].key, old) != 0 || strcmp(evs[0].value, "1") != 0) fail();
+
+	/* A name that is bound after the subscription */
+	if (state_bind(new) < 0) fail();
+	if (state_publish(new, "2", 1) < 0) fail();
+	if ((n = state_check_many(evs, 8)) < 1) fail();
+	if ((ev = find_event(evs, n, new)) == NULL) fail();
+	if (strcmp(ev->value, "2") != 0) fail();
+	if (find_event(evs, n, other)) fail();
+	if (state_get(new, &value) != 1 || strcmp(value, "2") != 0) fail();
+
+	if (state_unsubscribe_prefix("user.prefix.") < 0) fail();
+	if (state_unsubscribe_prefix("user.prefix.") == 0) fail();
+	if (state_publish(old, "3", 1) < 0) fail();
+	if (state_check_many(evs, 8) != 0) fail();
+	if (state_unbind(new) < 0) fail();
+	state_atexit();
+
+	if (!(flags & STATE_ARENA)) {
+		snprintf(path, sizeof(path), "%s/.libstate/run/%s",
+				getenv("HOME"), new + strlen("user."));
+		(void) unlink(path);
+	}
+	return 1;
+}
+
+int test_reserved()
+{
+	const int flags[] = { 0, STATE_ARENA };
+	const char *name = "user.reserved";
+	const size_t biglen = 512 * 1024;
+	char *big, buf[16];
+	struct stat sb;
+	char path[PATH_MAX];
+	int i;
+
+	if ((big = malloc(biglen + 1)) == NULL) fail();
+	for (i = 0; i < (int) biglen; i++)
+		big[i] = 'a' + i % 26;
+
+	for (i = 0; i < 2; i++) {
+		if (state_init(0, flags[i]) < 0) fail();
+		if (state_bind_reserved(name, biglen) < 0) fail();
+		if (state_subscribe(name) < 0) fail();
+
+		/* The space is allocated before anything is published */
+		if (flags[i] == 0) {
+			snprintf(path, sizeof(path), "%s/.libstate/run/reserved", getenv("HOME"));
+			if (stat(path, &sb) < 0) fail();
+			if ((size_t) sb.st_size < biglen || (size_t) sb.st_blocks * 512 < biglen) fail();
+		}
+
+		if (state_publish(name, big, biglen) < 0) fail();
+		if (state_publish(name, big, biglen + 1) != -1) fail();
+
+		/* Only the part that is needed is copied */
+		if (state_get_range(name, 27, sizeof(buf), buf) != sizeof(buf)) fail();
+		if (memcmp(buf, big + 27, sizeof(buf)) != 0) fail();
+		if (state_get_range(name, biglen - 4, sizeof(buf), buf) != 4) fail();
+		if (memcmp(buf, big + biglen - 4, 4) != 0) fail();
+		if (state_get_range(name, biglen + 100, sizeof(buf), buf) != 0) fail();
+		if (state_get_range("user.reserved.none", 0, sizeof(buf), buf) != -1) fail();
+		state_atexit();
+	}
+	free(big);
+
+	return 1;
+}
+
+struct snapshot_result {
+	int count;
+	int found[3];
+};
+
+static void snapshot_cb(void *context, const char *name, const char *value,
+		ssize_t len)
+{
+	struct snapshot_result *sr = context;
+	int i;
+
+	sr->count++;
+	if (strncmp(name, "user.snapshot.", 14) != 0)
+		return;
+	i = name[14] - 'a';
+	if (i >= 0 && i < 3 && len == 1 && value[0] == '0' + i)
+		sr->found[i]++;
+}
+
+int test_snapshot()
+{
+	const int flags[] = { 0, STATE_ARENA };
+	char name[32], value[2];
+	struct snapshot_result sr;
+	int i, j;
+
+	for (i = 0; i < 2; i++) {
+		if (state_init(0, flags[i]) < 0) fail();
+		for (j = 0; j < 3; j++) {
+			snprintf(name, sizeof(name), "user.snapshot.%c", 'a' + j);
+			snprintf(value, sizeof(value), "%d", j);
+			if (state_bind(name) < 0) fail();
+			if (state_publish(name, value, 1) < 0) fail();
+		}
+		if (state_bind("user.snapshotx") < 0) fail();
+
+		/* Nothing needs to be subscribed to */
+		memset(&sr, 0, sizeof(sr));
+		if (state_snapshot("user.snapshot.", snapshot_cb, &sr) != 3) fail();
+		if (sr.count != 3) fail();
+		for (j = 0; j < 3; j++) {
+			if (sr.found[j] != 1) fail();
+		}
+
+		/* Every namespace */
+		memset(&sr, 0, sizeof(sr));
+		if (state_snapshot(NULL, snapshot_cb, &sr) < 4) fail();
+		if (sr.found[0] != 1 || sr.found[2] != 1) fail();
+		state_atexit();
+	}
+
+	return 1;
+}
+
+int test_prefix()
+{
+	return check_prefix(0);
+}
+
+int test_arena_prefix()
+{
+	return check_prefix(STATE_ARENA);
+}
+
+int test_arena_shared()
+{
+	const char *name = "user.arena_shared";
+	const char *grow = "user.arena_shared.grow";
+	const size_t biglen = 2 * 1024 * 1024;
+	char home[] = "/tmp/ntest.XXXXXX";
+	char path[PATH_MAX], *big, *oldhome, *value;
+	state_ctx_t a, b;
+
+	/* Start from an empty arena, so that it grows by a known amount */
+	if ((oldhome = getenv("HOME")) == NULL) fail();
+	if ((oldhome = strdup(oldhome)) == NULL) fail();
+	if (mkdtemp(home) == NULL) fail();
+	if (setenv("HOME", home, 1) < 0) fail();
+	if ((big = malloc(biglen)) == NULL) fail();
+	memset(big, 'x', biglen);
+
+	if ((a = state_ctx_new(STATE_ARENA)) == NULL) fail();
+	if ((b = state_ctx_new(STATE_ARENA)) == NULL) fail();
+	if (state_ctx_bind(a, name) < 0) fail();
+	if (state_ctx_bind(b, name) < 0) fail();
+	if (state_ctx_bind(b, grow) < 0) fail();
+
+	/* Move the value past the end of the arena as mapped by the first */
+	if (state_ctx_publish(b, grow, big, biglen) < 0) fail();
+	if (state_ctx_publish(b, name, big, 1024) < 0) fail();
+	if (state_ctx_publish(a, name, "a", 1) < 0) fail();
+	if (state_ctx_subscribe(b, name) < 0) fail();
+	if (state_ctx_get(b, name, &value) != 1 || strcmp(value, "a") != 0) fail();
+	state_ctx_free(a);
+	state_ctx_free(b);
+	free(big);
+
+	snprintf(path, sizeof(path), "%s/.libstate/run/.arena", home);
+	(void) unlink(path);
+	snprintf(path, sizeof(path), "%s/.libstate/run", home);
+	(void) rmdir(path);
+	snprintf(path, sizeof(path), "%s/.libstate", home);
+	(void) rmdir(path);
+	(void) rmdir(home);
+	if (setenv("HOME", oldhome, 1) < 0) fail();
+	free(oldhome);
+
+	return 1;
+}
+
+/* Wait for notifications to arrive, since the broker sends them asynchronously */
+static ssize_t check_many_wait(struct state_event *evs, size_t max)
+{
+	struct pollfd pfd;
+
+	pfd.fd = state_get_event_fd();
+	pfd.events = POLLIN;
+	if (poll(&pfd, 1, 5000) != 1)
+		return -1;
+	return state_check_many(evs, max);
+}
+
+static int check_broker(void)
+{
+	const char *name = "user.broker";
+	const char *other = "user.broker.other";
+	const char *child = "user.broker.prefix.child";
+	struct state_event evs[8];
+	const char *peeked;
+	unsigned int seq;
+	char *value;
+
+	if (state_init(0, STATE_BROKER) < 0) fail();
+	if (state_bind(name) < 0) fail();
+	if (state_subscribe(name) < 0) fail();
+	if (state_publish(name, "1", 1) < 0) fail();
+	if (check_many_wait(evs, 8) != 1) fail();
+	if (strcmp(evs[0].key, name) != 0 || strcmp(evs[0].value, "1") != 0) fail();
+	if (state_get(name, &value) != 1 || strcmp(value, "1") != 0) fail();
+
+	/* The current value is sent when subscribing */
+	if (state_bind(other) < 0) fail();
+	if (state_publish(other, "22", 2) < 0) fail();
+	if (state_subscribe(other) < 0) fail();
+	if (check_many_wait(evs, 8) != 1) fail();
+	if (strcmp(evs[0].key, other) != 0 || strcmp(evs[0].value, "22") != 0) fail();
+
+	/* A transaction is applied and sent as a whole */
+	struct state_value values[] = { { name, "4", 1 }, { other, "55", 2 } };
+	if (state_publish_multi(values, 2) < 0) fail();
+	if (check_many_wait(evs, 8) != 2) fail();
+	if (state_get(other, &value) != 2 || strcmp(value, "55") != 0) fail();
+	if (state_peek(other, &peeked, &seq) != 2 || strcmp(peeked, "55") != 0) fail();
+	if (!state_peek_valid(other, seq)) fail();
+
+	/* Names under a prefix are fanned out by the broker */
+	if (state_subscribe_prefix("user.broker.prefix.") < 0) fail();
+	if (state_bind(child) < 0) fail();
+	if (state_publish(child, "333", 3) < 0) fail();
+	if (check_many_wait(evs, 8) != 1) fail();
+	if (strcmp(evs[0].key, child) != 0 || evs[0].len != 3) fail();
+	if (state_get(child, &value) != 3 || strcmp(value, "333") != 0) fail();
+	state_atexit();
+
+	return 1;
+}
+
+/* Send one message to the broker over a raw connection */
+static int broker_raw_send(int fd, int type, const char *name, const char *value,
+		size_t len)
+{
+	struct broker_msg msg;
+	struct iovec iov[3];
+	size_t namelen = name ? strlen(name) : 0;
+
+	msg.bm_len = namelen + len;
+	msg.bm_type = type;
+	msg.bm_namelen = namelen;
+	iov[0].iov_base = &msg;
+	iov[0].iov_len = sizeof(msg);
+	iov[1].iov_base = (char *) name;
+	iov[1].iov_len = namelen;
+	iov[2].iov_base = (char *) value;
+	iov[2].iov_len = len;
+	return writev(fd, iov, 3) < 0 ? -1 : 0;
+}
+
+static int broker_raw_connect(void)
+{
+	struct sockaddr_un sa;
+	int fd;
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sun_family = AF_UNIX;
+	strncpy(sa.sun_path, BROKER_PATH, sizeof(sa.sun_path) - 1);
+	if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+		return -1;
+	if (connect(fd, (struct sockaddr *) &sa, sizeof(sa)) < 0) {
+		(void) close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+/* Clients that misbehave are dropped, and the broker keeps serving others */
+static int check_broker_limits(void)
+{
+	const char *name = "user.broker.slow";
+	struct state_event evs[8];
+	size_t len = 8 * 1024 * 1024;
+	char *value;
+	int i, fd;
+
+	(void) signal(SIGPIPE, SIG_IGN);
+
+	/* Subscribe to a name and never read, while flooding it */
+	if ((value = calloc(1, len)) == NULL) fail();
+	if ((fd = broker_raw_connect()) < 0) fail();
+	if (broker_raw_send(fd, BROKER_SUBSCRIBE, name, NULL, 0) < 0) fail();
+	for (i = 0; i < 32; i++) {
+		if (broker_raw_send(fd, BROKER_PUBLISH, name, value, len) < 0)
+			break;
+	}
+	free(value);
+	(void) close(fd);
+	if (i == 32) fail();
+
+	/* Hold back more publishes than a transaction may have */
+	if ((fd = broker_raw_connect()) < 0) fail();
+	if (broker_raw_send(fd, BROKER_BEGIN, NULL, NULL, 0) < 0) fail();
+	for (i = 0; i < 2 * BROKER_TXN_MAX; i++) {
+		if (broker_raw_send(fd, BROKER_PUBLISH, name, "1", 1) < 0)
+			break;
+	}
+	(void) close(fd);
+	if (i == 2 * BROKER_TXN_MAX) fail();
+
+	/* The broker is still there for everyone else */
+	if (state_init(0, STATE_BROKER) < 0) fail();
+	if (state_bind("user.broker.alive") < 0) fail();
+	if (state_subscribe("user.broker.alive") < 0) fail();
+	if (state_publish("user.broker.alive", "yes", 3) < 0) fail();
+	if (check_many_wait(evs, 8) != 1) fail();
+	if (strcmp(evs[0].value, "yes") != 0) fail();
+	state_atexit();
+
+	return 1;
+}
+
+/* Run stated as a broker, and wait for it to start listening */
+static pid_t broker_start(void)
+{
+	struct stat sb;
+	pid_t pid;
+	int i, fd;
+
+	(void) unlink(BROKER_PATH);
+	if ((pid = fork()) < 0)
+		return -1;
+	if (pid == 0) {
+		if ((fd = open("/dev/null", O_WRONLY)) >= 0)
+			(void) dup2(fd, STDERR_FILENO);
+		execl("../stated", "stated", "-f", "-n", "-b", NULL);
+		_exit(1);
+	}
+	for (i = 0; i < 500; i++) {
+		if (stat(BROKER_PATH, &sb) == 0 && S_ISSOCK(sb.st_mode))
+			return pid;
+		(void) usleep(10000);
+	}
+	(void) kill(pid, SIGTERM);
+	(void) waitpid(pid, NULL, 0);
+	return -1;
+}
+
+static int broker_stop(pid_t pid)
+{
+	int status;
+
+	(void) kill(pid, SIGTERM);
+	return waitpid(pid, &status, 0) < 0 ? -1 : 0;
+}
+
+int test_broker()
+{
+	pid_t pid;
+	int rv;
+
+	if (getuid() != 0) skip("this test must be run as root");
+	if ((pid = broker_start()) < 0) fail();
+	rv = check_broker() && check_broker_limits();
+	if (broker_stop(pid) < 0) fail();
+	if (rv == 0) fail();
+
+	return 1;
+}
+
+int test_throttle()
+{
+	const char *rate = "user.throttle.rate";
+	const char *debounce = "user.throttle.debounce";
+	struct state_event evs[8];
+	char *value;
+
+	if (state_init(0, STATE_COALESCE) < 0) fail();
+	if (state_bind_throttled(rate, 10, 0) < 0) fail();
+	if (state_bind_throttled(debounce, 0, 50) < 0) fail();
+	if (state_subscribe(rate) < 0) fail();
+	if (state_subscribe(debounce) < 0) fail();
+
+	/* The first value is written at once, and the rest wait for the timer */
+	if (state_publish(rate, "1", 1) < 0) fail();
+	if (state_check_many(evs, 8) != 1) fail();
+	if (strcmp(evs[0].value, "1") != 0) fail();
+	if (state_publish(rate, "2", 1) < 0) fail();
+	if (state_publish(rate, "3", 1) < 0) fail();
+	if (state_check_many(evs, 8) != 0) fail();
+	if (check_many_wait(evs, 8) != 1) fail();
+	if (strcmp(evs[0].key, rate) != 0 || strcmp(evs[0].value, "3") != 0) fail();
+
+	/* Only the value that is left alone is written */
+	if (state_publish(debounce, "a", 1) < 0) fail();
+	if (state_publish(debounce, "b", 1) < 0) fail();
+	if (state_check_many(evs, 8) != 0) fail();
+	if (check_many_wait(evs, 8) != 1) fail();
+	if (strcmp(evs[0].key, debounce) != 0 || strcmp(evs[0].value, "b") != 0) fail();
+
+	/* Unbinding writes the final value */
+	if (state_publish(debounce, "c", 1) < 0) fail();
+	if (state_unbind(debounce) < 0) fail();
+	if (state_get(debounce, &value) != 1 || strcmp(value, "c") != 0) fail();
+	state_atexit();
+
+	return 1;
+}
+
+#define CONCURRENT_READERS	4
+#define CONCURRENT_NAMES	4
+
+static const char *concurrent_names[CONCURRENT_NAMES] = {
+	"user.concurrent.0", "user.concurrent.1",
+	"user.concurrent.2", "user.concurrent.3",
+};
+static int concurrent_stop;
+static int concurrent_errors;
+
+/* Every value is one character repeated, so a torn read is easy to spot */
+static void *concurrent_reader(void *arg)
+{
+	char *value, churn[64];
+	ssize_t len, i;
+	unsigned int n = 0;
+	int j;
+
+	(void) arg;
+	while (!__atomic_load_n(&concurrent_stop, __ATOMIC_ACQUIRE)) {
+		for (j = 0; j < CONCURRENT_NAMES; j++) {
+			len = state_get(concurrent_names[j], &value);
+			if (len < 1 || (size_t) len != strlen(value))
+				goto error;
+			for (i = 1; i < len; i++) {
+				if (value[i] != value[0])
+					goto error;
+			}
+		}
+
+		/* These come and go while the readers are using the index */
+		snprintf(churn, sizeof(churn), "user.concurrent.churn.%u", n++ % 64);
+		(void) state_get(churn, &value);
+	}
+	return NULL;
+
+error:
+	__atomic_add_fetch(&concurrent_errors, 1, __ATOMIC_RELAXED);
+	return NULL;
+}
+
+/*
+ * With STATE_BROKER, values are only stored by state_check_many(), so it
+ * is called after every publish, while the readers are copying them.
+ */
+static int check_concurrent_get(int flags)
+{
+	pthread_t readers[CONCURRENT_READERS];
+	static char value[32768];
+	struct state_event evs[8];
+	char churn[64], *got;
+	size_t len;
+	int i, j;
+
+	if (state_init(0, flags) < 0) fail();
+	for (j = 0; j < CONCURRENT_NAMES; j++) {
+		if (state_bind(concurrent_names[j]) < 0) fail();
+		if (state_subscribe(concurrent_names[j]) < 0) fail();
+		if (state_publish(concurrent_names[j], "0", 1) < 0) fail();
+	}
+	for (j = 0; flags & STATE_BROKER && j < CONCURRENT_NAMES; j++) {
+		for (i = 0; i < 500 && state_get(concurrent_names[j], &got) < 0; i++) {
+			(void) state_check_many(evs, 8);
+			(void) usleep(10000);
+		}
+	}
+	concurrent_stop = 0;
+	concurrent_errors = 0;
+	for (i = 0; i < CONCURRENT_READERS; i++) {
+		if (pthread_create(&readers[i], NULL, concurrent_reader, NULL) != 0) fail();
+	}
+
+	/* Values grow and shrink, so the state files are remapped as well */
+	for (i = 0; i < 2000; i++) {
+		len = (i % 250 == 0) ? sizeof(value) / 8 * (1 + i / 250) : 1 + i % 64;
+		memset(value, '0' + i % 10, len);
+		j = i % CONCURRENT_NAMES;
+		if (state_publish(concurrent_names[j], value, len) < 0) fail();
+		if (flags & STATE_BROKER && state_check_many(evs, 8) < 0) fail();
+		snprintf(churn, sizeof(churn), "user.concurrent.churn.%d", i % 64);
+		if (i % 128 < 64) {
+			if (state_subscribe(churn) < 0) fail();
+		} else {
+			if (state_unsubscribe(churn) < 0) fail();
+		}
+	}
+
+	__atomic_store_n(&concurrent_stop, 1, __ATOMIC_RELEASE);
+	for (i = 0; i < CONCURRENT_READERS; i++)
+		(void) pthread_join(readers[i], NULL);
+	if (concurrent_errors != 0) fail();
+	state_atexit();
+
+	return 1;
+}
+
+int test_concurrent_get()
+{
+	pid_t pid;
+	int rv;
+
+	if (!check_concurrent_get(0)) fail();
+	if (getuid() != 0)
+		return 1;
+	if ((pid = broker_start()) < 0) fail();
+	rv = check_concurrent_get(STATE_BROKER);
+	if (broker_stop(pid) < 0) fail();
+	if (rv == 0) fail();
+
+	return 1;
+}
+
+#define DISPATCH_COUNT	200
+struct dispatch_test {
+	int last;		/* The last value seen */
+	int calls;
+	int errors;
+	char name[64];
+};
+
+static void dispatch_callback(void *context, const char *name,
+		const char *value, ssize_t len)
+{
+	struct dispatch_test *dt = context;
+	int n;
+
+	/* Values may be skipped, but must never go backwards */
+	n = (value && len > 0) ? atoi(value) : -1;
+	if (n < dt->last)
+		__atomic_add_fetch(&dt->errors, 1, __ATOMIC_RELAXED);
+	snprintf(dt->name, sizeof(dt->name), "%s", name);
+	__atomic_store_n(&dt->last, n, __ATOMIC_RELEASE);
+	__atomic_add_fetch(&dt->calls, 1, __ATOMIC_RELAXED);
+}
+
+static int dispatch_wait(struct dispatch_test *dt, int last)
+{
+	int i;
+
+	for (i = 0; i < 500; i++) {
+		if (__atomic_load_n(&dt->last, __ATOMIC_ACQUIRE) == last)
+			return 0;
+		(void) usleep(10000);
+	}
+	return -1;
+}
+
+int test_dispatch()
+{
+	const char *names[] = { "user.dispatch.a", "user.dispatch.b" };
+	const char *child = "user.dispatch.prefix.child";
+	struct dispatch_test dt[3];
+	char buf[16];
+	int i, j, calls;
+
+	memset(dt, 0, sizeof(dt));
+	if (state_init(0, 0) < 0) fail();
+	if (state_dispatch_cancel(names[0]) != -1) fail();
+	for (j = 0; j < 2; j++) {
+		if (state_bind(names[j]) < 0) fail();
+		if (state_dispatch_f(names[j], &dt[j], dispatch_callback) < 0) fail();
+	}
+	if (state_dispatch_prefix_f("user.dispatch.prefix.", &dt[2],
+			dispatch_callback) < 0) fail();
+	if (state_bind(child) < 0) fail();
+
+	for (i = 1; i <= DISPATCH_COUNT; i++) {
+		snprintf(buf, sizeof(buf), "%d", i);
+		for (j = 0; j < 2; j++) {
+			if (state_publish(names[j], buf, strlen(buf)) < 0) fail();
+		}
+	}
+	if (state_publish(child, "7", 1) < 0) fail();
+	for (j = 0; j < 2; j++) {
+		if (dispatch_wait(&dt[j], DISPATCH_COUNT) < 0) fail();
+		if (dt[j].errors != 0) fail();
+		if (strcmp(dt[j].name, names[j]) != 0) fail();
+	}
+	if (dispatch_wait(&dt[2], 7) < 0) fail();
+	if (strcmp(dt[2].name, child) != 0) fail();
+
+	/* Nothing is called after cancelling */
+	if (state_dispatch_cancel(names[0]) < 0) fail();
+	calls = __atomic_load_n(&dt[0].calls, __ATOMIC_ACQUIRE);
+	if (state_publish(names[0], "1000", 4) < 0) fail();
+	if (state_publish(names[1], "1000", 4) < 0) fail();
+	if (dispatch_wait(&dt[1], 1000) < 0) fail();
+	if (__atomic_load_n(&dt[0].calls, __ATOMIC_ACQUIRE) != calls) fail();
+	state_atexit();
+
+	return 1;
+}
+
+int test_contexts()
+{
+	const char *name = "user.contexts";
+	state_ctx_t a, b;
+	struct state_event evs[8];
+	char *value;
+	int i, fd;
+
+	/* Contexts do not need the default context to be initialized */
+	if ((a = state_ctx_new(0)) == NULL) fail();
+	if ((b = state_ctx_new(STATE_COALESCE)) == NULL) fail();
+	if (state_ctx_get_event_fd(a) == state_ctx_get_event_fd(b)) fail();
+	if (state_ctx_bind(a, name) < 0) fail();
+	if (state_ctx_subscribe(a, name) < 0) fail();
+	if (state_ctx_subscribe(b, name) < 0) fail();
+
+	/* A publish is seen by both, and neither sees the other's events */
+	if (state_ctx_publish(a, name, "1", 1) < 0) fail();
+	if (state_ctx_publish(a, name, "22", 2) < 0) fail();
+	if (state_ctx_check_many(b, evs, 8) != 1) fail();
+	if (strcmp(evs[0].value, "22") != 0) fail();
+	if (state_ctx_check_many(a, evs, 8) < 1) fail();
+	if (state_ctx_check_many(b, evs, 8) != 0) fail();
+	if (state_ctx_get(a, name, &value) != 2 || strcmp(value, "22") != 0) fail();
+	if (state_ctx_get(b, name, &value) != 2 || strcmp(value, "22") != 0) fail();
+
+	/* Freeing one context leaves the other working */
+	state_ctx_free(b);
+	if (state_ctx_publish(a, name, "333", 3) < 0) fail();
+	if (state_ctx_get(a, name, &value) != 3 || strcmp(value, "333") != 0) fail();
+	if (state_get(name, &value) != -1) fail();
+	state_ctx_free(a);
+
+	/* A context that cannot be set up does not leak descriptors */
+	if ((fd = dup(0)) < 0) fail();
+	(void) close(fd);
+	for (i = 0; i < 8; i++) {
+		if ((a = state_ctx_new(STATE_BROKER)) == NULL)
+			continue;
+		state_ctx_free(a);	/* stated is running as a broker */
+	}
+	if ((i = dup(0)) != fd) fail();
+	(void) close(i);
+
+	return 1;
+}
+
+int test_counters()
+{
+	const int flags[] = { 0, STATE_ARENA };
+	const char *name = "user.counter";
+	struct state_event evs[8];
+	state_counter_t c;
+	char *value, buf[64];
+	int64_t i64;
+	int i, j;
+
+	for (i = 0; i < 2; i++) {
+		if (state_init(0, flags[i]) < 0) fail();
+		if ((c = state_bind_counter(name, 100)) == NULL) fail();
+		if (state_subscribe(name) < 0) fail();
+		if (state_get_i64(name, &i64) < 0 || i64 != 0) fail();
+
+		/* Subscribers can read every update, but are notified once per sample */
+		for (j = 0; j < 1000; j++)
+			(void) state_counter_add(c, 1);
+		if (state_counter_add(c, -500) != 500) fail();
+		if (state_get_i64(name, &i64) < 0 || i64 != 500) fail();
+		if (state_wait(evs, 8, 1000) != 1) fail();
+		if (strcmp(evs[0].key, name) != 0) fail();
+		if (state_wait(evs, 8, 50) != 0) fail();
+
+		/* A gauge */
+		state_counter_set(c, -7);
+		if (state_wait(evs, 8, 1000) != 1) fail();
+		if (state_get(name, &value) < 0) fail();
+		if (state_format(value, STATE_TYPED_HEADER + 8, buf, sizeof(buf)) != 2) fail();
+		if (strcmp(buf, "-7") != 0) fail();
+
+		if (state_publish(name, "1", 1) != -1) fail();
+		if (state_unbind(name) < 0) fail();
+		state_atexit();
+	}
+
+	return 1;
+}
+
+int test_history()
+{
+	const char *name = "user.history";
+	const char *values[] = { "starting", "running", "degraded", "running",
+		"stopping", "stopped", "starting" };
+	struct state_transition ts[8];
+	char big[STATE_HISTORY_VALUE_MAX + 10];
+	uint64_t seq = 0;
+	int i;
+
+	if (state_init(0, 0) < 0) fail();
+	if (state_bind_history(name, 4) < 0) fail();
+	if (state_check_history(name, &seq, ts, 8) != 0 || seq != 0) fail();
+
+	/* Every transition is kept, even though a subscriber only sees the last */
+	for (i = 0; i < 3; i++) {
+		if (state_publish(name, values[i], strlen(values[i])) < 0) fail();
+	}
+	if (state_check_history(name, &seq, ts, 8) != 3 || seq != 3) fail();
+	for (i = 0; i < 3; i++) {
+		if (ts[i].seq != (uint64_t) i + 1) fail();
+		if (strcmp(ts[i].value, values[i]) != 0) fail();
+	}
+
+	/* Unchanged values are not transitions */
+	if (state_publish(name, values[2], strlen(values[2])) < 0) fail();
+	if (state_check_history(name, &seq, ts, 8) != 0) fail();
+
+	/* A slow reader loses the oldest, and can see where */
+	for (i = 3; i < 7; i++) {
+		if (state_publish(name, values[i], strlen(values[i])) < 0) fail();
+	}
+	if (state_publish(name, values[1], strlen(values[1])) < 0) fail();
+	if (state_check_history(name, &seq, ts, 2) != 2 || seq != 6) fail();
+	if (ts[0].seq != 5 || strcmp(ts[0].value, values[4]) != 0) fail();
+	if (state_check_history(name, &seq, ts, 8) != 2 || seq != 8) fail();
+	if (strcmp(ts[1].value, values[1]) != 0) fail();
+
+	/* Long values are truncated */
+	memset(big, 'x', sizeof(big));
+	if (state_publish(name, big, sizeof(big)) < 0) fail();
+	if (state_check_history(name, &seq, ts, 8) != 1) fail();
+	if (ts[0].len != sizeof(big) || strlen(ts[0].value) != STATE_HISTORY_VALUE_MAX) fail();
+
+	/* A new depth starts a new history, which readers notice */
+	if (state_unbind(name) < 0) fail();
+	if (state_bind_history(name, 2) < 0) fail();
+	if (state_publish(name, values[0], strlen(values[0])) < 0) fail();
+	if (state_check_history(name, &seq, ts, 8) != 1 || seq != 1) fail();
+	if (strcmp(ts[0].value, values[0]) != 0) fail();
+
+	if (state_bind("user.history.none") < 0) fail();
+	if (state_check_history("user.history.none", &seq, ts, 8) != -1) fail();
+	state_atexit();
+
+	return 1;
+}
+
 int test_system_namespace()
 {
 	const char *name = "system.name";
@@ -237,13 +1558,39 @@ int main(int argc, char *argv[]) {
 		run_test(state_bind);
 		run_test(state_unbind);
 		run_test(state_publish);
+		run_test(state_publish_unchanged);
 		run_test(state_check);
+		run_test(state_check_many);
+		run_test(state_wait);
+		run_test(state_publish_multi);
+		run_test(state_publish_many);
 		run_test(state_get);
+		run_test(state_get_if_changed);
+		run_test(state_peek);
+		run_test(typed_values);
 	}
 
  	/* Acceptance tests, looking for specific behavior */
 	if (argc == 1 || strcmp(argv[1], "behavior") == 0) {
 		run_test(multiple_state_changes);
+		run_test(event_fd_readiness);
+		run_test(coalesce);
+		run_test(event_overflow);
+		run_test(unlinked);
+		run_test(large_values);
+		run_test(reserved);
+		run_test(snapshot);
+		run_test(prefix);
+		run_test(arena);
+		run_test(arena_prefix);
+		run_test(arena_shared);
+		run_test(broker);
+		run_test(throttle);
+		run_test(concurrent_get);
+		run_test(contexts);
+		run_test(dispatch);
+		run_test(counters);
+		run_test(history);
 		run_test(system_namespace);
 	}
 
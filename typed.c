@@ -0,0 +1,400 @@
+/*
+ * Copyright (c) 2015 Mark Heily <mark@heily.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "counter.h"
+#include "log.h"
+#include "include/state.h"
+
+/*
+ * Typed values are ordinary values with a header, so they can be stored,
+ * compared and sent by every backend without any changes. The layout
+ * is described with the STATE_TYPE_* constants in state.h.
+ */
+
+#define TYPED_MAGIC0	'\0'
+#define TYPED_MAGIC1	'T'
+
+/* The number of times to retry reading a value that keeps changing */
+#define TYPED_MAX_RETRIES	1000
+
+/* Strings longer than this cannot be converted to a number */
+#define TYPED_TEXT_MAX	64
+
+static void put_le32(unsigned char *p, uint32_t v)
+{
+	int i;
+
+	for (i = 0; i < 4; i++)
+		p[i] = (unsigned char) (v >> (8 * i));
+}
+
+static void put_le64(unsigned char *p, uint64_t v)
+{
+	int i;
+
+	for (i = 0; i < 8; i++)
+		p[i] = (unsigned char) (v >> (8 * i));
+}
+
+static uint32_t get_le32(const unsigned char *p)
+{
+	uint32_t v = 0;
+	int i;
+
+	for (i = 3; i >= 0; i--)
+		v = (v << 8) | p[i];
+	return v;
+}
+
+static uint64_t get_le64(const unsigned char *p)
+{
+	uint64_t v = 0;
+	int i;
+
+	for (i = 7; i >= 0; i--)
+		v = (v << 8) | p[i];
+	return v;
+}
+
+int state_decode(const char *value, size_t len, struct state_typed *tv)
+{
+	const unsigned char *p = (const unsigned char *) value;
+	uint64_t bits;
+	uint32_t plen;
+
+	memset(tv, 0, sizeof(*tv));
+	tv->type = STATE_TYPE_STRING;
+	tv->data = value;
+	tv->len = len;
+	if (value == NULL || len < 2 || p[0] != TYPED_MAGIC0 || p[1] != TYPED_MAGIC1)
+		return 0;
+
+	if (len < STATE_TYPED_HEADER || p[2] != STATE_TYPED_VERSION)
+		return -1;
+	plen = get_le32(p + 4);
+	if (plen > len - STATE_TYPED_HEADER)
+		return -1;
+	p += STATE_TYPED_HEADER;
+	switch (value[3]) {
+	case STATE_TYPE_I64:
+	case STATE_TYPE_COUNTER:
+		if (plen != 8)
+			return -1;
+		tv->i64 = (int64_t) get_le64(p);
+		break;
+	case STATE_TYPE_F64:
+		if (plen != 8)
+			return -1;
+		bits = get_le64(p);
+		memcpy(&tv->f64, &bits, sizeof(tv->f64));
+		break;
+	case STATE_TYPE_BOOL:
+		if (plen != 1 || p[0] > 1)
+			return -1;
+		tv->boolean = p[0];
+		break;
+	case STATE_TYPE_BLOB:
+		break;
+	default:
+		return -1;
+	}
+	tv->type = value[3];
+	tv->data = (const char *) p;
+	tv->len = plen;
+	return 0;
+}
+
+static int typed_publish(state_ctx_t ctx, const char *name, int type,
+		const void *payload, size_t len)
+{
+	char small[STATE_TYPED_HEADER + 8], *buf = small;
+	int rv;
+
+	if (len > UINT32_MAX)
+		return -1;
+	if (len > sizeof(small) - STATE_TYPED_HEADER) {
+		if ((buf = malloc(STATE_TYPED_HEADER + len)) == NULL) {
+			log_errno("malloc(3)");
+			return -1;
+		}
+	}
+	buf[0] = TYPED_MAGIC0;
+	buf[1] = TYPED_MAGIC1;
+	buf[2] = STATE_TYPED_VERSION;
+	buf[3] = type;
+	put_le32((unsigned char *) buf + 4, len);
+	if (len > 0)
+		memcpy(buf + STATE_TYPED_HEADER, payload, len);
+	rv = state_ctx_publish(ctx, name, buf, STATE_TYPED_HEADER + len);
+	if (buf != small)
+		free(buf);
+	return rv;
+}
+
+int state_ctx_publish_i64(state_ctx_t ctx, const char *name, int64_t value)
+{
+	unsigned char payload[8];
+
+	put_le64(payload, (uint64_t) value);
+	return typed_publish(ctx, name, STATE_TYPE_I64, payload, sizeof(payload));
+}
+
+int state_ctx_publish_f64(state_ctx_t ctx, const char *name, double value)
+{
+	unsigned char payload[8];
+	uint64_t bits;
+
+	memcpy(&bits, &value, sizeof(bits));
+	put_le64(payload, bits);
+	return typed_publish(ctx, name, STATE_TYPE_F64, payload, sizeof(payload));
+}
+
+int state_ctx_publish_bool(state_ctx_t ctx, const char *name, int value)
+{
+	unsigned char payload = value ? 1 : 0;
+
+	return typed_publish(ctx, name, STATE_TYPE_BOOL, &payload, 1);
+}
+
+int state_ctx_publish_blob(state_ctx_t ctx, const char *name, const void *data,
+		size_t len)
+{
+	if (data == NULL && len > 0)
+		return -1;
+	return typed_publish(ctx, name, STATE_TYPE_BLOB, data, len);
+}
+
+/*
+ * Decode the current value of a scalar straight from the shared memory,
+ * retrying if it is modified meanwhile. A string is copied into <text>,
+ * which must hold TYPED_TEXT_MAX bytes, and is left empty if it is too
+ * long to be a number.
+ */
+static int typed_peek(state_ctx_t ctx, const char *name, struct state_typed *tv,
+		char *text)
+{
+	const char *value;
+	unsigned int seq;
+	ssize_t len;
+	int i, rv;
+
+	for (i = 0; i < TYPED_MAX_RETRIES; i++) {
+		if ((len = state_ctx_peek(ctx, name, &value, &seq)) < 0)
+			return -1;
+		rv = state_decode(value, len, tv);
+		if (rv == 0 && tv->type == STATE_TYPE_COUNTER) {
+			/* It is updated in place, so the sequence number does not protect it */
+			tv->i64 = counter_load(tv->data);
+		} else if (rv == 0 && tv->type == STATE_TYPE_STRING) {
+			if (len >= TYPED_TEXT_MAX)
+				len = 0;
+			memcpy(text, value, len);
+			text[len] = '\0';
+			tv->data = text;
+			tv->len = len;
+		}
+		if (state_ctx_peek_valid(ctx, name, seq))
+			return rv;
+	}
+	log_warning("gave up reading %s, which is constantly changing", name);
+	return -1;
+}
+
+int state_ctx_get_i64(state_ctx_t ctx, const char *name, int64_t *value)
+{
+	struct state_typed tv;
+	char text[TYPED_TEXT_MAX], *end;
+	long long n;
+
+	if (typed_peek(ctx, name, &tv, text) < 0)
+		return -1;
+	switch (tv.type) {
+	case STATE_TYPE_I64:
+	case STATE_TYPE_COUNTER:
+		*value = tv.i64;
+		return 0;
+	case STATE_TYPE_STRING:
+		errno = 0;
+		n = strtoll(text, &end, 10);
+		if (end == text || *end != '\0' || errno == ERANGE)
+			return -1;
+		*value = n;
+		return 0;
+	default:
+		log_debug("%s is not an integer", name);
+		return -1;
+	}
+}
+
+int state_ctx_get_f64(state_ctx_t ctx, const char *name, double *value)
+{
+	struct state_typed tv;
+	char text[TYPED_TEXT_MAX], *end;
+	double d;
+
+	if (typed_peek(ctx, name, &tv, text) < 0)
+		return -1;
+	switch (tv.type) {
+	case STATE_TYPE_F64:
+		*value = tv.f64;
+		return 0;
+	case STATE_TYPE_I64:
+	case STATE_TYPE_COUNTER:
+		*value = (double) tv.i64;
+		return 0;
+	case STATE_TYPE_STRING:
+		d = strtod(text, &end);
+		if (end == text || *end != '\0')
+			return -1;
+		*value = d;
+		return 0;
+	default:
+		log_debug("%s is not a number", name);
+		return -1;
+	}
+}
+
+int state_ctx_get_bool(state_ctx_t ctx, const char *name, int *value)
+{
+	struct state_typed tv;
+	char text[TYPED_TEXT_MAX];
+
+	if (typed_peek(ctx, name, &tv, text) < 0)
+		return -1;
+	switch (tv.type) {
+	case STATE_TYPE_BOOL:
+		*value = tv.boolean;
+		return 0;
+	case STATE_TYPE_STRING:
+		if (strcmp(text, "true") == 0 || strcmp(text, "1") == 0) {
+			*value = 1;
+			return 0;
+		}
+		if (strcmp(text, "false") == 0 || strcmp(text, "0") == 0) {
+			*value = 0;
+			return 0;
+		}
+		return -1;
+	default:
+		log_debug("%s is not a boolean", name);
+		return -1;
+	}
+}
+
+ssize_t state_ctx_get_blob(state_ctx_t ctx, const char *name, const void **data)
+{
+	struct state_typed tv;
+	char *value;
+	int len;
+
+	if ((len = state_ctx_get(ctx, name, &value)) < 0)
+		return -1;
+	if (state_decode(value, len, &tv) < 0 || tv.type != STATE_TYPE_BLOB) {
+		log_debug("%s is not a blob", name);
+		return -1;
+	}
+	*data = tv.data;
+	return tv.len;
+}
+
+/* Print a double with as few digits as it takes to read back the same value */
+static int format_f64(double d, char *buf, size_t size)
+{
+	char tmp[32];
+
+	(void) snprintf(tmp, sizeof(tmp), "%.15g", d);
+	if (strtod(tmp, NULL) != d)
+		(void) snprintf(tmp, sizeof(tmp), "%.17g", d);
+	return snprintf(buf, size, "%s", tmp);
+}
+
+int state_format(const char *value, size_t len, char *buf, size_t size)
+{
+	struct state_typed tv;
+	size_t i, n = 0;
+
+	if (state_decode(value, len, &tv) < 0)
+		return -1;
+	switch (tv.type) {
+	case STATE_TYPE_I64:
+	case STATE_TYPE_COUNTER:
+		return snprintf(buf, size, "%" PRId64, tv.i64);
+	case STATE_TYPE_F64:
+		return format_f64(tv.f64, buf, size);
+	case STATE_TYPE_BOOL:
+		return snprintf(buf, size, "%s", tv.boolean ? "true" : "false");
+	case STATE_TYPE_BLOB:
+		if (size > 0)
+			buf[0] = '\0';
+		for (i = 0; i < tv.len; i++, n += 2) {
+			if (n + 2 < size)
+				(void) snprintf(buf + n, size - n, "%02x",
+						(unsigned char) tv.data[i]);
+			else if (n < size)
+				buf[n] = '\0';
+		}
+		return n;
+	default:
+		return snprintf(buf, size, "%.*s", (int) tv.len,
+				tv.data ? tv.data : "");
+	}
+}
+
+int state_publish_i64(const char *name, int64_t value)
+{
+	return state_ctx_publish_i64(state_ctx_default(), name, value);
+}
+
+int state_publish_f64(const char *name, double value)
+{
+	return state_ctx_publish_f64(state_ctx_default(), name, value);
+}
+
+int state_publish_bool(const char *name, int value)
+{
+	return state_ctx_publish_bool(state_ctx_default(), name, value);
+}
+
+int state_publish_blob(const char *name, const void *data, size_t len)
+{
+	return state_ctx_publish_blob(state_ctx_default(), name, data, len);
+}
+
+int state_get_i64(const char *name, int64_t *value)
+{
+	return state_ctx_get_i64(state_ctx_default(), name, value);
+}
+
+int state_get_f64(const char *name, double *value)
+{
+	return state_ctx_get_f64(state_ctx_default(), name, value);
+}
+
+int state_get_bool(const char *name, int *value)
+{
+	return state_ctx_get_bool(state_ctx_default(), name, value);
+}
+
+ssize_t state_get_blob(const char *name, const void **data)
+{
+	return state_ctx_get_blob(state_ctx_default(), name, data);
+}
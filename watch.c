@@ -0,0 +1,424 @@
+/*
+ * Copyright (c) 2015 Mark Heily <mark@heily.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "platform.h"
+
+#if USE_KQUEUE
+#include <sys/event.h>
+#elif USE_INOTIFY
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#else
+#error No file notification mechanism is available
+#endif
+
+#include "log.h"
+#include "watch.h"
+
+#if USE_KQUEUE
+
+/* The maximum number of events to retrieve with a single call to kevent(2) */
+#define WATCH_BATCH 256
+
+/* The identifier of the EVFILT_USER event used by watch_kick() */
+#define WATCH_KICK_IDENT 0
+
+struct watch_s {
+	int	w_fd;		/* kqueue(2) descriptor */
+};
+
+watch_t watch_new(void)
+{
+	struct kevent kev;
+	watch_t w;
+
+	w = calloc(1, sizeof(*w));
+	if (!w)
+		return NULL;
+	if ((w->w_fd = kqueue()) < 0) {
+		log_errno("kqueue(2)");
+		free(w);
+		return NULL;
+	}
+	EV_SET(&kev, WATCH_KICK_IDENT, EVFILT_USER, EV_ADD | EV_CLEAR, 0, 0, 0);
+	if (kevent(w->w_fd, &kev, 1, NULL, 0, NULL) < 0) {
+		log_errno("kevent(2)");
+		watch_free(w);
+		return NULL;
+	}
+	return w;
+}
+
+void watch_free(watch_t w)
+{
+	if (w) {
+		(void) close(w->w_fd);
+		free(w);
+	}
+}
+
+int watch_add(watch_t w, int fd, const char *path)
+{
+	struct kevent kev;
+
+	(void) path;
+	EV_SET(&kev, fd, EVFILT_VNODE, EV_ADD | EV_CLEAR,
+			NOTE_WRITE | NOTE_DELETE, 0, 0);
+	if (kevent(w->w_fd, &kev, 1, NULL, 0, NULL) < 0) {
+		log_errno("kevent(2)");
+		return -1;
+	}
+	return fd;
+}
+
+int watch_add_dir(watch_t w, int fd, const char *path)
+{
+	struct kevent kev;
+
+	(void) path;
+	EV_SET(&kev, fd, EVFILT_VNODE, EV_ADD | EV_CLEAR, NOTE_WRITE, 0, 0);
+	if (kevent(w->w_fd, &kev, 1, NULL, 0, NULL) < 0) {
+		log_errno("kevent(2)");
+		return -1;
+	}
+	return fd;
+}
+
+int watch_add_fd(watch_t w, int fd)
+{
+	struct kevent kev;
+
+	EV_SET(&kev, fd, EVFILT_READ, EV_ADD, 0, 0, 0);
+	if (kevent(w->w_fd, &kev, 1, NULL, 0, NULL) < 0) {
+		log_errno("kevent(2)");
+		return -1;
+	}
+	return 0;
+}
+
+int watch_remove(watch_t w, int ident)
+{
+	struct kevent kev;
+
+	EV_SET(&kev, ident, EVFILT_VNODE, EV_DELETE, 0, 0, 0);
+	if (kevent(w->w_fd, &kev, 1, NULL, 0, NULL) < 0) {
+		log_errno("kevent(2)");
+		return -1;
+	}
+	return 0;
+}
+
+/* With kqueue(2), waiting and dequeueing the events is a single system call */
+ssize_t watch_wait(watch_t w, struct watch_event *evs, size_t nevents,
+		int timeout_ms)
+{
+	struct timespec ts, *tsp = NULL;
+	struct kevent kev[WATCH_BATCH];
+	int i, n, nret;
+
+	if (timeout_ms >= 0) {
+		ts.tv_sec = timeout_ms / 1000;
+		ts.tv_nsec = (timeout_ms % 1000) * 1000000L;
+		tsp = &ts;
+	}
+	if (nevents > WATCH_BATCH)
+		nevents = WATCH_BATCH;
+	nret = kevent(w->w_fd, NULL, 0, kev, nevents, tsp);
+	if (nret < 0) {
+		if (errno == EINTR)
+			return 0;
+		log_errno("kevent(2)");
+		return -1;
+	}
+	for (i = 0, n = 0; i < nret; i++) {
+		if (kev[i].filter != EVFILT_VNODE)
+			continue;
+		evs[n].we_ident = kev[i].ident;
+		evs[n].we_written = (kev[i].fflags & NOTE_WRITE) != 0;
+		evs[n].we_deleted = (kev[i].fflags & NOTE_DELETE) != 0;
+		evs[n].we_attrib = false;
+		n++;
+	}
+	return n;
+}
+
+ssize_t watch_read(watch_t w, struct watch_event *evs, size_t nevents)
+{
+	return watch_wait(w, evs, nevents, 0);
+}
+
+int watch_kick(watch_t w)
+{
+	struct kevent kev;
+
+	EV_SET(&kev, WATCH_KICK_IDENT, EVFILT_USER, 0, NOTE_TRIGGER, 0, 0);
+	if (kevent(w->w_fd, &kev, 1, NULL, 0, NULL) < 0) {
+		log_errno("kevent(2)");
+		return -1;
+	}
+	return 0;
+}
+
+#elif USE_INOTIFY
+
+/*
+ * The size of the buffer passed to read(2). A single read can return
+ * several thousand events, which are then handed out from the buffer
+ * without going back into the kernel.
+ */
+#define WATCH_BUFSZ (64 * 1024)
+
+/*
+ * IN_DELETE_SELF is not sent while the file is still open, which it is for
+ * as long as it is watched, so unlinking it only generates IN_ATTRIB.
+ */
+#define WATCH_MASK (IN_MODIFY | IN_ATTRIB | IN_DELETE_SELF)
+#define WATCH_DIR_MASK (IN_CREATE | IN_MOVED_TO | IN_ONLYDIR)
+
+struct watch_s {
+	int	w_fd;		/* epoll(7) descriptor */
+	int	w_infd;		/* inotify(7) descriptor */
+	int	w_pendfd;	/* eventfd(2) that is readable while w_buf holds events */
+	bool	w_pending;	/* True if w_pendfd is currently readable */
+	char	*w_buf;		/* Raw events from the last read(2) of w_infd */
+	size_t	w_off, w_len;
+};
+
+static int epoll_add(int epfd, int fd)
+{
+	struct epoll_event ev;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.fd = fd;
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+		log_errno("epoll_ctl(2)");
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Events that were read into w_buf are no longer visible to the kernel, so
+ * w_pendfd is used to keep the epoll descriptor readable until they are gone.
+ */
+static int watch_set_pending(watch_t w, bool pending)
+{
+	uint64_t val = 1;
+
+	if (pending == w->w_pending)
+		return 0;
+	if (pending) {
+		if (write(w->w_pendfd, &val, sizeof(val)) < 0) {
+			log_errno("write(2)");
+			return -1;
+		}
+	} else {
+		if (read(w->w_pendfd, &val, sizeof(val)) < 0 && errno != EAGAIN) {
+			log_errno("read(2)");
+			return -1;
+		}
+	}
+	w->w_pending = pending;
+	return 0;
+}
+
+watch_t watch_new(void)
+{
+	watch_t w;
+
+	w = calloc(1, sizeof(*w));
+	if (!w)
+		return NULL;
+	w->w_fd = w->w_infd = w->w_pendfd = -1;
+	if ((w->w_buf = malloc(WATCH_BUFSZ)) == NULL) {
+		log_errno("malloc(3)");
+		goto err_out;
+	}
+	if ((w->w_fd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+		log_errno("epoll_create1(2)");
+		goto err_out;
+	}
+	if ((w->w_infd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) < 0) {
+		log_errno("inotify_init1(2)");
+		goto err_out;
+	}
+	if ((w->w_pendfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0) {
+		log_errno("eventfd(2)");
+		goto err_out;
+	}
+	if (epoll_add(w->w_fd, w->w_infd) < 0 ||
+			epoll_add(w->w_fd, w->w_pendfd) < 0)
+		goto err_out;
+	return w;
+
+err_out:
+	watch_free(w);
+	return NULL;
+}
+
+void watch_free(watch_t w)
+{
+	if (w) {
+		if (w->w_pendfd >= 0) (void) close(w->w_pendfd);
+		if (w->w_infd >= 0) (void) close(w->w_infd);
+		if (w->w_fd >= 0) (void) close(w->w_fd);
+		free(w->w_buf);
+		free(w);
+	}
+}
+
+int watch_add(watch_t w, int fd, const char *path)
+{
+	int wd;
+
+	(void) fd;
+	wd = inotify_add_watch(w->w_infd, path, WATCH_MASK);
+	if (wd < 0) {
+		log_errno("inotify_add_watch(2) of %s", path);
+		return -1;
+	}
+	return wd;
+}
+
+int watch_add_dir(watch_t w, int fd, const char *path)
+{
+	int wd;
+
+	(void) fd;
+	wd = inotify_add_watch(w->w_infd, path, WATCH_DIR_MASK);
+	if (wd < 0) {
+		log_errno("inotify_add_watch(2) of %s", path);
+		return -1;
+	}
+	return wd;
+}
+
+int watch_add_fd(watch_t w, int fd)
+{
+	return epoll_add(w->w_fd, fd);
+}
+
+int watch_remove(watch_t w, int ident)
+{
+	struct inotify_event *iev;
+	size_t off;
+
+	if (inotify_rm_watch(w->w_infd, ident) < 0) {
+		log_errno("inotify_rm_watch(2)");
+		return -1;
+	}
+
+	/* Discard any events for this watch that were already read */
+	for (off = w->w_off; off < w->w_len; off += sizeof(*iev) + iev->len) {
+		iev = (struct inotify_event *) (w->w_buf + off);
+		if (iev->wd == ident)
+			iev->mask = IN_IGNORED;
+	}
+	return 0;
+}
+
+ssize_t watch_read(watch_t w, struct watch_event *evs, size_t nevents)
+{
+	const struct inotify_event *iev;
+	ssize_t nret;
+	size_t n = 0;
+
+	while (n < nevents) {
+		if (w->w_off >= w->w_len) {
+			nret = read(w->w_infd, w->w_buf, WATCH_BUFSZ);
+			if (nret < 0) {
+				if (errno == EINTR)
+					continue;
+				if (errno == EAGAIN)
+					break;
+				log_errno("read(2)");
+				return -1;
+			}
+			w->w_off = 0;
+			w->w_len = nret;
+			if (nret == 0)
+				break;
+		}
+		iev = (const struct inotify_event *) (w->w_buf + w->w_off);
+		w->w_off += sizeof(*iev) + iev->len;
+
+		if (iev->mask & IN_Q_OVERFLOW) {
+			log_warning("inotify event queue overflowed; events were lost");
+			evs[n].we_ident = WATCH_OVERFLOW;
+			evs[n].we_written = true;
+			evs[n].we_deleted = false;
+			evs[n].we_attrib = false;
+			n++;
+			continue;
+		}
+		if (iev->mask & IN_IGNORED)
+			continue;
+		evs[n].we_ident = iev->wd;
+		evs[n].we_written = (iev->mask & (IN_MODIFY | IN_CREATE | IN_MOVED_TO)) != 0;
+		evs[n].we_deleted = (iev->mask & IN_DELETE_SELF) != 0;
+		evs[n].we_attrib = (iev->mask & IN_ATTRIB) != 0;
+		n++;
+	}
+
+	if (watch_set_pending(w, w->w_off < w->w_len) < 0)
+		return -1;
+	return n;
+}
+
+/*
+ * Events that are already buffered, or a kick, make the epoll descriptor
+ * readable, so there is no need to ask the kernel in that case.
+ */
+ssize_t watch_wait(watch_t w, struct watch_event *evs, size_t nevents,
+		int timeout_ms)
+{
+	struct epoll_event ev;
+	int nret;
+
+	if (!w->w_pending && timeout_ms != 0) {
+		nret = epoll_wait(w->w_fd, &ev, 1, timeout_ms);
+		if (nret < 0) {
+			if (errno == EINTR)
+				return 0;
+			log_errno("epoll_wait(2)");
+			return -1;
+		}
+		if (nret == 0)
+			return 0;
+	}
+	return watch_read(w, evs, nevents);
+}
+
+int watch_kick(watch_t w)
+{
+	return watch_set_pending(w, true);
+}
+
+#endif /* USE_INOTIFY */
+
+int watch_get_fd(watch_t w)
+{
+	return w->w_fd;
+}
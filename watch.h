@@ -0,0 +1,86 @@
+/*
+ * Copyright (c) 2015 Mark Heily <mark@heily.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#ifndef WATCH_H_
+#define WATCH_H_
+
+#include <stdbool.h>
+#include <sys/types.h>
+
+/*
+ * A thin wrapper around the kernel file notification mechanism.
+ * kqueue(2) is used on BSD, and inotify(7) inside an epoll(7) descriptor
+ * on Linux. The backend is selected at build time by USE_KQUEUE and
+ * USE_INOTIFY in platform.h.
+ */
+
+/*
+ * The identifier of an event that means others were lost, because the
+ * kernel queue overflowed. The caller must check everything it watches.
+ */
+#define WATCH_OVERFLOW	(-1)
+
+struct watch_event {
+	int	we_ident;	/* The identifier returned by watch_add(), or WATCH_OVERFLOW */
+	bool	we_written;	/* The file was modified */
+	bool	we_deleted;	/* The file was removed */
+	bool	we_attrib;	/* The metadata changed, so it may have been unlinked */
+};
+
+typedef struct watch_s * watch_t;
+
+watch_t watch_new(void);
+void watch_free(watch_t w);
+
+/* A descriptor that becomes readable while events are pending */
+int watch_get_fd(watch_t w);
+
+/* Start watching <path>, which is already open as <fd>. Returns an identifier. */
+int watch_add(watch_t w, int fd, const char *path);
+int watch_remove(watch_t w, int ident);
+
+/*
+ * Start watching the directory <path>, which is already open as <fd>, for
+ * entries being added. These are reported as the directory being written.
+ */
+int watch_add_dir(watch_t w, int fd, const char *path);
+
+/*
+ * Make the descriptor readable whenever <fd> is readable. No events are
+ * returned by watch_read() for it, so the caller must check <fd> itself.
+ */
+int watch_add_fd(watch_t w, int fd);
+
+/* Dequeue up to <nevents> pending events, without blocking */
+ssize_t watch_read(watch_t w, struct watch_event *evs, size_t nevents);
+
+/*
+ * Like watch_read(), but first wait up to <timeout_ms> milliseconds, or
+ * forever if it is negative, for the descriptor to become readable.
+ * This may return zero events when the descriptor became readable for
+ * another reason, such as watch_kick() or a descriptor from watch_add_fd().
+ */
+ssize_t watch_wait(watch_t w, struct watch_event *evs, size_t nevents,
+		int timeout_ms);
+
+/*
+ * Make the descriptor readable until the next call to watch_read(), to
+ * signal that work is pending which did not come from the kernel.
+ */
+int watch_kick(watch_t w);
+
+#endif /* WATCH_H_ */